@@ -0,0 +1,102 @@
+#ifndef __ALLOCATOR_HPP__
+#define __ALLOCATOR_HPP__
+
+#include <cstddef>
+#include <vector>
+
+// alignment of every Tensor buffer, one AVX-512 register / cache line
+const size_t kTensorAlignment = 64;
+
+/**
+ * TensorBackend:
+ *   where Tensor storage comes from. Every buffer is kTensorAlignment
+ *   aligned and goes back to the backend that allocated it, with the
+ *   same byte count.
+ */
+class TensorBackend {
+public:
+    virtual ~TensorBackend() {}
+    virtual void *allocate(size_t bytes) = 0;
+    virtual void deallocate(void *p, size_t bytes) = 0;
+    virtual const char *name() const = 0;
+    // true when every buffer of `bytes` comes back zero-filled, so a
+    // zero-initialised Tensor need not write (and fault in) its pages
+    virtual bool zero_filled(size_t bytes) const { (void)bytes; return false; }
+};
+
+// posix_memalign / free; the default backend
+TensorBackend &aligned_backend();
+
+/**
+ * huge_page_backend:
+ *   buffers of at least kHugePageMinBytes are mmap'ed in whole 2 MB pages
+ *   and madvise(MADV_HUGEPAGE)d, so multi-MB weights and activations sit
+ *   on transparent huge pages (fewer TLB misses and page faults); smaller
+ *   ones come from aligned_backend(). Without THP support it is the
+ *   aligned backend. The mapped buffers are fresh zero pages.
+ */
+const size_t kHugePageMinBytes = (size_t)2 << 20;
+TensorBackend &huge_page_backend();
+
+/**
+ * BumpArena:
+ *   hands out consecutive slices of large chunks and never frees single
+ *   buffers; reset() recycles everything at once. For short-lived
+ *   scratch whose total size is bounded, e.g. one layer's temporaries.
+ *   Chunks come from `upstream` and are added as needed.
+ */
+class BumpArena : public TensorBackend {
+public:
+    explicit BumpArena(size_t chunk_bytes = (size_t)4 << 20,
+                       TensorBackend &upstream = aligned_backend());
+    ~BumpArena();
+
+    void *allocate(size_t bytes);
+    void deallocate(void *p, size_t bytes);
+    const char *name() const { return "bump"; }
+
+    // make all memory available again; buffers handed out become invalid
+    void reset();
+    // bytes handed out since the last reset / held in chunks
+    size_t used() const { return used_; }
+    size_t capacity() const;
+
+private:
+    BumpArena(const BumpArena &) = delete;
+    BumpArena &operator=(const BumpArena &) = delete;
+
+    struct Chunk {
+        char *base;
+        size_t size;
+    };
+
+    size_t chunk_bytes_;
+    TensorBackend &upstream_;
+    std::vector<Chunk> chunks_;
+    size_t current_ = 0; // chunk being bumped
+    size_t offset_ = 0;  // into chunks_[current_]
+    size_t used_ = 0;
+};
+
+/**
+ * TensorBackendScope:
+ *   new Tensors created by the calling thread come from `backend` while
+ *   the scope lives (e.g. a model's weights from huge_page_backend());
+ *   scopes nest. Outside any scope Tensors use aligned_backend().
+ */
+class TensorBackendScope {
+public:
+    explicit TensorBackendScope(TensorBackend &backend);
+    ~TensorBackendScope();
+
+private:
+    TensorBackendScope(const TensorBackendScope &) = delete;
+    TensorBackendScope &operator=(const TensorBackendScope &) = delete;
+
+    TensorBackend *prev_;
+};
+
+// backend new Tensors on this thread come from
+TensorBackend &current_tensor_backend();
+
+#endif
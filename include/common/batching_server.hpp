@@ -0,0 +1,170 @@
+#ifndef __BATCHING_SERVER_HPP__
+#define __BATCHING_SERVER_HPP__
+
+#include "common/core_groups.hpp"
+#include "common/execution_context.hpp"
+#include "common/mpmc_queue.hpp"
+#include "common/tensor.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * LatencyHistogram:
+ *   counts of durations in log-spaced buckets (8 per doubling, from 1 us
+ *   to about 70 s, so a percentile is within 9% of the true value);
+ *   record() is lock-free and may be called from any thread.
+ */
+class LatencyHistogram {
+public:
+    static const int kBuckets = 8 * 26;
+
+    LatencyHistogram();
+
+    void record(double ms);
+    void reset();
+
+    long long count() const;
+    double mean_ms() const;
+    double max_ms() const;
+    // upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+    double percentile_ms(double p) const;
+
+private:
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+    static int bucket(double ms);
+    static double bucket_upper_ms(int b);
+
+    std::atomic<long long> counts_[kBuckets];
+    std::atomic<long long> total_;
+    std::atomic<long long> sum_ns_;
+    std::atomic<long long> max_ns_;
+};
+
+struct BatchingOptions {
+    // requests coalesced into one forward pass at most
+    int max_batch = 8;
+    // a batch is run once its oldest request has waited this long, full
+    // or not
+    double max_delay_ms = 2.0;
+    // replicas: core groups (see CoreGroups), each running its own
+    // batches; 0 cores: all of them
+    int num_groups = 1;
+    int num_cores = 0;
+    // pending requests at most; submit() throws beyond that
+    size_t queue_capacity = 4096;
+};
+
+/**
+ * BatchingServer:
+ *   dynamic batching for a model that takes a batch dimension. submit()
+ *   puts one request (its input, [1, ...]) on a lock-free MPMC queue;
+ *   the workers, one per core group, take requests off it and coalesce
+ *   those of equal shape into batches of up to max_batch, waiting at
+ *   most max_delay after the oldest one arrived. A batch is stacked into
+ *   one [N, ...] tensor (e.g. [N,3,224,224] images, [N,S] token ids), run
+ *   with a single call of the batch function, and row n of its output
+ *   ([N, ...]) goes back to request n, through its future or callback,
+ *   as a [1, ...] view of the batch output.
+ *
+ *   The batch function runs on the worker's core group with an
+ *   ExecutionContext of the worker's own, one per batch shape (so each
+ *   batch size keeps its arena planned): with a model's const
+ *   forward(input, ctx) all workers share one copy of the weights.
+ *
+ *   stats() has the per-request latency (submit to result) and queueing
+ *   delay (submit to batch start) histograms and the batch sizes.
+ */
+class BatchingServer {
+public:
+    // `batch` is the requests' inputs stacked along dim 0; returns their
+    // outputs stacked along dim 0
+    typedef std::function<Tensor<float>(const Tensor<float> &batch, ExecutionContext &ctx)> BatchFunction;
+    // the request's output, or the exception the batch threw (and an
+    // empty tensor)
+    typedef std::function<void(Tensor<float> output, std::exception_ptr error)> Callback;
+
+    BatchingServer(BatchFunction fn, const BatchingOptions &options = BatchingOptions());
+    // completes every request already submitted, then stops the workers;
+    // a submit() racing with it either throws or is completed
+    ~BatchingServer();
+
+    const BatchingOptions &options() const { return options_; }
+
+    // throws std::runtime_error when the queue is full, the server is
+    // stopping or the input has no leading dimension of 1
+    std::future<Tensor<float>> submit(const Tensor<float> &input);
+    // `done` runs on a worker thread: keep it short, and it must not throw
+    void submit(const Tensor<float> &input, Callback done);
+
+    struct Stats {
+        long long requests = 0;
+        long long batches = 0;
+        long long failed = 0;
+        // batch_sizes[n]: batches of n requests
+        std::vector<long long> batch_sizes;
+        double mean_batch() const;
+    };
+    Stats stats() const;
+    const LatencyHistogram &latency() const { return latency_; }
+    const LatencyHistogram &queueing() const { return queueing_; }
+    void reset_stats();
+    // latency percentiles and the batch size distribution
+    void report(std::ostream &os) const;
+
+private:
+    BatchingServer(const BatchingServer &) = delete;
+    BatchingServer &operator=(const BatchingServer &) = delete;
+
+    struct Request {
+        Tensor<float> input;
+        std::chrono::steady_clock::time_point arrival;
+        std::promise<Tensor<float>> promise;
+        Callback done; // instead of the promise when set
+    };
+
+    void enqueue(Request *request);
+    void worker_loop();
+    // the next batch: requests of one shape, started when full or due
+    void collect(std::vector<Request *> &pending, std::vector<Request *> &batch);
+    void run_batch(std::vector<Request *> &batch,
+                   std::map<std::vector<int>, std::unique_ptr<ExecutionContext>> &contexts);
+    void finish(Request *request, const Tensor<float> &output, std::exception_ptr error);
+
+    BatchFunction fn_;
+    BatchingOptions options_;
+    MpmcQueue<Request *> queue_;
+
+    // idle workers sleep here; submit only takes the lock when one does
+    std::atomic<int> sleepers_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::atomic<bool> stopping_;
+    // submit() calls past their stopping_ check; the destructor waits
+    // for them before letting the workers finish
+    std::atomic<int> submitting_;
+
+    LatencyHistogram latency_;
+    LatencyHistogram queueing_;
+    std::atomic<long long> requests_;
+    std::atomic<long long> batches_;
+    std::atomic<long long> failed_;
+    std::unique_ptr<std::atomic<long long>[]> batch_sizes_;
+
+    // last: its destructor joins the workers before the rest goes
+    std::unique_ptr<CoreGroups> groups_;
+    std::vector<std::future<void>> workers_;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef __CHECKPOINT_HPP__
+#define __CHECKPOINT_HPP__
+
+#include "common/tensor.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Checkpoint file, version 1 (all integers little-endian):
+ *
+ *   CheckpointHeader   64 bytes at offset 0
+ *   index              tensor_count entries, each
+ *                        u32 name length, name bytes (no terminator),
+ *                        u32 dtype, u32 ndim, i32 dims[ndim],
+ *                        u64 offset, u64 bytes
+ *   data               every tensor dense row-major at an offset (from
+ *                      the start of the file) that is a multiple of
+ *                      `alignment` (kTensorAlignment)
+ *
+ * Model weights are F32; the other dtypes hold prepared state (16-bit
+ * GEMM panels, int8 weights, sizes, text) in plan files, see
+ * common/plan_cache.hpp.
+ *
+ * The data being aligned like any Tensor buffer lets a loader map the
+ * file and hand out its pages as Tensor storage as they are.
+ */
+const char kCheckpointMagic[8] = {'P', 'O', 'L', 'Y', 'C', 'K', 'P', 'T'};
+const uint32_t kCheckpointVersion = 1;
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t alignment;
+    uint64_t tensor_count;
+    uint64_t index_offset;
+    uint64_t index_bytes;
+    uint64_t data_offset;
+    uint64_t file_bytes;
+    uint64_t reserved;
+};
+
+enum class CheckpointDType : uint32_t {
+    F32 = 0,
+    U16 = 1, // fp16 / bf16 bits
+    I32 = 2,
+    U8 = 3,  // also s8 and text
+    U64 = 4,
+};
+
+size_t checkpoint_dtype_bytes(CheckpointDType dtype);
+
+struct CheckpointEntry {
+    std::string name;
+    CheckpointDType dtype = CheckpointDType::F32;
+    TensorShape shape;
+    uint64_t offset = 0;
+    uint64_t bytes = 0;
+};
+
+/**
+ * Checkpoint:
+ *   a checkpoint file mapped into memory (MAP_PRIVATE, readahead
+ *   requested by default) with its index parsed. tensor() returns Tensors whose
+ *   storage is the mapped pages themselves: nothing is read or copied
+ *   until the values are touched, processes mapping the same file share
+ *   those pages through the page cache, and writes to a loaded Tensor
+ *   stay private to the process (copy-on-write). The mapping lives as
+ *   long as the Checkpoint or any Tensor from it.
+ */
+class Checkpoint {
+public:
+    // throws std::runtime_error when the file is missing or malformed.
+    // Without `readahead` pages are only read when touched, for callers
+    // that page the data in themselves (see WeightStream)
+    explicit Checkpoint(const std::string &path, bool readahead = true);
+
+    const std::string &path() const { return path_; }
+    size_t file_bytes() const;
+    const std::vector<CheckpointEntry> &entries() const { return entries_; }
+    // null when there is no such tensor
+    const CheckpointEntry *find(const std::string &name) const;
+
+    // tensor `name` backed by the mapping, no copy; throws when missing
+    // or not F32
+    Tensor<float> tensor(const std::string &name) const;
+
+    // where the data of `entry` is mapped, and a reference that keeps
+    // the mapping alive for views of it outside a Tensor
+    const void *data(const CheckpointEntry &entry) const;
+    std::shared_ptr<const void> mapping() const;
+
+private:
+    struct Mapping;
+
+    std::string path_;
+    std::shared_ptr<Mapping> mapping_;
+    std::vector<CheckpointEntry> entries_;
+    std::unordered_map<std::string, size_t> by_name_;
+};
+
+/**
+ * CheckpointWriter:
+ *   collects named tensors and writes them out in the format above. Only
+ *   pointers are kept: what was added has to outlive write(). The file
+ *   is written under a temporary name (unique to the process) and
+ *   renamed into place, so a reader never maps a half-written checkpoint.
+ */
+class CheckpointWriter {
+public:
+    void add(const std::string &name, const Tensor<float> &tensor);
+    void add(const std::string &name, const std::vector<float> &values);
+    // shape.numel() dense values of `dtype` at `data`
+    void add(const std::string &name, CheckpointDType dtype, const TensorShape &shape,
+             const void *data);
+
+    // throws std::runtime_error on a duplicate name or an I/O error
+    void write(const std::string &path) const;
+
+private:
+    struct Item {
+        std::string name;
+        CheckpointDType dtype;
+        TensorShape shape;
+        const void *data;
+        Tensor<float> dense; // keeps a dense copy of a strided tensor
+    };
+    std::vector<Item> items_;
+
+    static uint64_t item_bytes(const Item &item);
+};
+
+/**
+ * ModelParam:
+ *   one named parameter of a model: a weight Tensor, loaded as a view
+ *   of the mapped checkpoint, or a small vector (biases, norm
+ *   parameters), copied out of it. The models list theirs with
+ *   parameters(); the layer param structs add their own members with
+ *   list_params().
+ */
+struct ModelParam {
+    std::string name;
+    Tensor<float> *tensor = nullptr;
+    std::vector<float> *values = nullptr;
+};
+
+void list_params(std::vector<ModelParam> &params, const std::string &name, Tensor<float> &tensor);
+void list_params(std::vector<ModelParam> &params, const std::string &name, std::vector<float> &values);
+
+// every parameter under its name
+void save_checkpoint(const std::string &path, const std::vector<ModelParam> &params);
+
+// every parameter from `checkpoint`; throws naming the first one that is
+// missing or has another shape (the parameters before it are loaded)
+void load_checkpoint(const Checkpoint &checkpoint, const std::vector<ModelParam> &params);
+
+#endif
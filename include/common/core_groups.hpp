@@ -0,0 +1,69 @@
+#ifndef __CORE_GROUPS_HPP__
+#define __CORE_GROUPS_HPP__
+
+#include "common/thread_pool.hpp"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * CoreGroups:
+ *   the cores split into `num_groups` groups of cores / num_groups
+ *   threads, each with its own ThreadPool and a runner thread that takes
+ *   jobs from one shared queue and runs them with that pool bound (see
+ *   ThreadPoolScope). Jobs on different groups run side by side, e.g.
+ *   independent requests against one model through its reentrant
+ *   forward(input, ctx), with one ExecutionContext per group: replicas
+ *   without copies of the weights.
+ *
+ *   The cores are the ones this process may run on (available_cpus(),
+ *   so taskset and cgroup cpusets are honoured). A group's threads are
+ *   pinned to its cores when the groups fit on them; with more threads
+ *   than cores they share them unpinned. pin_failures() counts the
+ *   threads whose pinning the OS refused, which then run unpinned.
+ */
+class CoreGroups {
+public:
+    // num_cores 0: all available cpus
+    explicit CoreGroups(int num_groups, int num_cores = 0);
+    // runs the jobs still queued, then stops the groups
+    ~CoreGroups();
+
+    int num_groups() const { return (int)groups_.size(); }
+    int threads_per_group() const { return threads_per_group_; }
+    // the cpus group g is pinned to, empty when unpinned
+    const std::vector<int> &cpus(int group) const { return groups_[group].cpus; }
+    // threads (runners and pool workers) that could not be pinned
+    int pin_failures() const;
+
+    // job(group) on the next free group; the future rethrows what it threw
+    std::future<void> submit(std::function<void(int group)> job);
+
+private:
+    CoreGroups(const CoreGroups &) = delete;
+    CoreGroups &operator=(const CoreGroups &) = delete;
+
+    struct Group {
+        std::vector<int> cpus; // empty: not pinned
+        std::unique_ptr<ThreadPool> pool;
+        std::thread runner;
+    };
+
+    void runner_loop(int group);
+
+    int threads_per_group_ = 1;
+    std::vector<Group> groups_;
+    int runner_pin_failures_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::deque<std::packaged_task<void(int)> > jobs_;
+    bool quit_ = false;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __CPU_FEATURES_HPP__
+#define __CPU_FEATURES_HPP__
+
+/**
+ * Instruction set levels the kernels are specialised for, ordered from
+ * the portable fallback to the widest vector unit.
+ */
+enum class IsaLevel {
+    SCALAR = 0,
+    SSE,
+    AVX2,
+    AVX512,
+};
+
+/**
+ * CpuFeatures:
+ *   what CPUID (and XGETBV for the OS-enabled register state) reports
+ *   for the host. Detected once, on first use.
+ */
+struct CpuFeatures {
+    bool sse2 = false;
+    bool sse41 = false;
+    bool avx = false;
+    bool avx2 = false;
+    bool fma = false;
+    bool f16c = false;
+    bool avx512f = false;
+    bool avx512bw = false;
+    bool avx512vl = false;
+    bool avx512vnni = false;
+};
+
+const CpuFeatures& cpu_features();
+
+/**
+ * best_isa:
+ *   widest level supported by the host. The environment variable
+ *   POLY_ISA=scalar|sse|avx2|avx512 caps it, e.g. to compare paths.
+ */
+IsaLevel best_isa();
+
+const char* isa_name(IsaLevel isa);
+
+#endif
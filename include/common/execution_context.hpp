@@ -0,0 +1,44 @@
+#ifndef __EXECUTION_CONTEXT_HPP__
+#define __EXECUTION_CONTEXT_HPP__
+
+#include "common/memory_planner.hpp"
+#include "common/time_utils.hpp"
+
+/**
+ * ExecutionContext:
+ *   everything a forward pass changes: the activation arena its tensors
+ *   come from and the profiler its timers add to. The models'
+ *   forward(input, ctx) are const and keep nothing else between calls,
+ *   so one model (one copy of the weights) serves any number of threads
+ *   at once, each with its own context.
+ *
+ *   The arena plans one model's pass at one input shape (see
+ *   ActivationArena): give each model its own context and reuse it, so
+ *   every call after the first replays the plan.
+ */
+struct ExecutionContext {
+    ActivationArena arena;
+    Profiler profiler;
+};
+
+/**
+ * ExecutionScope:
+ *   binds `ctx`'s arena (ArenaScope) and profiler (ProfilerScope) to the
+ *   calling thread for one pass.
+ */
+class ExecutionScope {
+public:
+    explicit ExecutionScope(ExecutionContext &ctx)
+        : arena_(ctx.arena), profiler_(ctx.profiler)
+    {
+    }
+
+private:
+    ExecutionScope(const ExecutionScope &) = delete;
+    ExecutionScope &operator=(const ExecutionScope &) = delete;
+
+    ArenaScope arena_;
+    ProfilerScope profiler_;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __GEMM_KERNELS_HPP__
+#define __GEMM_KERNELS_HPP__
+
+#include "common/cpu_features.hpp"
+#include "common/half.hpp"
+#include <cstdint>
+
+/**
+ * Register-tiled micro-kernel:
+ *   c[0:mr, 0:nr] (+)= a_panel * b_panel
+ *   a: packed A panel, kc steps of mr values (column of the tile)
+ *   b: packed B panel, kc steps of nr values (row of the tile)
+ *   c: row-major with leading dimension ldc
+ *   accumulate=false overwrites c, true adds to it
+ */
+typedef void (*GemmMicroKernel)(int kc, const float *a, const float *b,
+                                float *c, int ldc, bool accumulate);
+
+/**
+ * The same with the B panel stored in fp16 or bf16 (kc steps of nr
+ * halves): each row is widened to fp32 in registers as it is loaded,
+ * accumulation stays fp32.
+ */
+typedef void (*GemmHalfMicroKernel)(int kc, const float *a, const uint16_t *b,
+                                    float *c, int ldc, bool accumulate);
+
+/**
+ * GemmKernel:
+ *   one ISA's micro-kernel plus the tile and cache-block sizes it was
+ *   tuned for. mc is a multiple of mr and nc a multiple of nr.
+ */
+struct GemmKernel {
+    IsaLevel isa;
+    int mr;
+    int nr;
+    int mc;
+    int kc;
+    int nc;
+    GemmMicroKernel ukernel;
+    // B panels in fp16 / bf16; levels without a conversion instruction
+    // widen the panel into a local buffer and run `ukernel`
+    GemmHalfMicroKernel ukernel_fp16;
+    GemmHalfMicroKernel ukernel_bf16;
+};
+
+// kernel for the given level (falls back to the next lower one compiled in)
+const GemmKernel& gemm_kernel_for(IsaLevel isa);
+
+// kernel selected at startup from best_isa()
+const GemmKernel& gemm_kernel();
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __HALF_HPP__
+#define __HALF_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * WeightPrecision:
+ *   how a packed GEMM weight is stored. FP16 (IEEE binary16) and BF16
+ *   (the upper half of an fp32) take two bytes per value, halving what
+ *   a bandwidth-bound GEMM streams; values are widened back to fp32 as
+ *   they are loaded and products always accumulate in fp32.
+ */
+enum class WeightPrecision {
+    FP32 = 0,
+    FP16,
+    BF16,
+};
+
+const char* precision_name(WeightPrecision precision);
+
+// precision named `name` (as precision_name, any case); false if none is
+bool precision_from_name(const std::string& name, WeightPrecision& precision);
+
+// bytes one stored value takes
+inline size_t precision_bytes(WeightPrecision precision)
+{
+    return precision == WeightPrecision::FP32 ? 4 : 2;
+}
+
+// round to nearest even; fp16 overflows to +-inf, NaNs stay NaN
+uint16_t float_to_fp16(float v);
+float fp16_to_float(uint16_t h);
+uint16_t float_to_bf16(float v);
+float bf16_to_float(uint16_t h);
+
+/**
+ * narrow_from_float / widen_to_float:
+ *   n values between fp32 and `precision` (FP16 or BF16). Widening is
+ *   vectorised (F16C / AVX-512) where the host has it, as it runs on
+ *   every GEMM that widens whole panels.
+ */
+void narrow_from_float(const float* src, uint16_t* dst, size_t n, WeightPrecision precision);
+void widen_to_float(const uint16_t* src, float* dst, size_t n, WeightPrecision precision);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __LOAD_GENERATOR_HPP__
+#define __LOAD_GENERATOR_HPP__
+
+#include "common/batching_server.hpp"
+#include <functional>
+
+struct LoadOptions {
+    // open loop: requests per second over all clients, Poisson arrivals;
+    // 0: closed loop, every client sends its next request once the last
+    // one is answered
+    double rate = 0.0;
+    int clients = 8;
+    double seconds = 3.0;
+};
+
+struct LoadResult {
+    long long sent = 0;
+    long long completed = 0;
+    long long failed = 0;
+    long long rejected = 0; // queue full
+    double seconds = 0.0;   // first request to last answer
+
+    double throughput() const { return seconds > 0.0 ? completed / seconds : 0.0; }
+};
+
+/**
+ * generate_load:
+ *   drives `server` from options.clients threads for options.seconds,
+ *   request i of a client with input make_input(client, i) (called on
+ *   that client's thread), and waits for every answer. The latencies
+ *   are in server.latency().
+ */
+LoadResult generate_load(BatchingServer &server,
+                         const std::function<Tensor<float>(int client, long long i)> &make_input,
+                         const LoadOptions &options = LoadOptions());
+
+#endif
@@ -3,8 +3,196 @@
 
 #include "common/tensor.hpp"
 #include "common/time_utils.hpp"
+#include "common/thread_pool.hpp"
+#include "common/cpu_features.hpp"
+#include "common/half.hpp"
+#include <cstdint>
+#include <memory>
+#include <vector>
 
+/**
+ * PackedMatrix:
+ *   a GEMM operand stored once in the selected micro-kernel's panel
+ *   layout, so repeated products (weights) skip the per-call packing.
+ *   For every kc-block of K the mr-row (A) or nr-column (B) panels are
+ *   contiguous; rows/columns are zero-padded to the panel width.
+ *
+ *   Packed in FP16 / BF16 the panels take half the memory and half the
+ *   bandwidth: B operands are widened to fp32 inside the micro-kernel,
+ *   A operands one cache block at a time as they are used. Products
+ *   accumulate in fp32 either way.
+ *
+ *   The panels are held by the PackedMatrix, or, when it was loaded from
+ *   a plan file (see common/plan_cache.hpp), are the file's mapped pages.
+ */
+class PackedMatrix {
+public:
+    enum class Role { A, B };
+
+    PackedMatrix() {}
+
+    // M x K row-major matrix (leading dimension lda) as the left operand
+    static PackedMatrix pack_a(const float *A, int M, int K, int lda,
+                               WeightPrecision precision = WeightPrecision::FP32);
+    // K x N row-major matrix (leading dimension ldb) as the right operand
+    static PackedMatrix pack_b(const float *B, int K, int N, int ldb,
+                               WeightPrecision precision = WeightPrecision::FP32);
+
+    bool empty() const { return data_.empty() && half_.empty() && !mapped_panels_; }
+    Role role() const { return role_; }
+    IsaLevel isa() const { return isa_; }
+    WeightPrecision precision() const { return precision_; }
+    // logical shape: [M, K] for A, [K, N] for B
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    // M (A) or N (B) rounded up to the panel width
+    int padded() const { return padded_; }
+    // the panels: data() when packed in FP32, half_data() otherwise
+    const float *data() const
+    {
+        return mapped_panels_ ? static_cast<const float *>(mapped_panels_) : data_.data();
+    }
+    const uint16_t *half_data() const
+    {
+        return mapped_panels_ ? static_cast<const uint16_t *>(mapped_panels_) : half_.data();
+    }
+    // number of panel values: padded() times K
+    size_t elements() const { return (size_t)padded_ * (role_ == Role::A ? cols_ : rows_); }
+    // memory the panels take
+    size_t bytes() const { return empty() ? 0 : elements() * precision_bytes(precision_); }
+
+    // write the logical matrix back out, row-major ([M,K] or [K,N])
+    void unpack(float *dst) const;
+
+private:
+    Role role_ = Role::A;
+    IsaLevel isa_ = IsaLevel::SCALAR;
+    WeightPrecision precision_ = WeightPrecision::FP32;
+    int rows_ = 0;
+    int cols_ = 0;
+    int padded_ = 0;
+    std::vector<float> data_;
+    std::vector<uint16_t> half_;
+    // panels mapped from a plan file instead of data_ / half_
+    const void *mapped_panels_ = nullptr;
+    std::shared_ptr<const void> mapped_;
+
+    // narrow data_ into half_ when packing for a 16-bit precision
+    void store_as(WeightPrecision precision);
+
+    friend class PlanArchive;
+};
+
+/**
+ * GemmPanelSource:
+ *   produces one GEMM operand in micro-kernel panel layout on demand,
+ *   for operands that never exist as a plain matrix (e.g. the implicit
+ *   im2col matrix of a convolution).
+ *
+ *   panels(i0, len, p0, kc, width, scratch) returns the panels covering
+ *   rows (A) / columns (B) [i0, i0+len) of the K-block [p0, p0+kc):
+ *   ceil(len/width) panels of [kc x width], zero-padded past len.
+ *   i0 is a multiple of width. `scratch` has room for all of them and
+ *   is private to the calling thread; implementations may fill it or
+ *   return a pointer to data they already hold.
+ */
+class GemmPanelSource {
+public:
+    virtual ~GemmPanelSource() {}
+    virtual const float *panels(int i0, int len, int p0, int kc,
+                                int width, float *scratch) const = 0;
+};
+
+enum class Activation
+{
+    NONE = 0,
+    RELU,
+    RELU6,
+};
+
+/**
+ * GemmEpilogue:
+ *   C = act(C * scale + shift + residual), applied to each output tile
+ *   right after its last K-block, while the tile is still in L1, so the
+ *   result is written to memory once.
+ *   scale / shift are per row (e.g. conv output channels) or, with
+ *   per_column, per column (e.g. linear output features); null means
+ *   1 / 0. residual is an [M, N] matrix with leading dimension ldr,
+ *   null for none.
+ */
+struct GemmEpilogue
+{
+    const float *scale = nullptr;
+    const float *shift = nullptr;
+    bool per_column = false;
+    const float *residual = nullptr;
+    int ldr = 0;
+    Activation act = Activation::NONE;
+};
+
+/**
+ * apply_epilogue:
+ *   the same epilogue on C[row0:row0+rows, col0:col0+cols] computed
+ *   outside the GEMM (c points at element (row0, col0)).
+ */
+void apply_epilogue(const GemmEpilogue &ep, float *c, int ldc,
+                    int row0, int col0, int rows, int cols);
+
+/**
+ * matmul:
+ *   C[M,N] = A[M,K] * B[K,N], all row-major and contiguous.
+ *   Packed, cache-blocked GEMM; the micro-kernel (scalar/SSE/AVX2/AVX-512)
+ *   is picked once from CPUID, see common/gemm_kernels.hpp.
+ *   Large products are split into 2D tiles of C and run on the
+ *   ThreadPool; small ones stay on the calling thread.
+ *   `ep` (optional) is fused into the store of every output tile.
+ */
 void matmul(const float *A, const float *B, float *C,
-            int M, int K, int N);
+            int M, int K, int N, const GemmEpilogue *ep = nullptr);
+
+// C[M,N] = A * B[K,N] with A pre-packed ([M,K])
+void matmul(const PackedMatrix &A, const float *B, float *C, int N,
+            const GemmEpilogue *ep = nullptr);
+
+// C[M,N] = A[M,K] * B with B pre-packed ([K,N])
+void matmul(const float *A, const PackedMatrix &B, float *C, int M,
+            const GemmEpilogue *ep = nullptr);
+
+// C[M,N] = A * B with A pre-packed and B produced by a panel source (K = A.cols())
+void matmul(const PackedMatrix &A, const GemmPanelSource &B, float *C, int N,
+            const GemmEpilogue *ep = nullptr);
+
+/**
+ * sgemm:
+ *   C = alpha * op(A) * op(B) + beta * C, BLAS conventions on row-major
+ *   storage: op(X) = X, or X^T when trans_x. op(A) is [M,K], op(B) is
+ *   [K,N], so A is stored [M,K] (or [K,M] when transposed) with leading
+ *   dimension lda, likewise B, and C is [M,N] with ldc. Any operand can
+ *   be a strided sub-view of a larger matrix. Runs on the same packed
+ *   kernels as matmul; transposes are resolved while packing. beta == 0
+ *   never reads C. `ep` (optional) is applied to the final C.
+ */
+void sgemm(bool trans_a, bool trans_b, int M, int N, int K,
+           float alpha, const float *A, int lda, const float *B, int ldb,
+           float beta, float *C, int ldc, const GemmEpilogue *ep = nullptr);
+
+/**
+ * sgemm_strided_batched:
+ *   batch_count independent sgemm calls, operand b at A + b*stride_a,
+ *   B + b*stride_b, C + b*stride_c (e.g. one per attention head). With at
+ *   least as many batches as threads each GEMM runs whole on one thread.
+ *   `ep` is applied to every C as is (a residual is not offset per batch).
+ */
+void sgemm_strided_batched(bool trans_a, bool trans_b, int M, int N, int K,
+                           float alpha, const float *A, int lda, long long stride_a,
+                           const float *B, int ldb, long long stride_b,
+                           float beta, float *C, int ldc, long long stride_c,
+                           int batch_count, const GemmEpilogue *ep = nullptr);
+
+// how C tiles are handed to the pool threads (default DYNAMIC)
+void set_matmul_schedule(Schedule sched);
+
+// name of the ISA the selected micro-kernel targets
+const char *matmul_kernel_name();
 
-#endif // __MATMUL_HPP__
\ No newline at end of file
+#endif // __MATMUL_HPP__
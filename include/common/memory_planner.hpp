@@ -0,0 +1,142 @@
+#ifndef __MEMORY_PLANNER_HPP__
+#define __MEMORY_PLANNER_HPP__
+
+#include "common/allocator.hpp"
+#include <cstddef>
+#include <vector>
+
+/**
+ * BufferLifetime:
+ *   one activation buffer of `bytes`, alive from step `first` (allocated)
+ *   to step `last` (last freed) inclusive. Two buffers may share memory
+ *   iff their step ranges do not intersect.
+ */
+struct BufferLifetime {
+    size_t bytes = 0;
+    int first = 0;
+    int last = 0;
+};
+
+/**
+ * MemoryPlan:
+ *   offset of every buffer in one arena of `peak` bytes; `unplanned` is
+ *   what the buffers take when each gets its own allocation.
+ */
+struct MemoryPlan {
+    std::vector<size_t> offsets;
+    size_t peak = 0;
+    size_t unplanned = 0;
+};
+
+/**
+ * plan_memory:
+ *   greedy-by-size offset assignment: buffers are placed largest first,
+ *   each into the smallest gap left by the already placed buffers whose
+ *   lifetimes overlap it (or on top of them). Offsets are multiples of
+ *   `alignment`.
+ */
+MemoryPlan plan_memory(const std::vector<BufferLifetime> &buffers, size_t alignment = 64);
+
+/**
+ * ActivationArena:
+ *   serves the Tensor allocations of a repeated computation (a model's
+ *   forward pass) from one preallocated block.
+ *
+ *   Bound to the calling thread with ArenaScope. The first pass runs on
+ *   the current TensorBackend and records every Tensor allocation and free in order, which
+ *   gives the tensor lifetimes; at the end of the scope they are planned
+ *   with plan_memory and the block is reserved. Later passes replay the
+ *   plan: the i-th allocation gets its planned offset, frees are no-ops.
+ *   Buffers still alive when the first pass ends (the returned output)
+ *   come from the current backend. If a pass deviates from the recording
+ *   (e.g. a new input shape), the rest of it falls back to the backend
+ *   and the next pass records again. The block is taken from
+ *   huge_page_backend().
+ *
+ *   Only allocations made by the bound thread outside parallel_for tasks
+ *   go through the arena.
+ */
+class ActivationArena {
+public:
+    ActivationArena() {}
+    ~ActivationArena();
+
+    // planned arena size, 0 before the first pass
+    size_t peak_bytes() const { return plan_.peak; }
+    // the same buffers with one allocation each
+    size_t unplanned_bytes() const { return plan_.unplanned; }
+    // number of planned buffers
+    int num_buffers() const { return (int)plan_.offsets.size(); }
+    // true once a plan is in place and being replayed
+    bool planned() const { return mode_ == Mode::REPLAY; }
+
+    // used by the Tensor allocation hooks; `owner` gets the backend the
+    // buffer must be returned to
+    void *allocate(size_t bytes, TensorBackend *&owner);
+    // a Tensor buffer (from anywhere) is freed, for the lifetimes
+    void note_free(const void *p);
+
+    void begin_pass();
+    void end_pass();
+
+private:
+    ActivationArena(const ActivationArena &) = delete;
+    ActivationArena &operator=(const ActivationArena &) = delete;
+
+    enum class Mode { RECORD, REPLAY };
+
+    struct Event {
+        size_t bytes;
+        bool escapes;
+    };
+
+    void reserve(size_t bytes);
+
+    Mode mode_ = Mode::RECORD;
+    int step_ = 0;
+    int next_ = 0;
+    bool diverged_ = false;
+
+    // recording
+    std::vector<Event> events_;
+    std::vector<BufferLifetime> lifetimes_;
+    std::vector<std::pair<const void *, int> > live_; // buffer -> event
+
+    // replay
+    MemoryPlan plan_;
+    std::vector<int> slot_;  // event -> planned buffer, -1 for the backend
+    char *block_ = nullptr;
+    size_t capacity_ = 0;
+    std::vector<std::pair<char *, size_t> > retired_; // older blocks
+
+    // saves / restores the recording and plan (see common/plan_cache.hpp)
+    friend class PlanArchive;
+};
+
+/**
+ * ArenaScope:
+ *   routes the calling thread's Tensor allocations to `arena` for its
+ *   lifetime (one pass); scopes nest.
+ */
+class ArenaScope {
+public:
+    explicit ArenaScope(ActivationArena &arena);
+    ~ArenaScope();
+
+private:
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+    ActivationArena &arena_;
+    ActivationArena *prev_;
+};
+
+/**
+ * Tensor storage hooks: the current thread's ActivationArena (outside
+ * parallel_for tasks), else current_tensor_backend(). `owner` receives
+ * the backend tensor_deallocate must hand the buffer back to.
+ */
+void *tensor_allocate(size_t bytes, TensorBackend *&owner);
+void tensor_deallocate(void *p, size_t bytes, TensorBackend *owner);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef __MPMC_QUEUE_HPP__
+#define __MPMC_QUEUE_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * MpmcQueue:
+ *   bounded lock-free multi-producer multi-consumer FIFO (D. Vyukov's
+ *   ring: every cell carries a sequence number that tells producers and
+ *   consumers whose turn it is, so each side claims a cell with one CAS
+ *   on its own position counter and never waits for the other).
+ *   try_push / try_pop fail instead of blocking when the queue is full /
+ *   empty. T must be default constructible and copy assignable; queue
+ *   pointers to anything larger.
+ */
+template <typename T>
+class MpmcQueue {
+public:
+    // capacity rounded up to a power of two (at least 2)
+    explicit MpmcQueue(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        mask_ = n - 1;
+        cells_.reset(new Cell[n]);
+        for (size_t i = 0; i < n; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        enqueue_pos_.store(0, std::memory_order_relaxed);
+        dequeue_pos_.store(0, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // false when full
+    bool try_push(const T &value)
+    {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // false when empty
+    bool try_pop(T &value)
+    {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = cell.value;
+                    cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // a snapshot, exact only while nobody pushes or pops
+    size_t size_approx() const
+    {
+        size_t enq = enqueue_pos_.load(std::memory_order_seq_cst);
+        size_t deq = dequeue_pos_.load(std::memory_order_seq_cst);
+        return enq > deq ? enq - deq : 0;
+    }
+
+private:
+    MpmcQueue(const MpmcQueue &) = delete;
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    // producers and consumers on separate cache lines
+    alignas(64) std::atomic<size_t> enqueue_pos_;
+    alignas(64) std::atomic<size_t> dequeue_pos_;
+};
+
+#endif
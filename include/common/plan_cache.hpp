@@ -0,0 +1,143 @@
+#ifndef __PLAN_CACHE_HPP__
+#define __PLAN_CACHE_HPP__
+
+#include "common/checkpoint.hpp"
+#include "common/matmul.hpp"
+#include "common/memory_planner.hpp"
+#include "common/qgemm.hpp"
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Plan cache: a prepared model (packed GEMM panels, folded biases,
+ * Winograd transforms, per-layer kernel choices, int8 weights, the
+ * activation memory plan, and the raw parameters it was prepared from)
+ * serialized into a checkpoint file (see common/checkpoint.hpp) and
+ * mapped back by the next process instead of preparing again. Large
+ * state (weights, panels) is used straight from the mapped pages.
+ *
+ * Plans are only valid for the build and CPU that wrote them: the key
+ * (plan_key) names the model, its configuration, the input shape, the
+ * GEMM kernels picked for this CPU and kPlanVersion, and a plan stored
+ * under another key is a miss.
+ */
+
+// bump whenever the layout of any prepared state changes
+const int kPlanVersion = 2;
+
+/**
+ * plan_key:
+ *   "<model>;<config>;input=1x3x224x224;isa=avx512;gemm=...;int8=...;
+ *   cpu=...;plan=<kPlanVersion>". `config` must name everything else the
+ *   prepared state depends on: the weights (e.g. the checkpoint file),
+ *   prepare()'s arguments, int8 quantization.
+ */
+std::string plan_key(const std::string &model, const std::string &config,
+                     const std::vector<int> &input_shape);
+
+// where the plan for `key` lives in `dir`
+std::string plan_path(const std::string &dir, const std::string &key);
+
+/**
+ * open_plan:
+ *   the plan at `path` mapped, or null on a miss: no such file, not a
+ *   plan of this version, or stored under another key. `readahead` as
+ *   for Checkpoint.
+ */
+std::unique_ptr<Checkpoint> open_plan(const std::string &path, const std::string &key,
+                                      bool readahead = true);
+
+/**
+ * PlanArchive:
+ *   one traversal of a model's prepared state serves both directions:
+ *   writing, io() records each value under its name and write() stores
+ *   them; reading, io() sets each value from the plan. Tensors and
+ *   PackedMatrix panels are read as views of the mapped plan, all else
+ *   is copied. Reading throws std::runtime_error naming a missing entry.
+ *   The layer headers add io for their own structs (plan_io overloads).
+ */
+class PlanArchive {
+public:
+    // writing, under `key`
+    explicit PlanArchive(const std::string &key);
+    // reading from an open_plan() result, which must outlive the reads
+    explicit PlanArchive(const Checkpoint &plan);
+
+    bool loading() const { return plan_ != nullptr; }
+
+    void io(const std::string &name, int &value);
+    void io(const std::string &name, float &value);
+    void io(const std::string &name, bool &value);
+    void io(const std::string &name, std::vector<float> &values);
+    void io(const std::string &name, std::vector<int> &values);
+    void io(const std::string &name, Tensor<float> &tensor);
+    void io(const std::string &name, PackedMatrix &m);
+    void io(const std::string &name, PackedQMatrix &m);
+    void io(const std::string &name, ActivationArena &arena);
+
+    template <typename E>
+    void io_enum(const std::string &name, E &value)
+    {
+        int v = (int)value;
+        io(name, v);
+        value = (E)v;
+    }
+
+    // writing only: store everything recorded at `path`
+    void write(const std::string &path) const;
+
+private:
+    PlanArchive(const PlanArchive &) = delete;
+    PlanArchive &operator=(const PlanArchive &) = delete;
+
+    const CheckpointEntry &entry(const std::string &name, CheckpointDType dtype) const;
+    template <typename T>
+    void io_array(const std::string &name, CheckpointDType dtype, std::vector<T> &values);
+    void io_sizes(const std::string &name, std::vector<size_t> &values);
+    // writing: a copy of `bytes` at `p` that lives until write()
+    const void *keep(const void *p, size_t bytes);
+
+    const Checkpoint *plan_ = nullptr;
+    CheckpointWriter writer_;
+    // values recorded by copy, kept until write()
+    std::deque<std::string> copies_;
+    std::string key_;
+};
+
+// the raw parameters, under "param.<name>"
+void plan_io(PlanArchive &ar, const std::vector<ModelParam> &params);
+
+/**
+ * DeferPrepare:
+ *   constructor tag: build the model without running prepare(), for a
+ *   caller that prepares it right after (e.g. prepare_cached), so the
+ *   default packing is not done for nothing.
+ */
+struct DeferPrepare {};
+
+/**
+ * prepare_cached:
+ *   `model` prepared from the plan in `dir` stored under `key`, and true;
+ *   on a miss `prepare` and then `warmup` (a forward pass at the keyed
+ *   input shape, which records the activation plan) are run, the result
+ *   is stored for the next process, and false. The model's load_plan /
+ *   save_plan do the (de)serialization.
+ */
+template <typename Model, typename Prepare, typename Warmup>
+bool prepare_cached(Model &model, const std::string &dir, const std::string &key,
+                    Prepare prepare, Warmup warmup)
+{
+    const std::string path = plan_path(dir, key);
+    if (model.load_plan(path, key))
+    {
+        return true;
+    }
+    prepare();
+    warmup();
+    model.save_plan(path, key);
+    return false;
+}
+
+#endif
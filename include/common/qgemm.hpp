@@ -0,0 +1,83 @@
+#ifndef __QGEMM_HPP__
+#define __QGEMM_HPP__
+
+#include "common/matmul.hpp"
+#include "common/quantize.hpp"
+#include <vector>
+
+/**
+ * PackedQMatrix:
+ *   an fp32 [M, K] left operand quantized to s8 with one symmetric scale
+ *   per row (a conv output channel), A ~= scale[i] * q[i][k], stored in
+ *   the int8 micro-kernel's panel layout: mr-row panels over the whole
+ *   K, 4 consecutive K values per row and step, K zero-padded to a
+ *   multiple of 4. |q| is bounded by the kernel's weight_max, so the
+ *   packing depends on the kernel selected at startup.
+ */
+class PackedQMatrix {
+public:
+    PackedQMatrix() {}
+
+    static PackedQMatrix quantize_a(const float *A, int M, int K, int lda);
+
+    bool empty() const { return data_.empty(); }
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    // per-row scale and sum of the quantized row (for the zero-point term)
+    const float *scale() const { return scale_.data(); }
+    const int *row_sum() const { return row_sum_.data(); }
+    const signed char *data() const { return data_.data(); }
+
+    // the dequantized matrix, row-major [M, K]
+    void dequantize(float *dst) const;
+
+private:
+    int rows_ = 0;
+    int cols_ = 0;
+    int mr_ = 0;
+    std::vector<float> scale_;
+    std::vector<int> row_sum_;
+    std::vector<signed char> data_;
+
+    friend class PlanArchive;
+};
+
+/**
+ * QGemmEpilogue:
+ *   how the int32 products become the output, per element:
+ *   v = act((acc - b.zero_point * row_sum[i]) * a_scale[i] * b.scale
+ *           * scale[i] + shift[i] + residual[i][j])
+ *   scale / shift are per row, null for 1 / 0; residual is fp32 [M, N]
+ *   with leading dimension ldr, null for none. A u8 output is
+ *   requantized with `out`; the activation clamps before it, so ReLU /
+ *   ReLU6 cost nothing extra.
+ */
+struct QGemmEpilogue
+{
+    QuantParams b;
+    const float *scale = nullptr;
+    const float *shift = nullptr;
+    const float *residual = nullptr;
+    int ldr = 0;
+    Activation act = Activation::NONE;
+    QuantParams out;
+};
+
+/**
+ * qgemm:
+ *   C[M,N] = A * B with A quantized (K = A.cols()) and B a row-major u8
+ *   [K, N] matrix, accumulated exactly in int32 by the u8 x s8 kernel
+ *   (AVX-512 VNNI, AVX2 vpmaddubsw or scalar, picked once from CPUID),
+ *   then the epilogue fused into the store of every tile. Column blocks
+ *   of B are packed per call and shared by all rows.
+ */
+void qgemm(const PackedQMatrix &A, const unsigned char *B, int N, float *C,
+           const QGemmEpilogue &ep);
+// the same, requantized to u8 with ep.out
+void qgemm(const PackedQMatrix &A, const unsigned char *B, int N, unsigned char *C,
+           const QGemmEpilogue &ep);
+
+// name of the selected int8 micro-kernel
+const char *qgemm_kernel_name();
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __QGEMM_KERNELS_HPP__
+#define __QGEMM_KERNELS_HPP__
+
+#include "common/cpu_features.hpp"
+
+/**
+ * Register-tiled u8 x s8 -> s32 micro-kernel:
+ *   c[0:mr, 0:nr] = a_panel * b_panel, K taken 4 values at a time
+ *   a: packed s8 A panel, kq steps of mr rows x 4 values
+ *   b: packed u8 B panel, kq steps of nr columns x 4 values
+ *   c: int32, row-major with leading dimension ldc
+ */
+typedef void (*QGemmMicroKernel)(int kq, const signed char *a, const unsigned char *b,
+                                 int *c, int ldc);
+
+/**
+ * One output row of a finished tile, acc[0:n] -> out[0:n]:
+ *   v = (acc - corr) * scale + shift (+ res), clamped to [lo, hi]
+ *   (the activation); the u8 variant then requantizes, q = v * inv + zp
+ *   rounded and clamped to [0, 255]. res is null for none.
+ */
+typedef void (*QStoreF32Fn)(const int *acc, int n, int corr, float scale, float shift,
+                            const float *res, float lo, float hi, float *out);
+typedef void (*QStoreU8Fn)(const int *acc, int n, int corr, float scale, float shift,
+                           const float *res, float lo, float hi, float inv, float zp,
+                           unsigned char *out);
+
+// B[K x cols] (row-major, ldb) => ceil(cols / nr) panels of
+// [kq x nr x 4], zero past K and past cols
+typedef void (*QPackBFn)(const unsigned char *B, int ldb, int K, int cols, int nr,
+                         unsigned char *dst);
+
+// q = x * inv + zp rounded and clamped to [0, 255]
+typedef void (*QuantizeRowFn)(const float *x, int n, float inv, float zp, unsigned char *q);
+
+/**
+ * QGemmKernel:
+ *   one ISA's int8 micro-kernel, its tile and block sizes, and the
+ *   vectorised row helpers that go with it.
+ *   weight_max bounds |A| values: AVX2 vpmaddubsw adds pairs of u8 * s8
+ *   products into saturating int16, which is exact only for |a| <= 63;
+ *   VNNI vpdpbusd accumulates in int32 and takes the full s8 range.
+ */
+struct QGemmKernel {
+    IsaLevel isa;
+    bool vnni;
+    const char *name;
+    int mr;
+    int nr;
+    int mc;
+    int nc;
+    int weight_max;
+    QGemmMicroKernel ukernel;
+    QStoreF32Fn store_f32;
+    QStoreU8Fn store_u8;
+    QuantizeRowFn quantize;
+    QPackBFn pack_b;
+};
+
+// kernel selected at startup from best_isa() and VNNI support
+const QGemmKernel& qgemm_kernel();
+
+#endif
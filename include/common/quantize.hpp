@@ -0,0 +1,85 @@
+#ifndef __QUANTIZE_HPP__
+#define __QUANTIZE_HPP__
+
+#include "common/tensor.hpp"
+#include <map>
+
+/**
+ * QuantParams:
+ *   affine u8 quantization of one tensor, real = scale * (q - zero_point)
+ *   with q in [0, 255]. Zero is always exactly representable, so padding
+ *   and ReLU outputs quantize without error.
+ */
+struct QuantParams {
+    float scale = 1.f;
+    int zero_point = 0;
+};
+
+// u8 parameters covering [lo, hi] (widened to contain 0)
+QuantParams choose_quant_params(float lo, float hi);
+
+/**
+ * QTensor:
+ *   a u8 tensor and the parameters its values are quantized with,
+ *   NCHW and contiguous like the fp32 activations it stands for.
+ */
+struct QTensor {
+    Tensor<unsigned char> data;
+    QuantParams params;
+
+    const TensorShape &shape() const { return data.shape(); }
+};
+
+// x quantized with `params` into out (see Tensor::ensure_shape)
+void quantize_into(const Tensor<float> &x, const QuantParams &params, QTensor &out);
+
+// back to fp32
+void dequantize_into(const QTensor &x, Tensor<float> &out);
+
+/**
+ * ActivationRanges:
+ *   the smallest and largest value seen per activation, keyed by the
+ *   address of whatever the range is recorded for (e.g. the layer that
+ *   consumes it); filled while a CalibrationScope is bound.
+ */
+class ActivationRanges {
+public:
+    struct Range {
+        float lo = 0.f;
+        float hi = 0.f;
+        long long count = 0; // values observed
+    };
+
+    void observe(const void *key, const Tensor<float> &x);
+    // the range of `key`, null when it was never observed
+    const Range *find(const void *key) const;
+
+    size_t size() const { return ranges_.size(); }
+    void clear() { ranges_.clear(); }
+
+private:
+    std::map<const void *, Range> ranges_;
+};
+
+/**
+ * CalibrationScope:
+ *   routes the calling thread's observe_activation calls to `ranges`
+ *   for its lifetime; forward passes run inside one record the input
+ *   range of every layer that can be quantized. Scopes nest.
+ */
+class CalibrationScope {
+public:
+    explicit CalibrationScope(ActivationRanges &ranges);
+    ~CalibrationScope();
+
+private:
+    CalibrationScope(const CalibrationScope &) = delete;
+    CalibrationScope &operator=(const CalibrationScope &) = delete;
+
+    ActivationRanges *prev_;
+};
+
+// record x for `key` in the bound ActivationRanges, a no-op without one
+void observe_activation(const void *key, const Tensor<float> &x);
+
+#endif
@@ -1,37 +1,240 @@
 #ifndef __TENSOR_HPP__
 #define __TENSOR_HPP__
 
+#include "common/memory_planner.hpp"
+#include <initializer_list>
+#include <memory>
 #include <vector>
 #include <stdexcept>
 #include <string>
 
+// initial contents of a new Tensor; UNINITIALIZED skips the zero fill
+// for outputs a kernel overwrites completely
+enum class TensorInit {
+    ZERO = 0,
+    UNINITIALIZED,
+};
+
+// most dimensions a Tensor can have
+const int kMaxTensorDims = 6;
+
+/**
+ * TensorLayout:
+ *   memory order of a 4-D tensor. The shape is always the logical
+ *   [N, C, H, W]; the layout only says where each element lives.
+ *   NCHW    - row-major, the default (and the only one for other ranks)
+ *   NHWC    - channels last
+ *   NCHW8c  - [N, ceil(C/8), H, W, 8]: channels in blocks of 8, the
+ *             block innermost; the last block is padded with zeros
+ *   NCHW16c - the same with blocks of 16
+ */
+enum class TensorLayout {
+    NCHW = 0,
+    NHWC,
+    NCHW8c,
+    NCHW16c,
+};
+
+// channels stored next to each other: C for NHWC, the block size for
+// NCHW8c / NCHW16c, 1 for NCHW. A 4-D tensor in any layout is then
+// [N, ceil(C/lanes), H, W, lanes] in memory
+int layout_lanes(TensorLayout layout, int channels);
+
+bool is_blocked(TensorLayout layout);
+
+const char* layout_name(TensorLayout layout);
+
+// layout named `name` (as layout_name, any case); false if none is
+bool layout_from_name(const std::string& name, TensorLayout& layout);
+
+/**
+ * TensorShape:
+ *   the dimensions of a Tensor, kept inline (no heap allocation).
+ *   Converts from a braced list or a std::vector<int>.
+ */
+class TensorShape {
+public:
+    TensorShape() {}
+    TensorShape(std::initializer_list<int> dims) { assign(dims.begin(), (int)dims.size()); }
+    TensorShape(const std::vector<int>& dims) { assign(dims.data(), (int)dims.size()); }
+
+    int size() const { return ndim_; }
+    bool empty() const { return ndim_ == 0; }
+    int operator[](int i) const { return dims_[i]; }
+    int& operator[](int i) { return dims_[i]; }
+    const int* begin() const { return dims_; }
+    const int* end() const { return dims_ + ndim_; }
+
+    // product of the dimensions, 1 for an empty shape
+    int numel() const;
+
+    bool operator==(const TensorShape& other) const;
+    bool operator!=(const TensorShape& other) const { return !(*this == other); }
+
+private:
+    void assign(const int* dims, int n);
+
+    int dims_[kMaxTensorDims] = {};
+    int ndim_ = 0;
+};
+
+/**
+ * TensorStorage:
+ *   one buffer from tensor_allocate, shared by a Tensor and all views
+ *   of it; handed back when the last of them goes away. Storage over
+ *   memory that belongs to something else (e.g. a mapped checkpoint)
+ *   has no backend and keeps `owner` alive instead.
+ */
+struct TensorStorage {
+    TensorStorage(size_t bytes);
+    TensorStorage(void* data, size_t bytes, std::shared_ptr<const void> owner);
+    ~TensorStorage();
+
+    void* data = nullptr;
+    size_t bytes = 0;
+    TensorBackend* backend = nullptr;
+    std::shared_ptr<const void> owner;
+
+private:
+    TensorStorage(const TensorStorage&) = delete;
+    TensorStorage& operator=(const TensorStorage&) = delete;
+};
+
+/**
+ * Tensor:
+ *   strided view of a TensorStorage. A new Tensor is dense row-major and
+ *   its storage is kTensorAlignment (64-byte) aligned, from the calling
+ *   thread's ActivationArena or TensorBackend (see common/allocator.hpp).
+ *
+ *   view/reshape/flatten/slice/transpose/squeeze/unsqueeze return views
+ *   sharing the storage (writes go through, also for views of a const
+ *   Tensor); copies and copy assignment are deep and dense. data() and
+ *   operator[] address the elements as a dense array, which is only valid
+ *   when is_contiguous(); at4d follows the strides. Kernels that read
+ *   data() call contiguous() on their inputs first.
+ *
+ *   A 4-D Tensor may instead be dense in another TensorLayout (see
+ *   to_layout); data() is then its storage_size() values in that order.
+ *   Such a tensor is never is_contiguous(): contiguous() and reshape()
+ *   convert it back to NCHW, the other views reject it, and at4d only
+ *   works for NHWC. Copies keep the layout. Kernels that handle a layout
+ *   themselves call dense() instead of contiguous(), and keep the
+ *   padding lanes of a blocked tensor zero.
+ */
 template<typename T>
 class Tensor {
 public:
     Tensor();
 
-    explicit Tensor(const std::vector<int>& shape);
+    explicit Tensor(const TensorShape& shape, TensorInit init = TensorInit::ZERO);
+    // 4-D [N, C, H, W] `shape` stored in `layout`; ZERO also zeroes the padding
+    Tensor(const TensorShape& shape, TensorLayout layout, TensorInit init = TensorInit::ZERO);
+    // dense row-major `shape` over the start of `storage`, which must be
+    // large enough and aligned for T; nothing is copied or filled
+    Tensor(const TensorShape& shape, std::shared_ptr<TensorStorage> storage);
+
+    Tensor(const Tensor& other);
+    Tensor(Tensor&& other) noexcept;
+    Tensor& operator=(const Tensor& other);
+    Tensor& operator=(Tensor&& other) noexcept;
+    ~Tensor();
 
-    // Tensor(int n, int c, int h, int w);
+    const TensorShape& shape() const { return shape_; }
 
-    const std::vector<int>& shape() const;
+    int dim() const { return shape_.size(); }
 
     int size(int dim) const;
 
-    int total_size() const;
+    // elements between neighbours along `dim`
+    int stride(int dim) const;
+
+    int total_size() const { return size_; }
+
+    TensorLayout layout() const { return layout_; }
 
-    T* data();
-    const T* data() const;
+    // values data() spans when dense: total_size() plus any block padding
+    int storage_size() const;
 
-    T& operator[](int idx);
-    const T& operator[](int idx) const;
+    // dense row-major strides (NCHW)
+    bool is_contiguous() const;
 
-    T& at4d(int n, int c, int h, int w);
-    const T& at4d(int n, int c, int h, int w) const;
+    // dense in its own layout: is_contiguous(), or any other layout
+    bool is_dense() const { return layout_ != TensorLayout::NCHW || is_contiguous(); }
+
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+
+    T& operator[](int idx) { return data_[idx]; }
+    const T& operator[](int idx) const { return data_[idx]; }
+
+    // first four dimensions; missing trailing ones must be indexed with 0.
+    // Not for blocked layouts
+    T& at4d(int n, int c, int h, int w) {
+        return data_[n * strides_[0] + c * strides_[1] + h * strides_[2] + w * strides_[3]];
+    }
+    const T& at4d(int n, int c, int h, int w) const {
+        return data_[n * strides_[0] + c * strides_[1] + h * strides_[2] + w * strides_[3]];
+    }
+
+    // same elements with a new shape; one dimension may be -1 (inferred).
+    // Needs is_contiguous()
+    Tensor view(const TensorShape& shape) const;
+    // view() when contiguous, else a dense copy with the new shape
+    Tensor reshape(const TensorShape& shape) const;
+    // dimensions start_dim..end_dim merged into one (reshape semantics)
+    Tensor flatten(int start_dim = 0, int end_dim = -1) const;
+    // elements [start, end) along `dim`
+    Tensor slice(int dim, int start, int end) const;
+    // dimensions d0 and d1 swapped
+    Tensor transpose(int d0, int d1) const;
+    // size-1 dimension `dim` removed / inserted before `dim`
+    Tensor squeeze(int dim) const;
+    Tensor unsqueeze(int dim) const;
+    // a view of *this when contiguous, else a dense NCHW copy
+    Tensor contiguous() const;
+    // a view of *this when is_dense(), else a dense NCHW copy
+    Tensor dense() const;
+    // *this dense in `layout`: a view when it already is, else a copy
+    // (4-D only, the padding of a blocked copy zeroed)
+    Tensor to_layout(TensorLayout layout) const;
+
+    // make *this a dense `shape` tensor for a kernel to write into: kept
+    // as it is when it already is one (a view into a workspace stays a
+    // view), else its buffer is reused when no view shares it and it is
+    // large enough, else it gets a new one. Contents are unspecified
+    // unless newly allocated with `init`
+    void ensure_shape(const TensorShape& shape, TensorInit init = TensorInit::UNINITIALIZED);
+    // the same for a dense `layout` tensor; padding lanes are unspecified
+    // too, a kernel writing a blocked tensor writes them as well
+    void ensure_shape(const TensorShape& shape, TensorLayout layout,
+                      TensorInit init = TensorInit::UNINITIALIZED);
+
+    // true when both address the same storage
+    bool shares_storage(const Tensor& other) const {
+        return storage_ && storage_ == other.storage_;
+    }
+
+    // backend the storage is returned to (null when empty)
+    const TensorBackend* backend() const { return storage_ ? storage_->backend : nullptr; }
 
 private:
-    std::vector<int> shape_;
-    std::vector<T> data_;
+    // shallow copy sharing the storage, the start of every view
+    Tensor alias() const;
+    void allocate(const TensorShape& shape, TensorLayout layout = TensorLayout::NCHW);
+    // dense strides of shape_ in layout_ (per channel block when blocked)
+    void set_dense_strides();
+    void copy_from(const Tensor& other);
+    int normalize_dim(int dim, int ndim) const;
+    // offset of element (n, c, h, w) of a 4-D tensor, any layout
+    size_t offset4d(int n, int c, int h, int w) const;
+    void require_nchw(const char* op) const;
+
+    std::shared_ptr<TensorStorage> storage_;
+    T* data_ = nullptr; // first element, inside storage_
+    TensorShape shape_;
+    TensorLayout layout_ = TensorLayout::NCHW;
+    int strides_[kMaxTensorDims] = {}; // 0 past dim(), for at4d
+    int size_ = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
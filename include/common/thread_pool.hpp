@@ -0,0 +1,122 @@
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+
+#include "common/time_utils.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class Schedule {
+    STATIC = 0, // task range split into one contiguous chunk per thread
+    DYNAMIC,    // threads grab the next task from a shared counter
+};
+
+/**
+ * ThreadPool:
+ *   persistent workers that sleep between parallel regions.
+ *   The calling thread always takes part, so a pool of n threads
+ *   owns n-1 workers. Nested parallel_for calls run serially.
+ *
+ *   Size: POLY_NUM_THREADS, else std::thread::hardware_concurrency().
+ *
+ *   Tasks run with the caller's profiler (see ProfilerScope).
+ */
+class ThreadPool {
+public:
+    // the calling thread's pool: the innermost ThreadPoolScope's, else
+    // the process-wide one
+    static ThreadPool& instance();
+
+    // with `cpus`, worker t is pinned to cpus[t % cpus.size()] (the
+    // calling thread pins itself, see pin_current_thread)
+    explicit ThreadPool(int num_threads, const std::vector<int>& cpus = std::vector<int>());
+    ~ThreadPool();
+
+    int num_threads() const { return num_threads_; }
+    // workers that could not be pinned to their cpu
+    int pin_failures() const { return pin_failures_; }
+
+    // stop the current workers and start n-1 new ones
+    void resize(int num_threads);
+
+    // fn(task) for every task in [0, num_tasks); returns when all are
+    // done. If a task throws, the first exception is rethrown here once
+    // the running tasks have finished (DYNAMIC tasks not started yet are
+    // skipped)
+    void parallel_for(int num_tasks, const std::function<void(int)>& fn,
+                      Schedule sched = Schedule::DYNAMIC);
+
+private:
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void start(int num_threads);
+    void stop();
+    // `seen`: the generation of the last job run before this worker started
+    void worker_loop(int thread_id, unsigned long seen);
+    void run_tasks(int thread_id);
+
+    int num_threads_ = 1;
+    std::vector<int> cpus_;
+    int pin_failures_ = 0;
+    std::vector<std::thread> workers_;
+
+    std::mutex run_mutex_; // one parallel region at a time
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool quit_ = false;
+    unsigned long generation_ = 0;
+    int active_ = 0;
+
+    // current job
+    const std::function<void(int)>* fn_ = nullptr;
+    Profiler* profiler_ = nullptr;
+    int num_tasks_ = 0;
+    Schedule sched_ = Schedule::DYNAMIC;
+    std::atomic<int> next_task_;
+    std::exception_ptr error_; // first exception a task threw
+};
+
+/**
+ * ThreadPoolScope:
+ *   makes `pool` the calling thread's ThreadPool::instance() for its
+ *   lifetime, so the parallel regions it starts run on that pool's
+ *   threads only; scopes nest. Threads running independent work each
+ *   bind a pool of their own (see CoreGroups).
+ */
+class ThreadPoolScope {
+public:
+    explicit ThreadPoolScope(ThreadPool& pool);
+    ~ThreadPoolScope();
+
+private:
+    ThreadPoolScope(const ThreadPoolScope&) = delete;
+    ThreadPoolScope& operator=(const ThreadPoolScope&) = delete;
+
+    ThreadPool* prev_;
+};
+
+// true while the calling thread runs tasks of a parallel_for
+bool in_parallel_region();
+
+// the cpus this process may run on, in increasing order: its affinity
+// mask (narrowed e.g. by taskset or a cgroup cpuset), else 0 to
+// hardware_concurrency() - 1
+std::vector<int> available_cpus();
+
+// restrict the calling thread / `thread` to `cpus`; false when that is
+// not possible (unsupported, no such cpu, or not one this process may
+// run on)
+bool pin_current_thread(const std::vector<int>& cpus);
+bool pin_thread(std::thread& thread, const std::vector<int>& cpus);
+
+// shortcuts for the calling thread's pool
+void set_num_threads(int num_threads);
+int get_num_threads();
+
+#endif
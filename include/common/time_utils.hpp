@@ -2,6 +2,7 @@
 #define __TIME_UTILS_HPP__
 
 #include <chrono>
+#include <mutex>
 #include <vector>
 #include <string>
 
@@ -16,34 +17,73 @@ enum class OpType {
     ENDOP, // add all new op before this, dont change this
 };
 
-class GlobalProfiler {
+/**
+ * Profiler:
+ *   accumulated time per OpType. add_time may be called from several
+ *   threads at once.
+ */
+class Profiler {
 public:
-    static GlobalProfiler& instance() {
-        static GlobalProfiler profiler;
-        return profiler;
+    Profiler() {
+        times_.resize(static_cast<int>(OpType::ENDOP), 0.0);
     }
 
     void add_time(OpType op, double ms) {
+        std::lock_guard<std::mutex> lock(mutex_);
         times_[static_cast<int>(op)] += ms;
     }
 
     double get_time(OpType op) const {
+        std::lock_guard<std::mutex> lock(mutex_);
         return times_[static_cast<int>(op)];
     }
 
     void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
         for(auto &t : times_) {
             t = 0.0;
         }
     }
 
 private:
-    GlobalProfiler() {
-        times_.resize(static_cast<int>(OpType::ENDOP), 0.0);
-    }
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    mutable std::mutex mutex_;
     std::vector<double> times_;
 };
 
+// the process-wide profiler, where timings go unless a ProfilerScope is bound
+class GlobalProfiler {
+public:
+    static Profiler& instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+};
+
+// the calling thread's profiler: the innermost ProfilerScope's, else
+// GlobalProfiler::instance()
+Profiler& current_profiler();
+
+/**
+ * ProfilerScope:
+ *   routes the calling thread's ScopedTimers (and those of the
+ *   parallel_for tasks it starts) to `profiler` for its lifetime; scopes
+ *   nest.
+ */
+class ProfilerScope {
+public:
+    explicit ProfilerScope(Profiler& profiler);
+    ~ProfilerScope();
+
+private:
+    ProfilerScope(const ProfilerScope&) = delete;
+    ProfilerScope& operator=(const ProfilerScope&) = delete;
+
+    Profiler* prev_;
+};
+
 class ScopedTimer {
 public:
     explicit ScopedTimer(OpType op_type)
@@ -54,7 +94,7 @@ public:
     ~ScopedTimer() {
         auto end = std::chrono::steady_clock::now();
         double ms = std::chrono::duration<double, std::milli>(end - start_).count();
-        GlobalProfiler::instance().add_time(op_type_, ms);
+        current_profiler().add_time(op_type_, ms);
     }
 
 private:
@@ -62,4 +102,4 @@ private:
     std::chrono::time_point<std::chrono::steady_clock> start_;
 };
 
-#endif
\ No newline at end of file
+#endif
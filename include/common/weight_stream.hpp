@@ -0,0 +1,161 @@
+#ifndef __WEIGHT_STREAM_HPP__
+#define __WEIGHT_STREAM_HPP__
+
+#include "common/checkpoint.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct WeightStreamOptions {
+    // layers whose weights may be resident at once (>= 1): the one
+    // computing and the window - 1 after it, which are prefetched
+    int window = 2;
+    // false: no reader thread, each layer is paged in when it is reached
+    // (what compute waits for without overlap)
+    bool prefetch = true;
+};
+
+/**
+ * WeightStreamStats:
+ *   per layer, summed over `passes` forward passes: `load_ms` paging its
+ *   weights in, `stall_ms` compute waiting for them, `compute_ms` running
+ *   it. I/O that overlaps compute is the part of the load nobody waited
+ *   for.
+ */
+struct WeightStreamStats {
+    int window = 0;
+    bool prefetch = false;
+    int passes = 0;
+    std::vector<size_t> layer_bytes;
+    std::vector<double> load_ms;
+    std::vector<double> stall_ms;
+    std::vector<double> compute_ms;
+    size_t resident_peak_bytes = 0;
+
+    double total_load_ms() const;
+    double total_stall_ms() const;
+    double total_compute_ms() const;
+    // 1 - stall / load: 1 when compute hides all I/O, 0 when it waits for
+    // all of it
+    double overlap_efficiency() const;
+    // per-layer table and totals
+    void report(std::ostream &os) const;
+};
+
+/**
+ * WeightStream:
+ *   keeps a bounded window of a model's layers resident while it runs
+ *   them in order, for weights mapped from a plan (see
+ *   common/plan_cache.hpp) that need not fit in RAM. Layer i is the plan
+ *   entries named `prefix[i]`*.
+ *
+ *   begin(i) waits until layer i is paged in and queues the next
+ *   window - 1 layers (wrapping to the first, for the next pass) for the
+ *   reader thread, which pages them in (MADV_WILLNEED, then touching
+ *   every page) while i computes. end(i) releases layer i: its pages are
+ *   dropped from the mapping and from the page cache, so its memory
+ *   returns to the system and the next pass reads it again.
+ *
+ *   Weights must be read-only (copy-on-write pages would be lost on
+ *   release) and a pass calls begin/end from one thread, in layer order,
+ *   holding pass_mutex() so that passes do not interleave.
+ */
+class WeightStream {
+public:
+    // throws std::runtime_error when a prefix names no entries
+    WeightStream(std::unique_ptr<Checkpoint> plan, const std::vector<std::string> &prefix,
+                 const WeightStreamOptions &options = WeightStreamOptions());
+    ~WeightStream();
+
+    int num_layers() const { return (int)layers_.size(); }
+
+    void begin(int layer);
+    void end(int layer);
+    std::mutex &pass_mutex() { return pass_mutex_; }
+
+    WeightStreamStats stats() const;
+    void reset_stats();
+
+private:
+    WeightStream(const WeightStream &) = delete;
+    WeightStream &operator=(const WeightStream &) = delete;
+
+    enum class State {
+        RELEASED,
+        QUEUED,
+        RESIDENT,
+    };
+
+    // byte range of the file, in the mapping at `data`
+    struct Range {
+        const char *data;
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    struct Layer {
+        std::vector<Range> ranges;
+        size_t bytes = 0;
+        State state = State::RELEASED;
+    };
+
+    // page layer's ranges in; returns the time taken (ms)
+    double load(const Layer &layer) const;
+    // drop the pages that lie wholly inside layer's ranges
+    void release(const Layer &layer) const;
+    void reader_loop();
+
+    std::unique_ptr<Checkpoint> plan_;
+    int fd_ = -1; // for the page cache advice
+    size_t page_ = 4096;
+    WeightStreamOptions options_;
+    std::vector<Layer> layers_;
+
+    std::mutex pass_mutex_;
+    mutable std::mutex mutex_;
+    std::condition_variable queued_;
+    std::condition_variable loaded_;
+    std::deque<int> queue_;
+    bool quit_ = false;
+    std::thread reader_;
+
+    WeightStreamStats stats_;
+    size_t resident_bytes_ = 0;
+    std::chrono::steady_clock::time_point compute_start_;
+};
+
+/**
+ * WeightStreamScope:
+ *   begin(layer) on construction, end(layer) on destruction; a no-op on
+ *   a null stream, so a model
+ *   runs its layer loop the same way streaming or not.
+ */
+class WeightStreamScope {
+public:
+    WeightStreamScope(WeightStream *stream, int layer)
+        : stream_(stream), layer_(layer)
+    {
+        if (stream_)
+            stream_->begin(layer_);
+    }
+    ~WeightStreamScope()
+    {
+        if (stream_)
+            stream_->end(layer_);
+    }
+
+private:
+    WeightStreamScope(const WeightStreamScope &) = delete;
+    WeightStreamScope &operator=(const WeightStreamScope &) = delete;
+
+    WeightStream *stream_;
+    int layer_;
+};
+
+#endif
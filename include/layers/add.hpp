@@ -0,0 +1,19 @@
+#ifndef __ADD_HPP__
+#define __ADD_HPP__
+
+#include "common/tensor.hpp"
+
+/**
+ * add:
+ *   elementwise a + b (residual connections); a and b have the same shape.
+ *   The result is in a's layout, b is converted if its layout differs.
+ */
+Tensor<float> add(const Tensor<float> &a, const Tensor<float> &b);
+
+// into a caller-provided output (see Tensor::ensure_shape); output may be a or b
+void add_into(const Tensor<float> &a, const Tensor<float> &b, Tensor<float> &output);
+
+// x += y in place, x must be dense (see Tensor::is_dense)
+void add_inplace(Tensor<float> &x, const Tensor<float> &y);
+
+#endif
@@ -2,6 +2,9 @@
 #define __ATTENTION_HPP__
 
 #include "common/tensor.hpp"
+#include "common/matmul.hpp"
+#include "common/checkpoint.hpp"
+#include "common/plan_cache.hpp"
 #include <vector>
 
 /**
@@ -22,14 +25,47 @@ struct MHAParam {
     Tensor<float> Wo;
     std::vector<float> bo;
     int num_heads=8;
+
+    // Wq/Wk/Wv/Wo packed as GEMM right operands; used when non-empty
+    PackedMatrix Wq_packed;
+    PackedMatrix Wk_packed;
+    PackedMatrix Wv_packed;
+    PackedMatrix Wo_packed;
+
+    // fused Q/K/V projection: [Wq | Wk | Wv] as one packed [D, 3D]
+    // operand and [bq | bk | bv]; replaces the three GEMMs when non-empty
+    PackedMatrix Wqkv_packed;
+    std::vector<float> bqkv;
 };
 
+/**
+ * (re)build the packed copies of the weights. With fuse_qkv Wq/Wk/Wv
+ * go into Wqkv_packed / bqkv (and Wq/Wk/Wv_packed are cleared),
+ * otherwise they are packed one by one. `precision` is how the packed
+ * copies are stored (see PackedMatrix).
+ */
+void pack_mha_param(MHAParam &param, bool fuse_qkv = true,
+                    WeightPrecision precision = WeightPrecision::FP32);
+
+// the raw weights and biases as `prefix`.wq, `prefix`.bq, ... (see
+// ModelParam); the packed copies are rebuilt by pack_mha_param
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, MHAParam &param);
+
+// the packed copies (and bqkv) under `prefix`.* in a plan
+void plan_io(PlanArchive &ar, const std::string &prefix, MHAParam &param);
+
 /**
  * multi_head_self_attention:
  *  input: [N, seq_len, hidden_dim]
  *  output: same shape
+ *  Each sequence attends only to itself. Scores are computed tile by
+ *  tile with an online softmax and never materialized as [S, S].
  */
 Tensor<float> multi_head_self_attention(const Tensor<float> &input,
                                         const MHAParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape), not overlapping input
+void multi_head_self_attention_into(const Tensor<float> &input,
+                                    const MHAParam &param, Tensor<float> &out);
+
 #endif // MY_DEMO_LAYERS_ATTENTION_HPP_
\ No newline at end of file
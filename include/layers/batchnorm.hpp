@@ -2,6 +2,8 @@
 #define __BN_HPP__
 
 #include "common/tensor.hpp"
+#include "common/checkpoint.hpp"
+#include "common/plan_cache.hpp"
 #include <vector>
 
 struct BNParam {
@@ -12,6 +14,40 @@ struct BNParam {
     float eps = 1e-5f;
 };
 
+// gamma/beta/running_mean/running_var as `prefix`.gamma, ... (see ModelParam)
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, BNParam &param);
+
 Tensor<float> batchnorm2d(const Tensor<float> &input, const BNParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape); output may be input
+void batchnorm2d_into(const Tensor<float> &input, const BNParam &param, Tensor<float> &output);
+
+// in place, x must be dense (see Tensor::is_dense)
+void batchnorm2d_inplace(Tensor<float> &x, const BNParam &param);
+
+/**
+ * BNAffine:
+ *   an inference-mode BN as a per-channel affine map,
+ *   y = x * scale[c] + shift[c]; empty when there is nothing to apply.
+ */
+struct BNAffine {
+    std::vector<float> scale;
+    std::vector<float> shift;
+};
+
+BNAffine batchnorm_affine(const BNParam &param);
+
+// scale/shift as `prefix`.scale, `prefix`.shift in a plan
+void plan_io(PlanArchive &ar, const std::string &prefix, BNAffine &affine);
+
+/**
+ * fold_batchnorm:
+ *   conv weight [C_out, ...] and bias with an inference-mode BN folded
+ *   in, so that bn(conv(x, w, b)) == conv(x, w_out, b_out):
+ *   s = gamma / sqrt(var + eps), w_out = w * s, b_out = (b - mean) * s + beta.
+ */
+void fold_batchnorm(const Tensor<float> &weight, const std::vector<float> &bias,
+                    const BNParam &param,
+                    Tensor<float> &weight_out, std::vector<float> &bias_out);
+
 #endif
\ No newline at end of file
@@ -3,14 +3,48 @@
 
 #include "common/tensor.hpp"
 #include "common/matmul.hpp"
+#include "common/plan_cache.hpp"
+#include "layers/batchnorm.hpp"
 #include <vector>
 
+/**
+ * Conv2DAlgo:
+ *   AUTO picks by shape (see conv2d.cpp); the others force a path,
+ *   e.g. to compare results.
+ *   IM2COL        - materialise [C*kH*kW, out_h*out_w] per image, then GEMM
+ *   IMPLICIT_GEMM - gather input patches straight into GEMM panels;
+ *                   unpadded 1x1 convs multiply the NCHW input directly
+ *   DIRECT        - accumulate weight * input rows, no GEMM
+ *   WINOGRAD_F2   - Winograd F(2x2,3x3), 3x3 stride-1 only
+ *   WINOGRAD_F4   - Winograd F(4x4,3x3), 3x3 stride-1 only
+ */
+enum class Conv2DAlgo
+{
+    AUTO = 0,
+    IM2COL,
+    IMPLICIT_GEMM,
+    DIRECT,
+    WINOGRAD_F2,
+    WINOGRAD_F4,
+};
+
+// AUTO uses the direct kernel up to this many output channels
+const int kConv2DDirectMaxOut = 1;
+
+// AUTO uses Winograd for 3x3 stride-1 convs with at least this many
+// input and output channels (below it the transforms dominate) and
+// output tiles over the batch (below it the per-point GEMMs are too
+// narrow to fill the micro-kernel)
+const int kConv2DWinogradMinChannels = 16;
+const int kConv2DWinogradMinTiles = 32;
+
 struct Conv2DParam
 {
     int stride_h = 1;
     int stride_w = 1;
     int pad_h = 0;
     int pad_w = 0;
+    Conv2DAlgo algo = Conv2DAlgo::AUTO;
 };
 
 struct DepthwiseConv2DParam
@@ -21,11 +55,171 @@ struct DepthwiseConv2DParam
     int pad_w = 0;
 };
 
+/**
+ * PackedConv2DWeight:
+ *   conv weight [C_out, C_in, kH, kW] seen as the GEMM left operand
+ *   [C_out, C_in*kH*kW] and packed once into the kernel's panel layout.
+ *   Build it when the model is set up / weights are loaded, then reuse.
+ *
+ *   Packing with the conv's Conv2DParam also precomputes the Winograd
+ *   weight transform when that conv will take a Winograd path (3x3,
+ *   stride 1; the tile from param.algo, F(4x4) under AUTO).
+ *
+ *   A weight packed for another input layout (see layers/conv2d_layout.hpp)
+ *   has no Winograd / direct forms: for NHWC `gemm` is the right operand
+ *   [kH*kW*C_in, C_out], for NCHW8c / NCHW16c `blocked` holds it instead.
+ *
+ *   `precision` is how `gemm` and the Winograd matrices are stored; the
+ *   direct and blocked forms are always fp32.
+ */
+struct PackedConv2DWeight
+{
+    int out_channels = 0;
+    int in_channels = 0;
+    int kernel_h = 0;
+    int kernel_w = 0;
+    // layout of the inputs this weight is packed for
+    TensorLayout layout = TensorLayout::NCHW;
+    PackedMatrix gemm;
+    // [C_out/x][C_in/x][kH][kW][x][x] (ci, co innermost), zero-padded; blocked layouts only
+    Tensor<float> blocked;
+    // plain copy, kept only when AUTO would pick the direct kernel
+    Tensor<float> direct;
+    // Winograd F(m x m, 3x3): (m+2)^2 transformed [C_out, C_in] matrices,
+    // one per point of the transform domain; m = 0 when not packed
+    int winograd_tile = 0;
+    std::vector<PackedMatrix> winograd;
+};
+
+PackedConv2DWeight pack_conv2d_weight(const Tensor<float> &weight,
+                                      const Conv2DParam &param = Conv2DParam(),
+                                      TensorLayout layout = TensorLayout::NCHW,
+                                      WeightPrecision precision = WeightPrecision::FP32);
+
+// the raw [C_out, C_in, kH, kW] weight back, from any packed form
+Tensor<float> unpack_conv2d_weight(const PackedConv2DWeight &weight);
+
+// every packed form under `prefix`.* in a plan (see common/plan_cache.hpp)
+void plan_io(PlanArchive &ar, const std::string &prefix, PackedConv2DWeight &weight);
+
+// blocked layout the NCHWxc conv kernels are vectorised for on this CPU:
+// NCHW16c with AVX-512, else NCHW8c
+TensorLayout conv2d_blocked_layout();
+
+/**
+ * pack_conv2d_weight with the following batchnorm folded in (see
+ * fold_batchnorm); `folded_bias` receives the bias to run the conv with,
+ * after which the batchnorm2d call is dropped.
+ */
+PackedConv2DWeight pack_conv2d_weight_bn(const Tensor<float> &weight,
+                                         const std::vector<float> &bias,
+                                         const BNParam &bn,
+                                         std::vector<float> &folded_bias,
+                                         const Conv2DParam &param = Conv2DParam(),
+                                         TensorLayout layout = TensorLayout::NCHW,
+                                         WeightPrecision precision = WeightPrecision::FP32);
+
+/**
+ * conv2d_bn_affine:
+ *   the unfolded counterpart of pack_conv2d_weight_bn: `bn` as the
+ *   conv's epilogue (see conv2d_epilogue) with the conv bias merged into
+ *   its shift, bias * scale + shift, once at prepare rather than on
+ *   every call. `folded_bias` receives the bias to run the conv with:
+ *   empty.
+ */
+BNAffine conv2d_bn_affine(const std::vector<float> &bias, const BNParam &bn,
+                          std::vector<float> &folded_bias);
+
+/**
+ * Conv2DEpilogue:
+ *   fused into the conv's output store, so the post-activation result
+ *   is written once:  y = act((conv + bias) * scale[c] + shift[c] + residual)
+ *   scale / shift hold C_out values (null: 1 / 0), e.g. an unfolded BN;
+ *   residual is an output-shaped tensor (null: none). An empty conv
+ *   bias is none.
+ */
+struct Conv2DEpilogue
+{
+    const float *scale = nullptr;
+    const float *shift = nullptr;
+    const Tensor<float> *residual = nullptr;
+    Activation act = Activation::NONE;
+};
+
+// epilogue applying `bn` (skipped when empty, i.e. folded into the conv),
+// then the residual and the activation
+Conv2DEpilogue conv2d_epilogue(const BNAffine &bn, Activation act,
+                               const Tensor<float> *residual = nullptr);
+
 Tensor<float> conv2d(const Tensor<float> &input,
                      const Tensor<float> &weight,
                      const std::vector<float> &bias,
-                     const Conv2DParam &param);
+                     const Conv2DParam &param,
+                     const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+Tensor<float> conv2d(const Tensor<float> &input,
+                     const PackedConv2DWeight &weight,
+                     const std::vector<float> &bias,
+                     const Conv2DParam &param,
+                     const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+// into a caller-provided output (see Tensor::ensure_shape), which must
+// not overlap the input or the epilogue's residual. Inputs in another
+// layout are convolved in it (see layers/conv2d_layout.hpp); a packed
+// weight is best packed for that layout, else it is repacked per call
+void conv2d_into(const Tensor<float> &input,
+                 const Tensor<float> &weight,
+                 const std::vector<float> &bias,
+                 const Conv2DParam &param,
+                 Tensor<float> &output,
+                 const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+void conv2d_into(const Tensor<float> &input,
+                 const PackedConv2DWeight &weight,
+                 const std::vector<float> &bias,
+                 const Conv2DParam &param,
+                 Tensor<float> &output,
+                 const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+/**
+ * Conv2DError:
+ *   how far a conv path is from the direct kernel on the same input:
+ *   max |y - y_direct| and that divided by max |y_direct|.
+ */
+struct Conv2DError
+{
+    float max_abs = 0.f;
+    float max_rel = 0.f;
+};
+
+// error of the Winograd path with output tile m (2 or 4) against DIRECT
+Conv2DError conv2d_winograd_error(const Tensor<float> &input,
+                                  const Tensor<float> &weight,
+                                  const std::vector<float> &bias,
+                                  const Conv2DParam &param, int tile);
+
+/**
+ * depthwise_conv2d:
+ *   per-channel conv, weight [C, 1, kH, kW]. Computed plane by plane
+ *   straight into the output, bias folded in and the epilogue applied
+ *   while the plane is in cache; 3x3 stride-1/2 convs use a kernel
+ *   vectorised along the width.
+ */
+Tensor<float> depthwise_conv2d(const Tensor<float> &input,
+                               const Tensor<float> &weight,
+                               const std::vector<float> &bias,
+                               const DepthwiseConv2DParam &param,
+                               const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+// into a caller-provided output, as conv2d_into
+void depthwise_conv2d_into(const Tensor<float> &input,
+                           const Tensor<float> &weight,
+                           const std::vector<float> &bias,
+                           const DepthwiseConv2DParam &param,
+                           Tensor<float> &output,
+                           const Conv2DEpilogue &epilogue = Conv2DEpilogue());
 
+// same as depthwise_conv2d(), kept for existing callers
 Tensor<float> depthwise_conv2d_im2col(const Tensor<float> &input,
                                       const Tensor<float> &weight,
                                       const std::vector<float> &bias,
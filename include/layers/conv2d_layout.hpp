@@ -0,0 +1,46 @@
+#ifndef __CONV2D_LAYOUT_HPP__
+#define __CONV2D_LAYOUT_HPP__
+
+#include "layers/conv2d.hpp"
+
+/**
+ * Convolutions on NHWC and blocked NCHW8c / NCHW16c tensors.
+ * conv2d_into and depthwise_conv2d_into send inputs in those layouts
+ * here; the output is written in the input's layout, and the epilogue's
+ * residual must be in it too.
+ *
+ *   NHWC    - GEMM over [pixels, C] rows with the weight packed as the
+ *             [kH*kW*C_in, C_out] right operand: 1x1 stride-1 convs
+ *             multiply the input in place, the others gather one im2col
+ *             row per output pixel (runs of C_in contiguous values).
+ *   NCHWxc  - direct conv, register-blocked over a row segment of output
+ *             pixels times two output channel blocks; AVX-512 for 16c,
+ *             AVX2 for 8c, portable loops otherwise. Weight packed as
+ *             [C_out/x][C_in/x][kH][kW][x ci][x co]; padded input
+ *             channels are skipped.
+ *   depthwise - one output row of a channel block (NHWC: of all channels)
+ *             at a time, vectorised across the lanes.
+ */
+void conv2d_layout_into(const Tensor<float> &input,
+                        const PackedConv2DWeight &weight,
+                        const std::vector<float> &bias,
+                        const Conv2DParam &param,
+                        Tensor<float> &output,
+                        const Conv2DEpilogue &epilogue);
+
+void depthwise_conv2d_layout_into(const Tensor<float> &input,
+                                  const Tensor<float> &weight,
+                                  const std::vector<float> &bias,
+                                  const DepthwiseConv2DParam &param,
+                                  Tensor<float> &output,
+                                  const Conv2DEpilogue &epilogue);
+
+// the layout-specific part of pack_conv2d_weight: fills pw.gemm (NHWC,
+// stored in `precision`) or pw.blocked from the raw [C_out, C_in, kH, kW] weight
+void pack_conv2d_weight_layout(const Tensor<float> &weight, PackedConv2DWeight &pw,
+                               WeightPrecision precision = WeightPrecision::FP32);
+
+// and back: the raw weight into dst
+void unpack_conv2d_weight_layout(const PackedConv2DWeight &pw, float *dst);
+
+#endif
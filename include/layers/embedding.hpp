@@ -2,12 +2,16 @@
 #define __EMBEDDING_HPP__
 
 #include "common/tensor.hpp"
+#include "common/checkpoint.hpp"
 
 struct EmbeddingParam
 {
     Tensor<float> weight;
 };
 
+// weight as `prefix`.weight (see ModelParam)
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, EmbeddingParam &param);
+
 /**
  * Embedding:
  *  input: [N, seq_len], each element is an id in [0, vocab_size-1].
@@ -17,6 +21,10 @@ struct EmbeddingParam
 Tensor<float> embedding_forward(const Tensor<float> &input_ids,
                                 const EmbeddingParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape)
+void embedding_forward_into(const Tensor<float> &input_ids,
+                            const EmbeddingParam &param, Tensor<float> &out);
+
 /**
  * PatchEmbedParam:
  *   - patch_size: typically 16 for DeiT-Tiny
@@ -36,6 +44,9 @@ struct PatchEmbedParam
     std::vector<float> bias;
 };
 
+// weight/bias as `prefix`.weight, `prefix`.bias (see ModelParam)
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, PatchEmbedParam &param);
+
 /**
  * patch_embed_forward:
  *  input: [N, in_ch, H, W]
@@ -44,4 +55,8 @@ struct PatchEmbedParam
 Tensor<float> patch_embed_forward(const Tensor<float> &input,
                                   const PatchEmbedParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape), not overlapping input
+void patch_embed_forward_into(const Tensor<float> &input,
+                              const PatchEmbedParam &param, Tensor<float> &out);
+
 #endif // MY_DEMO_LAYERS_EMBEDDING_HPP_
\ No newline at end of file
@@ -2,6 +2,9 @@
 #define MY_LAYERS_FEEDFORWARD_HPP_
 
 #include "common/tensor.hpp"
+#include "common/matmul.hpp"
+#include "common/checkpoint.hpp"
+#include "common/plan_cache.hpp"
 #include <vector>
 
 struct FFParam {
@@ -9,8 +12,24 @@ struct FFParam {
     std::vector<float> b1;
     Tensor<float> W2;
     std::vector<float> b2;
+
+    // W1/W2 packed as GEMM right operands; used when non-empty
+    PackedMatrix W1_packed;
+    PackedMatrix W2_packed;
 };
 
+// (re)build W1_packed/W2_packed from W1/W2, stored in `precision`
+void pack_ff_param(FFParam &param, WeightPrecision precision = WeightPrecision::FP32);
+
+// W1/b1/W2/b2 as `prefix`.w1, ... (see ModelParam)
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, FFParam &param);
+
+// W1_packed/W2_packed under `prefix`.* in a plan
+void plan_io(PlanArchive &ar, const std::string &prefix, FFParam &param);
+
 Tensor<float> feed_forward(const Tensor<float> &x, const FFParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape), not overlapping x
+void feed_forward_into(const Tensor<float> &x, const FFParam &param, Tensor<float> &out);
+
 #endif // MY_LAYERS_FEEDFORWARD_HPP_
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define __LAYERNORM_HPP__
 
 #include "common/tensor.hpp"
+#include "common/checkpoint.hpp"
 #include <vector>
 
 /**
@@ -16,6 +17,9 @@ struct LayerNormParam {
     float eps=1e-5f;
 };
 
+// gamma/beta as `prefix`.gamma, `prefix`.beta (see ModelParam)
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, LayerNormParam &param);
+
 /**
  * layernorm:
  *  input: [N, seq_len, hidden_dim]
@@ -24,4 +28,8 @@ struct LayerNormParam {
 Tensor<float> layernorm(const Tensor<float> &input,
                         const LayerNormParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape); output may be input
+void layernorm_into(const Tensor<float> &input, const LayerNormParam &param,
+                    Tensor<float> &output);
+
 #endif // MY_DEMO_LAYERS_LAYERNORM_HPP_
\ No newline at end of file
@@ -2,15 +2,34 @@
 #define __LINEAR_HPP__
 
 #include "common/tensor.hpp"
+#include "common/matmul.hpp"
+#include "common/checkpoint.hpp"
+#include "common/plan_cache.hpp"
 #include <vector>
 
 struct LinearParam
 {
     Tensor<float> weight;
     std::vector<float> bias;
+
+    // weight^T packed as the GEMM right operand; used when non-empty
+    PackedMatrix weight_packed;
 };
 
+// (re)build weight_packed from weight, stored in `precision`
+void pack_linear_param(LinearParam &param, WeightPrecision precision = WeightPrecision::FP32);
+
+// weight/bias as `prefix`.weight, `prefix`.bias (see ModelParam)
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, LinearParam &param);
+
+// weight_packed as `prefix`.weight_packed in a plan
+void plan_io(PlanArchive &ar, const std::string &prefix, LinearParam &param);
+
 Tensor<float> linear(const Tensor<float> &input,
                      const LinearParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape), not overlapping input
+void linear_into(const Tensor<float> &input, const LinearParam &param,
+                 Tensor<float> &output);
+
 #endif
\ No newline at end of file
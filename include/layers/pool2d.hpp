@@ -16,4 +16,8 @@ Tensor<float> max_pool2d(const Tensor<float> &input, const Pool2DParam &param);
 
 Tensor<float> avg_pool2d(const Tensor<float> &input, const Pool2DParam &param);
 
+// into a caller-provided output (see Tensor::ensure_shape), not overlapping input
+void max_pool2d_into(const Tensor<float> &input, const Pool2DParam &param, Tensor<float> &output);
+void avg_pool2d_into(const Tensor<float> &input, const Pool2DParam &param, Tensor<float> &output);
+
 #endif
\ No newline at end of file
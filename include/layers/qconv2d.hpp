@@ -0,0 +1,142 @@
+#ifndef __QCONV2D_HPP__
+#define __QCONV2D_HPP__
+
+#include "common/qgemm.hpp"
+#include "layers/conv2d.hpp"
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+/**
+ * PackedQConv2DWeight:
+ *   conv weight [C_out, C_in, kH, kW] as the s8 GEMM left operand
+ *   [C_out, C_in*kH*kW], one scale per output channel.
+ */
+struct PackedQConv2DWeight
+{
+    int out_channels = 0;
+    int in_channels = 0;
+    int kernel_h = 0;
+    int kernel_w = 0;
+    PackedQMatrix gemm;
+};
+
+PackedQConv2DWeight pack_qconv2d_weight(const Tensor<float> &weight);
+
+/**
+ * qconv2d_into:
+ *   int8 conv of a u8 NCHW input: per image the u8 im2col matrix
+ *   (padded with the input's zero point; unpadded 1x1 stride-1 convs
+ *   use the input as is) times the s8 weight in int32, then bias and
+ *   epilogue applied in the GEMM's store. param.algo is ignored.
+ */
+void qconv2d_into(const QTensor &input,
+                  const PackedQConv2DWeight &weight,
+                  const std::vector<float> &bias,
+                  const Conv2DParam &param,
+                  Tensor<float> &output,
+                  const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+// the same, requantized to u8 with output.params (set by the caller)
+void qconv2d_into(const QTensor &input,
+                  const PackedQConv2DWeight &weight,
+                  const std::vector<float> &bias,
+                  const Conv2DParam &param,
+                  QTensor &output,
+                  const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+/**
+ * QConv2DSlot:
+ *   the int8 form of one conv of a model. While disabled the conv runs
+ *   in fp32 from its PackedConv2DWeight; the slot's address keys its
+ *   input range during calibration.
+ */
+struct QConv2DSlot
+{
+    bool enabled = false;
+    QuantParams input;
+    PackedQConv2DWeight weight;
+};
+
+// the slot under `prefix`.* in a plan (see common/plan_cache.hpp)
+void plan_io(PlanArchive &ar, const std::string &prefix, QConv2DSlot &slot);
+
+/**
+ * ConvActivation:
+ *   an activation between two convs of a model: fp32, or u8 when both
+ *   convs run in int8, so the first one requantizes straight to the
+ *   second one's input parameters.
+ */
+struct ConvActivation
+{
+    bool quantized = false;
+    Tensor<float> f;
+    QTensor q;
+};
+
+/**
+ * conv2d_slot_into:
+ *   conv2d_into with `slot` in the loop: records the input range under
+ *   a CalibrationScope, and runs qconv2d_into instead when the slot is
+ *   enabled (quantizing an fp32 input with slot.input). The variants
+ *   with `next` write a u8 output when both slots are enabled.
+ */
+void conv2d_slot_into(const Tensor<float> &input, const QConv2DSlot &slot,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, Tensor<float> &output,
+                      const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+void conv2d_slot_into(const ConvActivation &input, const QConv2DSlot &slot,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, Tensor<float> &output,
+                      const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+void conv2d_slot_into(const Tensor<float> &input, const QConv2DSlot &slot,
+                      const QConv2DSlot &next,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, ConvActivation &output,
+                      const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+void conv2d_slot_into(const ConvActivation &input, const QConv2DSlot &slot,
+                      const QConv2DSlot &next,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, ConvActivation &output,
+                      const Conv2DEpilogue &epilogue = Conv2DEpilogue());
+
+/**
+ * QuantLayer:
+ *   a named conv of a model that can run in int8; the models list
+ *   theirs for quantize() and the drift report.
+ */
+struct QuantLayer
+{
+    std::string name;
+    QConv2DSlot *slot;
+    const PackedConv2DWeight *weight;
+};
+
+// enable the layers with enable[i] from their calibrated input ranges
+// (throws for a layer missing from `ranges`), disable the others
+void quantize_layers(const std::vector<QuantLayer> &layers, const ActivationRanges &ranges,
+                     const std::vector<bool> &enable);
+
+// enable[i] for layers named in `names`, every layer when it is empty
+std::vector<bool> select_quant_layers(const std::vector<QuantLayer> &layers,
+                                      const std::vector<std::string> &names);
+
+/**
+ * quantization_report:
+ *   how far int8 moves the model output from fp32, to choose which
+ *   layers to quantize: `run` is called with every layer in fp32, with
+ *   each layer alone in int8 and with all of them, printing per run the
+ *   max |y - y_fp32|, the relative L2 error and how many rows keep
+ *   their top-1 class, then the fp32 and all-int8 run times. The
+ *   layers' previous state is restored afterwards.
+ */
+void quantization_report(const std::vector<QuantLayer> &layers,
+                         const ActivationRanges &ranges,
+                         const std::function<Tensor<float>()> &run,
+                         std::ostream &os);
+
+#endif
@@ -7,4 +7,12 @@
 Tensor<float> relu(const Tensor<float> &input);
 Tensor<float> relu6(const Tensor<float> &input);
 
-#endif
\ No newline at end of file
+// into a caller-provided output (see Tensor::ensure_shape); output may be input
+void relu_into(const Tensor<float> &input, Tensor<float> &output);
+void relu6_into(const Tensor<float> &input, Tensor<float> &output);
+
+// in place, x must be dense (see Tensor::is_dense)
+void relu_inplace(Tensor<float> &x);
+void relu6_inplace(Tensor<float> &x);
+
+#endif
@@ -5,4 +5,7 @@
 
 Tensor<float> softmax(const Tensor<float> &input);
 
+// into a caller-provided output (see Tensor::ensure_shape); output may be input
+void softmax_into(const Tensor<float> &input, Tensor<float> &output);
+
 #endif
\ No newline at end of file
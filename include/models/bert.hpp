@@ -5,7 +5,12 @@
 #include "layers/layernorm.hpp"
 #include "layers/attention.hpp"
 #include "layers/feedforward.hpp"
+#include "layers/add.hpp"
+#include "common/execution_context.hpp"
+#include "common/weight_stream.hpp"
+#include <memory>
 #include <vector>
+#include <string>
 
 struct BertEncoderLayer
 {
@@ -14,18 +19,70 @@ struct BertEncoderLayer
     FFParam ff;
     LayerNormParam ln2;
 
+    // every raw parameter under `prefix`.<name> (see ModelParam)
+    void list_params(std::vector<ModelParam> &params, const std::string &prefix);
+    // prepared state under `prefix`.* in a plan (see common/plan_cache.hpp)
+    void plan_io(PlanArchive &ar, const std::string &prefix);
+
     Tensor<float> forward(const Tensor<float> &x) const;
+    // into `out`, which must not be x; add & norm run in place
+    void forward_into(const Tensor<float> &x, Tensor<float> &out) const;
 };
 
 class BertModel
 {
 public:
     BertModel();
+    // without prepare(), see DeferPrepare
+    explicit BertModel(DeferPrepare);
+
+    // re-pack all GEMM weights; call again after loading new weights.
+    // FP16 / BF16 `precision` halves the packed weights' memory and the
+    // bandwidth small-batch GEMMs are bound by (see PackedMatrix)
+    void prepare(WeightPrecision precision = WeightPrecision::FP32);
+    // in the model's own activation arena: one call at a time
     Tensor<float> forward(const Tensor<float> &token_ids,
                           const Tensor<float> &pos_ids,
                           const Tensor<float> &seg_ids);
+    // reentrant, as ResNet50::forward(input, ctx); a streaming model
+    // (see stream_plan) runs one pass at a time
+    Tensor<float> forward(const Tensor<float> &token_ids,
+                          const Tensor<float> &pos_ids,
+                          const Tensor<float> &seg_ids,
+                          ExecutionContext &ctx) const;
+
+    // checkpoints, as ResNet50::parameters / save / load ("embeddings.word.weight",
+    // "layer0.attn.wq", ...); call prepare() after load()
+    std::vector<ModelParam> parameters();
+    void save(const std::string &path);
+    void load(const std::string &path);
+
+    // plan cache, as ResNet50::save_plan / load_plan
+    void save_plan(const std::string &path, const std::string &key);
+    bool load_plan(const std::string &path, const std::string &key);
+
+    // weight streaming: load_plan, but in forward() only options.window
+    // encoder layers' weights are resident at a time, paged in ahead of
+    // use and released after (see WeightStream); ends with prepare() or
+    // load_plan()
+    bool stream_plan(const std::string &path, const std::string &key,
+                     const WeightStreamOptions &options = WeightStreamOptions());
+    // null unless streaming; stats() has the overlap of I/O and compute
+    WeightStream *weight_stream() { return stream_.get(); }
+
+    // activation memory of forward(), planned on the first call
+    const ActivationArena &activation_arena() const { return arena_; }
 
 private:
+    ActivationArena arena_;
+    // the pass, on the arena and profiler the caller bound
+    Tensor<float> run(const Tensor<float> &token_ids,
+                      const Tensor<float> &pos_ids,
+                      const Tensor<float> &seg_ids) const;
+
+    void plan_io(PlanArchive &ar);
+    std::unique_ptr<WeightStream> stream_;
+
     EmbeddingParam word_emb_;
     EmbeddingParam pos_emb_;
     EmbeddingParam seg_emb_;
@@ -6,7 +6,12 @@
 #include "layers/feedforward.hpp"
 #include "layers/layernorm.hpp"
 #include "layers/linear.hpp"
+#include "layers/add.hpp"
+#include "common/execution_context.hpp"
+#include "common/weight_stream.hpp"
+#include <memory>
 #include <vector>
+#include <string>
 
 /**
  * DeiTEncoderLayer:
@@ -22,8 +27,15 @@ struct DeiTEncoderLayer
     FFParam ff;
     LayerNormParam ln2;
 
+    // every raw parameter under `prefix`.<name> (see ModelParam)
+    void list_params(std::vector<ModelParam> &params, const std::string &prefix);
+    // prepared state under `prefix`.* in a plan (see common/plan_cache.hpp)
+    void plan_io(PlanArchive &ar, const std::string &prefix);
+
     // forward
     Tensor<float> forward(const Tensor<float> &x) const;
+    // into `out`, which must not be x; add & norm run in place
+    void forward_into(const Tensor<float> &x, Tensor<float> &out) const;
 };
 
 /**
@@ -40,13 +52,46 @@ class DeiTTiny
 {
 public:
     DeiTTiny();
+    // without prepare(), see DeferPrepare
+    explicit DeiTTiny(DeferPrepare);
+
+    // re-pack all GEMM weights; call again after loading new weights,
+    // stored in `precision` (see BertModel::prepare)
+    void prepare(WeightPrecision precision = WeightPrecision::FP32);
     // forward
     // input: [N,3,224,224], output => {cls_logits, dist_logits}
     // we can return a pair or 2 Tensors
     // here just return a vector: out[0]=cls, out[1]=dist
     std::vector<Tensor<float>> forward(const Tensor<float> &input);
+    // reentrant, as BertModel::forward(..., ctx)
+    std::vector<Tensor<float>> forward(const Tensor<float> &input, ExecutionContext &ctx) const;
+
+    // checkpoints, as ResNet50::parameters / save / load ("patch_embed.weight",
+    // "layer0.attn.wq", ...); call prepare() after load()
+    std::vector<ModelParam> parameters();
+    void save(const std::string &path);
+    void load(const std::string &path);
+
+    // plan cache, as ResNet50::save_plan / load_plan
+    void save_plan(const std::string &path, const std::string &key);
+    bool load_plan(const std::string &path, const std::string &key);
+
+    // weight streaming, as BertModel::stream_plan / weight_stream
+    bool stream_plan(const std::string &path, const std::string &key,
+                     const WeightStreamOptions &options = WeightStreamOptions());
+    WeightStream *weight_stream() { return stream_.get(); }
+
+    // activation memory of forward(), planned on the first call
+    const ActivationArena &activation_arena() const { return arena_; }
 
 private:
+    ActivationArena arena_;
+    // the pass, on the arena and profiler the caller bound
+    std::vector<Tensor<float>> run(const Tensor<float> &input) const;
+
+    void plan_io(PlanArchive &ar);
+    std::unique_ptr<WeightStream> stream_;
+
     // patch embed
     PatchEmbedParam patch_;
     // cls_token, dist_token
@@ -61,6 +106,10 @@ private:
     // heads
     LinearParam head_;      // for cls
     LinearParam dist_head_; // for dist
+    // their weight buffers read as the [embed_dim, 1000] GEMM right
+    // operand (see run), packed by prepare()
+    PackedMatrix head_packed_;
+    PackedMatrix dist_head_packed_;
     // some config
     int embed_dim_;
     int depth_;
@@ -3,12 +3,16 @@
 
 #include "common/tensor.hpp"
 #include "layers/conv2d.hpp"
+#include "layers/qconv2d.hpp"
 #include "layers/batchnorm.hpp"
 #include "layers/linear.hpp"
 #include "layers/softmax.hpp"
 #include "layers/relu.hpp"
 #include "layers/pool2d.hpp"
+#include "common/execution_context.hpp"
 #include <vector>
+#include <string>
+#include <ostream>
 
 struct InvertedResidual {
     int in_channels;
@@ -28,27 +32,113 @@ struct InvertedResidual {
     std::vector<float> b_project;
     BNParam bn_project;
 
+    // 1x1 conv weights packed for the GEMM kernel, filled by prepare()
+    PackedConv2DWeight pw_expand, pw_project;
+    // depthwise weight the block runs with: w_dwise, or with bn_dwise folded in
+    Tensor<float> fw_dwise;
+    // biases the convs run with: b_*, or b_* with bn_* folded in
+    std::vector<float> fb_expand, fb_dwise, fb_project;
+    // bn_* as conv epilogues when not folded, empty when folded
+    BNAffine aff_expand, aff_dwise, aff_project;
+    // int8 forms of the 1x1 convs, set by MobileNetV2::quantize(), reset
+    // by prepare(); the depthwise conv stays fp32
+    QConv2DSlot q_expand, q_project;
+
+    void prepare(bool fold_bn, TensorLayout layout = TensorLayout::NCHW,
+                 WeightPrecision precision = WeightPrecision::FP32);
+
+    // every raw parameter under `prefix`.<name> (see ModelParam)
+    void list_params(std::vector<ModelParam> &params, const std::string &prefix);
+    // prepared state under `prefix`.* in a plan (see common/plan_cache.hpp)
+    void plan_io(PlanArchive &ar, const std::string &prefix);
+
     Tensor<float> forward(const Tensor<float>& x) const;
+    // into `out`, which must not be x
+    void forward_into(const Tensor<float>& x, Tensor<float>& out) const;
 };
 
 class MobileNetV2 {
 public:
     MobileNetV2();
+    // without prepare(), see DeferPrepare
+    explicit MobileNetV2(DeferPrepare);
+
+    /**
+     * Re-pack all conv weights; call again after loading new weights.
+     * With fold_bn every BatchNorm is folded into its conv's weight and
+     * bias; fold_bn = false applies it in the conv epilogue instead,
+     * e.g. to validate the folding. The raw w_*,
+     * b_* and bn_* parameters are left untouched either way.
+     * `layout` is the activation layout the network runs in: forward()
+     * converts its input once and every layer after it stays in it.
+     * `precision` is how the packed 1x1 conv and fc weights are stored
+     * (see PackedMatrix); the depthwise weights stay fp32.
+     */
+    void prepare(bool fold_bn = true, TensorLayout layout = TensorLayout::NCHW,
+                 WeightPrecision precision = WeightPrecision::FP32);
+
+    // in the model's own activation arena: one call at a time
     Tensor<float> forward(const Tensor<float> &input);
+    // reentrant, as ResNet50::forward(input, ctx)
+    Tensor<float> forward(const Tensor<float> &input, ExecutionContext &ctx) const;
+
+    // checkpoints, as ResNet50::parameters / save / load ("first_conv.weight",
+    // "block1.expand.weight", ...); call prepare() after load()
+    std::vector<ModelParam> parameters();
+    void save(const std::string &path);
+    void load(const std::string &path);
+
+    // plan cache, as ResNet50::save_plan / load_plan
+    void save_plan(const std::string &path, const std::string &key);
+    bool load_plan(const std::string &path, const std::string &key);
+
+    // activation memory of forward(), planned on the first call
+    const ActivationArena &activation_arena() const { return arena_; }
+
+    /**
+     * int8 post-training quantization of the first, last and 1x1 convs
+     * (NCHW only), as ResNet50::quantize(): calibrate with forward()
+     * inside a CalibrationScope, then quantize the layers named in
+     * `layers` (see quant_layers(), all when empty). The depthwise convs
+     * between them keep fp32 activations.
+     */
+    std::vector<std::string> quant_layers();
+    void quantize(const ActivationRanges &ranges,
+                  const std::vector<std::string> &layers = std::vector<std::string>());
+
+    // output drift of int8 against fp32 per conv on `input`
+    void quantization_report(const Tensor<float> &input, const ActivationRanges &ranges,
+                             std::ostream &os);
 
 private:
+    ActivationArena arena_;
+    // the pass, on the arena and profiler the caller bound
+    Tensor<float> run(const Tensor<float> &input) const;
+    TensorLayout layout_ = TensorLayout::NCHW;
+
     Tensor<float> first_conv_w_;
     std::vector<float> first_conv_b_;
     BNParam first_conv_bn_;
+    PackedConv2DWeight first_conv_pw_;
+    std::vector<float> first_conv_fb_;
+    BNAffine first_conv_aff_;
+    QConv2DSlot first_conv_q_;
 
     std::vector<InvertedResidual> blocks_;
 
     Tensor<float> last_conv_w_;
     std::vector<float> last_conv_b_;
     BNParam last_conv_bn_;
+    PackedConv2DWeight last_conv_pw_;
+    std::vector<float> last_conv_fb_;
+    BNAffine last_conv_aff_;
+    QConv2DSlot last_conv_q_;
 
     LinearParam fc_;
 
+    std::vector<QuantLayer> quant_layer_list();
+    void plan_io(PlanArchive &ar);
+
     int current_channels_;
 
     InvertedResidual make_inverted_residual(int in_c,int out_c,int stride,int expand_ratio);
@@ -3,13 +3,17 @@
 
 #include "common/tensor.hpp"
 #include "layers/conv2d.hpp"
+#include "layers/qconv2d.hpp"
 #include "layers/pool2d.hpp"
 #include "layers/batchnorm.hpp"
 #include "layers/relu.hpp"
 #include "layers/linear.hpp"
 #include "layers/softmax.hpp"
+#include "common/execution_context.hpp"
 #include <vector>
+#include <string>
 #include <memory>
+#include <ostream>
 
 struct Bottleneck {
     Tensor<float> w1;       // shape [planes, in_planes, 1, 1]
@@ -30,21 +34,136 @@ struct Bottleneck {
     BNParam bn_down;
 
     int stride = 1;
+    // conv path for w2, e.g. a Winograd tile picked per stage
+    Conv2DAlgo algo2 = Conv2DAlgo::AUTO;
+
+    // conv weights packed for the GEMM kernel, filled by prepare()
+    PackedConv2DWeight pw1, pw2, pw3, pw_down;
+    // biases the packed convs run with: b*, or b* with bn* folded in
+    std::vector<float> fb1, fb2, fb3, fb_down;
+    // bn* as conv epilogues when not folded, empty when folded
+    BNAffine aff1, aff2, aff3, aff_down;
+    // int8 forms of the convs, set by ResNet50::quantize(), reset by prepare()
+    QConv2DSlot q1, q2, q3, q_down;
+
+    void prepare(bool fold_bn, TensorLayout layout = TensorLayout::NCHW,
+                 WeightPrecision precision = WeightPrecision::FP32);
+
+    Conv2DParam conv2_param() const;
+
+    // every raw parameter under `prefix`.<name> (see ModelParam)
+    void list_params(std::vector<ModelParam> &params, const std::string &prefix);
+    // prepared state under `prefix`.* in a plan (see common/plan_cache.hpp)
+    void plan_io(PlanArchive &ar, const std::string &prefix);
+
+    // 1x1 conv + bn + relu, i.e. the input of the 3x3 conv
+    Tensor<float> reduce(const Tensor<float> &x) const;
 
     // 前向
     Tensor<float> forward(const Tensor<float> &x) const;
+    // into `out`, which must not be x
+    void forward_into(const Tensor<float> &x, Tensor<float> &out) const;
 };
 
 class ResNet50 {
 public:
-    ResNet50();  
+    ResNet50();
+    // without prepare(), see DeferPrepare
+    explicit ResNet50(DeferPrepare);
+
+    /**
+     * Re-pack all conv weights; call again after loading new weights.
+     * With fold_bn every BatchNorm is folded into its conv's packed
+     * weight and bias; fold_bn = false applies it in the conv epilogue
+     * instead, e.g. to validate the folding.
+     * The raw w*, b* and bn* parameters are left untouched either way.
+     * `layout` is the activation layout the body runs in: forward()
+     * converts its input once and every conv, pool and add after the
+     * stem stays in it (see TensorLayout).
+     * `precision` is how the packed conv and fc weights are stored (see
+     * PackedMatrix); FP16 / BF16 halve their memory.
+     */
+    void prepare(bool fold_bn = true, TensorLayout layout = TensorLayout::NCHW,
+                 WeightPrecision precision = WeightPrecision::FP32);
 
+    // in the model's own activation arena: one call at a time
     Tensor<float> forward(const Tensor<float> &input);
+    /**
+     * Reentrant forward: all the pass changes is in `ctx` (see
+     * ExecutionContext), so any number of threads may run it at once on
+     * one model, each with its own context; not while a non-const member
+     * (prepare, load, quantize, ...) runs.
+     */
+    Tensor<float> forward(const Tensor<float> &input, ExecutionContext &ctx) const;
+
+    /**
+     * Checkpoints (see common/checkpoint.hpp). parameters() names every
+     * raw parameter ("conv1.weight", "layer1.0.bn1.gamma", ...); save()
+     * writes them to `path`; load() maps `path` and points the weights at
+     * the mapped pages, no copy. The packed copies are not part of the
+     * checkpoint: call prepare() after load().
+     */
+    std::vector<ModelParam> parameters();
+    void save(const std::string &path);
+    void load(const std::string &path);
+
+    /**
+     * Plan cache (see common/plan_cache.hpp): save_plan() stores the
+     * prepared model at `path` under `key`: its parameters, every packed
+     * conv and fc weight, the folded biases and BN epilogues, the conv
+     * path per layer, the int8 slots and the activation plan.
+     * load_plan() maps all of it back in place of prepare() (and of the
+     * first, planning forward pass) and returns true, or returns false
+     * and leaves the model as it was when `path` holds no plan for `key`.
+     */
+    void save_plan(const std::string &path, const std::string &key);
+    bool load_plan(const std::string &path, const std::string &key);
+
+    // activation memory of forward(), planned on the first call
+    const ActivationArena &activation_arena() const { return arena_; }
+
+    /**
+     * Runs the network on `input` and, for every bottleneck 3x3 conv,
+     * prints the F(2x2) and F(4x4) Winograd error against the direct
+     * kernel on that layer's actual input, to pick the tile per stage.
+     */
+    void winograd_report(const Tensor<float> &input, std::ostream &os);
+
+    /**
+     * int8 post-training quantization of the convs (NCHW only).
+     * Calibrate by running forward() on representative inputs inside a
+     * CalibrationScope, with the model still in fp32; quantize() then
+     * runs the convs named in `layers` (see quant_layers(), all when
+     * empty) in int8: the packed weights, BN folded, per output channel,
+     * and each input with its calibrated range. The convs of a
+     * bottleneck that are both int8 pass the activation on in u8.
+     * prepare() returns every conv to fp32.
+     */
+    std::vector<std::string> quant_layers();
+    void quantize(const ActivationRanges &ranges,
+                  const std::vector<std::string> &layers = std::vector<std::string>());
+
+    // output drift of int8 against fp32 per conv on `input` (see
+    // layers/qconv2d.hpp); the quantized convs are left as they were
+    void quantization_report(const Tensor<float> &input, const ActivationRanges &ranges,
+                             std::ostream &os);
 
 private:
+    ActivationArena arena_;
+    TensorLayout layout_ = TensorLayout::NCHW;
+
+    // the pass, on the arena and profiler the caller bound
+    Tensor<float> run(const Tensor<float> &input) const;
+    // conv1 + bn + relu + maxpool
+    Tensor<float> stem(const Tensor<float> &input) const;
+
     Tensor<float> conv1_w_;
     std::vector<float> conv1_b_;
     BNParam bn1_;
+    PackedConv2DWeight conv1_pw_;
+    std::vector<float> conv1_fb_;
+    BNAffine conv1_aff_;
+    QConv2DSlot conv1_q_;
 
     std::vector<Bottleneck> layer1_;  // 3 blocks
     std::vector<Bottleneck> layer2_;  // 4 blocks
@@ -54,7 +173,11 @@ private:
     LinearParam fc_;   // [1000, 2048], bias[1000]
 
     Bottleneck make_bottleneck(int inplanes, int planes, int stride, bool downsample);
-    std::vector<Bottleneck> make_layer(int inplanes, int planes, int blocks, int stride);
+    std::vector<Bottleneck> make_layer(int inplanes, int planes, int blocks, int stride,
+                                       Conv2DAlgo algo2);
+
+    std::vector<QuantLayer> quant_layer_list();
+    void plan_io(PlanArchive &ar);
 
     int current_inplanes_;
 };
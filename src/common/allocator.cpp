@@ -0,0 +1,165 @@
+#include "common/allocator.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+
+namespace
+{
+    size_t align_up(size_t v, size_t a)
+    {
+        return (v + a - 1) / a * a;
+    }
+
+    class AlignedBackend : public TensorBackend
+    {
+    public:
+        void *allocate(size_t bytes)
+        {
+            void *p = nullptr;
+            if (posix_memalign(&p, kTensorAlignment, bytes ? bytes : kTensorAlignment) != 0)
+            {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+        void deallocate(void *p, size_t)
+        {
+            std::free(p);
+        }
+        const char *name() const { return "aligned"; }
+    };
+
+    class HugePageBackend : public TensorBackend
+    {
+    public:
+        void *allocate(size_t bytes)
+        {
+#ifdef MADV_HUGEPAGE
+            if (bytes >= kHugePageMinBytes)
+            {
+                void *p = mmap(nullptr, align_up(bytes, kHugePageMinBytes), PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                {
+                    throw std::bad_alloc();
+                }
+                // only a hint: without THP the mapping stays on 4 KB pages
+                madvise(p, align_up(bytes, kHugePageMinBytes), MADV_HUGEPAGE);
+                return p;
+            }
+#endif
+            return aligned_backend().allocate(bytes);
+        }
+        void deallocate(void *p, size_t bytes)
+        {
+#ifdef MADV_HUGEPAGE
+            if (bytes >= kHugePageMinBytes)
+            {
+                munmap(p, align_up(bytes, kHugePageMinBytes));
+                return;
+            }
+#endif
+            aligned_backend().deallocate(p, bytes);
+        }
+        const char *name() const { return "hugepage"; }
+        bool zero_filled(size_t bytes) const
+        {
+#ifdef MADV_HUGEPAGE
+            return bytes >= kHugePageMinBytes;
+#else
+            (void)bytes;
+            return false;
+#endif
+        }
+    };
+
+    thread_local TensorBackend *current_backend = nullptr;
+}
+
+TensorBackend &aligned_backend()
+{
+    // never destroyed, Tensors with static storage may outlive it otherwise
+    static AlignedBackend *backend = new AlignedBackend();
+    return *backend;
+}
+
+TensorBackend &huge_page_backend()
+{
+    static HugePageBackend *backend = new HugePageBackend();
+    return *backend;
+}
+
+BumpArena::BumpArena(size_t chunk_bytes, TensorBackend &upstream)
+    : chunk_bytes_(align_up(std::max(chunk_bytes, kTensorAlignment), kTensorAlignment)),
+      upstream_(upstream)
+{
+}
+
+BumpArena::~BumpArena()
+{
+    for (auto &c : chunks_)
+    {
+        upstream_.deallocate(c.base, c.size);
+    }
+}
+
+void *BumpArena::allocate(size_t bytes)
+{
+    size_t need = align_up(std::max(bytes, (size_t)1), kTensorAlignment);
+    // first chunk from the current one on with room left
+    while (current_ < chunks_.size() && offset_ + need > chunks_[current_].size)
+    {
+        current_++;
+        offset_ = 0;
+    }
+    if (current_ == chunks_.size())
+    {
+        Chunk c;
+        c.size = std::max(chunk_bytes_, need);
+        c.base = static_cast<char *>(upstream_.allocate(c.size));
+        chunks_.push_back(c);
+        offset_ = 0;
+    }
+    void *p = chunks_[current_].base + offset_;
+    offset_ += need;
+    used_ += need;
+    return p;
+}
+
+void BumpArena::deallocate(void *, size_t)
+{
+}
+
+void BumpArena::reset()
+{
+    current_ = 0;
+    offset_ = 0;
+    used_ = 0;
+}
+
+size_t BumpArena::capacity() const
+{
+    size_t total = 0;
+    for (auto &c : chunks_)
+    {
+        total += c.size;
+    }
+    return total;
+}
+
+TensorBackendScope::TensorBackendScope(TensorBackend &backend)
+    : prev_(current_backend)
+{
+    current_backend = &backend;
+}
+
+TensorBackendScope::~TensorBackendScope()
+{
+    current_backend = prev_;
+}
+
+TensorBackend &current_tensor_backend()
+{
+    return current_backend ? *current_backend : aligned_backend();
+}
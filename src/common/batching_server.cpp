@@ -0,0 +1,421 @@
+#include "common/batching_server.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    double ms_between(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b)
+    {
+        return std::chrono::duration<double, std::milli>(b - a).count();
+    }
+
+    bool same_shape(const Tensor<float> &a, const Tensor<float> &b)
+    {
+        return a.shape() == b.shape();
+    }
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+int LatencyHistogram::bucket(double ms)
+{
+    double us = ms * 1000.0;
+    if (!(us >= 1.0))
+    {
+        return 0;
+    }
+    int b = 1 + (int)std::floor(8.0 * std::log2(us));
+    return std::min(b, kBuckets - 1);
+}
+
+double LatencyHistogram::bucket_upper_ms(int b)
+{
+    return std::exp2(b / 8.0) / 1000.0;
+}
+
+void LatencyHistogram::record(double ms)
+{
+    counts_[bucket(ms)].fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(1, std::memory_order_relaxed);
+    long long ns = (long long)(std::max(0.0, ms) * 1e6);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+    long long prev = max_ns_.load(std::memory_order_relaxed);
+    while (ns > prev && !max_ns_.compare_exchange_weak(prev, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto &c : counts_)
+    {
+        c.store(0, std::memory_order_relaxed);
+    }
+    total_.store(0, std::memory_order_relaxed);
+    sum_ns_.store(0, std::memory_order_relaxed);
+    max_ns_.store(0, std::memory_order_relaxed);
+}
+
+long long LatencyHistogram::count() const
+{
+    return total_.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean_ms() const
+{
+    long long n = count();
+    return n ? sum_ns_.load(std::memory_order_relaxed) / 1e6 / n : 0.0;
+}
+
+double LatencyHistogram::max_ms() const
+{
+    return max_ns_.load(std::memory_order_relaxed) / 1e6;
+}
+
+double LatencyHistogram::percentile_ms(double p) const
+{
+    long long n = count();
+    if (n == 0)
+    {
+        return 0.0;
+    }
+    long long target = std::max(1LL, (long long)std::ceil(p / 100.0 * n));
+    long long seen = 0;
+    for (int b = 0; b < kBuckets; b++)
+    {
+        seen += counts_[b].load(std::memory_order_relaxed);
+        if (seen >= target)
+        {
+            return std::min(bucket_upper_ms(b), max_ms());
+        }
+    }
+    return max_ms();
+}
+
+double BatchingServer::Stats::mean_batch() const
+{
+    return batches ? (double)requests / batches : 0.0;
+}
+
+BatchingServer::BatchingServer(BatchFunction fn, const BatchingOptions &options)
+    : fn_(std::move(fn)), options_(options), queue_(options.queue_capacity), sleepers_(0),
+      stopping_(false), submitting_(0), requests_(0), batches_(0), failed_(0)
+{
+    options_.max_batch = std::max(1, options_.max_batch);
+    options_.max_delay_ms = std::max(0.0, options_.max_delay_ms);
+    batch_sizes_.reset(new std::atomic<long long>[options_.max_batch + 1]);
+    reset_stats();
+
+    groups_.reset(new CoreGroups(options_.num_groups, options_.num_cores));
+    for (int g = 0; g < groups_->num_groups(); g++)
+    {
+        workers_.push_back(groups_->submit([this](int)
+                                           { worker_loop(); }));
+    }
+}
+
+BatchingServer::~BatchingServer()
+{
+    stopping_.store(true);
+    // a submit() past its stopping_ check pushes before the workers may
+    // see an empty queue for the last time
+    while (submitting_.load() > 0)
+    {
+        std::this_thread::yield();
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        wake_.notify_all();
+    }
+    for (auto &w : workers_)
+    {
+        w.wait();
+    }
+    // nothing should be left; whatever is gets failed, not dropped
+    Request *r;
+    while (queue_.try_pop(r))
+    {
+        finish(r, Tensor<float>(),
+               std::make_exception_ptr(std::runtime_error("BatchingServer: server stopped")));
+    }
+}
+
+std::future<Tensor<float>> BatchingServer::submit(const Tensor<float> &input)
+{
+    std::unique_ptr<Request> request(new Request);
+    request->input = input;
+    std::future<Tensor<float>> result = request->promise.get_future();
+    enqueue(request.get());
+    request.release();
+    return result;
+}
+
+void BatchingServer::submit(const Tensor<float> &input, Callback done)
+{
+    std::unique_ptr<Request> request(new Request);
+    request->input = input;
+    request->done = std::move(done);
+    enqueue(request.get());
+    request.release();
+}
+
+void BatchingServer::enqueue(Request *request)
+{
+    if (request->input.dim() < 1 || request->input.shape()[0] != 1)
+    {
+        throw std::runtime_error("BatchingServer::submit: input must be one request, [1, ...]");
+    }
+    // counted before stopping_ is read, the destructor after it is set
+    // (both seq_cst): either this sees stopping_ or the destructor waits
+    // until the push and the doorbell below are done
+    submitting_.fetch_add(1);
+    if (stopping_.load())
+    {
+        submitting_.fetch_sub(1);
+        throw std::runtime_error("BatchingServer::submit: server is stopping");
+    }
+    request->arrival = std::chrono::steady_clock::now();
+    const bool pushed = queue_.try_push(request);
+    if (pushed)
+    {
+        // the push before the sleeper count; a worker going to sleep counts
+        // itself before it looks at the queue, so one of the two sees the
+        // other
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+    submitting_.fetch_sub(1);
+    if (!pushed)
+    {
+        throw std::runtime_error("BatchingServer::submit: queue full (" +
+                                 std::to_string(queue_.capacity()) + " requests)");
+    }
+}
+
+void BatchingServer::collect(std::vector<Request *> &pending, std::vector<Request *> &batch)
+{
+    const size_t max_batch = (size_t)options_.max_batch;
+    const auto max_delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(options_.max_delay_ms));
+    batch.clear();
+    // a request of another shape waits for a later batch
+    auto take = [&](Request *r)
+    {
+        if (batch.size() < max_batch && (batch.empty() || same_shape(batch[0]->input, r->input)))
+            batch.push_back(r);
+        else
+            pending.push_back(r);
+    };
+    std::vector<Request *> carried;
+    carried.swap(pending);
+    for (Request *r : carried)
+    {
+        take(r);
+    }
+
+    for (;;)
+    {
+        if (batch.size() == max_batch)
+        {
+            return;
+        }
+        Request *r;
+        if (queue_.try_pop(r))
+        {
+            take(r);
+            continue;
+        }
+        if (stopping_.load() && (!batch.empty() || pending.empty()))
+        {
+            return;
+        }
+        // wait for the next request, until the oldest one is due (or a
+        // while, when idle)
+        auto until = batch.empty() ? std::chrono::steady_clock::now() + std::chrono::milliseconds(10)
+                                   : batch[0]->arrival + max_delay;
+        if (!batch.empty() && std::chrono::steady_clock::now() >= until)
+        {
+            return;
+        }
+        sleepers_.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            wake_.wait_until(lock, until, [this]
+                             { return queue_.size_approx() > 0 || stopping_.load(); });
+        }
+        sleepers_.fetch_sub(1);
+    }
+}
+
+void BatchingServer::finish(Request *request, const Tensor<float> &output, std::exception_ptr error)
+{
+    std::unique_ptr<Request> owned(request);
+    latency_.record(ms_between(request->arrival, std::chrono::steady_clock::now()));
+    if (error)
+    {
+        failed_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (request->done)
+    {
+        request->done(error ? Tensor<float>() : output, error);
+    }
+    else if (error)
+    {
+        request->promise.set_exception(error);
+    }
+    else
+    {
+        request->promise.set_value(output);
+    }
+}
+
+void BatchingServer::run_batch(std::vector<Request *> &batch,
+                               std::map<std::vector<int>, std::unique_ptr<ExecutionContext>> &contexts)
+{
+    const int n = (int)batch.size();
+    const auto start = std::chrono::steady_clock::now();
+    for (Request *r : batch)
+    {
+        queueing_.record(ms_between(r->arrival, start));
+    }
+
+    Tensor<float> output;
+    std::exception_ptr error;
+    try
+    {
+        // [1, ...] inputs stacked into [n, ...]
+        std::vector<int> shape(batch[0]->input.shape().begin(), batch[0]->input.shape().end());
+        shape[0] = n;
+        Tensor<float> stacked;
+        if (n == 1)
+        {
+            stacked = batch[0]->input;
+        }
+        else
+        {
+            stacked = Tensor<float>(shape, TensorInit::UNINITIALIZED);
+            const size_t per = (size_t)batch[0]->input.total_size();
+            for (int i = 0; i < n; i++)
+            {
+                Tensor<float> in = batch[i]->input.contiguous();
+                std::memcpy(stacked.data() + i * per, in.data(), per * sizeof(float));
+            }
+        }
+        std::unique_ptr<ExecutionContext> &ctx = contexts[shape];
+        if (!ctx)
+        {
+            ctx.reset(new ExecutionContext);
+        }
+        output = fn_(stacked, *ctx);
+        if (output.dim() < 1 || output.shape()[0] != n)
+        {
+            throw std::runtime_error("BatchingServer: the batch function returned " +
+                                     std::to_string(output.dim() ? output.shape()[0] : 0) +
+                                     " outputs for " + std::to_string(n) + " requests");
+        }
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    requests_.fetch_add(n, std::memory_order_relaxed);
+    batches_.fetch_add(1, std::memory_order_relaxed);
+    batch_sizes_[n].fetch_add(1, std::memory_order_relaxed);
+    for (int i = 0; i < n; i++)
+    {
+        finish(batch[i], error ? Tensor<float>() : output.slice(0, i, i + 1), error);
+    }
+}
+
+void BatchingServer::worker_loop()
+{
+    std::map<std::vector<int>, std::unique_ptr<ExecutionContext>> contexts;
+    std::vector<Request *> pending, batch;
+    for (;;)
+    {
+        collect(pending, batch);
+        if (batch.empty())
+        {
+            // stopping, and nothing left for this worker
+            return;
+        }
+        run_batch(batch, contexts);
+    }
+}
+
+BatchingServer::Stats BatchingServer::stats() const
+{
+    Stats s;
+    s.requests = requests_.load(std::memory_order_relaxed);
+    s.batches = batches_.load(std::memory_order_relaxed);
+    s.failed = failed_.load(std::memory_order_relaxed);
+    for (int n = 0; n <= options_.max_batch; n++)
+    {
+        s.batch_sizes.push_back(batch_sizes_[n].load(std::memory_order_relaxed));
+    }
+    return s;
+}
+
+void BatchingServer::reset_stats()
+{
+    latency_.reset();
+    queueing_.reset();
+    requests_.store(0);
+    batches_.store(0);
+    failed_.store(0);
+    for (int n = 0; n <= options_.max_batch; n++)
+    {
+        batch_sizes_[n].store(0);
+    }
+}
+
+void BatchingServer::report(std::ostream &os) const
+{
+    Stats s = stats();
+    char line[200];
+    std::snprintf(line, sizeof(line),
+                  "batching: max batch %d, max delay %.2f ms, %d group(s); %lld requests in %lld "
+                  "batches (mean %.2f), %lld failed\n",
+                  options_.max_batch, options_.max_delay_ms, groups_->num_groups(), s.requests,
+                  s.batches, s.mean_batch(), s.failed);
+    os << line;
+    if (groups_->pin_failures() > 0)
+    {
+        std::snprintf(line, sizeof(line), "%d threads could not be pinned and run unpinned\n",
+                      groups_->pin_failures());
+        os << line;
+    }
+    const LatencyHistogram *hists[] = {&latency_, &queueing_};
+    const char *names[] = {"latency ", "queueing"};
+    for (int h = 0; h < 2; h++)
+    {
+        std::snprintf(line, sizeof(line),
+                      "%s ms: mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", names[h],
+                      hists[h]->mean_ms(), hists[h]->percentile_ms(50), hists[h]->percentile_ms(90),
+                      hists[h]->percentile_ms(99), hists[h]->max_ms());
+        os << line;
+    }
+    os << "batch size: requests (batches)\n";
+    for (int n = 1; n <= options_.max_batch; n++)
+    {
+        if (s.batch_sizes[n] == 0)
+        {
+            continue;
+        }
+        std::snprintf(line, sizeof(line), "%4d: %5.1f%% (%lld)\n", n,
+                      s.requests ? 100.0 * n * s.batch_sizes[n] / s.requests : 0.0, s.batch_sizes[n]);
+        os << line;
+    }
+}
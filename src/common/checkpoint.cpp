@@ -0,0 +1,421 @@
+#include "common/checkpoint.hpp"
+#include "common/allocator.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "checkpoints are little-endian; byte swapping is not implemented"
+#endif
+
+static_assert(sizeof(CheckpointHeader) == 64, "CheckpointHeader must stay 64 bytes");
+
+struct Checkpoint::Mapping {
+    void *base = nullptr;
+    size_t bytes = 0;
+
+    ~Mapping()
+    {
+        if (base)
+        {
+            munmap(base, bytes);
+        }
+    }
+};
+
+namespace
+{
+    uint64_t align_up(uint64_t v, uint64_t a)
+    {
+        return (v + a - 1) / a * a;
+    }
+
+    std::string shape_string(const TensorShape &shape)
+    {
+        std::string s = "[";
+        for (int i = 0; i < shape.size(); i++)
+        {
+            s += (i ? ", " : "") + std::to_string(shape[i]);
+        }
+        return s + "]";
+    }
+
+    // bounds-checked reads from the index
+    class IndexReader
+    {
+    public:
+        IndexReader(const char *p, const char *end, const std::string &path)
+            : p_(p), end_(end), path_(path) {}
+
+        template <typename V>
+        V read()
+        {
+            V v;
+            take(&v, sizeof(v));
+            return v;
+        }
+
+        std::string read_string(uint32_t n)
+        {
+            std::string s(n, '\0');
+            take(&s[0], n);
+            return s;
+        }
+
+    private:
+        void take(void *dst, size_t n)
+        {
+            if ((size_t)(end_ - p_) < n)
+            {
+                throw std::runtime_error("checkpoint " + path_ + ": index is truncated");
+            }
+            std::memcpy(dst, p_, n);
+            p_ += n;
+        }
+
+        const char *p_;
+        const char *end_;
+        const std::string &path_;
+    };
+
+}
+
+size_t checkpoint_dtype_bytes(CheckpointDType dtype)
+{
+    switch (dtype)
+    {
+    case CheckpointDType::U16:
+        return 2;
+    case CheckpointDType::U8:
+        return 1;
+    case CheckpointDType::U64:
+        return 8;
+    default:
+        return 4;
+    }
+}
+
+Checkpoint::Checkpoint(const std::string &path, bool readahead)
+    : path_(path), mapping_(std::make_shared<Mapping>())
+{
+    auto fail = [&](const std::string &what)
+    {
+        throw std::runtime_error("checkpoint " + path_ + ": " + what);
+    };
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        fail(std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CheckpointHeader))
+    {
+        ::close(fd);
+        fail("not a checkpoint (too small)");
+    }
+    // private and writable: pages are shared through the page cache until
+    // a process writes one, which then gets its own copy
+    void *base = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+    {
+        fail(std::string("mmap: ") + std::strerror(errno));
+    }
+    mapping_->base = base;
+    mapping_->bytes = (size_t)st.st_size;
+    if (readahead)
+    {
+        madvise(base, mapping_->bytes, MADV_WILLNEED);
+    }
+
+    CheckpointHeader h;
+    std::memcpy(&h, base, sizeof(h));
+    if (std::memcmp(h.magic, kCheckpointMagic, sizeof(h.magic)) != 0)
+    {
+        fail("not a checkpoint (bad magic)");
+    }
+    if (h.version != kCheckpointVersion)
+    {
+        fail("unsupported version " + std::to_string(h.version));
+    }
+    if (h.file_bytes != mapping_->bytes)
+    {
+        fail("file is " + std::to_string(mapping_->bytes) + " bytes, header says " +
+             std::to_string(h.file_bytes));
+    }
+    if (h.alignment == 0 || h.alignment % kTensorAlignment != 0 ||
+        h.index_offset > h.file_bytes || h.index_bytes > h.file_bytes - h.index_offset)
+    {
+        fail("corrupt header");
+    }
+
+    const char *bytes = static_cast<const char *>(base);
+    IndexReader index(bytes + h.index_offset, bytes + h.index_offset + h.index_bytes, path_);
+    entries_.resize(h.tensor_count);
+    for (auto &e : entries_)
+    {
+        e.name = index.read_string(index.read<uint32_t>());
+        uint32_t dtype = index.read<uint32_t>();
+        if (dtype > (uint32_t)CheckpointDType::U64)
+        {
+            fail("tensor '" + e.name + "' has unsupported dtype " + std::to_string(dtype));
+        }
+        e.dtype = (CheckpointDType)dtype;
+        uint32_t ndim = index.read<uint32_t>();
+        if (ndim == 0 || ndim > (uint32_t)kMaxTensorDims)
+        {
+            fail("tensor '" + e.name + "' has " + std::to_string(ndim) + " dimensions");
+        }
+        std::vector<int> dims(ndim);
+        for (auto &d : dims)
+        {
+            d = index.read<int32_t>();
+            if (d < 0)
+            {
+                fail("tensor '" + e.name + "' has a negative dimension");
+            }
+        }
+        e.shape = TensorShape(dims);
+        e.offset = index.read<uint64_t>();
+        e.bytes = index.read<uint64_t>();
+        if (e.bytes != (uint64_t)e.shape.numel() * checkpoint_dtype_bytes(e.dtype) ||
+            e.offset % h.alignment != 0 || e.offset > h.file_bytes ||
+            e.bytes > h.file_bytes - e.offset)
+        {
+            fail("tensor '" + e.name + "' lies outside the file or does not match its shape");
+        }
+        if (!by_name_.emplace(e.name, &e - entries_.data()).second)
+        {
+            fail("tensor '" + e.name + "' appears twice");
+        }
+    }
+}
+
+size_t Checkpoint::file_bytes() const
+{
+    return mapping_->bytes;
+}
+
+const CheckpointEntry *Checkpoint::find(const std::string &name) const
+{
+    auto it = by_name_.find(name);
+    return it == by_name_.end() ? nullptr : &entries_[it->second];
+}
+
+Tensor<float> Checkpoint::tensor(const std::string &name) const
+{
+    const CheckpointEntry *e = find(name);
+    if (!e)
+    {
+        throw std::runtime_error("checkpoint " + path_ + ": no tensor '" + name + "'");
+    }
+    if (e->dtype != CheckpointDType::F32)
+    {
+        throw std::runtime_error("checkpoint " + path_ + ": tensor '" + name + "' is not f32");
+    }
+    void *p = static_cast<char *>(mapping_->base) + e->offset;
+    return Tensor<float>(e->shape, std::make_shared<TensorStorage>(p, (size_t)e->bytes, mapping_));
+}
+
+const void *Checkpoint::data(const CheckpointEntry &entry) const
+{
+    return static_cast<const char *>(mapping_->base) + entry.offset;
+}
+
+std::shared_ptr<const void> Checkpoint::mapping() const
+{
+    return mapping_;
+}
+
+void CheckpointWriter::add(const std::string &name, const Tensor<float> &tensor)
+{
+    Item item;
+    item.name = name;
+    item.dtype = CheckpointDType::F32;
+    item.shape = tensor.shape();
+    if (!tensor.is_contiguous())
+    {
+        item.dense = tensor.contiguous();
+    }
+    item.data = item.dense.total_size() ? item.dense.data() : tensor.data();
+    items_.push_back(std::move(item));
+}
+
+void CheckpointWriter::add(const std::string &name, const std::vector<float> &values)
+{
+    add(name, CheckpointDType::F32, TensorShape({(int)values.size()}), values.data());
+}
+
+void CheckpointWriter::add(const std::string &name, CheckpointDType dtype,
+                           const TensorShape &shape, const void *data)
+{
+    Item item;
+    item.name = name;
+    item.dtype = dtype;
+    item.shape = shape;
+    item.data = data;
+    items_.push_back(std::move(item));
+}
+
+uint64_t CheckpointWriter::item_bytes(const Item &item)
+{
+    return (uint64_t)item.shape.numel() * checkpoint_dtype_bytes(item.dtype);
+}
+
+void CheckpointWriter::write(const std::string &path) const
+{
+    auto fail = [&](const std::string &what)
+    {
+        throw std::runtime_error("checkpoint " + path + ": " + what);
+    };
+
+    // lay out the index, then the data behind it
+    CheckpointHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, kCheckpointMagic, sizeof(h.magic));
+    h.version = kCheckpointVersion;
+    h.alignment = kTensorAlignment;
+    h.tensor_count = items_.size();
+    h.index_offset = sizeof(CheckpointHeader);
+
+    std::string index;
+    auto put = [&index](const void *p, size_t n)
+    { index.append(static_cast<const char *>(p), n); };
+    std::unordered_map<std::string, int> seen;
+    std::vector<uint64_t> offsets(items_.size());
+    uint64_t index_bytes = 0;
+    for (const auto &it : items_)
+    {
+        if (!seen.emplace(it.name, 0).second)
+        {
+            fail("tensor '" + it.name + "' added twice");
+        }
+        index_bytes += 4 + it.name.size() + 4 + 4 + 4 * it.shape.size() + 8 + 8;
+    }
+    h.index_bytes = index_bytes;
+    h.data_offset = align_up(h.index_offset + index_bytes, h.alignment);
+    uint64_t end = h.data_offset;
+    for (size_t i = 0; i < items_.size(); i++)
+    {
+        offsets[i] = align_up(end, h.alignment);
+        end = offsets[i] + item_bytes(items_[i]);
+    }
+    h.file_bytes = end;
+
+    for (size_t i = 0; i < items_.size(); i++)
+    {
+        const Item &it = items_[i];
+        uint32_t n = (uint32_t)it.name.size();
+        uint32_t dtype = (uint32_t)it.dtype;
+        uint32_t ndim = (uint32_t)it.shape.size();
+        uint64_t bytes = item_bytes(it);
+        put(&n, 4);
+        put(it.name.data(), n);
+        put(&dtype, 4);
+        put(&ndim, 4);
+        for (int d : it.shape)
+        {
+            int32_t v = d;
+            put(&v, 4);
+        }
+        put(&offsets[i], 8);
+        put(&bytes, 8);
+    }
+
+    std::string tmp = path + ".tmp" + std::to_string((long)getpid());
+    FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f)
+    {
+        fail(std::strerror(errno));
+    }
+    static const char zeros[kTensorAlignment] = {};
+    uint64_t pos = 0;
+    auto write_bytes = [&](const void *p, size_t n)
+    {
+        if (n && std::fwrite(p, 1, n, f) != n)
+        {
+            std::fclose(f);
+            std::remove(tmp.c_str());
+            fail(std::strerror(errno));
+        }
+        pos += n;
+    };
+    auto pad_to = [&](uint64_t offset)
+    { write_bytes(zeros, (size_t)(offset - pos)); };
+
+    write_bytes(&h, sizeof(h));
+    write_bytes(index.data(), index.size());
+    for (size_t i = 0; i < items_.size(); i++)
+    {
+        pad_to(offsets[i]);
+        write_bytes(items_[i].data, (size_t)item_bytes(items_[i]));
+    }
+    if (std::fclose(f) != 0 || std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        fail(std::strerror(errno));
+    }
+}
+
+void list_params(std::vector<ModelParam> &params, const std::string &name, Tensor<float> &tensor)
+{
+    ModelParam p;
+    p.name = name;
+    p.tensor = &tensor;
+    params.push_back(p);
+}
+
+void list_params(std::vector<ModelParam> &params, const std::string &name, std::vector<float> &values)
+{
+    ModelParam p;
+    p.name = name;
+    p.values = &values;
+    params.push_back(p);
+}
+
+void save_checkpoint(const std::string &path, const std::vector<ModelParam> &params)
+{
+    CheckpointWriter writer;
+    for (const auto &p : params)
+    {
+        if (p.tensor)
+            writer.add(p.name, *p.tensor);
+        else
+            writer.add(p.name, *p.values);
+    }
+    writer.write(path);
+}
+
+void load_checkpoint(const Checkpoint &checkpoint, const std::vector<ModelParam> &params)
+{
+    for (const auto &p : params)
+    {
+        const CheckpointEntry *e = checkpoint.find(p.name);
+        if (!e)
+        {
+            throw std::runtime_error("checkpoint " + checkpoint.path() + ": no tensor '" + p.name + "'");
+        }
+        TensorShape expected = p.tensor ? p.tensor->shape() : TensorShape({(int)p.values->size()});
+        if (e->shape != expected)
+        {
+            throw std::runtime_error("checkpoint " + checkpoint.path() + ": '" + p.name + "' is " +
+                                     shape_string(e->shape) + ", the model has " +
+                                     shape_string(expected));
+        }
+        if (p.tensor)
+        {
+            *p.tensor = checkpoint.tensor(p.name);
+        }
+        else
+        {
+            Tensor<float> t = checkpoint.tensor(p.name);
+            p.values->assign(t.data(), t.data() + t.total_size());
+        }
+    }
+}
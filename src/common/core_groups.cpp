@@ -0,0 +1,95 @@
+#include "common/core_groups.hpp"
+#include <algorithm>
+
+CoreGroups::CoreGroups(int num_groups, int num_cores)
+{
+    num_groups = std::max(1, num_groups);
+    const std::vector<int> available = available_cpus();
+    const int hw = (int)available.size();
+    if (num_cores <= 0)
+    {
+        num_cores = hw;
+    }
+    threads_per_group_ = std::max(1, num_cores / num_groups);
+    const bool pin = num_groups * threads_per_group_ <= hw;
+
+    groups_.resize(num_groups);
+    for (int g = 0; g < num_groups; g++)
+    {
+        Group &group = groups_[g];
+        if (pin)
+        {
+            for (int t = 0; t < threads_per_group_; t++)
+            {
+                group.cpus.push_back(available[g * threads_per_group_ + t]);
+            }
+        }
+        group.pool.reset(new ThreadPool(threads_per_group_, group.cpus));
+    }
+    for (int g = 0; g < num_groups; g++)
+    {
+        Group &group = groups_[g];
+        group.runner = std::thread(&CoreGroups::runner_loop, this, g);
+        // the runner is the pool's thread 0
+        if (!group.cpus.empty() && !pin_thread(group.runner, std::vector<int>(1, group.cpus[0])))
+        {
+            runner_pin_failures_++;
+        }
+    }
+}
+
+int CoreGroups::pin_failures() const
+{
+    int failures = runner_pin_failures_;
+    for (const Group &group : groups_)
+    {
+        failures += group.pool->pin_failures();
+    }
+    return failures;
+}
+
+CoreGroups::~CoreGroups()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    queued_.notify_all();
+    for (auto &group : groups_)
+    {
+        group.runner.join();
+    }
+}
+
+std::future<void> CoreGroups::submit(std::function<void(int group)> job)
+{
+    std::packaged_task<void(int)> task(std::move(job));
+    std::future<void> done = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(task));
+    }
+    queued_.notify_one();
+    return done;
+}
+
+void CoreGroups::runner_loop(int g)
+{
+    ThreadPoolScope scope(*groups_[g].pool);
+    for (;;)
+    {
+        std::packaged_task<void(int)> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            queued_.wait(lock, [this]
+                         { return quit_ || !jobs_.empty(); });
+            if (jobs_.empty())
+            {
+                return;
+            }
+            task = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        task(g);
+    }
+}
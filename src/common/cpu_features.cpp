@@ -0,0 +1,115 @@
+#include "common/cpu_features.hpp"
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define POLY_X86 1
+#endif
+
+namespace
+{
+#ifdef POLY_X86
+    unsigned long long read_xcr0()
+    {
+        unsigned int eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((unsigned long long)edx << 32) | eax;
+    }
+#endif
+
+    CpuFeatures detect()
+    {
+        CpuFeatures f;
+#ifdef POLY_X86
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        {
+            return f;
+        }
+        f.sse2 = (edx >> 26) & 1;
+        f.sse41 = (ecx >> 19) & 1;
+        bool osxsave = (ecx >> 27) & 1;
+        bool avx_hw = (ecx >> 28) & 1;
+        bool fma_hw = (ecx >> 12) & 1;
+        bool f16c_hw = (ecx >> 29) & 1;
+
+        // the OS has to save the wide registers before we may use them
+        unsigned long long xcr0 = osxsave ? read_xcr0() : 0;
+        bool ymm_os = (xcr0 & 0x6) == 0x6;
+        bool zmm_os = (xcr0 & 0xe6) == 0xe6;
+
+        f.avx = avx_hw && ymm_os;
+        f.fma = fma_hw && f.avx;
+        f.f16c = f16c_hw && f.avx;
+
+        if (__get_cpuid_max(0, nullptr) >= 7)
+        {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            f.avx2 = ((ebx >> 5) & 1) && f.avx;
+            f.avx512f = ((ebx >> 16) & 1) && zmm_os;
+            f.avx512bw = ((ebx >> 30) & 1) && f.avx512f;
+            f.avx512vl = ((ebx >> 31) & 1) && f.avx512f;
+            f.avx512vnni = ((ecx >> 11) & 1) && f.avx512f;
+        }
+#endif
+        return f;
+    }
+
+    IsaLevel detect_isa()
+    {
+        const CpuFeatures &f = cpu_features();
+        IsaLevel isa = IsaLevel::SCALAR;
+        if (f.sse2)
+            isa = IsaLevel::SSE;
+        if (f.avx2 && f.fma)
+            isa = IsaLevel::AVX2;
+        if (f.avx512f && f.avx2 && f.fma)
+            isa = IsaLevel::AVX512;
+
+        const char *env = std::getenv("POLY_ISA");
+        if (env)
+        {
+            IsaLevel cap = isa;
+            if (std::strcmp(env, "scalar") == 0)
+                cap = IsaLevel::SCALAR;
+            else if (std::strcmp(env, "sse") == 0)
+                cap = IsaLevel::SSE;
+            else if (std::strcmp(env, "avx2") == 0)
+                cap = IsaLevel::AVX2;
+            else if (std::strcmp(env, "avx512") == 0)
+                cap = IsaLevel::AVX512;
+            if (cap < isa)
+                isa = cap;
+        }
+        return isa;
+    }
+}
+
+const CpuFeatures &cpu_features()
+{
+    static const CpuFeatures features = detect();
+    return features;
+}
+
+IsaLevel best_isa()
+{
+    static const IsaLevel isa = detect_isa();
+    return isa;
+}
+
+const char *isa_name(IsaLevel isa)
+{
+    switch (isa)
+    {
+    case IsaLevel::SCALAR:
+        return "scalar";
+    case IsaLevel::SSE:
+        return "sse";
+    case IsaLevel::AVX2:
+        return "avx2+fma";
+    case IsaLevel::AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
@@ -0,0 +1,314 @@
+#include "common/gemm_kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POLY_X86 1
+#define POLY_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace
+{
+    // ---------------- portable scalar 4x4 ----------------
+    void ukernel_scalar_4x4(int kc, const float *a, const float *b,
+                            float *c, int ldc, bool accumulate)
+    {
+        float acc[4][4] = {{0.f}};
+        for (int p = 0; p < kc; p++)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                float ai = a[p * 4 + i];
+                for (int j = 0; j < 4; j++)
+                {
+                    acc[i][j] += ai * b[p * 4 + j];
+                }
+            }
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            float *cr = c + i * ldc;
+            for (int j = 0; j < 4; j++)
+            {
+                cr[j] = accumulate ? cr[j] + acc[i][j] : acc[i][j];
+            }
+        }
+    }
+
+    /**
+     * Half-precision B for the levels without a conversion instruction:
+     * widen the whole [kc x NR] panel into a local buffer (KC is the
+     * level's kc block), then run the fp32 kernel on it.
+     */
+    template <GemmMicroKernel ukernel, int NR, int KC, WeightPrecision P>
+    void ukernel_widened(int kc, const float *a, const uint16_t *b,
+                         float *c, int ldc, bool accumulate)
+    {
+        alignas(64) float panel[KC * NR];
+        widen_to_float(b, panel, (size_t)kc * NR, P);
+        ukernel(kc, a, panel, c, ldc, accumulate);
+    }
+
+#ifdef POLY_X86
+    // Accumulators are spelled out one variable per register: GCC keeps
+    // them in registers reliably, which it does not do for local arrays.
+
+    // ---------------- SSE 4x8 ----------------
+    POLY_TARGET("sse2")
+    inline void store_row_sse(float *cr, __m128 r0, __m128 r1, bool accumulate)
+    {
+        if (accumulate)
+        {
+            r0 = _mm_add_ps(r0, _mm_loadu_ps(cr));
+            r1 = _mm_add_ps(r1, _mm_loadu_ps(cr + 4));
+        }
+        _mm_storeu_ps(cr, r0);
+        _mm_storeu_ps(cr + 4, r1);
+    }
+
+    POLY_TARGET("sse2")
+    void ukernel_sse_4x8(int kc, const float *a, const float *b,
+                         float *c, int ldc, bool accumulate)
+    {
+        __m128 c00 = _mm_setzero_ps(), c01 = _mm_setzero_ps();
+        __m128 c10 = _mm_setzero_ps(), c11 = _mm_setzero_ps();
+        __m128 c20 = _mm_setzero_ps(), c21 = _mm_setzero_ps();
+        __m128 c30 = _mm_setzero_ps(), c31 = _mm_setzero_ps();
+        for (int p = 0; p < kc; p++)
+        {
+            __m128 b0 = _mm_loadu_ps(b);
+            __m128 b1 = _mm_loadu_ps(b + 4);
+            __m128 ai;
+            ai = _mm_set1_ps(a[0]);
+            c00 = _mm_add_ps(c00, _mm_mul_ps(ai, b0));
+            c01 = _mm_add_ps(c01, _mm_mul_ps(ai, b1));
+            ai = _mm_set1_ps(a[1]);
+            c10 = _mm_add_ps(c10, _mm_mul_ps(ai, b0));
+            c11 = _mm_add_ps(c11, _mm_mul_ps(ai, b1));
+            ai = _mm_set1_ps(a[2]);
+            c20 = _mm_add_ps(c20, _mm_mul_ps(ai, b0));
+            c21 = _mm_add_ps(c21, _mm_mul_ps(ai, b1));
+            ai = _mm_set1_ps(a[3]);
+            c30 = _mm_add_ps(c30, _mm_mul_ps(ai, b0));
+            c31 = _mm_add_ps(c31, _mm_mul_ps(ai, b1));
+            a += 4;
+            b += 8;
+        }
+        store_row_sse(c + 0 * ldc, c00, c01, accumulate);
+        store_row_sse(c + 1 * ldc, c10, c11, accumulate);
+        store_row_sse(c + 2 * ldc, c20, c21, accumulate);
+        store_row_sse(c + 3 * ldc, c30, c31, accumulate);
+    }
+
+    // ---------------- AVX2+FMA 6x16 ----------------
+    POLY_TARGET("avx2,fma")
+    inline void store_row_avx2(float *cr, __m256 r0, __m256 r1, bool accumulate)
+    {
+        if (accumulate)
+        {
+            r0 = _mm256_add_ps(r0, _mm256_loadu_ps(cr));
+            r1 = _mm256_add_ps(r1, _mm256_loadu_ps(cr + 8));
+        }
+        _mm256_storeu_ps(cr, r0);
+        _mm256_storeu_ps(cr + 8, r1);
+    }
+
+    // eight B values as fp32, from each storage precision
+    POLY_TARGET("avx2,fma")
+    inline __m256 load8_f32(const float *b) { return _mm256_loadu_ps(b); }
+
+    POLY_TARGET("avx2,fma,f16c")
+    inline __m256 load8_fp16(const uint16_t *b)
+    {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)b));
+    }
+
+    POLY_TARGET("avx2,fma")
+    inline __m256 load8_bf16(const uint16_t *b)
+    {
+        __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)b));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(w, 16));
+    }
+
+#define POLY_UKERNEL_AVX2_6X16(name, target, btype, load)                  \
+    POLY_TARGET(target)                                                    \
+    void name(int kc, const float *a, const btype *b,                      \
+              float *c, int ldc, bool accumulate)                          \
+    {                                                                      \
+        __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();       \
+        __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();       \
+        __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();       \
+        __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();       \
+        __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();       \
+        __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();       \
+        for (int p = 0; p < kc; p++)                                       \
+        {                                                                  \
+            __m256 b0 = load(b);                                           \
+            __m256 b1 = load(b + 8);                                       \
+            __m256 ai;                                                     \
+            ai = _mm256_broadcast_ss(a + 0);                               \
+            c00 = _mm256_fmadd_ps(ai, b0, c00);                            \
+            c01 = _mm256_fmadd_ps(ai, b1, c01);                            \
+            ai = _mm256_broadcast_ss(a + 1);                               \
+            c10 = _mm256_fmadd_ps(ai, b0, c10);                            \
+            c11 = _mm256_fmadd_ps(ai, b1, c11);                            \
+            ai = _mm256_broadcast_ss(a + 2);                               \
+            c20 = _mm256_fmadd_ps(ai, b0, c20);                            \
+            c21 = _mm256_fmadd_ps(ai, b1, c21);                            \
+            ai = _mm256_broadcast_ss(a + 3);                               \
+            c30 = _mm256_fmadd_ps(ai, b0, c30);                            \
+            c31 = _mm256_fmadd_ps(ai, b1, c31);                            \
+            ai = _mm256_broadcast_ss(a + 4);                               \
+            c40 = _mm256_fmadd_ps(ai, b0, c40);                            \
+            c41 = _mm256_fmadd_ps(ai, b1, c41);                            \
+            ai = _mm256_broadcast_ss(a + 5);                               \
+            c50 = _mm256_fmadd_ps(ai, b0, c50);                            \
+            c51 = _mm256_fmadd_ps(ai, b1, c51);                            \
+            a += 6;                                                        \
+            b += 16;                                                       \
+        }                                                                  \
+        store_row_avx2(c + 0 * ldc, c00, c01, accumulate);                 \
+        store_row_avx2(c + 1 * ldc, c10, c11, accumulate);                 \
+        store_row_avx2(c + 2 * ldc, c20, c21, accumulate);                 \
+        store_row_avx2(c + 3 * ldc, c30, c31, accumulate);                 \
+        store_row_avx2(c + 4 * ldc, c40, c41, accumulate);                 \
+        store_row_avx2(c + 5 * ldc, c50, c51, accumulate);                 \
+    }
+
+    POLY_UKERNEL_AVX2_6X16(ukernel_avx2_6x16, "avx2,fma", float, load8_f32)
+    POLY_UKERNEL_AVX2_6X16(ukernel_avx2_6x16_fp16, "avx2,fma,f16c", uint16_t, load8_fp16)
+    POLY_UKERNEL_AVX2_6X16(ukernel_avx2_6x16_bf16, "avx2,fma", uint16_t, load8_bf16)
+
+    // ---------------- AVX-512 8x32 ----------------
+    POLY_TARGET("avx512f")
+    inline void store_row_avx512(float *cr, __m512 r0, __m512 r1, bool accumulate)
+    {
+        if (accumulate)
+        {
+            r0 = _mm512_add_ps(r0, _mm512_loadu_ps(cr));
+            r1 = _mm512_add_ps(r1, _mm512_loadu_ps(cr + 16));
+        }
+        _mm512_storeu_ps(cr, r0);
+        _mm512_storeu_ps(cr + 16, r1);
+    }
+
+    POLY_TARGET("avx512f")
+    inline __m512 load16_f32(const float *b) { return _mm512_loadu_ps(b); }
+
+    POLY_TARGET("avx512f")
+    inline __m512 load16_fp16(const uint16_t *b)
+    {
+        return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)b));
+    }
+
+    POLY_TARGET("avx512f")
+    inline __m512 load16_bf16(const uint16_t *b)
+    {
+        __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)b));
+        return _mm512_castsi512_ps(_mm512_slli_epi32(w, 16));
+    }
+
+#define POLY_UKERNEL_AVX512_8X32(name, btype, load)                        \
+    POLY_TARGET("avx512f")                                                 \
+    void name(int kc, const float *a, const btype *b,                      \
+              float *c, int ldc, bool accumulate)                          \
+    {                                                                      \
+        __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();       \
+        __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();       \
+        __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();       \
+        __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();       \
+        __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps();       \
+        __m512 c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();       \
+        __m512 c60 = _mm512_setzero_ps(), c61 = _mm512_setzero_ps();       \
+        __m512 c70 = _mm512_setzero_ps(), c71 = _mm512_setzero_ps();       \
+        for (int p = 0; p < kc; p++)                                       \
+        {                                                                  \
+            __m512 b0 = load(b);                                           \
+            __m512 b1 = load(b + 16);                                      \
+            __m512 ai;                                                     \
+            ai = _mm512_set1_ps(a[0]);                                     \
+            c00 = _mm512_fmadd_ps(ai, b0, c00);                            \
+            c01 = _mm512_fmadd_ps(ai, b1, c01);                            \
+            ai = _mm512_set1_ps(a[1]);                                     \
+            c10 = _mm512_fmadd_ps(ai, b0, c10);                            \
+            c11 = _mm512_fmadd_ps(ai, b1, c11);                            \
+            ai = _mm512_set1_ps(a[2]);                                     \
+            c20 = _mm512_fmadd_ps(ai, b0, c20);                            \
+            c21 = _mm512_fmadd_ps(ai, b1, c21);                            \
+            ai = _mm512_set1_ps(a[3]);                                     \
+            c30 = _mm512_fmadd_ps(ai, b0, c30);                            \
+            c31 = _mm512_fmadd_ps(ai, b1, c31);                            \
+            ai = _mm512_set1_ps(a[4]);                                     \
+            c40 = _mm512_fmadd_ps(ai, b0, c40);                            \
+            c41 = _mm512_fmadd_ps(ai, b1, c41);                            \
+            ai = _mm512_set1_ps(a[5]);                                     \
+            c50 = _mm512_fmadd_ps(ai, b0, c50);                            \
+            c51 = _mm512_fmadd_ps(ai, b1, c51);                            \
+            ai = _mm512_set1_ps(a[6]);                                     \
+            c60 = _mm512_fmadd_ps(ai, b0, c60);                            \
+            c61 = _mm512_fmadd_ps(ai, b1, c61);                            \
+            ai = _mm512_set1_ps(a[7]);                                     \
+            c70 = _mm512_fmadd_ps(ai, b0, c70);                            \
+            c71 = _mm512_fmadd_ps(ai, b1, c71);                            \
+            a += 8;                                                        \
+            b += 32;                                                       \
+        }                                                                  \
+        store_row_avx512(c + 0 * ldc, c00, c01, accumulate);               \
+        store_row_avx512(c + 1 * ldc, c10, c11, accumulate);               \
+        store_row_avx512(c + 2 * ldc, c20, c21, accumulate);               \
+        store_row_avx512(c + 3 * ldc, c30, c31, accumulate);               \
+        store_row_avx512(c + 4 * ldc, c40, c41, accumulate);               \
+        store_row_avx512(c + 5 * ldc, c50, c51, accumulate);               \
+        store_row_avx512(c + 6 * ldc, c60, c61, accumulate);               \
+        store_row_avx512(c + 7 * ldc, c70, c71, accumulate);               \
+    }
+
+    POLY_UKERNEL_AVX512_8X32(ukernel_avx512_8x32, float, load16_f32)
+    POLY_UKERNEL_AVX512_8X32(ukernel_avx512_8x32_fp16, uint16_t, load16_fp16)
+    POLY_UKERNEL_AVX512_8X32(ukernel_avx512_8x32_bf16, uint16_t, load16_bf16)
+#endif
+
+#define POLY_WIDENED(ukernel, nr, kc)                                           \
+    ukernel_widened<ukernel, nr, kc, WeightPrecision::FP16>,                   \
+        ukernel_widened<ukernel, nr, kc, WeightPrecision::BF16>
+
+    //                             isa               mr  nr  mc   kc   nc    ukernel, ukernel_fp16, ukernel_bf16
+    const GemmKernel k_scalar = {IsaLevel::SCALAR, 4, 4, 64, 256, 1024, ukernel_scalar_4x4,
+                                 POLY_WIDENED(ukernel_scalar_4x4, 4, 256)};
+#ifdef POLY_X86
+    const GemmKernel k_sse = {IsaLevel::SSE, 4, 8, 64, 256, 2048, ukernel_sse_4x8,
+                              POLY_WIDENED(ukernel_sse_4x8, 8, 256)};
+    const GemmKernel k_avx2 = {IsaLevel::AVX2, 6, 16, 96, 256, 3072, ukernel_avx2_6x16,
+                               ukernel_avx2_6x16_fp16, ukernel_avx2_6x16_bf16};
+    // AVX2 without F16C (rare): fp16 panels are widened in software
+    const GemmKernel k_avx2_no_f16c = {IsaLevel::AVX2, 6, 16, 96, 256, 3072, ukernel_avx2_6x16,
+                                       ukernel_widened<ukernel_avx2_6x16, 16, 256, WeightPrecision::FP16>,
+                                       ukernel_avx2_6x16_bf16};
+    const GemmKernel k_avx512 = {IsaLevel::AVX512, 8, 32, 128, 384, 3072, ukernel_avx512_8x32,
+                                 ukernel_avx512_8x32_fp16, ukernel_avx512_8x32_bf16};
+#endif
+}
+
+const GemmKernel &gemm_kernel_for(IsaLevel isa)
+{
+#ifdef POLY_X86
+    switch (isa)
+    {
+    case IsaLevel::AVX512:
+        return k_avx512;
+    case IsaLevel::AVX2:
+        return cpu_features().f16c ? k_avx2 : k_avx2_no_f16c;
+    case IsaLevel::SSE:
+        return k_sse;
+    default:
+        break;
+    }
+#endif
+    (void)isa;
+    return k_scalar;
+}
+
+const GemmKernel &gemm_kernel()
+{
+    static const GemmKernel &kernel = gemm_kernel_for(best_isa());
+    return kernel;
+}
@@ -0,0 +1,211 @@
+#include "common/half.hpp"
+#include "common/cpu_features.hpp"
+#include <cctype>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POLY_X86 1
+#define POLY_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+const char *precision_name(WeightPrecision precision)
+{
+    switch (precision)
+    {
+    case WeightPrecision::FP16:
+        return "fp16";
+    case WeightPrecision::BF16:
+        return "bf16";
+    default:
+        return "fp32";
+    }
+}
+
+bool precision_from_name(const std::string &name, WeightPrecision &precision)
+{
+    std::string lower(name);
+    for (auto &ch : lower)
+    {
+        ch = (char)std::tolower((unsigned char)ch);
+    }
+    for (WeightPrecision p : {WeightPrecision::FP32, WeightPrecision::FP16, WeightPrecision::BF16})
+    {
+        if (lower == precision_name(p))
+        {
+            precision = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace
+{
+    inline uint32_t float_bits(float v)
+    {
+        uint32_t x;
+        std::memcpy(&x, &v, sizeof(x));
+        return x;
+    }
+
+    inline float bits_float(uint32_t x)
+    {
+        float v;
+        std::memcpy(&v, &x, sizeof(v));
+        return v;
+    }
+}
+
+uint16_t float_to_fp16(float v)
+{
+    uint32_t x = float_bits(v);
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    uint32_t abs = x & 0x7fffffffu;
+    if (abs >= 0x7f800000u) // inf / NaN (kept quiet)
+    {
+        return (uint16_t)(sign | 0x7c00 | (abs > 0x7f800000u ? 0x200 : 0));
+    }
+    if (abs >= 0x477ff000u) // rounds past 65504
+    {
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if (abs < 0x38800000u) // below 2^-14: subnormal or zero
+    {
+        // adding 0.5 leaves the value in units of 2^-24 in the low
+        // mantissa bits, rounded to nearest even by the FPU
+        uint32_t r = float_bits(bits_float(abs) + 0.5f) - float_bits(0.5f);
+        return (uint16_t)(sign | r);
+    }
+    uint32_t odd = (abs >> 13) & 1;
+    abs -= (uint32_t)(127 - 15) << 23;
+    abs += 0xfff + odd;
+    return (uint16_t)(sign | (abs >> 13));
+}
+
+float fp16_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    if (exp == 0x1f)
+    {
+        return bits_float(sign | 0x7f800000u | (mant << 13));
+    }
+    if (exp == 0)
+    {
+        // subnormal: mant * 2^-24, exact in fp32
+        float v = (float)mant * (1.f / 16777216.f);
+        return bits_float(sign | float_bits(v));
+    }
+    return bits_float(sign | ((exp + 127 - 15) << 23) | (mant << 13));
+}
+
+uint16_t float_to_bf16(float v)
+{
+    uint32_t x = float_bits(v);
+    if ((x & 0x7fffffffu) > 0x7f800000u)
+    {
+        return (uint16_t)((x >> 16) | 0x40);
+    }
+    x += 0x7fff + ((x >> 16) & 1);
+    return (uint16_t)(x >> 16);
+}
+
+float bf16_to_float(uint16_t h)
+{
+    return bits_float((uint32_t)h << 16);
+}
+
+void narrow_from_float(const float *src, uint16_t *dst, size_t n, WeightPrecision precision)
+{
+    if (precision == WeightPrecision::FP16)
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = float_to_fp16(src[i]);
+    }
+    else
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+namespace
+{
+    void widen_generic(const uint16_t *src, float *dst, size_t n, WeightPrecision precision)
+    {
+        if (precision == WeightPrecision::FP16)
+        {
+            for (size_t i = 0; i < n; i++)
+                dst[i] = fp16_to_float(src[i]);
+        }
+        else
+        {
+            for (size_t i = 0; i < n; i++)
+                dst[i] = bf16_to_float(src[i]);
+        }
+    }
+
+#ifdef POLY_X86
+    POLY_TARGET("avx2,f16c")
+    void widen_avx2(const uint16_t *src, float *dst, size_t n, WeightPrecision precision)
+    {
+        size_t i = 0;
+        if (precision == WeightPrecision::FP16)
+        {
+            for (; i + 8 <= n; i += 8)
+                _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+        }
+        else
+        {
+            for (; i + 8 <= n; i += 8)
+            {
+                __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+                _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(w, 16)));
+            }
+        }
+        widen_generic(src + i, dst + i, n - i, precision);
+    }
+
+    POLY_TARGET("avx512f")
+    void widen_avx512(const uint16_t *src, float *dst, size_t n, WeightPrecision precision)
+    {
+        size_t i = 0;
+        if (precision == WeightPrecision::FP16)
+        {
+            for (; i + 16 <= n; i += 16)
+                _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(src + i))));
+        }
+        else
+        {
+            for (; i + 16 <= n; i += 16)
+            {
+                __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(src + i)));
+                _mm512_storeu_ps(dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(w, 16)));
+            }
+        }
+        widen_generic(src + i, dst + i, n - i, precision);
+    }
+#endif
+
+    typedef void (*WidenFn)(const uint16_t *, float *, size_t, WeightPrecision);
+
+    WidenFn select_widen()
+    {
+#ifdef POLY_X86
+        IsaLevel isa = best_isa();
+        if (isa >= IsaLevel::AVX512)
+            return widen_avx512;
+        if (isa >= IsaLevel::AVX2 && cpu_features().f16c)
+            return widen_avx2;
+#endif
+        return widen_generic;
+    }
+}
+
+void widen_to_float(const uint16_t *src, float *dst, size_t n, WeightPrecision precision)
+{
+    static const WidenFn widen = select_widen();
+    widen(src, dst, n, precision);
+}
@@ -0,0 +1,106 @@
+#include "common/load_generator.hpp"
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+LoadResult generate_load(BatchingServer &server,
+                         const std::function<Tensor<float>(int client, long long i)> &make_input,
+                         const LoadOptions &options)
+{
+    typedef std::chrono::steady_clock Clock;
+    const int clients = std::max(1, options.clients);
+    std::atomic<long long> sent(0), completed(0), failed(0), rejected(0);
+    std::atomic<long long> last_answer_ns(0);
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+                                              std::chrono::duration<double>(options.seconds));
+
+    auto answered = [&](bool ok)
+    {
+        (ok ? completed : failed).fetch_add(1);
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        long long prev = last_answer_ns.load();
+        while (ns > prev && !last_answer_ns.compare_exchange_weak(prev, ns))
+        {
+        }
+    };
+
+    auto client = [&](int c)
+    {
+        if (options.rate > 0.0)
+        {
+            // open loop: this client's share of the arrivals
+            std::mt19937_64 rng(1234 + c);
+            std::exponential_distribution<double> gap(options.rate / clients);
+            Clock::time_point next = start;
+            for (long long i = 0;; i++)
+            {
+                next += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(gap(rng)));
+                if (next >= end)
+                    return;
+                std::this_thread::sleep_until(next);
+                Tensor<float> input = make_input(c, i);
+                try
+                {
+                    server.submit(input, [&](Tensor<float>, std::exception_ptr error)
+                                  { answered(!error); });
+                    sent.fetch_add(1);
+                }
+                catch (const std::runtime_error &)
+                {
+                    rejected.fetch_add(1);
+                }
+            }
+        }
+        // closed loop
+        for (long long i = 0; Clock::now() < end; i++)
+        {
+            Tensor<float> input = make_input(c, i);
+            std::future<Tensor<float>> result;
+            try
+            {
+                result = server.submit(input);
+                sent.fetch_add(1);
+            }
+            catch (const std::runtime_error &)
+            {
+                rejected.fetch_add(1);
+                continue;
+            }
+            try
+            {
+                result.get();
+                answered(true);
+            }
+            catch (...)
+            {
+                answered(false);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; c++)
+    {
+        threads.emplace_back(client, c);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    // open loop: the last callbacks may still be on their way
+    while (completed.load() + failed.load() < sent.load())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    LoadResult r;
+    r.sent = sent.load();
+    r.completed = completed.load();
+    r.failed = failed.load();
+    r.rejected = rejected.load();
+    r.seconds = last_answer_ns.load() / 1e9;
+    return r;
+}
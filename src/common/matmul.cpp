@@ -1,19 +1,713 @@
 #include "common/matmul.hpp"
+#include "common/gemm_kernels.hpp"
+#include "common/thread_pool.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace
+{
+    /**
+     * Growable 64-byte aligned scratch for packed panels.
+     * One per thread, so packing never reallocates in steady state.
+     */
+    struct PackBuffer
+    {
+        float *ptr = nullptr;
+        size_t cap = 0;
+
+        float *get(size_t n)
+        {
+            if (n > cap)
+            {
+                std::free(ptr);
+                void *p = nullptr;
+                if (posix_memalign(&p, 64, n * sizeof(float)) != 0)
+                {
+                    throw std::bad_alloc();
+                }
+                ptr = static_cast<float *>(p);
+                cap = n;
+            }
+            return ptr;
+        }
+
+        ~PackBuffer() { std::free(ptr); }
+    };
+
+    thread_local PackBuffer a_pack;
+    thread_local PackBuffer b_pack;
+
+    int round_up(int v, int mult)
+    {
+        return (v + mult - 1) / mult * mult;
+    }
+
+    // A[mc x kc] (row-major, lda) => ceil(mc/mr) panels of [kc x mr]
+    void pack_a_block(const float *A, int lda, int mc, int kc, int mr, float *dst)
+    {
+        for (int i0 = 0; i0 < mc; i0 += mr)
+        {
+            int rows = std::min(mr, mc - i0);
+            for (int r = 0; r < rows; r++)
+            {
+                const float *src = A + (i0 + r) * lda;
+                for (int p = 0; p < kc; p++)
+                {
+                    dst[p * mr + r] = src[p];
+                }
+            }
+            for (int r = rows; r < mr; r++)
+            {
+                for (int p = 0; p < kc; p++)
+                {
+                    dst[p * mr + r] = 0.f;
+                }
+            }
+            dst += kc * mr;
+        }
+    }
+
+    // B[kc x nc] (row-major, ldb) => ceil(nc/nr) panels of [kc x nr]
+    void pack_b_block(const float *B, int ldb, int kc, int nc, int nr, float *dst)
+    {
+        for (int j0 = 0; j0 < nc; j0 += nr)
+        {
+            int cols = std::min(nr, nc - j0);
+            for (int p = 0; p < kc; p++)
+            {
+                const float *src = B + p * ldb + j0;
+                int j = 0;
+                for (; j < cols; j++)
+                {
+                    dst[j] = src[j];
+                }
+                for (; j < nr; j++)
+                {
+                    dst[j] = 0.f;
+                }
+                dst += nr;
+            }
+        }
+    }
+
+    // A^T, i.e. A stored [kc x mc] (row-major, lda), into the same panels;
+    // every source row is read contiguously
+    void pack_a_block_t(const float *A, int lda, int mc, int kc, int mr, float *dst)
+    {
+        for (int i0 = 0; i0 < mc; i0 += mr)
+        {
+            int rows = std::min(mr, mc - i0);
+            for (int p = 0; p < kc; p++)
+            {
+                const float *src = A + (size_t)p * lda + i0;
+                int r = 0;
+                for (; r < rows; r++)
+                {
+                    dst[p * mr + r] = src[r];
+                }
+                for (; r < mr; r++)
+                {
+                    dst[p * mr + r] = 0.f;
+                }
+            }
+            dst += kc * mr;
+        }
+    }
+
+    // B^T, i.e. B stored [nc x kc] (row-major, ldb), into the same panels
+    void pack_b_block_t(const float *B, int ldb, int kc, int nc, int nr, float *dst)
+    {
+        for (int j0 = 0; j0 < nc; j0 += nr)
+        {
+            int cols = std::min(nr, nc - j0);
+            for (int j = 0; j < cols; j++)
+            {
+                const float *src = B + (size_t)(j0 + j) * ldb;
+                for (int p = 0; p < kc; p++)
+                {
+                    dst[p * nr + j] = src[p];
+                }
+            }
+            for (int j = cols; j < nr; j++)
+            {
+                for (int p = 0; p < kc; p++)
+                {
+                    dst[p * nr + j] = 0.f;
+                }
+            }
+            dst += kc * nr;
+        }
+    }
+
+    void scale_block(float *dst, size_t n, float alpha)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            dst[i] *= alpha;
+        }
+    }
+
+    // plain (optionally transposed) A; alpha is folded into the packed panels
+    class RawA : public GemmPanelSource
+    {
+    public:
+        RawA(const float *A, int lda, bool trans = false, float alpha = 1.f)
+            : A_(A), lda_(lda), trans_(trans), alpha_(alpha) {}
+        const float *panels(int i0, int len, int p0, int kc,
+                            int width, float *scratch) const
+        {
+            if (trans_)
+                pack_a_block_t(A_ + (size_t)p0 * lda_ + i0, lda_, len, kc, width, scratch);
+            else
+                pack_a_block(A_ + (size_t)i0 * lda_ + p0, lda_, len, kc, width, scratch);
+            if (alpha_ != 1.f)
+                scale_block(scratch, (size_t)round_up(len, width) * kc, alpha_);
+            return scratch;
+        }
+
+    private:
+        const float *A_;
+        int lda_;
+        bool trans_;
+        float alpha_;
+    };
+
+    class RawB : public GemmPanelSource
+    {
+    public:
+        RawB(const float *B, int ldb, bool trans = false) : B_(B), ldb_(ldb), trans_(trans) {}
+        const float *panels(int j0, int len, int p0, int kc,
+                            int width, float *scratch) const
+        {
+            if (trans_)
+                pack_b_block_t(B_ + (size_t)j0 * ldb_ + p0, ldb_, kc, len, width, scratch);
+            else
+                pack_b_block(B_ + (size_t)p0 * ldb_ + j0, ldb_, kc, len, width, scratch);
+            return scratch;
+        }
+
+    private:
+        const float *B_;
+        int ldb_;
+        bool trans_;
+    };
+
+    // panels straight from a PackedMatrix; 16-bit ones are widened into scratch
+    class PrePacked : public GemmPanelSource
+    {
+    public:
+        explicit PrePacked(const PackedMatrix &m) : m_(m) {}
+        const float *panels(int i0, int len, int p0, int kc,
+                            int width, float *scratch) const
+        {
+            size_t offset = (size_t)p0 * m_.padded() + (size_t)i0 * kc;
+            if (m_.precision() == WeightPrecision::FP32)
+            {
+                return m_.data() + offset;
+            }
+            widen_to_float(m_.half_data() + offset, scratch,
+                           (size_t)round_up(len, width) * kc, m_.precision());
+            return scratch;
+        }
+
+    private:
+        const PackedMatrix &m_;
+    };
+
+    /**
+     * The B operand as gemm_region sees it: where its panels come from
+     * and the micro-kernel that reads them. FloatPanels wraps any panel
+     * source; HalfPanels hands the kernel the fp16 / bf16 panels of a
+     * pre-packed B as they are, to be widened in registers.
+     */
+    struct FloatPanels
+    {
+        typedef float value_type;
+        const GemmPanelSource &src;
+        GemmMicroKernel ukernel;
+
+        const float *panels(int j0, int len, int p0, int kc, int width, float *scratch) const
+        {
+            return src.panels(j0, len, p0, kc, width, scratch);
+        }
+    };
+
+    struct HalfPanels
+    {
+        typedef uint16_t value_type;
+        const PackedMatrix &m;
+        GemmHalfMicroKernel ukernel;
+
+        const uint16_t *panels(int j0, int len, int p0, int kc, int width, float *scratch) const
+        {
+            (void)len;
+            (void)width;
+            (void)scratch;
+            return m.half_data() + (size_t)p0 * m.padded() + (size_t)j0 * kc;
+        }
+    };
+
+    inline float activate(float v, Activation act)
+    {
+        if (act == Activation::RELU)
+            return v > 0.f ? v : 0.f;
+        if (act == Activation::RELU6)
+            return std::min(std::max(v, 0.f), 6.f);
+        return v;
+    }
+
+    // C[mc x nc] += / = packed A-block * packed B-block; with `ep` (last
+    // K-block only) each micro-tile gets the epilogue as soon as it is stored
+    template <typename BPanels>
+    void macro_kernel(const GemmKernel &k, const BPanels &B, int mc, int nc, int kc,
+                      const float *ap, const typename BPanels::value_type *bp,
+                      float *C, int ldc, bool accumulate,
+                      const GemmEpilogue *ep, int row0, int col0)
+    {
+        float tile[32 * 32];
+        for (int jr = 0; jr < nc; jr += k.nr)
+        {
+            int cols = std::min(k.nr, nc - jr);
+            const typename BPanels::value_type *bpanel = bp + jr * kc;
+            for (int ir = 0; ir < mc; ir += k.mr)
+            {
+                int rows = std::min(k.mr, mc - ir);
+                const float *apanel = ap + ir * kc;
+                float *cp = C + ir * ldc + jr;
+                if (rows == k.mr && cols == k.nr)
+                {
+                    B.ukernel(kc, apanel, bpanel, cp, ldc, accumulate);
+                }
+                else
+                {
+                    // edge tile: compute the full register tile, keep the valid part
+                    B.ukernel(kc, apanel, bpanel, tile, k.nr, false);
+                    for (int i = 0; i < rows; i++)
+                    {
+                        for (int j = 0; j < cols; j++)
+                        {
+                            float v = tile[i * k.nr + j];
+                            cp[i * ldc + j] = accumulate ? cp[i * ldc + j] + v : v;
+                        }
+                    }
+                }
+                if (ep)
+                {
+                    apply_epilogue(*ep, cp, ldc, row0 + ir, col0 + jr, rows, cols);
+                }
+            }
+        }
+    }
+
+    // C[m0:m1, n0:n1] (+)= A[m0:m1, :] * B[:, n0:n1], BLIS-style loop nest:
+    // B block stays in L3, A block in L2, one B micro-panel in L1 while
+    // the micro-kernel sweeps the A panels
+    template <typename BPanels>
+    void gemm_region(const GemmKernel &k,
+                     const GemmPanelSource &A, const BPanels &B,
+                     float *C, int ldc, int K,
+                     int m0, int m1, int n0, int n1,
+                     const GemmEpilogue *ep, bool accumulate)
+    {
+        for (int jc = n0; jc < n1; jc += k.nc)
+        {
+            int nc = std::min(k.nc, n1 - jc);
+            for (int pc = 0; pc < K; pc += k.kc)
+            {
+                int kc = std::min(k.kc, K - pc);
+                const typename BPanels::value_type *bp =
+                    B.panels(jc, nc, pc, kc, k.nr, b_pack.get((size_t)round_up(nc, k.nr) * kc));
+
+                for (int ic = m0; ic < m1; ic += k.mc)
+                {
+                    int mc = std::min(k.mc, m1 - ic);
+                    const float *ap = A.panels(ic, mc, pc, kc, k.mr,
+                                               a_pack.get((size_t)round_up(mc, k.mr) * kc));
+
+                    macro_kernel(k, B, mc, nc, kc, ap, bp,
+                                 C + (size_t)ic * ldc + jc, ldc, accumulate || pc > 0,
+                                 pc + kc == K ? ep : nullptr, ic, jc);
+                }
+            }
+        }
+    }
+
+    // below this many flops per thread a GEMM is not worth splitting
+    // (keeps e.g. the M=1 patch-embed GEMMs on the calling thread)
+    const double kMinFlopsPerThread = 1 << 21;
+
+    Schedule matmul_schedule = Schedule::DYNAMIC;
+
+    /**
+     * Split C into a gm x gn grid of tiles (tile sides are multiples of
+     * mr/nr). Each tile re-packs its own A rows and B columns, so pick the
+     * grid with at least `target` tiles that minimises the packing
+     * traffic K*(M*gn + N*gm).
+     */
+    void choose_grid(const GemmKernel &k, int M, int N, int target,
+                     int &gm, int &gn)
+    {
+        int max_gm = (M + k.mr - 1) / k.mr;
+        int max_gn = (N + k.nr - 1) / k.nr;
+        gm = 1;
+        gn = 1;
+        double best = -1.0;
+        for (int m = 1; m <= std::min(max_gm, target); m++)
+        {
+            int n = std::min(max_gn, (target + m - 1) / m);
+            double cost = (double)M * n + (double)N * m;
+            // prefer grids that actually reach the target tile count
+            if (m * n < target)
+                cost *= 4.0;
+            if (best < 0 || cost < best)
+            {
+                best = cost;
+                gm = m;
+                gn = n;
+            }
+        }
+    }
+
+    // C[M,N] (+)= A * B, split over the thread pool when it is big enough
+    template <typename BPanels>
+    void gemm_panels(const GemmKernel &k, const GemmPanelSource &A, const BPanels &B,
+                     float *C, int ldc, int M, int N, int K, const GemmEpilogue *ep,
+                     bool accumulate, bool parallel)
+    {
+        if (M <= 0 || N <= 0)
+        {
+            return;
+        }
+        if (K <= 0)
+        {
+            for (int i = 0; !accumulate && i < M; i++)
+            {
+                std::memset(C + (size_t)i * ldc, 0, sizeof(float) * N);
+            }
+            if (ep)
+            {
+                apply_epilogue(*ep, C, ldc, 0, 0, M, N);
+            }
+            return;
+        }
+
+        ThreadPool &pool = ThreadPool::instance();
+        double flops = 2.0 * M * N * K;
+        int threads = std::min(pool.num_threads(),
+                               std::max(1, (int)(flops / kMinFlopsPerThread)));
+        if (threads <= 1 || !parallel)
+        {
+            gemm_region(k, A, B, C, ldc, K, 0, M, 0, N, ep, accumulate);
+            return;
+        }
+
+        // static: one tile per thread; dynamic: a few per thread for balance
+        Schedule sched = matmul_schedule;
+        int target = (sched == Schedule::STATIC) ? threads : threads * 4;
+        int gm, gn;
+        choose_grid(k, M, N, target, gm, gn);
+        int tile_m = round_up((M + gm - 1) / gm, k.mr);
+        int tile_n = round_up((N + gn - 1) / gn, k.nr);
+        gm = (M + tile_m - 1) / tile_m;
+        gn = (N + tile_n - 1) / tile_n;
+
+        pool.parallel_for(gm * gn, [&](int t)
+                          {
+            int m0 = (t / gn) * tile_m;
+            int n0 = (t % gn) * tile_n;
+            gemm_region(k, A, B, C, ldc, K,
+                        m0, std::min(M, m0 + tile_m),
+                        n0, std::min(N, n0 + tile_n), ep, accumulate); },
+                          sched);
+    }
+
+    void gemm(const GemmKernel &k, const GemmPanelSource &A, const GemmPanelSource &B,
+              float *C, int ldc, int M, int N, int K, const GemmEpilogue *ep,
+              bool accumulate = false, bool parallel = true)
+    {
+        gemm_panels(k, A, FloatPanels{B, k.ukernel}, C, ldc, M, N, K, ep, accumulate, parallel);
+    }
+
+    const GemmKernel &checked_kernel(const PackedMatrix &m, PackedMatrix::Role role)
+    {
+        const GemmKernel &k = gemm_kernel();
+        if (m.role() != role)
+        {
+            throw std::runtime_error("matmul: PackedMatrix packed for the other operand");
+        }
+        if (m.isa() != k.isa)
+        {
+            throw std::runtime_error("matmul: PackedMatrix packed for a different GEMM kernel");
+        }
+        return k;
+    }
+}
+
+void PackedMatrix::store_as(WeightPrecision precision)
+{
+    precision_ = precision;
+    if (precision == WeightPrecision::FP32)
+    {
+        return;
+    }
+    half_.resize(data_.size());
+    narrow_from_float(data_.data(), half_.data(), data_.size(), precision);
+    std::vector<float>().swap(data_);
+}
+
+PackedMatrix PackedMatrix::pack_a(const float *A, int M, int K, int lda,
+                                  WeightPrecision precision)
+{
+    const GemmKernel &k = gemm_kernel();
+    PackedMatrix m;
+    m.role_ = Role::A;
+    m.rows_ = M;
+    m.cols_ = K;
+    m.isa_ = k.isa;
+    m.padded_ = round_up(M, k.mr);
+    m.data_.resize((size_t)m.padded_ * K);
+    // K-block pc starts at pc * padded, its mr-panels follow each other
+    for (int pc = 0; pc < K; pc += k.kc)
+    {
+        int kc = std::min(k.kc, K - pc);
+        pack_a_block(A + pc, lda, M, kc, k.mr, m.data_.data() + (size_t)pc * m.padded_);
+    }
+    m.store_as(precision);
+    return m;
+}
+
+PackedMatrix PackedMatrix::pack_b(const float *B, int K, int N, int ldb,
+                                  WeightPrecision precision)
+{
+    const GemmKernel &k = gemm_kernel();
+    PackedMatrix m;
+    m.role_ = Role::B;
+    m.rows_ = K;
+    m.cols_ = N;
+    m.isa_ = k.isa;
+    m.padded_ = round_up(N, k.nr);
+    m.data_.resize((size_t)m.padded_ * K);
+    for (int pc = 0; pc < K; pc += k.kc)
+    {
+        int kc = std::min(k.kc, K - pc);
+        pack_b_block(B + (size_t)pc * ldb, ldb, kc, N, k.nr, m.data_.data() + (size_t)pc * m.padded_);
+    }
+    m.store_as(precision);
+    return m;
+}
+
+void PackedMatrix::unpack(float *dst) const
+{
+    const GemmKernel &k = gemm_kernel_for(isa_);
+    bool is_a = (role_ == Role::A);
+    int K = is_a ? cols_ : rows_;
+    int outer = is_a ? rows_ : cols_;
+    int width = is_a ? k.mr : k.nr;
+    std::vector<float> widened;
+    const float *panels = data();
+    if (precision_ != WeightPrecision::FP32)
+    {
+        widened.resize(elements());
+        widen_to_float(half_data(), widened.data(), elements(), precision_);
+        panels = widened.data();
+    }
+    for (int pc = 0; pc < K; pc += k.kc)
+    {
+        int kc = std::min(k.kc, K - pc);
+        const float *block = panels + (size_t)pc * padded_;
+        for (int i = 0; i < outer; i++)
+        {
+            const float *panel = block + (size_t)(i / width) * width * kc + i % width;
+            for (int p = 0; p < kc; p++)
+            {
+                float v = panel[p * width];
+                if (is_a)
+                    dst[(size_t)i * cols_ + pc + p] = v;
+                else
+                    dst[(size_t)(pc + p) * cols_ + i] = v;
+            }
+        }
+    }
+}
+
+void apply_epilogue(const GemmEpilogue &ep, float *c, int ldc,
+                    int row0, int col0, int rows, int cols)
+{
+    const Activation act = ep.act;
+    for (int i = 0; i < rows; i++)
+    {
+        float *ci = c + (size_t)i * ldc;
+        const float *res = ep.residual ? ep.residual + (size_t)(row0 + i) * ep.ldr + col0 : nullptr;
+        if (ep.per_column)
+        {
+            // one branch-free pass per term, so that each one vectorises
+            if (ep.scale)
+            {
+                const float *sc = ep.scale + col0;
+                for (int j = 0; j < cols; j++)
+                    ci[j] *= sc[j];
+            }
+            if (ep.shift)
+            {
+                const float *sh = ep.shift + col0;
+                for (int j = 0; j < cols; j++)
+                    ci[j] += sh[j];
+            }
+            if (res)
+            {
+                for (int j = 0; j < cols; j++)
+                    ci[j] += res[j];
+            }
+            for (int j = 0; j < cols; j++)
+                ci[j] = activate(ci[j], act);
+        }
+        else
+        {
+            const float sc = ep.scale ? ep.scale[row0 + i] : 1.f;
+            const float sh = ep.shift ? ep.shift[row0 + i] : 0.f;
+            for (int j = 0; j < cols; j++)
+            {
+                float v = ci[j] * sc + sh;
+                if (res)
+                    v += res[j];
+                ci[j] = activate(v, act);
+            }
+        }
+    }
+}
+
+void set_matmul_schedule(Schedule sched)
+{
+    matmul_schedule = sched;
+}
 
 void matmul(const float *A, const float *B, float *C,
-            int M, int K, int N)
+            int M, int K, int N, const GemmEpilogue *ep)
 {
     ScopedTimer timer(OpType::MATMUL);
-    // for (int m = 0; m < M; m++)
-    // {
-    //     for (int n = 0; n < N; n++)
-    //     {
-    //         double sum = 0.0;
-    //         for (int k = 0; k < K; k++)
-    //         {
-    //             sum += (double)A[m * K + k] * (double)B[k * N + n];
-    //         }
-    //         C[m * N + n] = (float)sum;
-    //     }
-    // }
-}
\ No newline at end of file
+    const GemmKernel &k = gemm_kernel();
+    gemm(k, RawA(A, K), RawB(B, N), C, N, M, N, K, ep);
+}
+
+void matmul(const PackedMatrix &A, const float *B, float *C, int N,
+            const GemmEpilogue *ep)
+{
+    ScopedTimer timer(OpType::MATMUL);
+    const GemmKernel &k = checked_kernel(A, PackedMatrix::Role::A);
+    gemm(k, PrePacked(A), RawB(B, N), C, N, A.rows(), N, A.cols(), ep);
+}
+
+void matmul(const float *A, const PackedMatrix &B, float *C, int M,
+            const GemmEpilogue *ep)
+{
+    ScopedTimer timer(OpType::MATMUL);
+    const GemmKernel &k = checked_kernel(B, PackedMatrix::Role::B);
+    switch (B.precision())
+    {
+    case WeightPrecision::FP16:
+        gemm_panels(k, RawA(A, B.rows()), HalfPanels{B, k.ukernel_fp16},
+                    C, B.cols(), M, B.cols(), B.rows(), ep, false, true);
+        break;
+    case WeightPrecision::BF16:
+        gemm_panels(k, RawA(A, B.rows()), HalfPanels{B, k.ukernel_bf16},
+                    C, B.cols(), M, B.cols(), B.rows(), ep, false, true);
+        break;
+    default:
+        gemm(k, RawA(A, B.rows()), PrePacked(B), C, B.cols(), M, B.cols(), B.rows(), ep);
+    }
+}
+
+void matmul(const PackedMatrix &A, const GemmPanelSource &B, float *C, int N,
+            const GemmEpilogue *ep)
+{
+    ScopedTimer timer(OpType::MATMUL);
+    const GemmKernel &k = checked_kernel(A, PackedMatrix::Role::A);
+    gemm(k, PrePacked(A), B, C, N, A.rows(), N, A.cols(), ep);
+}
+
+namespace
+{
+    // C = beta * C ahead of an accumulating GEMM (beta == 0 never reads C)
+    void scale_c(float *C, int ldc, int M, int N, float beta)
+    {
+        for (int i = 0; i < M; i++)
+        {
+            float *c = C + (size_t)i * ldc;
+            if (beta == 0.f)
+                std::memset(c, 0, sizeof(float) * N);
+            else
+                scale_block(c, N, beta);
+        }
+    }
+
+    void sgemm_one(const GemmKernel &k, bool trans_a, bool trans_b,
+                   int M, int N, int K, float alpha,
+                   const float *A, int lda, const float *B, int ldb,
+                   float beta, float *C, int ldc, const GemmEpilogue *ep, bool parallel)
+    {
+        if (M <= 0 || N <= 0)
+        {
+            return;
+        }
+        // beta 0 / 1 are the plain overwrite / accumulate modes of the kernel
+        bool accumulate = beta != 0.f;
+        if (accumulate && beta != 1.f)
+        {
+            scale_c(C, ldc, M, N, beta);
+        }
+        if (alpha == 0.f)
+        {
+            if (!accumulate)
+                scale_c(C, ldc, M, N, 0.f);
+            if (ep)
+                apply_epilogue(*ep, C, ldc, 0, 0, M, N);
+            return;
+        }
+        gemm(k, RawA(A, lda, trans_a, alpha), RawB(B, ldb, trans_b), C, ldc, M, N, K, ep,
+             accumulate, parallel);
+    }
+}
+
+void sgemm(bool trans_a, bool trans_b, int M, int N, int K,
+           float alpha, const float *A, int lda, const float *B, int ldb,
+           float beta, float *C, int ldc, const GemmEpilogue *ep)
+{
+    ScopedTimer timer(OpType::MATMUL);
+    sgemm_one(gemm_kernel(), trans_a, trans_b, M, N, K, alpha, A, lda, B, ldb,
+              beta, C, ldc, ep, true);
+}
+
+void sgemm_strided_batched(bool trans_a, bool trans_b, int M, int N, int K,
+                           float alpha, const float *A, int lda, long long stride_a,
+                           const float *B, int ldb, long long stride_b,
+                           float beta, float *C, int ldc, long long stride_c,
+                           int batch_count, const GemmEpilogue *ep)
+{
+    ScopedTimer timer(OpType::MATMUL);
+    const GemmKernel &k = gemm_kernel();
+    auto one = [&](int b, bool parallel)
+    {
+        sgemm_one(k, trans_a, trans_b, M, N, K, alpha,
+                  A + b * stride_a, lda, B + b * stride_b, ldb,
+                  beta, C + b * stride_c, ldc, ep, parallel);
+    };
+    // enough batches to go round: one whole GEMM per task, else split each
+    ThreadPool &pool = ThreadPool::instance();
+    if (batch_count >= pool.num_threads())
+    {
+        pool.parallel_for(batch_count, [&](int b)
+                          { one(b, false); });
+        return;
+    }
+    for (int b = 0; b < batch_count; b++)
+    {
+        one(b, true);
+    }
+}
+
+const char *matmul_kernel_name()
+{
+    return isa_name(gemm_kernel().isa);
+}
@@ -0,0 +1,259 @@
+#include "common/memory_planner.hpp"
+#include "common/thread_pool.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    thread_local ActivationArena *current_arena = nullptr;
+
+    size_t align_up(size_t v, size_t a)
+    {
+        return (v + a - 1) / a * a;
+    }
+
+    // owner of the buffers inside an arena block: they go away with it
+    class PlannedBackend : public TensorBackend
+    {
+    public:
+        void *allocate(size_t)
+        {
+            throw std::bad_alloc();
+        }
+        void deallocate(void *, size_t) {}
+        const char *name() const { return "planned"; }
+    };
+
+    TensorBackend &planned_backend()
+    {
+        static PlannedBackend *backend = new PlannedBackend();
+        return *backend;
+    }
+}
+
+MemoryPlan plan_memory(const std::vector<BufferLifetime> &buffers, size_t alignment)
+{
+    MemoryPlan plan;
+    int n = (int)buffers.size();
+    plan.offsets.assign(n, 0);
+
+    std::vector<int> order(n);
+    for (int i = 0; i < n; i++)
+    {
+        order[i] = i;
+        plan.unplanned += align_up(buffers[i].bytes, alignment);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                     { return buffers[a].bytes > buffers[b].bytes; });
+
+    std::vector<int> placed;
+    std::vector<std::pair<size_t, size_t> > busy; // [begin, end) in use
+    for (int id : order)
+    {
+        const BufferLifetime &b = buffers[id];
+        size_t size = align_up(b.bytes, alignment);
+
+        busy.clear();
+        for (int other : placed)
+        {
+            const BufferLifetime &o = buffers[other];
+            if (o.first <= b.last && b.first <= o.last)
+            {
+                busy.push_back(std::make_pair(plan.offsets[other],
+                                              plan.offsets[other] + align_up(o.bytes, alignment)));
+            }
+        }
+        std::sort(busy.begin(), busy.end());
+
+        // smallest gap between overlapping buffers that fits, else on top
+        size_t best = 0, best_gap = 0, top = 0;
+        bool found = false;
+        for (const auto &r : busy)
+        {
+            if (r.first > top)
+            {
+                size_t gap = r.first - top;
+                if (gap >= size && (!found || gap < best_gap))
+                {
+                    best = top;
+                    best_gap = gap;
+                    found = true;
+                }
+            }
+            top = std::max(top, r.second);
+        }
+        size_t offset = found ? best : top;
+        plan.offsets[id] = offset;
+        plan.peak = std::max(plan.peak, offset + size);
+        placed.push_back(id);
+    }
+    return plan;
+}
+
+ActivationArena::~ActivationArena()
+{
+    if (block_)
+    {
+        huge_page_backend().deallocate(block_, capacity_);
+    }
+    for (auto &r : retired_)
+    {
+        huge_page_backend().deallocate(r.first, r.second);
+    }
+}
+
+void ActivationArena::reserve(size_t bytes)
+{
+    if (bytes <= capacity_)
+    {
+        return;
+    }
+    // buffers from an abandoned replay may still point into the old block
+    if (block_)
+    {
+        retired_.push_back(std::make_pair(block_, capacity_));
+    }
+    block_ = static_cast<char *>(huge_page_backend().allocate(bytes));
+    capacity_ = bytes;
+}
+
+void ActivationArena::begin_pass()
+{
+    step_ = 0;
+    next_ = 0;
+    diverged_ = false;
+    if (mode_ == Mode::RECORD)
+    {
+        events_.clear();
+        lifetimes_.clear();
+        live_.clear();
+    }
+}
+
+void ActivationArena::end_pass()
+{
+    if (mode_ == Mode::REPLAY)
+    {
+        if (diverged_ || next_ != (int)events_.size())
+        {
+            mode_ = Mode::RECORD;
+        }
+        return;
+    }
+
+    // whatever is still alive leaves the pass and must stay on the heap
+    for (auto &l : live_)
+    {
+        events_[l.second].escapes = true;
+    }
+    live_.clear();
+
+    std::vector<BufferLifetime> planned;
+    slot_.assign(events_.size(), -1);
+    for (size_t i = 0; i < events_.size(); i++)
+    {
+        if (!events_[i].escapes)
+        {
+            slot_[i] = (int)planned.size();
+            planned.push_back(lifetimes_[i]);
+        }
+    }
+    plan_ = plan_memory(planned);
+    reserve(plan_.peak);
+    lifetimes_.clear();
+    mode_ = Mode::REPLAY;
+}
+
+void *ActivationArena::allocate(size_t bytes, TensorBackend *&owner)
+{
+    int step = step_++;
+    TensorBackend &backend = current_tensor_backend();
+    if (mode_ == Mode::RECORD)
+    {
+        owner = &backend;
+        void *p = backend.allocate(bytes);
+        Event e;
+        e.bytes = bytes;
+        e.escapes = false;
+        BufferLifetime l;
+        l.bytes = bytes;
+        l.first = step;
+        l.last = step;
+        live_.push_back(std::make_pair((const void *)p, (int)events_.size()));
+        events_.push_back(e);
+        lifetimes_.push_back(l);
+        return p;
+    }
+
+    if (!diverged_)
+    {
+        int i = next_++;
+        if (i < (int)events_.size() && events_[i].bytes == bytes)
+        {
+            if (slot_[i] >= 0)
+            {
+                owner = &planned_backend();
+                return block_ + plan_.offsets[slot_[i]];
+            }
+        }
+        else
+        {
+            diverged_ = true;
+        }
+    }
+    owner = &backend;
+    return backend.allocate(bytes);
+}
+
+void ActivationArena::note_free(const void *p)
+{
+    int step = step_++;
+    if (mode_ != Mode::RECORD)
+    {
+        return;
+    }
+    for (size_t i = live_.size(); i-- > 0;)
+    {
+        if (live_[i].first == p)
+        {
+            lifetimes_[live_[i].second].last = step;
+            live_[i] = live_.back();
+            live_.pop_back();
+            break;
+        }
+    }
+}
+
+ArenaScope::ArenaScope(ActivationArena &arena)
+    : arena_(arena), prev_(current_arena)
+{
+    current_arena = &arena;
+    arena.begin_pass();
+}
+
+ArenaScope::~ArenaScope()
+{
+    arena_.end_pass();
+    current_arena = prev_;
+}
+
+void *tensor_allocate(size_t bytes, TensorBackend *&owner)
+{
+    // task order inside a parallel region is not reproducible
+    if (current_arena && !in_parallel_region())
+    {
+        return current_arena->allocate(bytes, owner);
+    }
+    owner = &current_tensor_backend();
+    return owner->allocate(bytes);
+}
+
+void tensor_deallocate(void *p, size_t bytes, TensorBackend *owner)
+{
+    if (current_arena)
+    {
+        current_arena->note_free(p);
+    }
+    owner->deallocate(p, bytes);
+}
@@ -0,0 +1,325 @@
+#include "common/plan_cache.hpp"
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+
+namespace
+{
+    uint64_t fnv1a(const std::string &s)
+    {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : s)
+        {
+            h = (h ^ c) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    std::string cpu_feature_list()
+    {
+        const CpuFeatures &f = cpu_features();
+        const std::pair<bool, const char *> flags[] = {
+            {f.sse2, "sse2"}, {f.sse41, "sse41"}, {f.avx, "avx"}, {f.avx2, "avx2"},
+            {f.fma, "fma"}, {f.f16c, "f16c"}, {f.avx512f, "avx512f"},
+            {f.avx512bw, "avx512bw"}, {f.avx512vl, "avx512vl"}, {f.avx512vnni, "avx512vnni"},
+        };
+        std::string s;
+        for (const auto &flag : flags)
+        {
+            if (flag.first)
+            {
+                s += (s.empty() ? "" : ",") + std::string(flag.second);
+            }
+        }
+        return s;
+    }
+}
+
+std::string plan_key(const std::string &model, const std::string &config,
+                     const std::vector<int> &input_shape)
+{
+    std::string key = model + ";" + config + ";input=";
+    for (size_t i = 0; i < input_shape.size(); i++)
+    {
+        key += (i ? "x" : "") + std::to_string(input_shape[i]);
+    }
+    key += std::string(";isa=") + isa_name(best_isa());
+    key += std::string(";gemm=") + matmul_kernel_name();
+    key += std::string(";int8=") + qgemm_kernel_name();
+    key += ";cpu=" + cpu_feature_list();
+    key += ";plan=" + std::to_string(kPlanVersion);
+    return key;
+}
+
+std::string plan_path(const std::string &dir, const std::string &key)
+{
+    char hash[17];
+    std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)fnv1a(key));
+    return dir + "/" + key.substr(0, key.find(';')) + "-" + hash + ".plan";
+}
+
+std::unique_ptr<Checkpoint> open_plan(const std::string &path, const std::string &key,
+                                      bool readahead)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return nullptr;
+    }
+    std::unique_ptr<Checkpoint> plan;
+    try
+    {
+        plan.reset(new Checkpoint(path, readahead));
+    }
+    catch (const std::runtime_error &)
+    {
+        return nullptr;
+    }
+    const CheckpointEntry *e = plan->find("plan.key");
+    if (!e || e->dtype != CheckpointDType::U8 ||
+        std::string(static_cast<const char *>(plan->data(*e)), (size_t)e->bytes) != key)
+    {
+        return nullptr;
+    }
+    return plan;
+}
+
+PlanArchive::PlanArchive(const std::string &key)
+    : key_(key)
+{
+    writer_.add("plan.key", CheckpointDType::U8, TensorShape({(int)key_.size()}), key_.data());
+}
+
+PlanArchive::PlanArchive(const Checkpoint &plan)
+    : plan_(&plan)
+{
+}
+
+const CheckpointEntry &PlanArchive::entry(const std::string &name, CheckpointDType dtype) const
+{
+    const CheckpointEntry *e = plan_->find(name);
+    if (!e || e->dtype != dtype)
+    {
+        throw std::runtime_error("plan " + plan_->path() + ": no entry '" + name + "' of the expected type");
+    }
+    return *e;
+}
+
+const void *PlanArchive::keep(const void *p, size_t bytes)
+{
+    copies_.push_back(std::string(static_cast<const char *>(p), bytes));
+    return copies_.back().data();
+}
+
+template <typename T>
+void PlanArchive::io_array(const std::string &name, CheckpointDType dtype, std::vector<T> &values)
+{
+    if (!loading())
+    {
+        writer_.add(name, dtype, TensorShape({(int)values.size()}), values.data());
+        return;
+    }
+    const CheckpointEntry &e = entry(name, dtype);
+    const T *p = static_cast<const T *>(plan_->data(e));
+    values.assign(p, p + e.bytes / sizeof(T));
+}
+
+void PlanArchive::io_sizes(const std::string &name, std::vector<size_t> &values)
+{
+    std::vector<uint64_t> v(values.begin(), values.end());
+    if (!loading())
+    {
+        writer_.add(name, CheckpointDType::U64, TensorShape({(int)v.size()}),
+                    keep(v.data(), v.size() * sizeof(uint64_t)));
+        return;
+    }
+    io_array(name, CheckpointDType::U64, v);
+    values.assign(v.begin(), v.end());
+}
+
+void PlanArchive::io(const std::string &name, int &value)
+{
+    if (!loading())
+    {
+        writer_.add(name, CheckpointDType::I32, TensorShape({1}), keep(&value, sizeof(int)));
+        return;
+    }
+    std::vector<int> v;
+    io_array(name, CheckpointDType::I32, v);
+    if (v.size() != 1)
+    {
+        throw std::runtime_error("plan " + plan_->path() + ": '" + name + "' is not a scalar");
+    }
+    value = v[0];
+}
+
+void PlanArchive::io(const std::string &name, float &value)
+{
+    if (!loading())
+    {
+        writer_.add(name, CheckpointDType::F32, TensorShape({1}), keep(&value, sizeof(float)));
+        return;
+    }
+    std::vector<float> v;
+    io_array(name, CheckpointDType::F32, v);
+    if (v.size() != 1)
+    {
+        throw std::runtime_error("plan " + plan_->path() + ": '" + name + "' is not a scalar");
+    }
+    value = v[0];
+}
+
+void PlanArchive::io(const std::string &name, bool &value)
+{
+    int v = value ? 1 : 0;
+    io(name, v);
+    value = v != 0;
+}
+
+void PlanArchive::io(const std::string &name, std::vector<float> &values)
+{
+    io_array(name, CheckpointDType::F32, values);
+}
+
+void PlanArchive::io(const std::string &name, std::vector<int> &values)
+{
+    io_array(name, CheckpointDType::I32, values);
+}
+
+void PlanArchive::io(const std::string &name, Tensor<float> &tensor)
+{
+    if (!loading())
+    {
+        if (tensor.total_size() == 0)
+            writer_.add(name, CheckpointDType::F32, TensorShape({0}), nullptr);
+        else
+            writer_.add(name, tensor);
+        return;
+    }
+    const CheckpointEntry &e = entry(name, CheckpointDType::F32);
+    if (e.shape.numel() == 0)
+        tensor = Tensor<float>();
+    else
+        tensor = plan_->tensor(name);
+}
+
+void PlanArchive::io(const std::string &name, PackedMatrix &m)
+{
+    // role, isa, precision, rows, cols, padded (0: empty)
+    std::vector<int> meta = {(int)m.role_, (int)m.isa_, (int)m.precision_,
+                             m.rows_, m.cols_, m.empty() ? 0 : m.padded_};
+    CheckpointDType dtype = m.precision_ == WeightPrecision::FP32 ? CheckpointDType::F32
+                                                                  : CheckpointDType::U16;
+    if (!loading())
+    {
+        writer_.add(name + ".meta", CheckpointDType::I32, TensorShape({6}),
+                    keep(meta.data(), meta.size() * sizeof(int)));
+        writer_.add(name + ".panels", dtype, TensorShape({m.empty() ? 0 : (int)m.elements()}),
+                    dtype == CheckpointDType::F32 ? (const void *)m.data() : m.half_data());
+        return;
+    }
+    io(name + ".meta", meta);
+    if (meta.size() != 6)
+    {
+        throw std::runtime_error("plan " + plan_->path() + ": bad '" + name + ".meta'");
+    }
+    m = PackedMatrix();
+    m.role_ = (PackedMatrix::Role)meta[0];
+    m.isa_ = (IsaLevel)meta[1];
+    m.precision_ = (WeightPrecision)meta[2];
+    m.rows_ = meta[3];
+    m.cols_ = meta[4];
+    m.padded_ = meta[5];
+    if (m.padded_ == 0)
+    {
+        return;
+    }
+    dtype = m.precision_ == WeightPrecision::FP32 ? CheckpointDType::F32 : CheckpointDType::U16;
+    const CheckpointEntry &e = entry(name + ".panels", dtype);
+    if (e.bytes != m.elements() * precision_bytes(m.precision_))
+    {
+        throw std::runtime_error("plan " + plan_->path() + ": '" + name + "' has the wrong size");
+    }
+    m.mapped_panels_ = plan_->data(e);
+    m.mapped_ = plan_->mapping();
+}
+
+void PlanArchive::io(const std::string &name, PackedQMatrix &m)
+{
+    io(name + ".rows", m.rows_);
+    io(name + ".cols", m.cols_);
+    io(name + ".mr", m.mr_);
+    io(name + ".scale", m.scale_);
+    io(name + ".row_sum", m.row_sum_);
+    io_array(name + ".data", CheckpointDType::U8, m.data_);
+}
+
+void PlanArchive::io(const std::string &name, ActivationArena &arena)
+{
+    bool planned = arena.planned();
+    io(name + ".planned", planned);
+    if (!planned)
+    {
+        if (loading())
+        {
+            arena.mode_ = ActivationArena::Mode::RECORD;
+        }
+        return;
+    }
+    std::vector<size_t> bytes;
+    for (const auto &e : arena.events_)
+    {
+        bytes.push_back(e.bytes);
+    }
+    std::vector<size_t> totals = {arena.plan_.peak, arena.plan_.unplanned};
+    io_sizes(name + ".event_bytes", bytes);
+    io(name + ".slot", arena.slot_);
+    io_sizes(name + ".offsets", arena.plan_.offsets);
+    io_sizes(name + ".totals", totals);
+    if (!loading())
+    {
+        return;
+    }
+    if (bytes.size() != arena.slot_.size() || totals.size() != 2)
+    {
+        throw std::runtime_error("plan " + plan_->path() + ": bad activation plan '" + name + "'");
+    }
+    arena.events_.resize(bytes.size());
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        int slot = arena.slot_[i];
+        if (slot >= (int)arena.plan_.offsets.size())
+        {
+            throw std::runtime_error("plan " + plan_->path() + ": bad activation plan '" + name + "'");
+        }
+        arena.events_[i].bytes = bytes[i];
+        arena.events_[i].escapes = slot < 0;
+    }
+    arena.plan_.peak = totals[0];
+    arena.plan_.unplanned = totals[1];
+    arena.lifetimes_.clear();
+    arena.live_.clear();
+    arena.reserve(arena.plan_.peak);
+    arena.mode_ = ActivationArena::Mode::REPLAY;
+}
+
+void PlanArchive::write(const std::string &path) const
+{
+    if (loading())
+    {
+        throw std::runtime_error("plan " + path + ": archive was opened for reading");
+    }
+    writer_.write(path);
+}
+
+void plan_io(PlanArchive &ar, const std::vector<ModelParam> &params)
+{
+    for (const auto &p : params)
+    {
+        if (p.tensor)
+            ar.io("param." + p.name, *p.tensor);
+        else
+            ar.io("param." + p.name, *p.values);
+    }
+}
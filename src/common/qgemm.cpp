@@ -0,0 +1,218 @@
+#include "common/qgemm.hpp"
+#include "common/qgemm_kernels.hpp"
+#include "common/thread_pool.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+namespace
+{
+    /**
+     * Growable 64-byte aligned scratch for packed B blocks, one per
+     * thread like the fp32 GEMM's.
+     */
+    struct QPackBuffer
+    {
+        unsigned char *ptr = nullptr;
+        size_t cap = 0;
+
+        unsigned char *get(size_t n)
+        {
+            if (n > cap)
+            {
+                std::free(ptr);
+                void *p = nullptr;
+                if (posix_memalign(&p, 64, n) != 0)
+                {
+                    throw std::bad_alloc();
+                }
+                ptr = static_cast<unsigned char *>(p);
+                cap = n;
+            }
+            return ptr;
+        }
+
+        ~QPackBuffer() { std::free(ptr); }
+    };
+
+    thread_local QPackBuffer b_qpack;
+
+    int round_up(int v, int mult)
+    {
+        return (v + mult - 1) / mult * mult;
+    }
+
+    void activation_bounds(Activation act, float &lo, float &hi)
+    {
+        lo = act == Activation::NONE ? -FLT_MAX : 0.f;
+        hi = act == Activation::RELU6 ? 6.f : FLT_MAX;
+    }
+
+    inline void store_row(const QGemmKernel &k, const QGemmEpilogue &ep, const int *acc, int n,
+                          int corr, float scale, float shift, const float *res,
+                          float lo, float hi, float *out)
+    {
+        (void)ep;
+        k.store_f32(acc, n, corr, scale, shift, res, lo, hi, out);
+    }
+
+    inline void store_row(const QGemmKernel &k, const QGemmEpilogue &ep, const int *acc, int n,
+                          int corr, float scale, float shift, const float *res,
+                          float lo, float hi, unsigned char *out)
+    {
+        k.store_u8(acc, n, corr, scale, shift, res, lo, hi,
+                   1.f / ep.out.scale, (float)ep.out.zero_point, out);
+    }
+
+    // C[m0:m1, n0:n1] of the product: per nc column block, pack B once,
+    // then for every mc row block sweep the B micro-panels (in L1) over
+    // the A panels of that block (in L2)
+    template <typename OutT>
+    void qgemm_region(const QGemmKernel &k, const PackedQMatrix &A,
+                      const unsigned char *B, int N, OutT *C, const QGemmEpilogue &ep,
+                      int m0, int m1, int n0, int n1)
+    {
+        const int K = A.cols();
+        const int kq = (K + 3) / 4;
+        const size_t a_panel = (size_t)kq * k.mr * 4;
+        const size_t b_panel = (size_t)kq * k.nr * 4;
+        float lo, hi;
+        activation_bounds(ep.act, lo, hi);
+        int tile[32 * 32];
+
+        for (int jc = n0; jc < n1; jc += k.nc)
+        {
+            const int nc = std::min(k.nc, n1 - jc);
+            unsigned char *bp = b_qpack.get((size_t)round_up(nc, k.nr) / k.nr * b_panel);
+            k.pack_b(B + jc, N, K, nc, k.nr, bp);
+
+            for (int ic = m0; ic < m1; ic += k.mc)
+            {
+                const int mc = std::min(k.mc, m1 - ic);
+                for (int jr = 0; jr < nc; jr += k.nr)
+                {
+                    const int cols = std::min(k.nr, nc - jr);
+                    const unsigned char *bpanel = bp + (size_t)(jr / k.nr) * b_panel;
+                    for (int ir = ic; ir < ic + mc; ir += k.mr)
+                    {
+                        const int rows = std::min(k.mr, ic + mc - ir);
+                        k.ukernel(kq, A.data() + (size_t)(ir / k.mr) * a_panel, bpanel, tile, k.nr);
+                        for (int r = 0; r < rows; r++)
+                        {
+                            const int i = ir + r;
+                            const float scale = A.scale()[i] * ep.b.scale * (ep.scale ? ep.scale[i] : 1.f);
+                            const float shift = ep.shift ? ep.shift[i] : 0.f;
+                            const float *res = ep.residual ? ep.residual + (size_t)i * ep.ldr + jc + jr : nullptr;
+                            store_row(k, ep, tile + r * k.nr, cols, ep.b.zero_point * A.row_sum()[i],
+                                      scale, shift, res, lo, hi, C + (size_t)i * N + jc + jr);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // below this many multiply-adds per thread a product stays on the caller
+    const double kMinMacsPerThread = 1 << 21;
+
+    template <typename OutT>
+    void qgemm_impl(const PackedQMatrix &A, const unsigned char *B, int N, OutT *C,
+                    const QGemmEpilogue &ep)
+    {
+        ScopedTimer timer(OpType::MATMUL);
+        const QGemmKernel &k = qgemm_kernel();
+        const int M = A.rows();
+        if (M <= 0 || N <= 0)
+        {
+            return;
+        }
+        ThreadPool &pool = ThreadPool::instance();
+        const double macs = (double)M * N * A.cols();
+        const int threads = std::min(pool.num_threads(),
+                                     std::max(1, (int)(macs / kMinMacsPerThread)));
+        const int gm = (M + k.mc - 1) / k.mc;
+        const int gn = (N + k.nc - 1) / k.nc;
+        if (threads <= 1 || gm * gn == 1)
+        {
+            qgemm_region(k, A, B, N, C, ep, 0, M, 0, N);
+            return;
+        }
+        pool.parallel_for(gm * gn, [&](int t)
+                          {
+            const int m0 = (t / gn) * k.mc;
+            const int n0 = (t % gn) * k.nc;
+            qgemm_region(k, A, B, N, C, ep, m0, std::min(M, m0 + k.mc),
+                         n0, std::min(N, n0 + k.nc)); });
+    }
+}
+
+PackedQMatrix PackedQMatrix::quantize_a(const float *A, int M, int K, int lda)
+{
+    const QGemmKernel &k = qgemm_kernel();
+    const int kq = (K + 3) / 4;
+    PackedQMatrix m;
+    m.rows_ = M;
+    m.cols_ = K;
+    m.mr_ = k.mr;
+    m.scale_.resize(M);
+    m.row_sum_.assign(M, 0);
+    m.data_.assign((size_t)round_up(M, k.mr) * kq * 4, 0);
+    for (int i = 0; i < M; i++)
+    {
+        const float *row = A + (size_t)i * lda;
+        float amax = 0.f;
+        for (int p = 0; p < K; p++)
+        {
+            amax = std::max(amax, std::fabs(row[p]));
+        }
+        const float scale = amax > 0.f ? amax / k.weight_max : 1.f;
+        m.scale_[i] = scale;
+        // panel i / mr, row i % mr of it; value p at step p / 4, byte p % 4
+        signed char *dst = &m.data_[((size_t)(i / k.mr) * kq * k.mr + i % k.mr) * 4];
+        for (int p = 0; p < K; p++)
+        {
+            int q = (int)std::lrint(row[p] / scale);
+            q = std::min(k.weight_max, std::max(-k.weight_max, q));
+            dst[(size_t)(p / 4) * k.mr * 4 + p % 4] = (signed char)q;
+            m.row_sum_[i] += q;
+        }
+    }
+    return m;
+}
+
+void PackedQMatrix::dequantize(float *dst) const
+{
+    const int kq = (cols_ + 3) / 4;
+    for (int i = 0; i < rows_; i++)
+    {
+        const signed char *src = &data_[((size_t)(i / mr_) * kq * mr_ + i % mr_) * 4];
+        for (int p = 0; p < cols_; p++)
+        {
+            dst[(size_t)i * cols_ + p] = scale_[i] * src[(size_t)(p / 4) * mr_ * 4 + p % 4];
+        }
+    }
+}
+
+void qgemm(const PackedQMatrix &A, const unsigned char *B, int N, float *C,
+           const QGemmEpilogue &ep)
+{
+    qgemm_impl(A, B, N, C, ep);
+}
+
+void qgemm(const PackedQMatrix &A, const unsigned char *B, int N, unsigned char *C,
+           const QGemmEpilogue &ep)
+{
+    if (!(ep.out.scale > 0.f))
+    {
+        throw std::runtime_error("qgemm: u8 output needs a positive output scale");
+    }
+    qgemm_impl(A, B, N, C, ep);
+}
+
+const char *qgemm_kernel_name()
+{
+    return qgemm_kernel().name;
+}
@@ -0,0 +1,326 @@
+#include "common/qgemm_kernels.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POLY_X86 1
+#define POLY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define POLY_TARGET(isa)
+#endif
+
+namespace
+{
+    // four packed s8 values as one 32-bit broadcast operand
+    inline int load_quad(const signed char *p)
+    {
+        int v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // ---------------- B packing ----------------
+    void pack_b_generic(const unsigned char *B, int ldb, int K, int cols, int nr,
+                        unsigned char *dst)
+    {
+        const int kq = (K + 3) / 4;
+        for (int j0 = 0; j0 < cols; j0 += nr, dst += (size_t)kq * nr * 4)
+        {
+            const int w = std::min(nr, cols - j0);
+            if (w < nr || K % 4)
+            {
+                std::fill(dst, dst + (size_t)kq * nr * 4, 0);
+            }
+            for (int k = 0; k < K; k++)
+            {
+                const unsigned char *row = B + (size_t)k * ldb + j0;
+                unsigned char *d = dst + (size_t)(k / 4) * nr * 4 + k % 4;
+                for (int j = 0; j < w; j++)
+                {
+                    d[j * 4] = row[j];
+                }
+            }
+        }
+    }
+
+    // ---------------- portable scalar 4x4 ----------------
+    void qkernel_scalar_4x4(int kq, const signed char *a, const unsigned char *b,
+                            int *c, int ldc)
+    {
+        int acc[4][4] = {{0}};
+        for (int q = 0; q < kq; q++)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                const signed char *ai = a + i * 4;
+                for (int j = 0; j < 4; j++)
+                {
+                    const unsigned char *bj = b + j * 4;
+                    acc[i][j] += ai[0] * bj[0] + ai[1] * bj[1] + ai[2] * bj[2] + ai[3] * bj[3];
+                }
+            }
+            a += 16;
+            b += 16;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            std::copy(acc[i], acc[i] + 4, c + i * ldc);
+        }
+    }
+
+    // The row helpers are plain loops, compiled once per target so that
+    // the autovectoriser uses the kernel's vector width; every step is
+    // its own loop to keep them branch-free.
+#define POLY_QSTORE_F32_BODY                                   \
+    for (int j = 0; j < n; j++)                                \
+        out[j] = (float)(acc[j] - corr) * scale + shift;       \
+    if (res)                                                   \
+        for (int j = 0; j < n; j++)                            \
+            out[j] += res[j];                                  \
+    for (int j = 0; j < n; j++)                                \
+    {                                                          \
+        const float y = out[j];                                \
+        out[j] = std::min(std::max(y, lo), hi);                \
+    }
+
+#define POLY_QSTORE_U8_BODY                                    \
+    float v[64];                                               \
+    int qi[64];                                                \
+    for (int j0 = 0; j0 < n; j0 += 64)                         \
+    {                                                          \
+        const int m = std::min(64, n - j0);                    \
+        for (int j = 0; j < m; j++)                            \
+            v[j] = (float)(acc[j0 + j] - corr) * scale + shift; \
+        if (res)                                               \
+            for (int j = 0; j < m; j++)                        \
+                v[j] += res[j0 + j];                           \
+        for (int j = 0; j < m; j++)                            \
+        {                                                      \
+            const float y = v[j];                              \
+            float x = std::min(std::max(y, lo), hi) * inv + zp; \
+            x = std::min(std::max(x, 0.f), 255.f);             \
+            qi[j] = (int)(x + 0.5f);                           \
+        }                                                      \
+        for (int j = 0; j < m; j++)                            \
+            out[j0 + j] = (unsigned char)qi[j];                \
+    }
+
+#define POLY_QUANTIZE_BODY                                     \
+    for (int j = 0; j < n; j++)                                \
+    {                                                          \
+        const float y = x[j] * inv + zp;                       \
+        const float v = std::min(std::max(y, 0.f), 255.f);     \
+        q[j] = (unsigned char)(int)(v + 0.5f);                 \
+    }
+
+#define POLY_QROW_FNS(suffix, target)                                                   \
+    target void qstore_f32_##suffix(const int *acc, int n, int corr, float scale,       \
+                                    float shift, const float *res, float lo, float hi,  \
+                                    float *out)                                         \
+    {                                                                                   \
+        POLY_QSTORE_F32_BODY                                                            \
+    }                                                                                   \
+    target void qstore_u8_##suffix(const int *acc, int n, int corr, float scale,        \
+                                   float shift, const float *res, float lo, float hi,   \
+                                   float inv, float zp, unsigned char *out)             \
+    {                                                                                   \
+        POLY_QSTORE_U8_BODY                                                             \
+    }                                                                                   \
+    target void quantize_##suffix(const float *x, int n, float inv, float zp,           \
+                                  unsigned char *q)                                     \
+    {                                                                                   \
+        POLY_QUANTIZE_BODY                                                              \
+    }
+
+    POLY_QROW_FNS(generic, )
+
+#ifdef POLY_X86
+    POLY_QROW_FNS(avx2, POLY_TARGET("avx2,fma"))
+    POLY_QROW_FNS(avx512, POLY_TARGET("avx512f,avx512bw,fma"))
+
+    // Full panels of whole quads interleave 16 columns of 4 rows at a
+    // time with SSE2 byte / word unpacks; the rest goes to the generic
+    // packing. nr is a multiple of 16 here.
+    void pack_b_sse2(const unsigned char *B, int ldb, int K, int cols, int nr,
+                     unsigned char *dst)
+    {
+        const int kq = K / 4;
+        const int full = K % 4 ? 0 : cols / nr * nr;
+        for (int j0 = 0; j0 < full; j0 += nr, dst += (size_t)kq * nr * 4)
+        {
+            for (int q = 0; q < kq; q++)
+            {
+                const unsigned char *r0 = B + (size_t)(4 * q) * ldb + j0;
+                unsigned char *d = dst + (size_t)q * nr * 4;
+                for (int j = 0; j < nr; j += 16, d += 64)
+                {
+                    __m128i x0 = _mm_loadu_si128((const __m128i *)(r0 + j));
+                    __m128i x1 = _mm_loadu_si128((const __m128i *)(r0 + ldb + j));
+                    __m128i x2 = _mm_loadu_si128((const __m128i *)(r0 + 2 * (size_t)ldb + j));
+                    __m128i x3 = _mm_loadu_si128((const __m128i *)(r0 + 3 * (size_t)ldb + j));
+                    __m128i lo01 = _mm_unpacklo_epi8(x0, x1), hi01 = _mm_unpackhi_epi8(x0, x1);
+                    __m128i lo23 = _mm_unpacklo_epi8(x2, x3), hi23 = _mm_unpackhi_epi8(x2, x3);
+                    _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(lo01, lo23));
+                    _mm_storeu_si128((__m128i *)(d + 16), _mm_unpackhi_epi16(lo01, lo23));
+                    _mm_storeu_si128((__m128i *)(d + 32), _mm_unpacklo_epi16(hi01, hi23));
+                    _mm_storeu_si128((__m128i *)(d + 48), _mm_unpackhi_epi16(hi01, hi23));
+                }
+            }
+        }
+        if (full < cols)
+        {
+            pack_b_generic(B + full, ldb, K, cols - full, nr, dst);
+        }
+    }
+
+    // Accumulators are spelled out one variable per register, as in the
+    // fp32 kernels.
+
+    // ---------------- AVX2 4x16, vpmaddubsw ----------------
+    POLY_TARGET("avx2")
+    inline __m256i maddubs_quads(__m256i b, __m256i a, __m256i ones)
+    {
+        // u8 * s8 pairs -> int16, then pairs of those -> int32 per quad
+        return _mm256_madd_epi16(_mm256_maddubs_epi16(b, a), ones);
+    }
+
+    POLY_TARGET("avx2")
+    void qkernel_avx2_4x16(int kq, const signed char *a, const unsigned char *b,
+                           int *c, int ldc)
+    {
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+        __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+        __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+        __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+        for (int q = 0; q < kq; q++)
+        {
+            __m256i b0 = _mm256_loadu_si256((const __m256i *)b);
+            __m256i b1 = _mm256_loadu_si256((const __m256i *)(b + 32));
+            __m256i ai;
+            ai = _mm256_set1_epi32(load_quad(a));
+            c00 = _mm256_add_epi32(c00, maddubs_quads(b0, ai, ones));
+            c01 = _mm256_add_epi32(c01, maddubs_quads(b1, ai, ones));
+            ai = _mm256_set1_epi32(load_quad(a + 4));
+            c10 = _mm256_add_epi32(c10, maddubs_quads(b0, ai, ones));
+            c11 = _mm256_add_epi32(c11, maddubs_quads(b1, ai, ones));
+            ai = _mm256_set1_epi32(load_quad(a + 8));
+            c20 = _mm256_add_epi32(c20, maddubs_quads(b0, ai, ones));
+            c21 = _mm256_add_epi32(c21, maddubs_quads(b1, ai, ones));
+            ai = _mm256_set1_epi32(load_quad(a + 12));
+            c30 = _mm256_add_epi32(c30, maddubs_quads(b0, ai, ones));
+            c31 = _mm256_add_epi32(c31, maddubs_quads(b1, ai, ones));
+            a += 16;
+            b += 64;
+        }
+        _mm256_storeu_si256((__m256i *)(c + 0 * ldc), c00);
+        _mm256_storeu_si256((__m256i *)(c + 0 * ldc + 8), c01);
+        _mm256_storeu_si256((__m256i *)(c + 1 * ldc), c10);
+        _mm256_storeu_si256((__m256i *)(c + 1 * ldc + 8), c11);
+        _mm256_storeu_si256((__m256i *)(c + 2 * ldc), c20);
+        _mm256_storeu_si256((__m256i *)(c + 2 * ldc + 8), c21);
+        _mm256_storeu_si256((__m256i *)(c + 3 * ldc), c30);
+        _mm256_storeu_si256((__m256i *)(c + 3 * ldc + 8), c31);
+    }
+
+    // ---------------- AVX-512 VNNI 8x32, vpdpbusd ----------------
+    POLY_TARGET("avx512f,avx512vnni")
+    inline void store_row_vnni(int *cr, __m512i r0, __m512i r1)
+    {
+        _mm512_storeu_si512((void *)cr, r0);
+        _mm512_storeu_si512((void *)(cr + 16), r1);
+    }
+
+    POLY_TARGET("avx512f,avx512vnni")
+    void qkernel_vnni_8x32(int kq, const signed char *a, const unsigned char *b,
+                           int *c, int ldc)
+    {
+        __m512i c00 = _mm512_setzero_si512(), c01 = _mm512_setzero_si512();
+        __m512i c10 = _mm512_setzero_si512(), c11 = _mm512_setzero_si512();
+        __m512i c20 = _mm512_setzero_si512(), c21 = _mm512_setzero_si512();
+        __m512i c30 = _mm512_setzero_si512(), c31 = _mm512_setzero_si512();
+        __m512i c40 = _mm512_setzero_si512(), c41 = _mm512_setzero_si512();
+        __m512i c50 = _mm512_setzero_si512(), c51 = _mm512_setzero_si512();
+        __m512i c60 = _mm512_setzero_si512(), c61 = _mm512_setzero_si512();
+        __m512i c70 = _mm512_setzero_si512(), c71 = _mm512_setzero_si512();
+        for (int q = 0; q < kq; q++)
+        {
+            __m512i b0 = _mm512_loadu_si512((const void *)b);
+            __m512i b1 = _mm512_loadu_si512((const void *)(b + 64));
+            __m512i ai;
+            ai = _mm512_set1_epi32(load_quad(a));
+            c00 = _mm512_dpbusd_epi32(c00, b0, ai);
+            c01 = _mm512_dpbusd_epi32(c01, b1, ai);
+            ai = _mm512_set1_epi32(load_quad(a + 4));
+            c10 = _mm512_dpbusd_epi32(c10, b0, ai);
+            c11 = _mm512_dpbusd_epi32(c11, b1, ai);
+            ai = _mm512_set1_epi32(load_quad(a + 8));
+            c20 = _mm512_dpbusd_epi32(c20, b0, ai);
+            c21 = _mm512_dpbusd_epi32(c21, b1, ai);
+            ai = _mm512_set1_epi32(load_quad(a + 12));
+            c30 = _mm512_dpbusd_epi32(c30, b0, ai);
+            c31 = _mm512_dpbusd_epi32(c31, b1, ai);
+            ai = _mm512_set1_epi32(load_quad(a + 16));
+            c40 = _mm512_dpbusd_epi32(c40, b0, ai);
+            c41 = _mm512_dpbusd_epi32(c41, b1, ai);
+            ai = _mm512_set1_epi32(load_quad(a + 20));
+            c50 = _mm512_dpbusd_epi32(c50, b0, ai);
+            c51 = _mm512_dpbusd_epi32(c51, b1, ai);
+            ai = _mm512_set1_epi32(load_quad(a + 24));
+            c60 = _mm512_dpbusd_epi32(c60, b0, ai);
+            c61 = _mm512_dpbusd_epi32(c61, b1, ai);
+            ai = _mm512_set1_epi32(load_quad(a + 28));
+            c70 = _mm512_dpbusd_epi32(c70, b0, ai);
+            c71 = _mm512_dpbusd_epi32(c71, b1, ai);
+            a += 32;
+            b += 128;
+        }
+        store_row_vnni(c + 0 * ldc, c00, c01);
+        store_row_vnni(c + 1 * ldc, c10, c11);
+        store_row_vnni(c + 2 * ldc, c20, c21);
+        store_row_vnni(c + 3 * ldc, c30, c31);
+        store_row_vnni(c + 4 * ldc, c40, c41);
+        store_row_vnni(c + 5 * ldc, c50, c51);
+        store_row_vnni(c + 6 * ldc, c60, c61);
+        store_row_vnni(c + 7 * ldc, c70, c71);
+    }
+#endif
+
+#undef POLY_QROW_FNS
+#undef POLY_QUANTIZE_BODY
+#undef POLY_QSTORE_U8_BODY
+#undef POLY_QSTORE_F32_BODY
+
+    //                               isa            vnni   name           mr  nr  mc   nc   wmax
+    const QGemmKernel k_qscalar = {IsaLevel::SCALAR, false, "scalar", 4, 4, 64, 256, 127,
+                                   qkernel_scalar_4x4, qstore_f32_generic, qstore_u8_generic,
+                                   quantize_generic, pack_b_generic};
+#ifdef POLY_X86
+    const QGemmKernel k_qavx2 = {IsaLevel::AVX2, false, "avx2-maddubs", 4, 16, 64, 512, 63,
+                                 qkernel_avx2_4x16, qstore_f32_avx2, qstore_u8_avx2,
+                                 quantize_avx2, pack_b_sse2};
+    const QGemmKernel k_qvnni = {IsaLevel::AVX512, true, "avx512-vnni", 8, 32, 128, 512, 127,
+                                 qkernel_vnni_8x32, qstore_f32_avx512, qstore_u8_avx512,
+                                 quantize_avx512, pack_b_sse2};
+#endif
+
+    const QGemmKernel &select_qkernel()
+    {
+#ifdef POLY_X86
+        const CpuFeatures &f = cpu_features();
+        IsaLevel isa = best_isa();
+        if (isa == IsaLevel::AVX512 && f.avx512vnni && f.avx512bw)
+            return k_qvnni;
+        if (isa >= IsaLevel::AVX2)
+            return k_qavx2;
+#endif
+        return k_qscalar;
+    }
+}
+
+const QGemmKernel &qgemm_kernel()
+{
+    static const QGemmKernel &kernel = select_qkernel();
+    return kernel;
+}
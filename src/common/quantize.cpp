@@ -0,0 +1,110 @@
+#include "common/quantize.hpp"
+#include "common/qgemm_kernels.hpp"
+#include "common/thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    thread_local ActivationRanges *current_ranges = nullptr;
+
+    // values per quantize / dequantize task
+    const int kQuantizeChunk = 1 << 14;
+}
+
+QuantParams choose_quant_params(float lo, float hi)
+{
+    lo = std::min(lo, 0.f);
+    hi = std::max(hi, 0.f);
+    QuantParams p;
+    if (hi - lo <= 0.f)
+    {
+        return p;
+    }
+    p.scale = (hi - lo) / 255.f;
+    p.zero_point = std::min(255, std::max(0, (int)std::lrint(-lo / p.scale)));
+    return p;
+}
+
+void quantize_into(const Tensor<float> &x, const QuantParams &params, QTensor &out)
+{
+    Tensor<float> in = x.contiguous();
+    out.params = params;
+    out.data.ensure_shape(in.shape());
+    const QGemmKernel &k = qgemm_kernel();
+    const float inv = 1.f / params.scale;
+    const float zp = (float)params.zero_point;
+    const int total = in.total_size();
+    const float *src = in.data();
+    unsigned char *dst = out.data.data();
+    ThreadPool::instance().parallel_for((total + kQuantizeChunk - 1) / kQuantizeChunk, [&](int t)
+                                        {
+        const int i0 = t * kQuantizeChunk;
+        k.quantize(src + i0, std::min(kQuantizeChunk, total - i0), inv, zp, dst + i0); });
+}
+
+void dequantize_into(const QTensor &x, Tensor<float> &out)
+{
+    out.ensure_shape(x.shape());
+    const int total = x.data.total_size();
+    const unsigned char *src = x.data.data();
+    float *dst = out.data();
+    for (int i = 0; i < total; i++)
+    {
+        dst[i] = x.params.scale * (float)(src[i] - x.params.zero_point);
+    }
+}
+
+void ActivationRanges::observe(const void *key, const Tensor<float> &x)
+{
+    Tensor<float> in = x.contiguous();
+    const int total = in.total_size();
+    if (total == 0)
+    {
+        return;
+    }
+    const float *p = in.data();
+    float lo = p[0], hi = p[0];
+    for (int i = 1; i < total; i++)
+    {
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+    }
+    Range &r = ranges_[key];
+    if (r.count == 0)
+    {
+        r.lo = lo;
+        r.hi = hi;
+    }
+    else
+    {
+        r.lo = std::min(r.lo, lo);
+        r.hi = std::max(r.hi, hi);
+    }
+    r.count += total;
+}
+
+const ActivationRanges::Range *ActivationRanges::find(const void *key) const
+{
+    std::map<const void *, Range>::const_iterator it = ranges_.find(key);
+    return it == ranges_.end() ? nullptr : &it->second;
+}
+
+CalibrationScope::CalibrationScope(ActivationRanges &ranges)
+    : prev_(current_ranges)
+{
+    current_ranges = &ranges;
+}
+
+CalibrationScope::~CalibrationScope()
+{
+    current_ranges = prev_;
+}
+
+void observe_activation(const void *key, const Tensor<float> &x)
+{
+    if (current_ranges)
+    {
+        current_ranges->observe(key, x);
+    }
+}
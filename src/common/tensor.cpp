@@ -1,8 +1,117 @@
 #include "common/tensor.hpp"
+#include <algorithm>
 #include <numeric>
 #include <stdexcept>
 #include <cmath>
 #include <iostream>
+#include <cctype>
+#include <cstdint>
+#include <utility>
+
+void TensorShape::assign(const int* dims, int n)
+{
+    if(n > kMaxTensorDims) {
+        throw std::runtime_error("TensorShape: more than " + std::to_string(kMaxTensorDims) + " dimensions.");
+    }
+    std::copy(dims, dims + n, dims_);
+    ndim_ = n;
+}
+
+int TensorShape::numel() const
+{
+    int total = 1;
+    for(int i = 0; i < ndim_; i++) {
+        total *= dims_[i];
+    }
+    return total;
+}
+
+bool TensorShape::operator==(const TensorShape& other) const
+{
+    return ndim_ == other.ndim_ && std::equal(begin(), end(), other.begin());
+}
+
+int layout_lanes(TensorLayout layout, int channels)
+{
+    switch(layout) {
+    case TensorLayout::NHWC:
+        return channels;
+    case TensorLayout::NCHW8c:
+        return 8;
+    case TensorLayout::NCHW16c:
+        return 16;
+    default:
+        return 1;
+    }
+}
+
+bool is_blocked(TensorLayout layout)
+{
+    return layout == TensorLayout::NCHW8c || layout == TensorLayout::NCHW16c;
+}
+
+const char* layout_name(TensorLayout layout)
+{
+    switch(layout) {
+    case TensorLayout::NHWC:
+        return "nhwc";
+    case TensorLayout::NCHW8c:
+        return "nchw8c";
+    case TensorLayout::NCHW16c:
+        return "nchw16c";
+    default:
+        return "nchw";
+    }
+}
+
+bool layout_from_name(const std::string& name, TensorLayout& layout)
+{
+    std::string lower(name);
+    for(auto& ch : lower) {
+        ch = (char)std::tolower((unsigned char)ch);
+    }
+    for(TensorLayout l : {TensorLayout::NCHW, TensorLayout::NHWC,
+                          TensorLayout::NCHW8c, TensorLayout::NCHW16c}) {
+        if(lower == layout_name(l)) {
+            layout = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+
+// values a dense `shape` tensor takes in `layout`
+size_t storage_elements(const TensorShape& shape, TensorLayout layout)
+{
+    if(!is_blocked(layout)) {
+        return (size_t)shape.numel();
+    }
+    int lanes = layout_lanes(layout, shape[1]);
+    int blocks = (shape[1] + lanes - 1) / lanes;
+    return (size_t)shape[0] * blocks * lanes * shape[2] * shape[3];
+}
+
+}
+
+TensorStorage::TensorStorage(size_t bytes)
+    : bytes(bytes)
+{
+    data = tensor_allocate(bytes, backend);
+}
+
+TensorStorage::TensorStorage(void* data, size_t bytes, std::shared_ptr<const void> owner)
+    : data(data), bytes(bytes), owner(std::move(owner))
+{
+}
+
+TensorStorage::~TensorStorage()
+{
+    if(backend) {
+        tensor_deallocate(data, bytes, backend);
+    }
+}
 
 template<typename T>
 Tensor<T>::Tensor()
@@ -10,91 +119,462 @@ Tensor<T>::Tensor()
 }
 
 template<typename T>
-Tensor<T>::Tensor(const std::vector<int>& shape)
-    : shape_(shape)
+Tensor<T>::Tensor(const TensorShape& shape, TensorInit init)
+    : Tensor(shape, TensorLayout::NCHW, init)
+{
+}
+
+template<typename T>
+Tensor<T>::Tensor(const TensorShape& shape, TensorLayout layout, TensorInit init)
 {
-    if(shape_.empty()) {
+    if(shape.empty()) {
         throw std::runtime_error("Tensor shape cannot be empty.");
     }
-    int total = 1;
-    for(auto dim : shape_) {
+    for(auto dim : shape) {
         if(dim <= 0) {
             throw std::runtime_error("Tensor shape dimension must be positive.");
         }
-        total *= dim;
     }
-    data_.resize(total, static_cast<T>(0));
+    if(layout != TensorLayout::NCHW && shape.size() != 4) {
+        throw std::runtime_error(std::string("Tensor: layout ") + layout_name(layout) +
+                                 " needs a 4-D shape.");
+    }
+    allocate(shape, layout);
+    // fresh pages straight from the OS are zero already, and stay
+    // untouched (not resident) until used
+    if(init == TensorInit::ZERO && !storage_->backend->zero_filled(storage_->bytes)) {
+        std::fill(data_, data_ + storage_size(), static_cast<T>(0));
+    }
+}
+
+template<typename T>
+Tensor<T>::Tensor(const TensorShape& shape, std::shared_ptr<TensorStorage> storage)
+{
+    if(shape.empty() || shape.numel() <= 0) {
+        throw std::runtime_error("Tensor shape cannot be empty.");
+    }
+    if(!storage || storage->bytes < sizeof(T) * (size_t)shape.numel() ||
+       reinterpret_cast<uintptr_t>(storage->data) % alignof(T) != 0) {
+        throw std::runtime_error("Tensor: storage too small or misaligned for the shape.");
+    }
+    storage_ = std::move(storage);
+    data_ = static_cast<T*>(storage_->data);
+    shape_ = shape;
+    size_ = shape.numel();
+    set_dense_strides();
+}
+
+template<typename T>
+Tensor<T>::Tensor(const Tensor& other)
+{
+    if(other.storage_) {
+        allocate(other.shape_, other.layout_);
+        copy_from(other);
+    }
+}
+
+template<typename T>
+Tensor<T>::Tensor(Tensor&& other) noexcept
+    : storage_(std::move(other.storage_)), data_(other.data_),
+      shape_(other.shape_), layout_(other.layout_), size_(other.size_)
+{
+    std::copy(other.strides_, other.strides_ + kMaxTensorDims, strides_);
+    other.data_ = nullptr;
+    other.shape_ = TensorShape();
+    other.layout_ = TensorLayout::NCHW;
+    other.size_ = 0;
+}
+
+template<typename T>
+Tensor<T>& Tensor<T>::operator=(const Tensor& other)
+{
+    if(this == &other) {
+        return *this;
+    }
+    if(!other.storage_) {
+        *this = Tensor();
+        return *this;
+    }
+    // the buffer is reused only when no view shares it
+    bool reuse = storage_ && storage_.use_count() == 1 && is_dense() &&
+                 layout_ == other.layout_ && size_ == other.size_ &&
+                 storage_size() == other.storage_size() && !shares_storage(other);
+    if(reuse) {
+        shape_ = other.shape_;
+        set_dense_strides();
+    } else {
+        Tensor fresh;
+        fresh.allocate(other.shape_, other.layout_);
+        *this = std::move(fresh);
+    }
+    copy_from(other);
+    return *this;
+}
+
+template<typename T>
+Tensor<T>& Tensor<T>::operator=(Tensor&& other) noexcept
+{
+    if(this != &other) {
+        storage_ = std::move(other.storage_);
+        data_ = other.data_;
+        shape_ = other.shape_;
+        layout_ = other.layout_;
+        size_ = other.size_;
+        std::copy(other.strides_, other.strides_ + kMaxTensorDims, strides_);
+        other.data_ = nullptr;
+        other.shape_ = TensorShape();
+        other.layout_ = TensorLayout::NCHW;
+        other.size_ = 0;
+    }
+    return *this;
 }
 
-// template<typename T>
-// Tensor<T>::Tensor(int n, int c, int h, int w)
-// {
-//     shape_ = {n, c, h, w};
-//     if(n<=0 || c<=0 || h<=0 || w<=0) {
-//         throw std::runtime_error("Tensor dimensions must be positive.");
-//     }
-//     data_.resize(n*c*h*w, static_cast<T>(0));
-// }
+template<typename T>
+Tensor<T>::~Tensor()
+{
+}
 
 template<typename T>
-const std::vector<int>& Tensor<T>::shape() const {
-    return shape_;
+void Tensor<T>::allocate(const TensorShape& shape, TensorLayout layout)
+{
+    shape_ = shape;
+    layout_ = layout;
+    size_ = shape.numel();
+    storage_ = std::make_shared<TensorStorage>(sizeof(T) * storage_elements(shape, layout));
+    data_ = static_cast<T*>(storage_->data);
+    set_dense_strides();
+}
+
+template<typename T>
+void Tensor<T>::set_dense_strides()
+{
+    std::fill(strides_, strides_ + kMaxTensorDims, 0);
+    if(layout_ != TensorLayout::NCHW) {
+        // [N, C/lanes, H, W, lanes]; NHWC has one block, so its channel
+        // stride is the lane stride 1
+        int lanes = layout_lanes(layout_, shape_[1]);
+        int blocks = (shape_[1] + lanes - 1) / lanes;
+        strides_[3] = lanes;
+        strides_[2] = shape_[3] * lanes;
+        strides_[1] = layout_ == TensorLayout::NHWC ? 1 : shape_[2] * strides_[2];
+        strides_[0] = blocks * shape_[2] * strides_[2];
+        return;
+    }
+    int s = 1;
+    for(int d = shape_.size() - 1; d >= 0; d--) {
+        strides_[d] = s;
+        s *= shape_[d];
+    }
+}
+
+template<typename T>
+int Tensor<T>::storage_size() const
+{
+    return is_blocked(layout_) ? (int)storage_elements(shape_, layout_) : size_;
+}
+
+template<typename T>
+size_t Tensor<T>::offset4d(int n, int c, int h, int w) const
+{
+    size_t off = (size_t)n * strides_[0] + (size_t)h * strides_[2] + (size_t)w * strides_[3];
+    if(is_blocked(layout_)) {
+        int lanes = layout_lanes(layout_, shape_[1]);
+        return off + (size_t)(c / lanes) * strides_[1] + c % lanes;
+    }
+    return off + (size_t)c * strides_[1];
+}
+
+template<typename T>
+void Tensor<T>::require_nchw(const char* op) const
+{
+    if(layout_ != TensorLayout::NCHW) {
+        throw std::runtime_error(std::string(op) + ": tensor is " + layout_name(layout_) +
+                                 ", convert it with to_layout first.");
+    }
+}
+
+// *this is dense with other's shape and layout; an NCHW other's
+// elements in row-major order
+template<typename T>
+void Tensor<T>::copy_from(const Tensor& other)
+{
+    if(other.layout_ != TensorLayout::NCHW) {
+        // never a strided view
+        std::copy(other.data_, other.data_ + other.storage_size(), data_);
+        return;
+    }
+    if(other.is_contiguous()) {
+        std::copy(other.data_, other.data_ + size_, data_);
+        return;
+    }
+    int nd = other.shape_.size();
+    int inner = other.shape_[nd - 1];
+    int inner_stride = other.strides_[nd - 1];
+    int idx[kMaxTensorDims] = {};
+    T* dst = data_;
+    for(int done = 0; done < size_; done += inner) {
+        const T* src = other.data_;
+        for(int d = 0; d < nd - 1; d++) {
+            src += idx[d] * other.strides_[d];
+        }
+        for(int i = 0; i < inner; i++) {
+            *dst++ = src[i * inner_stride];
+        }
+        // next index over the outer dimensions
+        for(int d = nd - 2; d >= 0; d--) {
+            if(++idx[d] < other.shape_[d]) {
+                break;
+            }
+            idx[d] = 0;
+        }
+    }
+}
+
+template<typename T>
+int Tensor<T>::normalize_dim(int dim, int ndim) const
+{
+    int d = dim < 0 ? dim + ndim : dim;
+    if(d < 0 || d >= ndim) {
+        throw std::runtime_error("Tensor: dimension " + std::to_string(dim) + " out of range.");
+    }
+    return d;
 }
 
 template<typename T>
 int Tensor<T>::size(int dim) const {
-    return shape_.at(dim);
+    return shape_[normalize_dim(dim, shape_.size())];
+}
+
+template<typename T>
+int Tensor<T>::stride(int dim) const {
+    return strides_[normalize_dim(dim, shape_.size())];
+}
+
+template<typename T>
+bool Tensor<T>::is_contiguous() const
+{
+    if(layout_ != TensorLayout::NCHW) {
+        return false;
+    }
+    int s = 1;
+    for(int d = shape_.size() - 1; d >= 0; d--) {
+        // the stride of a size-1 dimension never matters
+        if(shape_[d] != 1 && strides_[d] != s) {
+            return false;
+        }
+        s *= shape_[d];
+    }
+    return true;
+}
+
+template<typename T>
+Tensor<T> Tensor<T>::alias() const
+{
+    Tensor out;
+    out.storage_ = storage_;
+    out.data_ = data_;
+    out.shape_ = shape_;
+    out.layout_ = layout_;
+    out.size_ = size_;
+    std::copy(strides_, strides_ + kMaxTensorDims, out.strides_);
+    return out;
+}
+
+template<typename T>
+Tensor<T> Tensor<T>::view(const TensorShape& shape) const
+{
+    require_nchw("Tensor::view");
+    if(!is_contiguous()) {
+        throw std::runtime_error("Tensor::view: tensor is not contiguous, use reshape.");
+    }
+    TensorShape s = shape;
+    int infer = -1;
+    int known = 1;
+    for(int d = 0; d < s.size(); d++) {
+        if(s[d] == -1 && infer < 0) {
+            infer = d;
+        } else if(s[d] <= 0) {
+            throw std::runtime_error("Tensor::view: invalid dimension.");
+        } else {
+            known *= s[d];
+        }
+    }
+    if(infer >= 0) {
+        if(size_ % known != 0) {
+            throw std::runtime_error("Tensor::view: cannot infer dimension.");
+        }
+        s[infer] = size_ / known;
+    }
+    if(s.empty() || s.numel() != size_) {
+        throw std::runtime_error("Tensor::view: element count mismatch.");
+    }
+    Tensor out = alias();
+    out.shape_ = s;
+    out.set_dense_strides();
+    return out;
 }
 
 template<typename T>
-int Tensor<T>::total_size() const {
-    return static_cast<int>(data_.size());
+Tensor<T> Tensor<T>::reshape(const TensorShape& shape) const
+{
+    return contiguous().view(shape);
 }
 
 template<typename T>
-T* Tensor<T>::data() {
-    return data_.data();
+Tensor<T> Tensor<T>::flatten(int start_dim, int end_dim) const
+{
+    int nd = shape_.size();
+    int s = normalize_dim(start_dim, nd);
+    int e = normalize_dim(end_dim, nd);
+    if(s > e) {
+        throw std::runtime_error("Tensor::flatten: start_dim after end_dim.");
+    }
+    std::vector<int> dims(shape_.begin(), shape_.begin() + s);
+    int merged = 1;
+    for(int d = s; d <= e; d++) {
+        merged *= shape_[d];
+    }
+    dims.push_back(merged);
+    dims.insert(dims.end(), shape_.begin() + e + 1, shape_.end());
+    return reshape(dims);
 }
 
 template<typename T>
-const T* Tensor<T>::data() const {
-    return data_.data();
+Tensor<T> Tensor<T>::slice(int dim, int start, int end) const
+{
+    require_nchw("Tensor::slice");
+    int d = normalize_dim(dim, shape_.size());
+    if(start < 0 || end > shape_[d] || start >= end) {
+        throw std::runtime_error("Tensor::slice: invalid range.");
+    }
+    Tensor out = alias();
+    out.data_ += (size_t)start * strides_[d];
+    out.shape_[d] = end - start;
+    out.size_ = out.shape_.numel();
+    return out;
 }
 
 template<typename T>
-T& Tensor<T>::operator[](int idx) {
-    return data_[idx];
+Tensor<T> Tensor<T>::transpose(int d0, int d1) const
+{
+    require_nchw("Tensor::transpose");
+    int a = normalize_dim(d0, shape_.size());
+    int b = normalize_dim(d1, shape_.size());
+    Tensor out = alias();
+    std::swap(out.shape_[a], out.shape_[b]);
+    std::swap(out.strides_[a], out.strides_[b]);
+    return out;
+}
+
+template<typename T>
+Tensor<T> Tensor<T>::squeeze(int dim) const
+{
+    require_nchw("Tensor::squeeze");
+    int nd = shape_.size();
+    int d = normalize_dim(dim, nd);
+    if(shape_[d] != 1) {
+        throw std::runtime_error("Tensor::squeeze: dimension is not 1.");
+    }
+    if(nd == 1) {
+        throw std::runtime_error("Tensor::squeeze: cannot remove the last dimension.");
+    }
+    std::vector<int> dims(shape_.begin(), shape_.end());
+    dims.erase(dims.begin() + d);
+    Tensor out = alias();
+    out.shape_ = dims;
+    std::copy(strides_ + d + 1, strides_ + kMaxTensorDims, out.strides_ + d);
+    out.strides_[kMaxTensorDims - 1] = 0;
+    return out;
 }
 
 template<typename T>
-const T& Tensor<T>::operator[](int idx) const {
-    return data_[idx];
+Tensor<T> Tensor<T>::unsqueeze(int dim) const
+{
+    require_nchw("Tensor::unsqueeze");
+    int nd = shape_.size();
+    int d = normalize_dim(dim, nd + 1);
+    std::vector<int> dims(shape_.begin(), shape_.end());
+    dims.insert(dims.begin() + d, 1);
+    Tensor out = alias();
+    out.shape_ = dims;
+    for(int i = nd; i > d; i--) {
+        out.strides_[i] = strides_[i - 1];
+    }
+    // any stride works for size 1; keep it dense
+    out.strides_[d] = d + 1 < nd + 1 ? strides_[d] * shape_[d] : 1;
+    return out;
 }
 
 template<typename T>
-T& Tensor<T>::at4d(int n, int c, int h, int w) {
-    int shape0 = (shape_.size() > 0) ? shape_[0] : 1;
-    int shape1 = (shape_.size() > 1) ? shape_[1] : 1;
-    int shape2 = (shape_.size() > 2) ? shape_[2] : 1;
-    int shape3 = (shape_.size() > 3) ? shape_[3] : 1;
+Tensor<T> Tensor<T>::contiguous() const
+{
+    if(is_contiguous()) {
+        return alias();
+    }
+    return layout_ == TensorLayout::NCHW ? Tensor(*this) : to_layout(TensorLayout::NCHW);
+}
 
-    int index = ((n * shape1 + c) * shape2 + h) * shape3 + w;
+template<typename T>
+Tensor<T> Tensor<T>::dense() const
+{
+    return is_dense() ? alias() : Tensor(*this);
+}
 
-    return data_[index];
+template<typename T>
+Tensor<T> Tensor<T>::to_layout(TensorLayout layout) const
+{
+    if(layout == layout_) {
+        return dense();
+    }
+    if(shape_.size() != 4) {
+        throw std::runtime_error(std::string("Tensor::to_layout: ") + layout_name(layout) +
+                                 " needs a 4-D tensor.");
+    }
+    const int N = shape_[0], C = shape_[1], H = shape_[2], W = shape_[3];
+    bool padded = C % layout_lanes(layout, C) != 0;
+    Tensor out(shape_, layout, padded ? TensorInit::ZERO : TensorInit::UNINITIALIZED);
+    const int src_w = strides_[3];
+    const int dst_w = out.strides_[3];
+    for(int n = 0; n < N; n++) {
+        for(int c = 0; c < C; c++) {
+            for(int h = 0; h < H; h++) {
+                const T* src = data_ + offset4d(n, c, h, 0);
+                T* dst = out.data_ + out.offset4d(n, c, h, 0);
+                for(int w = 0; w < W; w++) {
+                    dst[(size_t)w * dst_w] = src[(size_t)w * src_w];
+                }
+            }
+        }
+    }
+    return out;
 }
 
 template<typename T>
-const T& Tensor<T>::at4d(int n, int c, int h, int w) const {
-    int shape0 = (shape_.size() > 0) ? shape_[0] : 1;
-    int shape1 = (shape_.size() > 1) ? shape_[1] : 1;
-    int shape2 = (shape_.size() > 2) ? shape_[2] : 1;
-    int shape3 = (shape_.size() > 3) ? shape_[3] : 1;
+void Tensor<T>::ensure_shape(const TensorShape& shape, TensorInit init)
+{
+    ensure_shape(shape, TensorLayout::NCHW, init);
+}
 
-    int index = ((n * shape1 + c) * shape2 + h) * shape3 + w;
-    return data_[index];
+template<typename T>
+void Tensor<T>::ensure_shape(const TensorShape& shape, TensorLayout layout, TensorInit init)
+{
+    if(storage_ && shape_ == shape && layout_ == layout && is_dense()) {
+        return;
+    }
+    if(storage_ && storage_.use_count() == 1 && !shape.empty() &&
+       (layout == TensorLayout::NCHW || shape.size() == 4) &&
+       storage_->bytes >= sizeof(T) * storage_elements(shape, layout)) {
+        data_ = static_cast<T*>(storage_->data);
+        shape_ = shape;
+        layout_ = layout;
+        size_ = shape.numel();
+        set_dense_strides();
+        return;
+    }
+    *this = Tensor(shape, layout, init);
 }
 
 template class Tensor<float>;
 template class Tensor<double>;
 template class Tensor<int>;
-template class Tensor<unsigned char>;
\ No newline at end of file
+template class Tensor<unsigned char>;
@@ -0,0 +1,279 @@
+#include "common/thread_pool.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+
+namespace
+{
+    // set while a thread is inside a parallel region
+    thread_local bool in_parallel = false;
+    // set by ThreadPoolScope
+    thread_local ThreadPool *bound_pool = nullptr;
+
+    // in_parallel for a scope, restored however it is left
+    class ParallelRegion {
+    public:
+        ParallelRegion() : prev_(in_parallel) { in_parallel = true; }
+        ~ParallelRegion() { in_parallel = prev_; }
+
+    private:
+        ParallelRegion(const ParallelRegion &) = delete;
+        ParallelRegion &operator=(const ParallelRegion &) = delete;
+
+        bool prev_;
+    };
+
+    int default_num_threads()
+    {
+        const char *env = std::getenv("POLY_NUM_THREADS");
+        if (env)
+        {
+            int n = std::atoi(env);
+            if (n > 0)
+                return n;
+        }
+        int hw = (int)std::thread::hardware_concurrency();
+        return hw > 0 ? hw : 1;
+    }
+
+    bool set_affinity(pthread_t thread, const std::vector<int> &cpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+        {
+            if (cpu < 0 || cpu >= CPU_SETSIZE)
+                return false;
+            CPU_SET(cpu, &set);
+        }
+        return !cpus.empty() && pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+}
+
+ThreadPool &ThreadPool::instance()
+{
+    if (bound_pool)
+        return *bound_pool;
+    static ThreadPool pool(default_num_threads());
+    return pool;
+}
+
+ThreadPool::ThreadPool(int num_threads, const std::vector<int> &cpus)
+    : cpus_(cpus), next_task_(0)
+{
+    start(num_threads);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+void ThreadPool::resize(int num_threads)
+{
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads == num_threads_)
+        return;
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    stop();
+    start(num_threads);
+}
+
+void ThreadPool::start(int num_threads)
+{
+    num_threads_ = std::max(1, num_threads);
+    // new workers must not take the last job (already done) for a new one
+    unsigned long generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = false;
+        generation = generation_;
+    }
+    pin_failures_ = 0;
+    for (int t = 1; t < num_threads_; t++)
+    {
+        workers_.emplace_back(&ThreadPool::worker_loop, this, t, generation);
+        if (!cpus_.empty() &&
+            !pin_thread(workers_.back(), std::vector<int>(1, cpus_[t % cpus_.size()])))
+        {
+            pin_failures_++;
+        }
+    }
+}
+
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    wake_.notify_all();
+    for (auto &w : workers_)
+    {
+        w.join();
+    }
+    workers_.clear();
+}
+
+void ThreadPool::run_tasks(int thread_id)
+{
+    ParallelRegion region;
+    try
+    {
+        if (sched_ == Schedule::STATIC)
+        {
+            int begin = (int)((long long)num_tasks_ * thread_id / num_threads_);
+            int end = (int)((long long)num_tasks_ * (thread_id + 1) / num_threads_);
+            for (int t = begin; t < end; t++)
+            {
+                (*fn_)(t);
+            }
+        }
+        else
+        {
+            for (;;)
+            {
+                int t = next_task_.fetch_add(1, std::memory_order_relaxed);
+                if (t >= num_tasks_)
+                    break;
+                (*fn_)(t);
+            }
+        }
+    }
+    catch (...)
+    {
+        // the tasks nobody has taken yet are not run
+        next_task_.store(num_tasks_, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_)
+            error_ = std::current_exception();
+    }
+}
+
+void ThreadPool::worker_loop(int thread_id, unsigned long seen)
+{
+    for (;;)
+    {
+        Profiler *profiler;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]
+                       { return quit_ || generation_ != seen; });
+            if (quit_)
+                return;
+            seen = generation_;
+            profiler = profiler_;
+        }
+        {
+            ProfilerScope scope(*profiler);
+            run_tasks(thread_id);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--active_ == 0)
+                done_.notify_one();
+        }
+    }
+}
+
+void ThreadPool::parallel_for(int num_tasks, const std::function<void(int)> &fn,
+                              Schedule sched)
+{
+    if (num_tasks <= 0)
+        return;
+    if (num_threads_ == 1 || num_tasks == 1 || in_parallel)
+    {
+        for (int t = 0; t < num_tasks; t++)
+        {
+            fn(t);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fn_ = &fn;
+        num_tasks_ = num_tasks;
+        sched_ = sched;
+        profiler_ = &current_profiler();
+        next_task_.store(0, std::memory_order_relaxed);
+        active_ = num_threads_ - 1;
+        error_ = nullptr;
+        generation_++;
+    }
+    wake_.notify_all();
+
+    run_tasks(0);
+
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&]
+                   { return active_ == 0; });
+        fn_ = nullptr;
+        std::swap(error, error_);
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void set_num_threads(int num_threads)
+{
+    ThreadPool::instance().resize(num_threads);
+}
+
+int get_num_threads()
+{
+    return ThreadPool::instance().num_threads();
+}
+
+ThreadPoolScope::ThreadPoolScope(ThreadPool &pool)
+    : prev_(bound_pool)
+{
+    bound_pool = &pool;
+}
+
+ThreadPoolScope::~ThreadPoolScope()
+{
+    bound_pool = prev_;
+}
+
+bool in_parallel_region()
+{
+    return in_parallel;
+}
+
+std::vector<int> available_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+    if (cpus.empty())
+    {
+        int hw = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int cpu = 0; cpu < hw; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+bool pin_current_thread(const std::vector<int> &cpus)
+{
+    return set_affinity(pthread_self(), cpus);
+}
+
+bool pin_thread(std::thread &thread, const std::vector<int> &cpus)
+{
+    return set_affinity(thread.native_handle(), cpus);
+}
@@ -1 +1,22 @@
-#include "common/time_utils.hpp"
\ No newline at end of file
+#include "common/time_utils.hpp"
+
+namespace
+{
+    thread_local Profiler *bound_profiler = nullptr;
+}
+
+Profiler &current_profiler()
+{
+    return bound_profiler ? *bound_profiler : GlobalProfiler::instance();
+}
+
+ProfilerScope::ProfilerScope(Profiler &profiler)
+    : prev_(bound_profiler)
+{
+    bound_profiler = &profiler;
+}
+
+ProfilerScope::~ProfilerScope()
+{
+    bound_profiler = prev_;
+}
@@ -0,0 +1,309 @@
+#include "common/weight_stream.hpp"
+#include "common/allocator.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+    double ms_since(std::chrono::steady_clock::time_point t0)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    double sum(const std::vector<double> &v)
+    {
+        double s = 0.0;
+        for (double x : v)
+        {
+            s += x;
+        }
+        return s;
+    }
+}
+
+double WeightStreamStats::total_load_ms() const
+{
+    return sum(load_ms);
+}
+
+double WeightStreamStats::total_stall_ms() const
+{
+    return sum(stall_ms);
+}
+
+double WeightStreamStats::total_compute_ms() const
+{
+    return sum(compute_ms);
+}
+
+double WeightStreamStats::overlap_efficiency() const
+{
+    double load = total_load_ms();
+    if (load <= 0.0)
+    {
+        return 1.0;
+    }
+    return std::max(0.0, 1.0 - total_stall_ms() / load);
+}
+
+void WeightStreamStats::report(std::ostream &os) const
+{
+    size_t bytes = 0;
+    for (size_t b : layer_bytes)
+    {
+        bytes += b;
+    }
+    char line[160];
+    std::snprintf(line, sizeof(line),
+                  "weight streaming: %d layers, %.1f MB, window %d, prefetch %s, %d passes, "
+                  "resident peak %.1f MB\n",
+                  (int)layer_bytes.size(), bytes / (1024.0 * 1024.0), window,
+                  prefetch ? "on" : "off", passes, resident_peak_bytes / (1024.0 * 1024.0));
+    os << line;
+    os << "layer      MB    load ms   stall ms  compute ms\n";
+    for (size_t i = 0; i < layer_bytes.size(); i++)
+    {
+        std::snprintf(line, sizeof(line), "%5d %7.1f %10.3f %10.3f %11.3f\n", (int)i,
+                      layer_bytes[i] / (1024.0 * 1024.0), load_ms[i], stall_ms[i], compute_ms[i]);
+        os << line;
+    }
+    std::snprintf(line, sizeof(line), "total %7.1f %10.3f %10.3f %11.3f\n",
+                  bytes / (1024.0 * 1024.0), total_load_ms(), total_stall_ms(), total_compute_ms());
+    os << line;
+    std::snprintf(line, sizeof(line), "overlap efficiency %.1f%% (I/O hidden behind compute)%s\n",
+                  100.0 * overlap_efficiency(),
+                  total_load_ms() > total_compute_ms() ? ", I/O bound: load exceeds compute" : "");
+    os << line;
+}
+
+WeightStream::WeightStream(std::unique_ptr<Checkpoint> plan, const std::vector<std::string> &prefix,
+                           const WeightStreamOptions &options)
+    : plan_(std::move(plan)), options_(options), layers_(prefix.size())
+{
+    options_.window = std::max(1, std::min(options_.window, (int)prefix.size()));
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0)
+    {
+        page_ = (size_t)page;
+    }
+    for (size_t i = 0; i < prefix.size(); i++)
+    {
+        std::vector<const CheckpointEntry *> entries;
+        for (const auto &e : plan_->entries())
+        {
+            if (e.bytes > 0 && e.name.compare(0, prefix[i].size(), prefix[i]) == 0)
+            {
+                entries.push_back(&e);
+            }
+        }
+        if (entries.empty())
+        {
+            throw std::runtime_error("weight stream: " + plan_->path() + " has no entries for '" +
+                                     prefix[i] + "'");
+        }
+        // a layer's entries are written together: merge them across the
+        // alignment padding into as few ranges as possible
+        std::sort(entries.begin(), entries.end(), [](const CheckpointEntry *a, const CheckpointEntry *b)
+                  { return a->offset < b->offset; });
+        Layer &layer = layers_[i];
+        for (const CheckpointEntry *e : entries)
+        {
+            layer.bytes += e->bytes;
+            if (!layer.ranges.empty())
+            {
+                Range &last = layer.ranges.back();
+                if (e->offset <= last.offset + last.bytes + kTensorAlignment)
+                {
+                    last.bytes = e->offset + e->bytes - last.offset;
+                    continue;
+                }
+            }
+            layer.ranges.push_back({static_cast<const char *>(plan_->data(*e)), e->offset, e->bytes});
+        }
+    }
+
+    fd_ = ::open(plan_->path().c_str(), O_RDONLY);
+    stats_.window = options_.window;
+    stats_.prefetch = options_.prefetch;
+    for (const Layer &layer : layers_)
+    {
+        stats_.layer_bytes.push_back(layer.bytes);
+    }
+    reset_stats();
+    // the layers' pages start out on disk
+    for (const Layer &layer : layers_)
+    {
+        release(layer);
+    }
+    if (options_.prefetch)
+    {
+        reader_ = std::thread(&WeightStream::reader_loop, this);
+    }
+}
+
+WeightStream::~WeightStream()
+{
+    if (reader_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        queued_.notify_all();
+        reader_.join();
+    }
+    if (fd_ >= 0)
+    {
+        ::close(fd_);
+    }
+}
+
+double WeightStream::load(const Layer &layer) const
+{
+    auto t0 = std::chrono::steady_clock::now();
+    for (const Range &r : layer.ranges)
+    {
+        uintptr_t start = (uintptr_t)r.data / page_ * page_;
+        madvise((void *)start, (uintptr_t)r.data + r.bytes - start, MADV_WILLNEED);
+    }
+    // fault every page in here rather than in the compute thread
+    volatile char sink = 0;
+    for (const Range &r : layer.ranges)
+    {
+        for (uint64_t off = 0; off < r.bytes; off += page_)
+        {
+            sink = r.data[off];
+        }
+        sink = r.data[r.bytes - 1];
+    }
+    (void)sink;
+    return ms_since(t0);
+}
+
+void WeightStream::release(const Layer &layer) const
+{
+    for (const Range &r : layer.ranges)
+    {
+        // pages shared with a neighbouring entry stay
+        uintptr_t start = ((uintptr_t)r.data + page_ - 1) / page_ * page_;
+        uintptr_t end = ((uintptr_t)r.data + r.bytes) / page_ * page_;
+        if (end <= start)
+        {
+            continue;
+        }
+        madvise((void *)start, end - start, MADV_DONTNEED);
+        if (fd_ >= 0)
+        {
+            posix_fadvise(fd_, (off_t)(r.offset + (start - (uintptr_t)r.data)), (off_t)(end - start),
+                          POSIX_FADV_DONTNEED);
+        }
+    }
+}
+
+void WeightStream::reader_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        queued_.wait(lock, [this]
+                     { return quit_ || !queue_.empty(); });
+        if (quit_)
+        {
+            return;
+        }
+        int i = queue_.front();
+        queue_.pop_front();
+        resident_bytes_ += layers_[i].bytes;
+        stats_.resident_peak_bytes = std::max(stats_.resident_peak_bytes, resident_bytes_);
+        lock.unlock();
+        double ms = load(layers_[i]);
+        lock.lock();
+        stats_.load_ms[i] += ms;
+        layers_[i].state = State::RESIDENT;
+        loaded_.notify_all();
+    }
+}
+
+void WeightStream::begin(int layer)
+{
+    const int n = num_layers();
+    auto t0 = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (layer == 0)
+    {
+        stats_.passes++;
+    }
+    if (!options_.prefetch)
+    {
+        Layer &l = layers_[layer];
+        if (l.state == State::RELEASED)
+        {
+            resident_bytes_ += l.bytes;
+            stats_.resident_peak_bytes = std::max(stats_.resident_peak_bytes, resident_bytes_);
+            double ms = load(l);
+            stats_.load_ms[layer] += ms;
+            l.state = State::RESIDENT;
+        }
+    }
+    else
+    {
+        // this layer first (only not yet queued on the first pass), then
+        // the ones after it in the window, wrapping for the next pass
+        if (layers_[layer].state == State::RELEASED)
+        {
+            layers_[layer].state = State::QUEUED;
+            queue_.push_front(layer);
+        }
+        for (int k = 1; k < options_.window; k++)
+        {
+            Layer &next = layers_[(layer + k) % n];
+            if (next.state == State::RELEASED)
+            {
+                next.state = State::QUEUED;
+                queue_.push_back((layer + k) % n);
+            }
+        }
+        queued_.notify_one();
+        loaded_.wait(lock, [&]
+                     { return layers_[layer].state == State::RESIDENT; });
+    }
+    stats_.stall_ms[layer] += ms_since(t0);
+    compute_start_ = std::chrono::steady_clock::now();
+}
+
+void WeightStream::end(int layer)
+{
+    double ms = ms_since(compute_start_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.compute_ms[layer] += ms;
+    // everything fits: nothing to release
+    if (options_.window >= num_layers())
+    {
+        return;
+    }
+    Layer &l = layers_[layer];
+    l.state = State::RELEASED;
+    resident_bytes_ -= l.bytes;
+    release(l);
+}
+
+WeightStreamStats WeightStream::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void WeightStream::reset_stats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t n = layers_.size();
+    stats_.passes = 0;
+    stats_.load_ms.assign(n, 0.0);
+    stats_.stall_ms.assign(n, 0.0);
+    stats_.compute_ms.assign(n, 0.0);
+    stats_.resident_peak_bytes = resident_bytes_;
+}
@@ -0,0 +1,39 @@
+#include "layers/add.hpp"
+
+Tensor<float> add(const Tensor<float> &a, const Tensor<float> &b)
+{
+    Tensor<float> output;
+    add_into(a, b, output);
+    return output;
+}
+
+void add_into(const Tensor<float> &a, const Tensor<float> &b, Tensor<float> &output)
+{
+    if (a.shape() != b.shape())
+    {
+        throw std::runtime_error("add: operand shapes differ");
+    }
+    // hold the operands while output (possibly one of them) is set up;
+    // the sum is in a's layout
+    Tensor<float> x = a.dense();
+    Tensor<float> y = b.to_layout(x.layout());
+    output.ensure_shape(x.shape(), x.layout());
+
+    const float *xp = x.data();
+    const float *yp = y.data();
+    float *out = output.data();
+    int total = x.storage_size();
+    for (int i = 0; i < total; i++)
+    {
+        out[i] = xp[i] + yp[i];
+    }
+}
+
+void add_inplace(Tensor<float> &x, const Tensor<float> &y)
+{
+    if (!x.is_dense())
+    {
+        throw std::runtime_error("add_inplace: tensor must be dense");
+    }
+    add_into(x, y, x);
+}
@@ -1,212 +1,252 @@
 #include "layers/attention.hpp"
 #include "common/time_utils.hpp"
 #include "common/matmul.hpp" // 使用全局matmul
+#include "common/thread_pool.hpp"
+#include <algorithm>
 #include <cmath>
 #include <vector>
 
-/**
- * multi_head_self_attention:
- *  1) Q/K/V
- *  2) split heads
- *  3) scaled dot-product attention
- *  4) concat
- *  5) final linear
- */
-Tensor<float> multi_head_self_attention(const Tensor<float> &input,
-                                        const MHAParam &param)
+namespace
 {
-    ScopedTimer t_attn(OpType::OTHERS);
-
-    int N = input.shape()[0]; // batch
-    int S = input.shape()[1]; // seq_len
-    int D = input.shape()[2]; // hidden_dim
-    int h = param.num_heads;
-    int d_h = D / h;
+    // query rows / key rows per tile; a tile of scores plus the running
+    // output rows stay in L1 for d_h up to 64
+    const int kAttnBlockQ = 32;
+    const int kAttnBlockK = 64;
 
-    // flatten input => [N*S, D]
-    Tensor<float> inp2d({N * S, D});
-    for (int n = 0; n < N; n++)
+    /**
+     * Attention for one (batch, head) and query rows [q0, q0 + rows):
+     *   out = softmax(q k^T * scale) v, with q/k/v rows of d_h floats
+     *   spaced ld apart and out rows ldo apart (the head's columns of the
+     *   projection and output matrices).
+     * Keys are visited in kAttnBlockK blocks with an online softmax: a
+     * running row max m and sum l rescale the accumulated output when the
+     * max grows, so only one score tile is ever live.
+     */
+    void attention_tile(const float *q, const float *k, const float *v, int ld, int ldo,
+                        int S, int d_h, float scale, int q0, int rows,
+                        float *out)
     {
-        for (int s = 0; s < S; s++)
+        // per-thread scratch, reused across calls
+        static thread_local std::vector<float> kt, p, acc;
+        kt.resize((size_t)d_h * kAttnBlockK); // k block, transposed
+        p.resize((size_t)kAttnBlockQ * kAttnBlockK);
+        acc.assign((size_t)kAttnBlockQ * d_h, 0.f);
+        float m[kAttnBlockQ], l[kAttnBlockQ];
+        std::fill(m, m + rows, -INFINITY);
+        std::fill(l, l + rows, 0.f);
+
+        for (int k0 = 0; k0 < S; k0 += kAttnBlockK)
         {
-            for (int d = 0; d < D; d++)
+            int cols = std::min(kAttnBlockK, S - k0);
+            for (int j = 0; j < cols; j++)
             {
-                inp2d.at4d(n * S + s, d, 0, 0) = input.at4d(n, s, d, 0);
+                const float *kr = k + (size_t)(k0 + j) * ld;
+                for (int d = 0; d < d_h; d++)
+                    kt[d * kAttnBlockK + j] = kr[d];
             }
-        }
-    }
 
-    // inline lambda for linear transform
-    auto linear_transform = [&](const Tensor<float> &x,
-                                const Tensor<float> &W,
-                                const std::vector<float> &b)
-    {
-        // x: [N*S, D], W: [D,D], b:[D]
-        Tensor<float> out({N * S, D});
-        for (int i = 0; i < (N * S); i++)
-        {
-            for (int c = 0; c < D; c++)
+            for (int i = 0; i < rows; i++)
             {
-                out.at4d(i, c, 0, 0) = 0.f;
+                // scores of row i against the block
+                const float *qr = q + (size_t)(q0 + i) * ld;
+                float *pr = &p[i * kAttnBlockK];
+                std::fill(pr, pr + cols, 0.f);
+                for (int d = 0; d < d_h; d++)
+                {
+                    float qd = qr[d] * scale;
+                    const float *kd = &kt[d * kAttnBlockK];
+                    for (int j = 0; j < cols; j++)
+                        pr[j] += qd * kd[j];
+                }
+
+                float m_new = m[i];
+                for (int j = 0; j < cols; j++)
+                    m_new = std::max(m_new, pr[j]);
+                float sum = 0.f;
+                for (int j = 0; j < cols; j++)
+                {
+                    pr[j] = std::exp(pr[j] - m_new);
+                    sum += pr[j];
+                }
+                // rescale what was accumulated under the old max
+                float corr = std::exp(m[i] - m_new);
+                m[i] = m_new;
+                l[i] = l[i] * corr + sum;
+
+                float *ar = &acc[i * d_h];
+                for (int d = 0; d < d_h; d++)
+                    ar[d] *= corr;
+                for (int j = 0; j < cols; j++)
+                {
+                    const float *vr = v + (size_t)(k0 + j) * ld;
+                    float pj = pr[j];
+                    for (int d = 0; d < d_h; d++)
+                        ar[d] += pj * vr[d];
+                }
             }
         }
-        // call matmul => out2d
-        // A= x.data(), shape(M= N*S, K=D)
-        // B= W.data(), shape(K=D, N=D)
-        // C= out.data(), shape(M= N*S, N= D)
-        const float *Ap = x.data();
-        const float *Bp = W.data();
-        float *Cp = out.data();
-        ::matmul(Ap, Bp, Cp, N * S, D, D);
-
-        // add bias
-        for (int i = 0; i < (N * S); i++)
+
+        for (int i = 0; i < rows; i++)
         {
-            for (int c = 0; c < D; c++)
-            {
-                float val = out.at4d(i, c, 0, 0) + b[c];
-                out.at4d(i, c, 0, 0) = val;
-            }
+            float inv = 1.f / l[i];
+            float *o = out + (size_t)(q0 + i) * ldo;
+            const float *ar = &acc[i * d_h];
+            for (int d = 0; d < d_h; d++)
+                o[d] = ar[d] * inv;
         }
-        return out;
-    };
+    }
+}
 
-    // Q,K,V
-    Tensor<float> Q = linear_transform(inp2d, param.Wq, param.bq);
-    Tensor<float> K = linear_transform(inp2d, param.Wk, param.bk);
-    Tensor<float> V = linear_transform(inp2d, param.Wv, param.bv);
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, MHAParam &param)
+{
+    list_params(params, prefix + ".wq", param.Wq);
+    list_params(params, prefix + ".bq", param.bq);
+    list_params(params, prefix + ".wk", param.Wk);
+    list_params(params, prefix + ".bk", param.bk);
+    list_params(params, prefix + ".wv", param.Wv);
+    list_params(params, prefix + ".bv", param.bv);
+    list_params(params, prefix + ".wo", param.Wo);
+    list_params(params, prefix + ".bo", param.bo);
+}
+
+void plan_io(PlanArchive &ar, const std::string &prefix, MHAParam &param)
+{
+    ar.io(prefix + ".wq_packed", param.Wq_packed);
+    ar.io(prefix + ".wk_packed", param.Wk_packed);
+    ar.io(prefix + ".wv_packed", param.Wv_packed);
+    ar.io(prefix + ".wo_packed", param.Wo_packed);
+    ar.io(prefix + ".wqkv_packed", param.Wqkv_packed);
+    ar.io(prefix + ".bqkv", param.bqkv);
+}
 
-    // output buffer
-    Tensor<float> out2d({N * S, D});
-    // accumulate each head
-    for (int head = 0; head < h; head++)
+void pack_mha_param(MHAParam &param, bool fuse_qkv, WeightPrecision precision)
+{
+    auto pack = [precision](const Tensor<float> &W)
     {
-        // slice Qh,Kh,Vh => [N*S, d_h]
-        Tensor<float> Qh({N * S, d_h});
-        Tensor<float> Kh({N * S, d_h});
-        Tensor<float> Vh({N * S, d_h});
-        for (int i = 0; i < (N * S); i++)
-        {
-            for (int dd = 0; dd < d_h; dd++)
-            {
-                Qh.at4d(i, dd, 0, 0) = Q.at4d(i, head * d_h + dd, 0, 0);
-                Kh.at4d(i, dd, 0, 0) = K.at4d(i, head * d_h + dd, 0, 0);
-                Vh.at4d(i, dd, 0, 0) = V.at4d(i, head * d_h + dd, 0, 0);
-            }
-        }
-        // scores = Qh * Kh^T => [N*S, N*S]
-        // 1) Kh^T => [d_h, N*S]
-        Tensor<float> KhT({d_h, N * S});
-        for (int i = 0; i < (N * S); i++)
-        {
-            for (int dd = 0; dd < d_h; dd++)
-            {
-                KhT.at4d(dd, i, 0, 0) = Kh.at4d(i, dd, 0, 0);
-            }
-        }
-        // matmul => scores
-        Tensor<float> scores({N * S, N * S});
-        {
-            const float *Ap = Qh.data();
-            const float *Bp = KhT.data();
-            float *Cp = scores.data();
-            ::matmul(Ap, Bp, Cp, N * S, d_h, N * S);
-        }
-        // scale + softmax
-        float scale = 1.0f / std::sqrt((float)d_h);
-        for (int i = 0; i < (N * S); i++)
-        {
-            for (int j = 0; j < (N * S); j++)
-            {
-                float v = scores.at4d(i, j, 0, 0) * scale;
-                scores.at4d(i, j, 0, 0) = v;
-            }
-        }
-        // row-wise softmax
-        for (int i = 0; i < (N * S); i++)
-        {
-            float m = -1e30f;
-            for (int j = 0; j < (N * S); j++)
-            {
-                float v = scores.at4d(i, j, 0, 0);
-                if (v > m)
-                    m = v;
-            }
-            double sum_exp = 0.0;
-            for (int j = 0; j < (N * S); j++)
-            {
-                double e = std::exp(scores.at4d(i, j, 0, 0) - m);
-                sum_exp += e;
-            }
-            for (int j = 0; j < (N * S); j++)
-            {
-                double e = std::exp(scores.at4d(i, j, 0, 0) - m);
-                float soft = (float)(e / sum_exp);
-                scores.at4d(i, j, 0, 0) = soft;
-            }
-        }
-        // multiply => scores * Vh => [N*S, d_h]
-        // Vh^T => [d_h, N*S]
-        Tensor<float> VhT({d_h, N * S});
-        for (int i = 0; i < (N * S); i++)
-        {
-            for (int dd = 0; dd < d_h; dd++)
-            {
-                VhT.at4d(dd, i, 0, 0) = Vh.at4d(i, dd, 0, 0);
-            }
-        }
-        Tensor<float> head_out({N * S, d_h});
-        {
-            const float *Ap = scores.data();
-            const float *Bp = VhT.data();
-            float *Cp = head_out.data();
-            ::matmul(Ap, Bp, Cp, N * S, N * S, d_h);
-        }
-        // add to out2d
-        for (int i = 0; i < (N * S); i++)
-        {
-            for (int dd = 0; dd < d_h; dd++)
-            {
-                float oldv = out2d.at4d(i, head * d_h + dd, 0, 0);
-                float newv = oldv + head_out.at4d(i, dd, 0, 0);
-                out2d.at4d(i, head * d_h + dd, 0, 0) = newv;
-            }
-        }
+        return PackedMatrix::pack_b(W.data(), W.shape()[0], W.shape()[1], W.shape()[1], precision);
+    };
+    param.Wo_packed = pack(param.Wo);
+    if (!fuse_qkv)
+    {
+        param.Wq_packed = pack(param.Wq);
+        param.Wk_packed = pack(param.Wk);
+        param.Wv_packed = pack(param.Wv);
+        param.Wqkv_packed = PackedMatrix();
+        param.bqkv.clear();
+        return;
     }
 
-    // final linear (Wo)
+    int D = param.Wq.shape()[0];
+    int E = param.Wq.shape()[1];
+    std::vector<float> w((size_t)D * 3 * E);
+    const Tensor<float> *parts[3] = {&param.Wq, &param.Wk, &param.Wv};
+    for (int p = 0; p < 3; p++)
     {
-        Tensor<float> tmp({N * S, D});
+        for (int i = 0; i < D; i++)
         {
-            // matmul out2d * Wo => tmp
-            // Wo: [D,D]
-            const float *Ap = out2d.data();
-            const float *Bp = param.Wo.data();
-            float *Cp = tmp.data();
-            ::matmul(Ap, Bp, Cp, N * S, D, D);
-        }
-        // add bo
-        for (int i = 0; i < (N * S); i++)
-        {
-            for (int c = 0; c < D; c++)
-            {
-                float v = tmp.at4d(i, c, 0, 0) + param.bo[c];
-                out2d.at4d(i, c, 0, 0) = v;
-            }
+            std::copy(parts[p]->data() + (size_t)i * E, parts[p]->data() + (size_t)(i + 1) * E,
+                      &w[(size_t)i * 3 * E + p * E]);
         }
     }
+    param.Wqkv_packed = PackedMatrix::pack_b(w.data(), D, 3 * E, 3 * E, precision);
+    param.bqkv.clear();
+    param.bqkv.insert(param.bqkv.end(), param.bq.begin(), param.bq.end());
+    param.bqkv.insert(param.bqkv.end(), param.bk.begin(), param.bk.end());
+    param.bqkv.insert(param.bqkv.end(), param.bv.begin(), param.bv.end());
+    param.Wq_packed = PackedMatrix();
+    param.Wk_packed = PackedMatrix();
+    param.Wv_packed = PackedMatrix();
+}
 
-    // reshape => [N,S,D]
-    Tensor<float> out({N, S, D});
-    for (int n = 0; n < N; n++)
+/**
+ * multi_head_self_attention:
+ *  1) Q/K/V, one fused GEMM when Wqkv_packed is set
+ *  2) scaled dot-product attention per (batch, head), read from and
+ *     written to the head's columns in place (attention_tile)
+ *  3) final linear
+ *  The input is used as the [N*S, D] GEMM operand directly and biases
+ *  go through the GEMM epilogue, so apart from GEMM packing nothing is
+ *  copied.
+ */
+Tensor<float> multi_head_self_attention(const Tensor<float> &input,
+                                        const MHAParam &param)
+{
+    Tensor<float> out;
+    multi_head_self_attention_into(input, param, out);
+    return out;
+}
+
+void multi_head_self_attention_into(const Tensor<float> &input,
+                                    const MHAParam &param, Tensor<float> &out)
+{
+    ScopedTimer t_attn(OpType::OTHERS);
+
+    int N = input.shape()[0]; // batch
+    int S = input.shape()[1]; // seq_len
+    int D = input.shape()[2]; // hidden_dim
+    int h = param.num_heads;
+    int d_h = D / h;
+
+    // [N, S, D] is already the row-major [N*S, D] GEMM operand
+    Tensor<float> in = input.contiguous();
+    const float *x = in.data();
+
+    // Q,K,V as [N*S, ld] row-major with the columns of Q at q, K at k and
+    // V at v: one [N*S, 3D] GEMM with the fused weight, else three [N*S, D]
+    Tensor<float> qkv({N * S, 3 * D}, TensorInit::UNINITIALIZED);
+    int ld = 3 * D;
+    GemmEpilogue ep;
+    ep.per_column = true;
+    if (!param.Wqkv_packed.empty())
+    {
+        ep.shift = param.bqkv.data();
+        ::matmul(x, param.Wqkv_packed, qkv.data(), N * S, &ep);
+    }
+    else
     {
-        for (int s = 0; s < S; s++)
+        // each projection into a contiguous [N*S, D] block of qkv
+        ld = D;
+        const Tensor<float> *W[3] = {&param.Wq, &param.Wk, &param.Wv};
+        const PackedMatrix *W_packed[3] = {&param.Wq_packed, &param.Wk_packed, &param.Wv_packed};
+        const std::vector<float> *b[3] = {&param.bq, &param.bk, &param.bv};
+        for (int p = 0; p < 3; p++)
         {
-            for (int d = 0; d < D; d++)
-            {
-                out.at4d(n, s, d, 0) = out2d.at4d(n * S + s, d, 0, 0);
-            }
+            float *Cp = qkv.data() + (size_t)p * N * S * D;
+            ep.shift = b[p]->data();
+            if (!W_packed[p]->empty())
+                ::matmul(x, *W_packed[p], Cp, N * S, &ep);
+            else
+                ::matmul(x, W[p]->data(), Cp, N * S, D, D, &ep);
         }
     }
-    return out;
-}
\ No newline at end of file
+    const float *q = qkv.data();
+    const float *k = ld == D ? q + (size_t)N * S * D : q + D;
+    const float *v = ld == D ? q + (size_t)2 * N * S * D : q + 2 * D;
+
+    // scaled dot-product attention, tiled per (batch, head, query block);
+    // each head writes its own columns of ctx
+    Tensor<float> ctx({N * S, D}, TensorInit::UNINITIALIZED);
+    {
+        float scale = 1.0f / std::sqrt((float)d_h);
+        int q_blocks = (S + kAttnBlockQ - 1) / kAttnBlockQ;
+        ThreadPool::instance().parallel_for(N * h * q_blocks, [&](int task)
+                                            {
+            int qb = task % q_blocks;
+            int head = task / q_blocks % h;
+            int n = task / q_blocks / h;
+            size_t in_off = (size_t)n * S * ld + head * d_h;
+            size_t out_off = (size_t)n * S * D + head * d_h;
+            int q0 = qb * kAttnBlockQ;
+            attention_tile(q + in_off, k + in_off, v + in_off, ld, D,
+                           S, d_h, scale, q0, std::min(kAttnBlockQ, S - q0),
+                           ctx.data() + out_off); });
+    }
+
+    // final linear (Wo) + bo, straight into the [N, S, D] output
+    out.ensure_shape({N, S, D});
+    ep.shift = param.bo.data();
+    if (!param.Wo_packed.empty())
+        ::matmul(ctx.data(), param.Wo_packed, out.data(), N * S, &ep);
+    else
+        ::matmul(ctx.data(), param.Wo.data(), out.data(), N * S, D, D, &ep);
+}
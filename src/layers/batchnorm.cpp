@@ -3,15 +3,53 @@
 #include <cmath>
 
 Tensor<float> batchnorm2d(const Tensor<float> &input, const BNParam &param)
+{
+    Tensor<float> output;
+    batchnorm2d_into(input, param, output);
+    return output;
+}
+
+void batchnorm2d_inplace(Tensor<float> &x, const BNParam &param)
+{
+    if(!x.is_dense()) {
+        throw std::runtime_error("batchnorm2d_inplace: tensor must be dense");
+    }
+    batchnorm2d_into(x, param, x);
+}
+
+void batchnorm2d_into(const Tensor<float> &input, const BNParam &param, Tensor<float> &output)
 {
     ScopedTimer timer(OpType::NORMALIZATION);
 
-    int N = input.shape()[0];
-    int C = input.shape()[1];
-    int H = input.shape()[2];
-    int W = input.shape()[3];
+    // holds the input while output (possibly the same tensor) is set up
+    Tensor<float> in = input.dense();
+    int N = in.shape()[0];
+    int C = in.shape()[1];
+    int H = in.shape()[2];
+    int W = in.shape()[3];
 
-    Tensor<float> output({N, C, H, W});
+    output.ensure_shape({N, C, H, W}, in.layout());
+
+    if(in.layout() != TensorLayout::NCHW){
+        // [N*blocks][H*W][lanes], the affine map per lane; padded lanes stay zero
+        BNAffine a = batchnorm_affine(param);
+        const int L = layout_lanes(in.layout(), C);
+        const int G = (C + L - 1) / L;
+        a.scale.resize((size_t)G * L, 0.f);
+        a.shift.resize((size_t)G * L, 0.f);
+        const float *src = in.data();
+        float *dst = output.data();
+        for(int p=0; p<N*G; p++){
+            const float *sc = &a.scale[(p % G) * L];
+            const float *sh = &a.shift[(p % G) * L];
+            for(int i=0; i<H*W; i++, src += L, dst += L){
+                for(int l=0; l<L; l++){
+                    dst[l] = src[l] * sc[l] + sh[l];
+                }
+            }
+        }
+        return;
+    }
 
     for(int n=0; n<N; n++){
         for(int c=0; c<C; c++){
@@ -23,7 +61,7 @@ Tensor<float> batchnorm2d(const Tensor<float> &input, const BNParam &param)
 
             for(int hh=0; hh<H; hh++){
                 for(int ww=0; ww<W; ww++){
-                    float x = input.at4d(n,c,hh,ww);
+                    float x = in.at4d(n,c,hh,ww);
                     float x_hat = (x - mean)*denom;
                     float y = gamma * x_hat + beta;
                     output.at4d(n,c,hh,ww) = y;
@@ -31,5 +69,49 @@ Tensor<float> batchnorm2d(const Tensor<float> &input, const BNParam &param)
             }
         }
     }
-    return output;
-}
\ No newline at end of file
+}
+
+BNAffine batchnorm_affine(const BNParam &param)
+{
+    int C = (int)param.gamma.size();
+    BNAffine a;
+    a.scale.resize(C);
+    a.shift.resize(C);
+    for(int c=0; c<C; c++){
+        a.scale[c] = param.gamma[c] / std::sqrt(param.running_var[c] + param.eps);
+        a.shift[c] = param.beta[c] - param.running_mean[c] * a.scale[c];
+    }
+    return a;
+}
+
+void plan_io(PlanArchive &ar, const std::string &prefix, BNAffine &affine)
+{
+    ar.io(prefix + ".scale", affine.scale);
+    ar.io(prefix + ".shift", affine.shift);
+}
+
+void fold_batchnorm(const Tensor<float> &weight, const std::vector<float> &bias,
+                    const BNParam &param,
+                    Tensor<float> &weight_out, std::vector<float> &bias_out)
+{
+    int C_out = weight.shape()[0];
+    int per_channel = weight.total_size() / C_out;
+
+    BNAffine a = batchnorm_affine(param);
+    weight_out = weight;
+    bias_out.resize(C_out);
+    for(int c=0; c<C_out; c++){
+        float *w = weight_out.data() + (size_t)c * per_channel;
+        for(int i=0; i<per_channel; i++){
+            w[i] *= a.scale[c];
+        }
+        bias_out[c] = bias[c] * a.scale[c] + a.shift[c];
+    }
+}
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, BNParam &param)
+{
+    list_params(params, prefix + ".gamma", param.gamma);
+    list_params(params, prefix + ".beta", param.beta);
+    list_params(params, prefix + ".running_mean", param.running_mean);
+    list_params(params, prefix + ".running_var", param.running_var);
+}
@@ -1,8 +1,18 @@
 #include "layers/conv2d.hpp"
+#include "layers/conv2d_layout.hpp"
 #include "common/time_utils.hpp"
+#include "common/thread_pool.hpp"
+#include "common/cpu_features.hpp"
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define POLY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define POLY_TARGET(isa)
+#endif
+
 namespace
 {
     // im2col
@@ -22,179 +32,1253 @@ namespace
         int out_w = (W + 2 * pad_w - kernel_w) / stride_w + 1;
 
         // [N, C*kernel_h*kernel_w, out_h*out_w]
-        Tensor<float> col(std::vector<int>{N, C * kernel_h * kernel_w, out_h * out_w});
-
-        // for (int n = 0; n < N; n++)
-        // {
-        //     float *col_data_n = col.data() + n * (col.shape()[1] * col.shape()[2]);
-
-        //     for (int c_in = 0; c_in < C; c_in++)
-        //     {
-        //         for (int kh = 0; kh < kernel_h; kh++)
-        //         {
-        //             for (int kw = 0; kw < kernel_w; kw++)
-        //             {
-        //                 int row_idx = c_in * kernel_h * kernel_w + kh * kernel_w + kw;
-        //                 for (int oh = 0; oh < out_h; oh++)
-        //                 {
-        //                     int ih = oh * stride_h + kh - pad_h;
-        //                     for (int ow = 0; ow < out_w; ow++)
-        //                     {
-        //                         int iw = ow * stride_w + kw - pad_w;
-        //                         float val = 0.f;
-        //                         if (ih >= 0 && ih < H && iw >= 0 && iw < W)
-        //                         {
-        //                             val = input.at4d(n, c_in, ih, iw);
-        //                         }
-        //                         int col_idx = row_idx * (out_h * out_w) + (oh * out_w + ow);
-        //                         col_data_n[col_idx] = val;
-        //                     }
-        //                 }
-        //             }
-        //         }
-        //     }
-        // }
+        Tensor<float> col({N, C * kernel_h * kernel_w, out_h * out_w}, TensorInit::UNINITIALIZED);
+
+        for (int n = 0; n < N; n++)
+        {
+            float *col_data_n = col.data() + n * (col.shape()[1] * col.shape()[2]);
+
+            for (int c_in = 0; c_in < C; c_in++)
+            {
+                for (int kh = 0; kh < kernel_h; kh++)
+                {
+                    for (int kw = 0; kw < kernel_w; kw++)
+                    {
+                        int row_idx = c_in * kernel_h * kernel_w + kh * kernel_w + kw;
+                        for (int oh = 0; oh < out_h; oh++)
+                        {
+                            int ih = oh * stride_h + kh - pad_h;
+                            for (int ow = 0; ow < out_w; ow++)
+                            {
+                                int iw = ow * stride_w + kw - pad_w;
+                                float val = 0.f;
+                                if (ih >= 0 && ih < H && iw >= 0 && iw < W)
+                                {
+                                    val = input.at4d(n, c_in, ih, iw);
+                                }
+                                int col_idx = row_idx * (out_h * out_w) + (oh * out_w + ow);
+                                col_data_n[col_idx] = val;
+                            }
+                        }
+                    }
+                }
+            }
+        }
         return col;
     }
-}
 
-Tensor<float> conv2d(const Tensor<float> &input,
-                     const Tensor<float> &weight,
-                     const std::vector<float> &bias,
-                     const Conv2DParam &param)
-{
-    int N = input.shape()[0];
-    int C_in = input.shape()[1];
-    int H_in = input.shape()[2];
-    int W_in = input.shape()[3];
+    struct ConvShape
+    {
+        int N, C_in, H_in, W_in;
+        int C_out, kH, kW;
+        int out_h, out_w;
+        int K;
+    };
 
-    int C_out = weight.shape()[0];
-    int kH = weight.shape()[2];
-    int kW = weight.shape()[3];
+    ConvShape conv_shape(const Tensor<float> &input, int C_out, int kH, int kW,
+                         const Conv2DParam &param)
+    {
+        ConvShape cs;
+        cs.N = input.shape()[0];
+        cs.C_in = input.shape()[1];
+        cs.H_in = input.shape()[2];
+        cs.W_in = input.shape()[3];
+        cs.C_out = C_out;
+        cs.kH = kH;
+        cs.kW = kW;
+        cs.out_h = (cs.H_in + 2 * param.pad_h - kH) / param.stride_h + 1;
+        cs.out_w = (cs.W_in + 2 * param.pad_w - kW) / param.stride_w + 1;
+        cs.K = cs.C_in * kH * kW;
+        return cs;
+    }
 
-    int out_h = (H_in + 2 * param.pad_h - kH) / param.stride_h + 1;
-    int out_w = (W_in + 2 * param.pad_w - kW) / param.stride_w + 1;
+    /**
+     * The conv bias and a Conv2DEpilogue merged into one GEMM epilogue
+     * over the [C_out, out_h*out_w] output of each image:
+     * y = act(acc * scale[c] + shift[c] + residual), where
+     * shift = bias * scale + epilogue shift. Prepared models hand in an
+     * empty bias with it already merged into the epilogue shift (see
+     * conv2d_bn_affine); only other callers pay for the merge per call.
+     */
+    struct ConvEpilogue
+    {
+        const float *scale = nullptr; // null: 1
+        const float *shift = nullptr;
+        const float *residual = nullptr;
+        Activation act = Activation::NONE;
+        int C_out = 0;
+        int hw = 0;
+        std::vector<float> merged; // shift, when it is not just the bias
 
-    // 1) im2col
-    Tensor<float> col = im2col(input, kH, kW,
-                               param.stride_h, param.stride_w,
-                               param.pad_h, param.pad_w);
+        ConvEpilogue(const std::vector<float> &bias, const Conv2DEpilogue &e,
+                     int C_out_, int hw_)
+            : scale(e.scale), shift(bias.empty() ? e.shift : bias.data()), act(e.act),
+              C_out(C_out_), hw(hw_)
+        {
+            if (!bias.empty() && (e.scale || e.shift))
+            {
+                merged.assign(bias.begin(), bias.begin() + C_out);
+                for (int c = 0; c < C_out; c++)
+                {
+                    if (e.scale)
+                        merged[c] *= e.scale[c];
+                    if (e.shift)
+                        merged[c] += e.shift[c];
+                }
+                shift = merged.data();
+            }
+            if (e.residual)
+                residual = e.residual->data();
+        }
+
+        // the full epilogue of image n, for the GEMM paths
+        GemmEpilogue image(int n) const
+        {
+            GemmEpilogue ep;
+            ep.scale = scale;
+            ep.shift = shift;
+            ep.residual = residual ? residual + (size_t)n * C_out * hw : nullptr;
+            ep.ldr = hw;
+            ep.act = act;
+            return ep;
+        }
 
-    // K = C_in * kH * kW
-    int K = C_in * kH * kW;
-    Tensor<float> w2d({C_out, K});
+        // part a kernel can add while accumulating (nothing if there is a scale)
+        float fused_bias(int c) const
+        {
+            return scale || !shift ? 0.f : shift[c];
+        }
+
+        // whether anything is left after fused_bias, and that remainder
+        bool needs_post() const
+        {
+            return scale || residual || act != Activation::NONE;
+        }
+
+        GemmEpilogue post(int n) const
+        {
+            GemmEpilogue ep = image(n);
+            if (!ep.scale)
+                ep.shift = nullptr;
+            return ep;
+        }
+    };
+
+    /**
+     * The im2col matrix [C_in*kH*kW, out_h*out_w] of one image, produced
+     * panel by panel straight from the NCHW input, so the full column
+     * buffer is never materialised. Columns of a panel are split into
+     * runs that share an output row; a run is a memcpy when stride is 1
+     * and it does not touch the padding.
+     */
+    class ImplicitIm2col : public GemmPanelSource
     {
-        const float *wp = weight.data();
-        float *w2dp = w2d.data();
-        for (int co = 0; co < C_out; co++)
+    public:
+        ImplicitIm2col(const float *image, const ConvShape &cs, const Conv2DParam &p)
+            : in_(image), cs_(cs), p_(p) {}
+
+        const float *panels(int j0, int len, int p0, int kc,
+                            int width, float *scratch) const
         {
-            for (int ci = 0; ci < C_in; ci++)
+            float *dst = scratch;
+            for (int jp = j0; jp < j0 + len; jp += width)
             {
-                for (int kh = 0; kh < kH; kh++)
+                int cols = std::min(width, j0 + len - jp);
+                fill_panel(jp, cols, p0, kc, width, dst);
+                dst += kc * width;
+            }
+            return scratch;
+        }
+
+    private:
+        struct Run
+        {
+            int j;       // first column in the panel
+            int count;   // columns in this output row
+            int ih_base; // input row for kh = 0
+            int iw_base; // input col of the first column for kw = 0
+        };
+
+        void fill_panel(int jp, int cols, int p0, int kc, int width, float *dst) const
+        {
+            const int H = cs_.H_in, W = cs_.W_in;
+            const int sw = p_.stride_w;
+            const int khw = cs_.kH * cs_.kW;
+
+            Run runs[64];
+            int num_runs = 0;
+            for (int j = 0; j < cols;)
+            {
+                int oh = (jp + j) / cs_.out_w;
+                int ow = (jp + j) % cs_.out_w;
+                int count = std::min(cols - j, cs_.out_w - ow);
+                Run r = {j, count, oh * p_.stride_h - p_.pad_h, ow * sw - p_.pad_w};
+                runs[num_runs++] = r;
+                j += count;
+            }
+
+            int ci = p0 / khw;
+            int kh = (p0 % khw) / cs_.kW;
+            int kw = p0 % cs_.kW;
+            for (int p = 0; p < kc; p++)
+            {
+                const float *plane = in_ + (size_t)ci * H * W;
+                float *row = dst + p * width;
+                for (int r = 0; r < num_runs; r++)
                 {
-                    for (int kw = 0; kw < kW; kw++)
+                    const Run &run = runs[r];
+                    float *d = row + run.j;
+                    int ih = run.ih_base + kh;
+                    if (ih < 0 || ih >= H)
+                    {
+                        std::memset(d, 0, sizeof(float) * run.count);
+                        continue;
+                    }
+                    const float *src = plane + ih * W;
+                    int iw = run.iw_base + kw;
+                    int iw_last = iw + (run.count - 1) * sw;
+                    if (sw == 1 && iw >= 0 && iw_last < W)
+                    {
+                        std::memcpy(d, src + iw, sizeof(float) * run.count);
+                        continue;
+                    }
+                    for (int j = 0; j < run.count; j++, iw += sw)
                     {
-                        int idx_in = ((co * C_in + ci) * kH + kh) * kW + kw;
-                        int idx_out = co * K + (ci * kH * kW + kh * kW + kw);
-                        w2dp[idx_out] = wp[idx_in];
+                        d[j] = (iw >= 0 && iw < W) ? src[iw] : 0.f;
                     }
                 }
+                for (int j = cols; j < width; j++)
+                {
+                    row[j] = 0.f;
+                }
+                if (++kw == cs_.kW)
+                {
+                    kw = 0;
+                    if (++kh == cs_.kH)
+                    {
+                        kh = 0;
+                        ci++;
+                    }
+                }
+            }
+        }
+
+        const float *in_;
+        ConvShape cs_;
+        Conv2DParam p_;
+    };
+
+    bool is_pointwise(const ConvShape &cs, const Conv2DParam &param)
+    {
+        return cs.kH == 1 && cs.kW == 1 && param.pad_h == 0 && param.pad_w == 0;
+    }
+
+    // x[c][oh][ow] = image[c][oh * sh][ow * sw]: the input of a strided 1x1 conv
+    void subsample(const float *image, const ConvShape &cs, const Conv2DParam &param,
+                   float *x)
+    {
+        const int sh = param.stride_h, sw = param.stride_w;
+        ThreadPool::instance().parallel_for(cs.C_in, [&](int c)
+                                            {
+            const float *plane = image + (size_t)c * cs.H_in * cs.W_in;
+            float *dst = x + (size_t)c * cs.out_h * cs.out_w;
+            for (int oh = 0; oh < cs.out_h; oh++)
+            {
+                const float *src = plane + oh * sh * cs.W_in;
+                for (int ow = 0; ow < cs.out_w; ow++)
+                    *dst++ = src[ow * sw];
+            } });
+    }
+
+    /**
+     * Implicit GEMM. For 1x1 convs without padding the im2col matrix is
+     * the NCHW image itself ([C_in, H*W]), so the GEMM reads the input
+     * buffer directly; strided ones first gather the sampled pixels into
+     * a [C_in, out_h*out_w] matrix, a 1/(sh*sw) copy of the input.
+     */
+    void conv2d_implicit(const Tensor<float> &input, const PackedMatrix &w,
+                         const ConvEpilogue &epi, const ConvShape &cs,
+                         const Conv2DParam &param, Tensor<float> &output)
+    {
+        int hw = cs.out_h * cs.out_w;
+        bool pointwise = is_pointwise(cs, param);
+        bool strided = param.stride_h != 1 || param.stride_w != 1;
+        Tensor<float> sampled;
+        if (pointwise && strided)
+        {
+            sampled = Tensor<float>({cs.C_in, hw}, TensorInit::UNINITIALIZED);
+        }
+        for (int n_i = 0; n_i < cs.N; n_i++)
+        {
+            const float *image = input.data() + (size_t)n_i * cs.C_in * cs.H_in * cs.W_in;
+            float *Out = output.data() + (size_t)n_i * cs.C_out * hw;
+            GemmEpilogue ep = epi.image(n_i);
+            if (pointwise)
+            {
+                if (strided)
+                {
+                    subsample(image, cs, param, sampled.data());
+                    image = sampled.data();
+                }
+                matmul(w, image, Out, hw, &ep);
+            }
+            else
+            {
+                matmul(w, ImplicitIm2col(image, cs, param), Out, hw, &ep);
             }
         }
     }
 
-    // [C_out x K] * [K x out_hw] => [C_out x out_hw]
-    Tensor<float> output({N, C_out, out_h, out_w});
+    void conv2d_im2col(const Tensor<float> &input, const float *weight,
+                       const PackedMatrix *packed, const ConvEpilogue &epi,
+                       const ConvShape &cs, const Conv2DParam &param,
+                       Tensor<float> &output)
     {
+        Tensor<float> col = im2col(input, cs.kH, cs.kW,
+                                   param.stride_h, param.stride_w,
+                                   param.pad_h, param.pad_w);
+        int hw = cs.out_h * cs.out_w;
+        // [C_out x K] * [K x out_hw] => [C_out x out_hw]
+        for (int n_i = 0; n_i < cs.N; n_i++)
+        {
+            const float *B = col.data() + (size_t)n_i * cs.K * hw;
+            float *Out = output.data() + (size_t)n_i * cs.C_out * hw;
+            GemmEpilogue ep = epi.image(n_i);
+            if (packed)
+                matmul(*packed, B, Out, hw, &ep);
+            else
+                matmul(weight, B, Out, cs.C_out, cs.K, hw, &ep);
+        }
+    }
+
+    /**
+     * Direct convolution, one output row of kDirectBlock output channels
+     * at a time: for every (ci, kh, kw) the needed input samples are
+     * gathered once into a contiguous, zero-padded row and then FMA'd
+     * into all channels of the block. The accumulators stay in L1 and
+     * the inner loop runs along the output width, so it vectorises.
+     */
+    const int kDirectBlock = 8;
 
-        for (int n_i = 0; n_i < N; n_i++)
+    // acc[cb][0..n) += w[cb * w_stride] * row[0..n) for cb < cb_n
+    typedef void (*DirectRowFn)(int cb_n, const float *w, int w_stride,
+                                const float *row, float *acc, int n);
+
+#define POLY_DIRECT_ROW_BODY                                  \
+    for (int cb = 0; cb < cb_n; cb++)                         \
+    {                                                         \
+        float wv = w[(size_t)cb * w_stride];                  \
+        float *__restrict a = acc + (size_t)cb * n;           \
+        const float *__restrict r = row;                      \
+        for (int i = 0; i < n; i++)                           \
+            a[i] += wv * r[i];                                \
+    }
+
+    void direct_row_generic(int cb_n, const float *w, int w_stride,
+                            const float *row, float *acc, int n)
+    {
+        POLY_DIRECT_ROW_BODY
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    POLY_TARGET("avx2,fma")
+    void direct_row_avx2(int cb_n, const float *w, int w_stride,
+                         const float *row, float *acc, int n)
+    {
+        POLY_DIRECT_ROW_BODY
+    }
+
+    POLY_TARGET("avx512f,fma")
+    void direct_row_avx512(int cb_n, const float *w, int w_stride,
+                           const float *row, float *acc, int n)
+    {
+        POLY_DIRECT_ROW_BODY
+    }
+#endif
+#undef POLY_DIRECT_ROW_BODY
+
+    DirectRowFn direct_row_fn()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        switch (best_isa())
         {
-            const float *B = col.data() + n_i * (K * (out_h * out_w));
-            float *Out = output.data() + n_i * (C_out * out_h * out_w);
+        case IsaLevel::AVX512:
+            return direct_row_avx512;
+        case IsaLevel::AVX2:
+            return direct_row_avx2;
+        default:
+            break;
+        }
+#endif
+        return direct_row_generic;
+    }
 
-            matmul(w2d.data(), B, Out, C_out, K, out_h * out_w);
+    void conv2d_direct(const Tensor<float> &input, const float *weight,
+                       const ConvEpilogue &epi, const ConvShape &cs,
+                       const Conv2DParam &param, Tensor<float> &output)
+    {
+        const int sh = param.stride_h, sw = param.stride_w;
+        const int ph = param.pad_h, pw = param.pad_w;
+        const int hw = cs.out_h * cs.out_w;
+        const int out_w = cs.out_w;
+        const int blocks = (cs.C_out + kDirectBlock - 1) / kDirectBlock;
+        static const DirectRowFn row_fma = direct_row_fn();
+
+        ThreadPool::instance().parallel_for(cs.N * blocks, [&](int task)
+                                            {
+            int n_i = task / blocks;
+            int co0 = (task % blocks) * kDirectBlock;
+            int cb_n = std::min(kDirectBlock, cs.C_out - co0);
+            const float *image = input.data() + (size_t)n_i * cs.C_in * cs.H_in * cs.W_in;
+            float *out = output.data() + ((size_t)n_i * cs.C_out + co0) * hw;
+            GemmEpilogue ep = epi.post(n_i);
 
-            // bias
-            for (int co = 0; co < C_out; co++)
+            // per-thread scratch, reused across calls
+            static thread_local std::vector<float> acc, row;
+            acc.resize((size_t)kDirectBlock * out_w);
+            row.resize(out_w);
+            for (int oh = 0; oh < cs.out_h; oh++)
             {
-                float b = bias[co];
-                float *outptr = Out + co * (out_h * out_w);
-                for (int idx = 0; idx < out_h * out_w; idx++)
+                for (int cb = 0; cb < cb_n; cb++)
+                    std::fill(&acc[cb * out_w], &acc[cb * out_w] + out_w, epi.fused_bias(co0 + cb));
+
+                for (int ci = 0; ci < cs.C_in; ci++)
                 {
-                    outptr[idx] += b;
+                    const float *plane = image + (size_t)ci * cs.H_in * cs.W_in;
+                    for (int kh = 0; kh < cs.kH; kh++)
+                    {
+                        int ih = oh * sh - ph + kh;
+                        if (ih < 0 || ih >= cs.H_in)
+                            continue;
+                        const float *src = plane + ih * cs.W_in;
+                        for (int kw = 0; kw < cs.kW; kw++)
+                        {
+                            for (int ow = 0, iw = kw - pw; ow < out_w; ow++, iw += sw)
+                                row[ow] = (iw >= 0 && iw < cs.W_in) ? src[iw] : 0.f;
+
+                            const float *wp = weight + ((size_t)co0 * cs.C_in + ci) * cs.kH * cs.kW + kh * cs.kW + kw;
+                            row_fma(cb_n, wp, cs.K, row.data(), acc.data(), out_w);
+                        }
+                    }
                 }
+
+                for (int cb = 0; cb < cb_n; cb++)
+                {
+                    float *o = out + (size_t)cb * hw + oh * out_w;
+                    std::memcpy(o, &acc[cb * out_w], sizeof(float) * out_w);
+                    if (epi.needs_post())
+                        apply_epilogue(ep, o, out_w, co0 + cb, oh * out_w, 1, out_w);
+                }
+            } });
+    }
+
+    // ---------------- Winograd F(m x m, 3x3) ----------------
+    // Y = AT [(G g GT) . (BT d B)] A over (m+2) x (m+2) input tiles;
+    // the elementwise product becomes (m+2)^2 GEMMs [C_out, C_in] x
+    // [C_in, tiles], one per transform-domain point.
+    //
+    // The data transforms run on kWinogradLanes horizontally adjacent
+    // tiles at once: every value below is a vector of lanes, so the
+    // 1-D transforms vectorise and V / M are read and written in runs.
+    const int kWinogradLanes = 8;
+
+    template <int M>
+    struct WinogradF;
+
+    template <>
+    struct WinogradF<2>
+    {
+        enum { alpha = 4 };
+        static const float G[4][3];
+
+        // y = BT x over alpha rows of lanes, row strides xs / ys
+        static void input_1d(const float *x, int xs, float *y, int ys)
+        {
+            const int L = kWinogradLanes;
+            for (int l = 0; l < L; l++)
+            {
+                float x0 = x[l], x1 = x[xs + l], x2 = x[2 * xs + l], x3 = x[3 * xs + l];
+                y[l] = x0 - x2;
+                y[ys + l] = x1 + x2;
+                y[2 * ys + l] = x2 - x1;
+                y[3 * ys + l] = x1 - x3;
             }
         }
+
+        // y = AT x: alpha rows in, m rows out
+        static void output_1d(const float *x, int xs, float *y, int ys)
+        {
+            const int L = kWinogradLanes;
+            for (int l = 0; l < L; l++)
+            {
+                float x0 = x[l], x1 = x[xs + l], x2 = x[2 * xs + l], x3 = x[3 * xs + l];
+                y[l] = x0 + x1 + x2;
+                y[ys + l] = x1 - x2 - x3;
+            }
+        }
+    };
+
+    const float WinogradF<2>::G[4][3] = {
+        {1.f, 0.f, 0.f},
+        {0.5f, 0.5f, 0.5f},
+        {0.5f, -0.5f, 0.5f},
+        {0.f, 0.f, 1.f}};
+
+    template <>
+    struct WinogradF<4>
+    {
+        enum { alpha = 6 };
+        static const float G[6][3];
+
+        static void input_1d(const float *x, int xs, float *y, int ys)
+        {
+            const int L = kWinogradLanes;
+            for (int l = 0; l < L; l++)
+            {
+                float x0 = x[l], x1 = x[xs + l], x2 = x[2 * xs + l];
+                float x3 = x[3 * xs + l], x4 = x[4 * xs + l], x5 = x[5 * xs + l];
+                float a = x4 - 4.f * x2;
+                float b = x3 - 4.f * x1;
+                float c = x4 - x2;
+                float d = 2.f * (x3 - x1);
+                y[l] = 4.f * x0 - 5.f * x2 + x4;
+                y[ys + l] = a + b;
+                y[2 * ys + l] = a - b;
+                y[3 * ys + l] = c + d;
+                y[4 * ys + l] = c - d;
+                y[5 * ys + l] = 4.f * x1 - 5.f * x3 + x5;
+            }
+        }
+
+        static void output_1d(const float *x, int xs, float *y, int ys)
+        {
+            const int L = kWinogradLanes;
+            for (int l = 0; l < L; l++)
+            {
+                float x0 = x[l], x1 = x[xs + l], x2 = x[2 * xs + l];
+                float x3 = x[3 * xs + l], x4 = x[4 * xs + l], x5 = x[5 * xs + l];
+                float s12 = x1 + x2, d12 = x1 - x2;
+                float s34 = x3 + x4, d34 = x3 - x4;
+                y[l] = x0 + s12 + s34;
+                y[ys + l] = d12 + 2.f * d34;
+                y[2 * ys + l] = s12 + 4.f * s34;
+                y[3 * ys + l] = d12 + 8.f * d34 + x5;
+            }
+        }
+    };
+
+    const float WinogradF<4>::G[6][3] = {
+        {1.f / 4, 0.f, 0.f},
+        {-1.f / 6, -1.f / 6, -1.f / 6},
+        {-1.f / 6, 1.f / 6, -1.f / 6},
+        {1.f / 24, 1.f / 12, 1.f / 6},
+        {1.f / 24, -1.f / 12, 1.f / 6},
+        {0.f, 0.f, 1.f}};
+
+    bool winograd_fits(int kH, int kW, const Conv2DParam &param)
+    {
+        return kH == 3 && kW == 3 && param.stride_h == 1 && param.stride_w == 1;
     }
 
-    return output;
-}
+    bool winograd_preferred(int C_in, int C_out, int kH, int kW, const Conv2DParam &param)
+    {
+        return winograd_fits(kH, kW, param) &&
+               C_in >= kConv2DWinogradMinChannels && C_out >= kConv2DWinogradMinChannels;
+    }
 
-Tensor<float> depthwise_conv2d_im2col(const Tensor<float> &input,
-                                      const Tensor<float> &weight,
-                                      const std::vector<float> &bias,
-                                      int stride_h, int stride_w,
-                                      int pad_h, int pad_w)
-{
-    // input shape: [N, C_in, H_in, W_in]
-    int N = input.shape()[0];
-    int C_in = input.shape()[1];
-    int H_in = input.shape()[2];
-    int W_in = input.shape()[3];
+    int winograd_tile_of(Conv2DAlgo algo)
+    {
+        return algo == Conv2DAlgo::WINOGRAD_F2 ? 2 : 4;
+    }
 
-    // weight shape: [C_in, 1, kH, kW]
-    int kH = weight.shape()[2];
-    int kW = weight.shape()[3];
+    int winograd_tiles(const ConvShape &cs, int tile)
+    {
+        return cs.N * ((cs.out_h + tile - 1) / tile) * ((cs.out_w + tile - 1) / tile);
+    }
+
+    // u[xi * u_stride] = (G g GT)[xi] for one 3x3 filter g
+    template <int M>
+    void winograd_weight_tile(const float *g, float *u, size_t u_stride)
+    {
+        typedef WinogradF<M> F;
+        const int A = F::alpha;
+        float t[A][3];
+        for (int i = 0; i < A; i++)
+            for (int j = 0; j < 3; j++)
+                t[i][j] = F::G[i][0] * g[j] + F::G[i][1] * g[3 + j] + F::G[i][2] * g[6 + j];
+        for (int i = 0; i < A; i++)
+            for (int j = 0; j < A; j++)
+                u[(i * A + j) * u_stride] = t[i][0] * F::G[j][0] + t[i][1] * F::G[j][1] + t[i][2] * F::G[j][2];
+    }
+
+    template <int M>
+    std::vector<PackedMatrix> winograd_weights_impl(const float *weight, int C_out, int C_in,
+                                                    WeightPrecision precision)
+    {
+        const int AA = WinogradF<M>::alpha * WinogradF<M>::alpha;
+        const size_t plane = (size_t)C_out * C_in;
+        std::vector<float> u(AA * plane);
+        for (int co = 0; co < C_out; co++)
+            for (int ci = 0; ci < C_in; ci++)
+                winograd_weight_tile<M>(weight + ((size_t)co * C_in + ci) * 9,
+                                        u.data() + (size_t)co * C_in + ci, plane);
 
-    // 卷积输出大小
-    int out_h = (H_in + 2 * pad_h - kH) / stride_h + 1;
-    int out_w = (W_in + 2 * pad_w - kW) / stride_w + 1;
+        std::vector<PackedMatrix> packed(AA);
+        for (int xi = 0; xi < AA; xi++)
+            packed[xi] = PackedMatrix::pack_a(u.data() + xi * plane, C_out, C_in, C_in, precision);
+        return packed;
+    }
 
-    // im2col => col shape = [N, (C_in*kH*kW), (out_h*out_w)]
-    Tensor<float> col = im2col(input, kH, kW, stride_h, stride_w, pad_h, pad_w);
+    std::vector<PackedMatrix> winograd_weights(const float *weight, int C_out, int C_in, int tile,
+                                               WeightPrecision precision = WeightPrecision::FP32)
+    {
+        if (tile == 2)
+            return winograd_weights_impl<2>(weight, C_out, C_in, precision);
+        return winograd_weights_impl<4>(weight, C_out, C_in, precision);
+    }
 
-    // col.shape = [N, (C_in*kH*kW), (out_h*out_w)]
+    template <int M>
+    void conv2d_winograd(const Tensor<float> &input, const std::vector<PackedMatrix> &U,
+                         const ConvEpilogue &epi, const ConvShape &cs,
+                         const Conv2DParam &param, Tensor<float> &output)
+    {
+        typedef WinogradF<M> F;
+        const int A = F::alpha;
+        const int AA = A * A;
+        const int L = kWinogradLanes;
+        const int tiles_h = (cs.out_h + M - 1) / M;
+        const int tiles_w = (cs.out_w + M - 1) / M;
+        const int tiles = tiles_h * tiles_w;
+        const int T = cs.N * tiles; // tiles of all images share the GEMMs
+        const int H = cs.H_in, W = cs.W_in;
 
-    //    weight[c_in, 0, :, :] => flatten => W_c( [1, kH*kW] )
-    //    col_for_c: shape [N, kH*kW, out_h*out_w]
+        Tensor<float> V({AA, cs.C_in, T}, TensorInit::UNINITIALIZED);
+        Tensor<float> Mt({AA, cs.C_out, T}, TensorInit::UNINITIALIZED);
+        ThreadPool &pool = ThreadPool::instance();
 
-    Tensor<float> output(std::vector<int>{N, C_in, out_h, out_w});
+        // V[xi][ci][t] = (BT d B)[xi]
+        pool.parallel_for(cs.N * cs.C_in, [&](int task)
+                          {
+            int n_i = task / cs.C_in;
+            int ci = task % cs.C_in;
+            const float *plane = input.data() + ((size_t)n_i * cs.C_in + ci) * H * W;
+            float *v_out = V.data() + (size_t)ci * T + n_i * tiles;
+            const size_t v_stride = (size_t)cs.C_in * T;
+            float d[A][A][L], r[A][A][L], v[A][L];
+            for (int ty = 0; ty < tiles_h; ty++)
+            {
+                int ih0 = ty * M - param.pad_h;
+                for (int tx0 = 0; tx0 < tiles_w; tx0 += L)
+                {
+                    int lanes = std::min(L, tiles_w - tx0);
+                    int iw0 = tx0 * M - param.pad_w;
+                    bool cols_in = iw0 >= 0 && iw0 + (lanes - 1) * M + A <= W;
+                    for (int i = 0; i < A; i++)
+                    {
+                        int ih = ih0 + i;
+                        const float *src = plane + ih * W + iw0;
+                        if (ih < 0 || ih >= H)
+                        {
+                            std::memset(d[i], 0, sizeof(d[i]));
+                        }
+                        else if (cols_in && lanes == L)
+                        {
+                            for (int j = 0; j < A; j++)
+                                for (int l = 0; l < L; l++)
+                                    d[i][j][l] = src[l * M + j];
+                        }
+                        else
+                        {
+                            for (int j = 0; j < A; j++)
+                                for (int l = 0; l < L; l++)
+                                {
+                                    int iw = iw0 + l * M + j;
+                                    d[i][j][l] = (l < lanes && iw >= 0 && iw < W) ? src[l * M + j] : 0.f;
+                                }
+                        }
+                        // rows: r[i] = d[i] B
+                        F::input_1d(d[i][0], L, r[i][0], L);
+                    }
+                    // columns: v = BT r, one transform-domain column at a time
+                    float *dst = v_out + ty * tiles_w + tx0;
+                    for (int j = 0; j < A; j++)
+                    {
+                        F::input_1d(r[0][j], A * L, v[0], L);
+                        for (int i = 0; i < A; i++)
+                            std::memcpy(dst + (i * A + j) * v_stride, v[i], sizeof(float) * lanes);
+                    }
+                }
+            } });
+
+        // one GEMM per transform point; they run side by side on the pool
+        pool.parallel_for(AA, [&](int xi)
+                          { matmul(U[xi], V.data() + (size_t)xi * cs.C_in * T,
+                                   Mt.data() + (size_t)xi * cs.C_out * T, T); });
+
+        // y = AT m A, cropped to the output, then the epilogue on the
+        // finished plane while it is still in cache
+        pool.parallel_for(cs.N * cs.C_out, [&](int task)
+                          {
+            int n_i = task / cs.C_out;
+            int co = task % cs.C_out;
+            const float *m_in = Mt.data() + (size_t)co * T + n_i * tiles;
+            const size_t m_stride = (size_t)cs.C_out * T;
+            float *out = output.data() + ((size_t)n_i * cs.C_out + co) * cs.out_h * cs.out_w;
+            const float b = epi.fused_bias(co);
+            float m[A][A][L], t[M][A][L], y[M][M][L];
+            for (int ty = 0; ty < tiles_h; ty++)
+            {
+                int oh0 = ty * M;
+                int rows = std::min(M, cs.out_h - oh0);
+                for (int tx0 = 0; tx0 < tiles_w; tx0 += L)
+                {
+                    int lanes = std::min(L, tiles_w - tx0);
+                    const float *src = m_in + ty * tiles_w + tx0;
+                    for (int i = 0; i < A; i++)
+                        for (int j = 0; j < A; j++)
+                        {
+                            std::memcpy(m[i][j], src + (i * A + j) * m_stride, sizeof(float) * lanes);
+                            std::fill(m[i][j] + lanes, m[i][j] + L, 0.f);
+                        }
+                    // columns: t = AT m
+                    for (int j = 0; j < A; j++)
+                        F::output_1d(m[0][j], A * L, t[0][j], A * L);
+                    // rows: y[i] = t[i] A
+                    for (int i = 0; i < rows; i++)
+                        F::output_1d(t[i][0], L, y[i][0], L);
+
+                    int ow0 = tx0 * M;
+                    for (int i = 0; i < rows; i++)
+                    {
+                        float *dst = out + (oh0 + i) * cs.out_w + ow0;
+                        int cols = std::min(lanes * M, cs.out_w - ow0);
+                        for (int c = 0; c < cols; c++)
+                            dst[c] = y[i][c % M][c / M] + b;
+                    }
+                }
+            }
+            if (epi.needs_post())
+            {
+                GemmEpilogue ep = epi.post(n_i);
+                int hw = cs.out_h * cs.out_w;
+                apply_epilogue(ep, out, hw, co, 0, 1, hw);
+            } });
+    }
 
-    std::vector<float> w_c;
-    w_c.resize(kH * kW);
+    /**
+     * AUTO:
+     *   - direct kernel for single-output-channel convs, where a GEMM
+     *     tile would be almost all padding. It streams its accumulators
+     *     through L1 rather than registers, so it loses to the GEMM as
+     *     soon as C_out fills a few micro-kernel rows, even for the
+     *     K = 27 stem convs;
+     *   - Winograd for 3x3 stride-1 convs with enough channels and
+     *     output tiles: the tile the packed weight was transformed for,
+     *     F(4x4) for raw weights;
+     *   - implicit GEMM everywhere else.
+     */
+    Conv2DAlgo choose_algo(const ConvShape &cs, const Conv2DParam &param,
+                           const PackedConv2DWeight *pw)
+    {
+        if (param.algo != Conv2DAlgo::AUTO)
+            return param.algo;
+        if (cs.C_out <= kConv2DDirectMaxOut)
+            return Conv2DAlgo::DIRECT;
+        if (winograd_preferred(cs.C_in, cs.C_out, cs.kH, cs.kW, param))
+        {
+            int tile = pw ? pw->winograd_tile : 4;
+            if (tile && winograd_tiles(cs, tile) >= kConv2DWinogradMinTiles)
+                return tile == 2 ? Conv2DAlgo::WINOGRAD_F2 : Conv2DAlgo::WINOGRAD_F4;
+        }
+        return Conv2DAlgo::IMPLICIT_GEMM;
+    }
 
-    for (int c = 0; c < C_in; c++)
+    // `weight` (raw) or `pw` (packed) may be null, not both
+    void conv2d_dispatch(const Tensor<float> &input,
+                         const float *weight, const PackedConv2DWeight *pw,
+                         int C_out, int kH, int kW,
+                         const std::vector<float> &bias,
+                         const Conv2DParam &param,
+                         const Conv2DEpilogue &epilogue,
+                         Tensor<float> &output)
     {
+        ConvShape cs = conv_shape(input, C_out, kH, kW, param);
+        output.ensure_shape({cs.N, C_out, cs.out_h, cs.out_w});
+        if (epilogue.residual && epilogue.residual->total_size() != output.total_size())
+        {
+            throw std::runtime_error("conv2d: residual does not match the output shape");
+        }
+        ConvEpilogue epi(bias, epilogue, C_out, cs.out_h * cs.out_w);
 
-        const float *wptr = weight.data() + c * kH * kW;
-        for (int i = 0; i < kH * kW; i++)
+        Conv2DAlgo algo = choose_algo(cs, param, pw);
+        bool winograd = algo == Conv2DAlgo::WINOGRAD_F2 || algo == Conv2DAlgo::WINOGRAD_F4;
+        int tile = winograd_tile_of(algo);
+        if (winograd && !winograd_fits(kH, kW, param))
         {
-            w_c[i] = wptr[i];
+            throw std::runtime_error("conv2d: Winograd needs a 3x3 stride-1 conv");
         }
 
-        float b_c = bias[c];
+        // each path wants the weight in its own form; build what is missing
+        const PackedMatrix *packed = pw ? &pw->gemm : nullptr;
+        const std::vector<PackedMatrix> *transformed =
+            (pw && pw->winograd_tile == tile) ? &pw->winograd : nullptr;
+        std::vector<float> unpacked;
+        bool need_raw = (algo == Conv2DAlgo::DIRECT) || (winograd && !transformed);
+        if (need_raw && !weight)
+        {
+            unpacked.resize((size_t)C_out * cs.K);
+            packed->unpack(unpacked.data());
+            weight = unpacked.data();
+        }
+        PackedMatrix packed_here;
+        if (algo == Conv2DAlgo::IMPLICIT_GEMM && !packed)
+        {
+            packed_here = PackedMatrix::pack_a(weight, C_out, cs.K, cs.K);
+            packed = &packed_here;
+        }
+        std::vector<PackedMatrix> transformed_here;
+        if (winograd && !transformed)
+        {
+            transformed_here = winograd_weights(weight, C_out, cs.C_in, tile);
+            transformed = &transformed_here;
+        }
 
-        for (int n_i = 0; n_i < N; n_i++)
+        switch (algo)
         {
-            int row_offset = c * kH * kW;
-            const float *col_base_n = col.data() + n_i * (col.shape()[1] * col.shape()[2]);
-            const float *col_for_c = col_base_n + row_offset * (out_h * out_w);
+        case Conv2DAlgo::DIRECT:
+            conv2d_direct(input, weight, epi, cs, param, output);
+            break;
+        case Conv2DAlgo::IM2COL:
+            conv2d_im2col(input, weight, packed, epi, cs, param, output);
+            break;
+        case Conv2DAlgo::WINOGRAD_F2:
+            conv2d_winograd<2>(input, *transformed, epi, cs, param, output);
+            break;
+        case Conv2DAlgo::WINOGRAD_F4:
+            conv2d_winograd<4>(input, *transformed, epi, cs, param, output);
+            break;
+        default:
+            conv2d_implicit(input, *packed, epi, cs, param, output);
+            break;
+        }
+    }
+
+    // ---------------- depthwise ----------------
+    // One output row segment of a 3x3 depthwise conv away from the
+    // borders: out[i] = b + sum w[kh][kw] * r_kh[i * S + kw].
+    typedef void (*DwRowFn)(const float *r0, const float *r1, const float *r2,
+                            const float *w, float b, float *out, int n);
 
-            float *out_ptr = output.data() + (n_i * C_in * out_h * out_w + c * out_h * out_w);
+#define POLY_DW_ROW_BODY(S)                                                 \
+    const float w00 = w[0], w01 = w[1], w02 = w[2];                         \
+    const float w10 = w[3], w11 = w[4], w12 = w[5];                         \
+    const float w20 = w[6], w21 = w[7], w22 = w[8];                         \
+    float *__restrict o = out;                                              \
+    for (int i = 0; i < n; i++)                                             \
+    {                                                                       \
+        const int j = i * S;                                                \
+        o[i] = b + w00 * r0[j] + w01 * r0[j + 1] + w02 * r0[j + 2] +        \
+               w10 * r1[j] + w11 * r1[j + 1] + w12 * r1[j + 2] +            \
+               w20 * r2[j] + w21 * r2[j + 1] + w22 * r2[j + 2];             \
+    }
 
-            // [1, kH*kW] * [kH*kW, out_h*out_w] => [1, out_h*out_w]
-            std::vector<float> temp_out(out_h * out_w, 0.f);
+#define POLY_DW_ROW_FN(name, S, target)                                     \
+    target void name(const float *r0, const float *r1, const float *r2,     \
+                     const float *w, float b, float *out, int n)            \
+    {                                                                       \
+        POLY_DW_ROW_BODY(S)                                                 \
+    }
 
-            matmul(w_c.data(), col_for_c, temp_out.data(), 1, kH * kW, out_h * out_w);
-            // bias
-            for (int idx = 0; idx < out_h * out_w; idx++)
-                temp_out[idx] += b_c;
+    POLY_DW_ROW_FN(dw_row_s1_generic, 1, )
+    POLY_DW_ROW_FN(dw_row_s2_generic, 2, )
+#if defined(__x86_64__) || defined(__i386__)
+    POLY_DW_ROW_FN(dw_row_s1_avx2, 1, POLY_TARGET("avx2,fma"))
+    POLY_DW_ROW_FN(dw_row_s2_avx2, 2, POLY_TARGET("avx2,fma"))
+    POLY_DW_ROW_FN(dw_row_s1_avx512, 1, POLY_TARGET("avx512f,fma"))
+    POLY_DW_ROW_FN(dw_row_s2_avx512, 2, POLY_TARGET("avx512f,fma"))
+#endif
+#undef POLY_DW_ROW_FN
+#undef POLY_DW_ROW_BODY
 
-            // out(n_i,c,oh,ow) => out_ptr[ oh*out_w + ow ]
-            for (int idx = 0; idx < out_h * out_w; idx++)
-                out_ptr[idx] = temp_out[idx];
+    // interior row kernel for stride 1 / 2, picked once from the ISA
+    DwRowFn dw_row_fn(int stride)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        switch (best_isa())
+        {
+        case IsaLevel::AVX512:
+            return stride == 1 ? dw_row_s1_avx512 : dw_row_s2_avx512;
+        case IsaLevel::AVX2:
+            return stride == 1 ? dw_row_s1_avx2 : dw_row_s2_avx2;
+        default:
+            break;
         }
+#endif
+        return stride == 1 ? dw_row_s1_generic : dw_row_s2_generic;
+    }
+
+    // one output pixel, skipping taps that fall into the padding
+    inline float dw_pixel(const float *plane, int H, int W, const float *w,
+                          int kH, int kW, float b, int ih0, int iw0)
+    {
+        float acc = b;
+        for (int kh = 0; kh < kH; kh++)
+        {
+            int ih = ih0 + kh;
+            if (ih < 0 || ih >= H)
+                continue;
+            for (int kw = 0; kw < kW; kw++)
+            {
+                int iw = iw0 + kw;
+                if (iw >= 0 && iw < W)
+                    acc += w[kh * kW + kw] * plane[ih * W + iw];
+            }
+        }
+        return acc;
+    }
+
+    // first / one-past-last output index whose taps are all inside [0, size)
+    void interior_range(int size, int k, int stride, int pad, int out_size,
+                        int &lo, int &hi)
+    {
+        lo = std::min(out_size, (pad + stride - 1) / stride);
+        hi = size + pad - k >= 0 ? (size + pad - k) / stride + 1 : 0;
+        hi = std::max(lo, std::min(out_size, hi));
+    }
+
+    /**
+     * One channel plane of a depthwise conv, written straight into the
+     * output with the bias folded in. 3x3 convs with stride 1 or 2 run
+     * the vectorised row kernel on the interior; border rows / columns
+     * (and every other shape) take the checked per-pixel loop.
+     */
+    void depthwise_plane(const float *plane, int H, int W, const float *w,
+                         int kH, int kW, float b, const DepthwiseConv2DParam &p,
+                         float *out, int out_h, int out_w)
+    {
+        const int sh = p.stride_h, sw = p.stride_w;
+        bool fast = kH == 3 && kW == 3 && sh == sw && (sh == 1 || sh == 2);
+        int oh_lo = 0, oh_hi = 0, ow_lo = 0, ow_hi = 0;
+        if (fast)
+        {
+            interior_range(H, kH, sh, p.pad_h, out_h, oh_lo, oh_hi);
+            interior_range(W, kW, sw, p.pad_w, out_w, ow_lo, ow_hi);
+        }
+        static const DwRowFn row_s1 = dw_row_fn(1);
+        static const DwRowFn row_s2 = dw_row_fn(2);
+        const DwRowFn row = sh == 1 ? row_s1 : row_s2;
+
+        for (int oh = 0; oh < out_h; oh++)
+        {
+            float *o = out + oh * out_w;
+            int ih0 = oh * sh - p.pad_h;
+            if (oh < oh_lo || oh >= oh_hi)
+            {
+                for (int ow = 0; ow < out_w; ow++)
+                    o[ow] = dw_pixel(plane, H, W, w, kH, kW, b, ih0, ow * sw - p.pad_w);
+                continue;
+            }
+            for (int ow = 0; ow < ow_lo; ow++)
+                o[ow] = dw_pixel(plane, H, W, w, kH, kW, b, ih0, ow * sw - p.pad_w);
+            if (ow_hi > ow_lo)
+            {
+                const float *r0 = plane + ih0 * W + ow_lo * sw - p.pad_w;
+                row(r0, r0 + W, r0 + 2 * W, w, b, o + ow_lo, ow_hi - ow_lo);
+            }
+            for (int ow = ow_hi; ow < out_w; ow++)
+                o[ow] = dw_pixel(plane, H, W, w, kH, kW, b, ih0, ow * sw - p.pad_w);
+        }
+    }
+}
+
+PackedConv2DWeight pack_conv2d_weight(const Tensor<float> &weight, const Conv2DParam &param,
+                                      TensorLayout layout, WeightPrecision precision)
+{
+    PackedConv2DWeight pw;
+    pw.out_channels = weight.shape()[0];
+    pw.in_channels = weight.shape()[1];
+    pw.kernel_h = weight.shape()[2];
+    pw.kernel_w = weight.shape()[3];
+    pw.layout = layout;
+    if (layout != TensorLayout::NCHW)
+    {
+        pack_conv2d_weight_layout(weight, pw, precision);
+        return pw;
+    }
+    int K = pw.in_channels * pw.kernel_h * pw.kernel_w;
+    pw.gemm = PackedMatrix::pack_a(weight.data(), pw.out_channels, K, K, precision);
+    if (pw.out_channels <= kConv2DDirectMaxOut)
+    {
+        pw.direct = weight;
+    }
+
+    bool winograd = false;
+    if (param.algo == Conv2DAlgo::WINOGRAD_F2 || param.algo == Conv2DAlgo::WINOGRAD_F4)
+    {
+        winograd = winograd_fits(pw.kernel_h, pw.kernel_w, param);
+    }
+    else if (param.algo == Conv2DAlgo::AUTO)
+    {
+        winograd = pw.out_channels > kConv2DDirectMaxOut &&
+                   winograd_preferred(pw.in_channels, pw.out_channels,
+                                      pw.kernel_h, pw.kernel_w, param);
+    }
+    if (winograd)
+    {
+        pw.winograd_tile = winograd_tile_of(param.algo);
+        pw.winograd = winograd_weights(weight.data(), pw.out_channels,
+                                       pw.in_channels, pw.winograd_tile, precision);
+    }
+    return pw;
+}
+
+Tensor<float> unpack_conv2d_weight(const PackedConv2DWeight &weight)
+{
+    if (weight.direct.total_size() > 0)
+    {
+        return weight.direct;
+    }
+    Tensor<float> raw({weight.out_channels, weight.in_channels,
+                       weight.kernel_h, weight.kernel_w},
+                      TensorInit::UNINITIALIZED);
+    if (weight.layout == TensorLayout::NCHW)
+        weight.gemm.unpack(raw.data());
+    else
+        unpack_conv2d_weight_layout(weight, raw.data());
+    return raw;
+}
+
+void plan_io(PlanArchive &ar, const std::string &prefix, PackedConv2DWeight &weight)
+{
+    ar.io(prefix + ".out_channels", weight.out_channels);
+    ar.io(prefix + ".in_channels", weight.in_channels);
+    ar.io(prefix + ".kernel_h", weight.kernel_h);
+    ar.io(prefix + ".kernel_w", weight.kernel_w);
+    ar.io_enum(prefix + ".layout", weight.layout);
+    ar.io(prefix + ".gemm", weight.gemm);
+    ar.io(prefix + ".blocked", weight.blocked);
+    ar.io(prefix + ".direct", weight.direct);
+    ar.io(prefix + ".winograd_tile", weight.winograd_tile);
+    int n = (int)weight.winograd.size();
+    ar.io(prefix + ".winograd.count", n);
+    weight.winograd.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        ar.io(prefix + ".winograd." + std::to_string(i), weight.winograd[i]);
     }
+}
+
+TensorLayout conv2d_blocked_layout()
+{
+    return best_isa() == IsaLevel::AVX512 ? TensorLayout::NCHW16c : TensorLayout::NCHW8c;
+}
+
+Conv2DEpilogue conv2d_epilogue(const BNAffine &bn, Activation act,
+                               const Tensor<float> *residual)
+{
+    Conv2DEpilogue e;
+    if (!bn.scale.empty())
+    {
+        e.scale = bn.scale.data();
+        e.shift = bn.shift.data();
+    }
+    e.residual = residual;
+    e.act = act;
+    return e;
+}
+
+BNAffine conv2d_bn_affine(const std::vector<float> &bias, const BNParam &bn,
+                          std::vector<float> &folded_bias)
+{
+    BNAffine a = batchnorm_affine(bn);
+    for (size_t c = 0; c < a.shift.size() && c < bias.size(); c++)
+    {
+        a.shift[c] += bias[c] * a.scale[c];
+    }
+    folded_bias.clear();
+    return a;
+}
+
+PackedConv2DWeight pack_conv2d_weight_bn(const Tensor<float> &weight,
+                                         const std::vector<float> &bias,
+                                         const BNParam &bn,
+                                         std::vector<float> &folded_bias,
+                                         const Conv2DParam &param,
+                                         TensorLayout layout,
+                                         WeightPrecision precision)
+{
+    Tensor<float> folded;
+    fold_batchnorm(weight, bias, bn, folded, folded_bias);
+    return pack_conv2d_weight(folded, param, layout, precision);
+}
 
+Tensor<float> conv2d(const Tensor<float> &input,
+                     const Tensor<float> &weight,
+                     const std::vector<float> &bias,
+                     const Conv2DParam &param,
+                     const Conv2DEpilogue &epilogue)
+{
+    Tensor<float> output;
+    conv2d_into(input, weight, bias, param, output, epilogue);
     return output;
-}
\ No newline at end of file
+}
+
+Tensor<float> conv2d(const Tensor<float> &input,
+                     const PackedConv2DWeight &weight,
+                     const std::vector<float> &bias,
+                     const Conv2DParam &param,
+                     const Conv2DEpilogue &epilogue)
+{
+    Tensor<float> output;
+    conv2d_into(input, weight, bias, param, output, epilogue);
+    return output;
+}
+
+void conv2d_into(const Tensor<float> &input,
+                 const Tensor<float> &weight,
+                 const std::vector<float> &bias,
+                 const Conv2DParam &param,
+                 Tensor<float> &output,
+                 const Conv2DEpilogue &epilogue)
+{
+    if (input.layout() != TensorLayout::NCHW)
+    {
+        conv2d_layout_into(input, pack_conv2d_weight(weight, param, input.layout()),
+                           bias, param, output, epilogue);
+        return;
+    }
+    conv2d_dispatch(input.contiguous(), weight.data(), nullptr,
+                    weight.shape()[0], weight.shape()[2], weight.shape()[3],
+                    bias, param, epilogue, output);
+}
+
+void conv2d_into(const Tensor<float> &input,
+                 const PackedConv2DWeight &weight,
+                 const std::vector<float> &bias,
+                 const Conv2DParam &param,
+                 Tensor<float> &output,
+                 const Conv2DEpilogue &epilogue)
+{
+    if (input.shape()[1] != weight.in_channels)
+    {
+        throw std::runtime_error("conv2d: input channels do not match packed weight");
+    }
+    if (weight.layout != input.layout())
+    {
+        conv2d_into(input, unpack_conv2d_weight(weight), bias, param, output, epilogue);
+        return;
+    }
+    if (input.layout() != TensorLayout::NCHW)
+    {
+        conv2d_layout_into(input, weight, bias, param, output, epilogue);
+        return;
+    }
+    const float *raw = weight.direct.total_size() > 0 ? weight.direct.data() : nullptr;
+    conv2d_dispatch(input.contiguous(), raw, &weight,
+                    weight.out_channels, weight.kernel_h, weight.kernel_w,
+                    bias, param, epilogue, output);
+}
+
+Conv2DError conv2d_winograd_error(const Tensor<float> &input,
+                                  const Tensor<float> &weight,
+                                  const std::vector<float> &bias,
+                                  const Conv2DParam &param, int tile)
+{
+    if (tile != 2 && tile != 4)
+    {
+        throw std::runtime_error("conv2d_winograd_error: tile must be 2 or 4");
+    }
+    Conv2DParam p_ref = param;
+    p_ref.algo = Conv2DAlgo::DIRECT;
+    Conv2DParam p_win = param;
+    p_win.algo = tile == 2 ? Conv2DAlgo::WINOGRAD_F2 : Conv2DAlgo::WINOGRAD_F4;
+
+    Tensor<float> in = input.contiguous();
+    Tensor<float> ref = conv2d(in, weight, bias, p_ref);
+    Tensor<float> out = conv2d(in, weight, bias, p_win);
+
+    float max_ref = 0.f;
+    Conv2DError err;
+    for (int i = 0; i < ref.total_size(); i++)
+    {
+        max_ref = std::max(max_ref, std::fabs(ref[i]));
+        err.max_abs = std::max(err.max_abs, std::fabs(out[i] - ref[i]));
+    }
+    err.max_rel = max_ref > 0.f ? err.max_abs / max_ref : 0.f;
+    return err;
+}
+
+Tensor<float> depthwise_conv2d(const Tensor<float> &input,
+                               const Tensor<float> &weight,
+                               const std::vector<float> &bias,
+                               const DepthwiseConv2DParam &param,
+                               const Conv2DEpilogue &epilogue)
+{
+    Tensor<float> output;
+    depthwise_conv2d_into(input, weight, bias, param, output, epilogue);
+    return output;
+}
+
+void depthwise_conv2d_into(const Tensor<float> &input,
+                           const Tensor<float> &weight,
+                           const std::vector<float> &bias,
+                           const DepthwiseConv2DParam &param,
+                           Tensor<float> &output,
+                           const Conv2DEpilogue &epilogue)
+{
+    if (input.layout() != TensorLayout::NCHW)
+    {
+        depthwise_conv2d_layout_into(input, weight, bias, param, output, epilogue);
+        return;
+    }
+    int N = input.shape()[0];
+    int C = input.shape()[1];
+    int H = input.shape()[2];
+    int W = input.shape()[3];
+    Tensor<float> in = input.contiguous();
+
+    // weight shape: [C, 1, kH, kW]
+    if (weight.shape()[0] != C || weight.shape()[1] != 1)
+    {
+        throw std::runtime_error("depthwise_conv2d: weight must be [C, 1, kH, kW]");
+    }
+    int kH = weight.shape()[2];
+    int kW = weight.shape()[3];
+
+    int out_h = (H + 2 * param.pad_h - kH) / param.stride_h + 1;
+    int out_w = (W + 2 * param.pad_w - kW) / param.stride_w + 1;
+    output.ensure_shape({N, C, out_h, out_w});
+    if (epilogue.residual && epilogue.residual->total_size() != output.total_size())
+    {
+        throw std::runtime_error("depthwise_conv2d: residual does not match the output shape");
+    }
+    ConvEpilogue epi(bias, epilogue, C, out_h * out_w);
+
+    ThreadPool::instance().parallel_for(N * C, [&](int task)
+                                        {
+        int n_i = task / C;
+        int c = task % C;
+        const float *plane = in.data() + (size_t)task * H * W;
+        float *out = output.data() + (size_t)task * out_h * out_w;
+        depthwise_plane(plane, H, W, weight.data() + c * kH * kW, kH, kW,
+                        epi.fused_bias(c), param, out, out_h, out_w);
+        if (epi.needs_post())
+        {
+            GemmEpilogue ep = epi.post(n_i);
+            apply_epilogue(ep, out, out_h * out_w, c, 0, 1, out_h * out_w);
+        } });
+}
+
+Tensor<float> depthwise_conv2d_im2col(const Tensor<float> &input,
+                                      const Tensor<float> &weight,
+                                      const std::vector<float> &bias,
+                                      int stride_h, int stride_w,
+                                      int pad_h, int pad_w)
+{
+    DepthwiseConv2DParam param;
+    param.stride_h = stride_h;
+    param.stride_w = stride_w;
+    param.pad_h = pad_h;
+    param.pad_w = pad_w;
+    return depthwise_conv2d(input, weight, bias, param);
+}
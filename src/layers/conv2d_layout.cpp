@@ -0,0 +1,783 @@
+#include "layers/conv2d_layout.hpp"
+#include "common/time_utils.hpp"
+#include "common/thread_pool.hpp"
+#include "common/cpu_features.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POLY_X86 1
+#define POLY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define POLY_TARGET(isa)
+#endif
+
+namespace
+{
+    struct LayoutConvShape
+    {
+        int N, C_in, H_in, W_in;
+        int C_out, kH, kW;
+        int out_h, out_w;
+        // channels per block and blocks (NHWC: all channels, one block)
+        int lanes_in, blocks_in;
+        int lanes_out, blocks_out;
+    };
+
+    LayoutConvShape layout_conv_shape(const Tensor<float> &input, int C_out, int kH, int kW,
+                                      int stride_h, int stride_w, int pad_h, int pad_w)
+    {
+        LayoutConvShape cs;
+        cs.N = input.shape()[0];
+        cs.C_in = input.shape()[1];
+        cs.H_in = input.shape()[2];
+        cs.W_in = input.shape()[3];
+        cs.C_out = C_out;
+        cs.kH = kH;
+        cs.kW = kW;
+        cs.out_h = (cs.H_in + 2 * pad_h - kH) / stride_h + 1;
+        cs.out_w = (cs.W_in + 2 * pad_w - kW) / stride_w + 1;
+        cs.lanes_in = layout_lanes(input.layout(), cs.C_in);
+        cs.blocks_in = (cs.C_in + cs.lanes_in - 1) / cs.lanes_in;
+        cs.lanes_out = layout_lanes(input.layout(), C_out);
+        cs.blocks_out = (C_out + cs.lanes_out - 1) / cs.lanes_out;
+        return cs;
+    }
+
+    void check_residual(const Conv2DEpilogue &e, const Tensor<float> &output, const char *op)
+    {
+        if (e.residual && (e.residual->shape() != output.shape() ||
+                           e.residual->layout() != output.layout()))
+        {
+            throw std::runtime_error(std::string(op) +
+                                     ": residual does not match the output shape and layout");
+        }
+    }
+
+    /**
+     * The conv bias and a Conv2DEpilogue per output channel, zero-padded
+     * to the output's blocks * lanes so padding lanes stay zero:
+     * y = act(acc * scale[c] + shift[c] + residual), where
+     * shift = bias * scale + epilogue shift. Tensors, so that they come
+     * from the activation arena like the rest of the per-call scratch.
+     */
+    struct LaneEpilogue
+    {
+        bool has_scale;
+        Tensor<float> scale_;
+        Tensor<float> shift_;
+        const float *residual = nullptr;
+        Activation act = Activation::NONE;
+
+        LaneEpilogue(const std::vector<float> &bias, const Conv2DEpilogue &e, int C, int padded)
+            : has_scale(e.scale != nullptr), shift_({padded}), act(e.act)
+        {
+            if (has_scale)
+                scale_ = Tensor<float>({padded});
+            for (int c = 0; c < C; c++)
+            {
+                float s = e.scale ? e.scale[c] : 1.f;
+                shift_[c] = (bias.empty() ? 0.f : bias[c]) * s + (e.shift ? e.shift[c] : 0.f);
+                if (e.scale)
+                    scale_[c] = s;
+            }
+            if (e.residual)
+                residual = e.residual->data();
+        }
+
+        const float *scale(int c0) const { return has_scale ? scale_.data() + c0 : nullptr; }
+        const float *shift(int c0) const { return shift_.data() + c0; }
+
+        // the epilogue of [rows, ld] output values from channel c0 on,
+        // `offset` values into the output
+        GemmEpilogue rows(size_t offset, int c0, int ld) const
+        {
+            GemmEpilogue ep;
+            ep.scale = scale(c0);
+            ep.shift = shift(c0);
+            ep.per_column = true;
+            ep.residual = residual ? residual + offset : nullptr;
+            ep.ldr = ld;
+            ep.act = act;
+            return ep;
+        }
+
+        // what a kernel starts its accumulators with: the shift when there is no scale
+        const float *init(int c0, const float *zeros) const
+        {
+            return has_scale ? zeros : shift(c0);
+        }
+
+        // whether anything is left after init(), and that remainder
+        bool needs_post() const
+        {
+            return has_scale || residual || act != Activation::NONE;
+        }
+
+        GemmEpilogue post(size_t offset, int c0, int ld) const
+        {
+            GemmEpilogue ep = rows(offset, c0, ld);
+            if (!ep.scale)
+                ep.shift = nullptr;
+            return ep;
+        }
+    };
+
+    // first / one-past-last output index whose taps are all inside [0, size)
+    void interior_range(int size, int k, int stride, int pad, int out_size,
+                        int &lo, int &hi)
+    {
+        lo = std::min(out_size, (pad + stride - 1) / stride);
+        hi = size + pad - k >= 0 ? (size + pad - k) / stride + 1 : 0;
+        hi = std::max(lo, std::min(out_size, hi));
+    }
+
+    // ---------------- NHWC: GEMM over pixel rows ----------------
+    // im2col values gathered per GEMM call, and output pixels per gather task
+    const int kNhwcColFloats = 1 << 19;
+    const int kNhwcRowsPerTask = 32;
+
+    // row r (output pixel n, oh, ow) of the NHWC im2col matrix:
+    // kH*kW runs of C_in values, zeros where the tap is in the padding
+    void gather_nhwc_row(const float *in, const LayoutConvShape &cs,
+                         const Conv2DParam &p, int r, float *dst)
+    {
+        const int hw = cs.out_h * cs.out_w;
+        const int n = r / hw;
+        const int oh = (r % hw) / cs.out_w;
+        const int ow = r % cs.out_w;
+        const float *image = in + (size_t)n * cs.H_in * cs.W_in * cs.C_in;
+        const size_t run = sizeof(float) * cs.C_in;
+        for (int kh = 0; kh < cs.kH; kh++)
+        {
+            int ih = oh * p.stride_h - p.pad_h + kh;
+            for (int kw = 0; kw < cs.kW; kw++, dst += cs.C_in)
+            {
+                int iw = ow * p.stride_w - p.pad_w + kw;
+                if (ih < 0 || ih >= cs.H_in || iw < 0 || iw >= cs.W_in)
+                    std::memset(dst, 0, run);
+                else
+                    std::memcpy(dst, image + ((size_t)ih * cs.W_in + iw) * cs.C_in, run);
+            }
+        }
+    }
+
+    /**
+     * NHWC conv as [N*out_h*out_w, K] x [K, C_out] with the epilogue per
+     * column. 1x1 stride-1 convs use the input as the left operand; the
+     * others gather im2col rows in chunks of about kNhwcColFloats.
+     */
+    void conv2d_nhwc(const Tensor<float> &input, const PackedMatrix &w,
+                     const LaneEpilogue &epi, const LayoutConvShape &cs,
+                     const Conv2DParam &p, Tensor<float> &output)
+    {
+        const int rows = cs.N * cs.out_h * cs.out_w;
+        if (cs.kH == 1 && cs.kW == 1 && p.stride_h == 1 && p.stride_w == 1 &&
+            p.pad_h == 0 && p.pad_w == 0)
+        {
+            GemmEpilogue ep = epi.rows(0, 0, cs.C_out);
+            matmul(input.data(), w, output.data(), rows, &ep);
+            return;
+        }
+        const int K = cs.kH * cs.kW * cs.C_in;
+        const int chunk = std::max(1, std::min(rows, kNhwcColFloats / K));
+        Tensor<float> col({chunk, K}, TensorInit::UNINITIALIZED);
+        for (int r0 = 0; r0 < rows; r0 += chunk)
+        {
+            const int len = std::min(chunk, rows - r0);
+            {
+                ScopedTimer timer(OpType::IM2COL);
+                int tasks = (len + kNhwcRowsPerTask - 1) / kNhwcRowsPerTask;
+                ThreadPool::instance().parallel_for(tasks, [&](int t)
+                                                    {
+                    int end = std::min(len, (t + 1) * kNhwcRowsPerTask);
+                    for (int i = t * kNhwcRowsPerTask; i < end; i++)
+                        gather_nhwc_row(input.data(), cs, p, r0 + i, col.data() + (size_t)i * K); });
+            }
+            GemmEpilogue ep = epi.rows((size_t)r0 * cs.C_out, 0, cs.C_out);
+            matmul(col.data(), w, output.data() + (size_t)r0 * cs.C_out, len, &ep);
+        }
+    }
+
+    // ---------------- NCHWxc: register-blocked direct conv ----------------
+    /**
+     * One tile of the blocked direct conv: `tile` neighbouring output
+     * pixels of a row times `out_blocks` (1 or 2) output channel blocks,
+     * accumulated over every input block and tap, then the epilogue and
+     * a single store. The input is pre-padded, so all taps are in range.
+     */
+    struct BlockedTile
+    {
+        const float *in;    // input of the first pixel at tap (0, 0), block 0
+        size_t in_block;    // values between input channel blocks
+        int in_row;         // values between input rows
+        int in_step;        // values between the inputs of neighbouring pixels
+        int in_blocks;
+        int last_lanes;     // real channels in the last input block
+        int kH, kW;
+        const float *w;     // weight of the first output block
+        size_t w_block;     // values between the weights of output blocks
+        const float *scale; // from the first output channel, null: 1
+        const float *shift;
+        const float *res;   // residual at the first output value, null: none
+        float *out;         // output of the first pixel, first block
+        size_t out_block;   // values between output channel blocks
+        Activation act;
+        int lanes;
+        int tile;
+        int out_blocks;
+    };
+
+    typedef void (*BlockedTileFn)(const BlockedTile &a);
+
+    // any lanes and tile, one pixel at a time
+    void blocked_tile_generic(const BlockedTile &a)
+    {
+        const int L = a.lanes;
+        float acc[2 * 16];
+        for (int t = 0; t < a.tile; t++)
+        {
+            std::fill(acc, acc + a.out_blocks * L, 0.f);
+            for (int ib = 0; ib < a.in_blocks; ib++)
+            {
+                const int lanes = ib + 1 < a.in_blocks ? L : a.last_lanes;
+                for (int kh = 0; kh < a.kH; kh++)
+                {
+                    for (int kw = 0; kw < a.kW; kw++)
+                    {
+                        const float *x = a.in + ib * a.in_block + kh * a.in_row + kw * L +
+                                         (size_t)t * a.in_step;
+                        const float *w = a.w + (((size_t)ib * a.kH + kh) * a.kW + kw) * L * L;
+                        for (int l = 0; l < lanes; l++)
+                        {
+                            for (int o = 0; o < a.out_blocks; o++)
+                            {
+                                const float *wo = w + o * a.w_block + l * L;
+                                float *ac = acc + o * L;
+                                for (int j = 0; j < L; j++)
+                                    ac[j] += x[l] * wo[j];
+                            }
+                        }
+                    }
+                }
+            }
+            for (int o = 0; o < a.out_blocks; o++)
+            {
+                float *dst = a.out + o * a.out_block + (size_t)t * L;
+                std::copy(acc + o * L, acc + (o + 1) * L, dst);
+                GemmEpilogue ep;
+                ep.scale = a.scale ? a.scale + o * L : nullptr;
+                ep.shift = a.shift + o * L;
+                ep.per_column = true;
+                ep.residual = a.res ? a.res + o * a.out_block + (size_t)t * L : nullptr;
+                ep.ldr = L;
+                ep.act = a.act;
+                apply_epilogue(ep, dst, L, 0, 0, 1, L);
+            }
+        }
+    }
+
+#ifdef POLY_X86
+    // Tile widths: T pixels x 2 blocks of accumulators plus the 2 weight
+    // vectors fill the register file (32 zmm / 16 ymm); broadcasts come
+    // straight from memory.
+    const int kBlockedTile16 = 14;
+    const int kBlockedTile8 = 6;
+
+    // ---------------- AVX-512, NCHW16c ----------------
+    template <int T, int OB>
+    POLY_TARGET("avx512f,fma")
+    void blocked_tile_avx512(const BlockedTile &a)
+    {
+        __m512 acc[OB][T];
+        for (int o = 0; o < OB; o++)
+            for (int t = 0; t < T; t++)
+                acc[o][t] = _mm512_setzero_ps();
+        for (int ib = 0; ib < a.in_blocks; ib++)
+        {
+            const int lanes = ib + 1 < a.in_blocks ? 16 : a.last_lanes;
+            for (int kh = 0; kh < a.kH; kh++)
+            {
+                for (int kw = 0; kw < a.kW; kw++)
+                {
+                    const float *x = a.in + ib * a.in_block + kh * a.in_row + kw * 16;
+                    const float *w = a.w + (((size_t)ib * a.kH + kh) * a.kW + kw) * 256;
+                    for (int l = 0; l < lanes; l++, x++, w += 16)
+                    {
+                        __m512 w0 = _mm512_loadu_ps(w);
+                        __m512 w1 = OB > 1 ? _mm512_loadu_ps(w + a.w_block) : w0;
+                        for (int t = 0; t < T; t++)
+                        {
+                            __m512 xv = _mm512_set1_ps(x[t * a.in_step]);
+                            acc[0][t] = _mm512_fmadd_ps(xv, w0, acc[0][t]);
+                            if (OB > 1)
+                                acc[OB - 1][t] = _mm512_fmadd_ps(xv, w1, acc[OB - 1][t]);
+                        }
+                    }
+                }
+            }
+        }
+        const __m512 zero = _mm512_setzero_ps();
+        const __m512 six = _mm512_set1_ps(6.f);
+        for (int o = 0; o < OB; o++)
+        {
+            const __m512 sh = _mm512_loadu_ps(a.shift + o * 16);
+            const __m512 sc = a.scale ? _mm512_loadu_ps(a.scale + o * 16) : zero;
+            float *dst = a.out + o * a.out_block;
+            const float *res = a.res ? a.res + o * a.out_block : nullptr;
+            for (int t = 0; t < T; t++)
+            {
+                __m512 v = a.scale ? _mm512_fmadd_ps(acc[o][t], sc, sh) : _mm512_add_ps(acc[o][t], sh);
+                if (res)
+                    v = _mm512_add_ps(v, _mm512_loadu_ps(res + t * 16));
+                if (a.act != Activation::NONE)
+                    v = _mm512_max_ps(v, zero);
+                if (a.act == Activation::RELU6)
+                    v = _mm512_min_ps(v, six);
+                _mm512_storeu_ps(dst + t * 16, v);
+            }
+        }
+    }
+
+    // ---------------- AVX2, NCHW8c ----------------
+    template <int T, int OB>
+    POLY_TARGET("avx2,fma")
+    void blocked_tile_avx2(const BlockedTile &a)
+    {
+        __m256 acc[OB][T];
+        for (int o = 0; o < OB; o++)
+            for (int t = 0; t < T; t++)
+                acc[o][t] = _mm256_setzero_ps();
+        for (int ib = 0; ib < a.in_blocks; ib++)
+        {
+            const int lanes = ib + 1 < a.in_blocks ? 8 : a.last_lanes;
+            for (int kh = 0; kh < a.kH; kh++)
+            {
+                for (int kw = 0; kw < a.kW; kw++)
+                {
+                    const float *x = a.in + ib * a.in_block + kh * a.in_row + kw * 8;
+                    const float *w = a.w + (((size_t)ib * a.kH + kh) * a.kW + kw) * 64;
+                    for (int l = 0; l < lanes; l++, x++, w += 8)
+                    {
+                        __m256 w0 = _mm256_loadu_ps(w);
+                        __m256 w1 = OB > 1 ? _mm256_loadu_ps(w + a.w_block) : w0;
+                        for (int t = 0; t < T; t++)
+                        {
+                            __m256 xv = _mm256_broadcast_ss(x + t * a.in_step);
+                            acc[0][t] = _mm256_fmadd_ps(xv, w0, acc[0][t]);
+                            if (OB > 1)
+                                acc[OB - 1][t] = _mm256_fmadd_ps(xv, w1, acc[OB - 1][t]);
+                        }
+                    }
+                }
+            }
+        }
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 six = _mm256_set1_ps(6.f);
+        for (int o = 0; o < OB; o++)
+        {
+            const __m256 sh = _mm256_loadu_ps(a.shift + o * 8);
+            const __m256 sc = a.scale ? _mm256_loadu_ps(a.scale + o * 8) : zero;
+            float *dst = a.out + o * a.out_block;
+            const float *res = a.res ? a.res + o * a.out_block : nullptr;
+            for (int t = 0; t < T; t++)
+            {
+                __m256 v = a.scale ? _mm256_fmadd_ps(acc[o][t], sc, sh) : _mm256_add_ps(acc[o][t], sh);
+                if (res)
+                    v = _mm256_add_ps(v, _mm256_loadu_ps(res + t * 8));
+                if (a.act != Activation::NONE)
+                    v = _mm256_max_ps(v, zero);
+                if (a.act == Activation::RELU6)
+                    v = _mm256_min_ps(v, six);
+                _mm256_storeu_ps(dst + t * 8, v);
+            }
+        }
+    }
+#endif
+
+    // the tile kernels of one ISA, fn[out_blocks - 1][tile - 1]
+    struct BlockedKernel
+    {
+        int max_tile;
+        BlockedTileFn fn[2][16];
+    };
+
+#ifdef POLY_X86
+#define POLY_TILES_16(OB)                                                        \
+    {                                                                            \
+        blocked_tile_avx512<1, OB>, blocked_tile_avx512<2, OB>,                  \
+            blocked_tile_avx512<3, OB>, blocked_tile_avx512<4, OB>,              \
+            blocked_tile_avx512<5, OB>, blocked_tile_avx512<6, OB>,              \
+            blocked_tile_avx512<7, OB>, blocked_tile_avx512<8, OB>,              \
+            blocked_tile_avx512<9, OB>, blocked_tile_avx512<10, OB>,             \
+            blocked_tile_avx512<11, OB>, blocked_tile_avx512<12, OB>,            \
+            blocked_tile_avx512<13, OB>, blocked_tile_avx512<14, OB>             \
+    }
+#define POLY_TILES_8(OB)                                                         \
+    {                                                                            \
+        blocked_tile_avx2<1, OB>, blocked_tile_avx2<2, OB>,                      \
+            blocked_tile_avx2<3, OB>, blocked_tile_avx2<4, OB>,                  \
+            blocked_tile_avx2<5, OB>, blocked_tile_avx2<6, OB>                   \
+    }
+    const BlockedKernel k_blocked16 = {kBlockedTile16, {POLY_TILES_16(1), POLY_TILES_16(2)}};
+    const BlockedKernel k_blocked8 = {kBlockedTile8, {POLY_TILES_8(1), POLY_TILES_8(2)}};
+#undef POLY_TILES_16
+#undef POLY_TILES_8
+#endif
+
+    // vectorised kernel for `lanes` on this CPU, null for the portable one
+    const BlockedKernel *blocked_kernel(int lanes)
+    {
+#ifdef POLY_X86
+        IsaLevel isa = best_isa();
+        if (lanes == 16 && isa == IsaLevel::AVX512)
+            return &k_blocked16;
+        if (lanes == 8 && (isa == IsaLevel::AVX512 || isa == IsaLevel::AVX2))
+            return &k_blocked8;
+#endif
+        (void)lanes;
+        return nullptr;
+    }
+
+    // planes of [H, W, L] values into [H + 2*ph, W + 2*pw, L] with a zero border
+    void pad_planes(const float *src, int planes, int H, int W, int L, int ph, int pw,
+                    float *dst)
+    {
+        const int Hp = H + 2 * ph, Wp = W + 2 * pw;
+        const size_t row = (size_t)Wp * L;
+        ThreadPool::instance().parallel_for(planes, [&](int pl)
+                                            {
+            const float *s = src + (size_t)pl * H * W * L;
+            float *d = dst + (size_t)pl * Hp * row;
+            std::fill(d, d + ph * row, 0.f);
+            for (int h = 0; h < H; h++)
+            {
+                float *r = d + (h + ph) * row;
+                std::fill(r, r + pw * L, 0.f);
+                std::memcpy(r + pw * L, s + (size_t)h * W * L, sizeof(float) * W * L);
+                std::fill(r + (pw + W) * L, r + row, 0.f);
+            }
+            std::fill(d + (ph + H) * row, d + Hp * row, 0.f); });
+    }
+
+    /**
+     * NCHWxc direct conv. One task per (image, pair of output blocks,
+     * output row), rows of the same blocks back to back so their weights
+     * stay in cache; each row is swept in tiles of the kernel's width.
+     */
+    void conv2d_blocked(const Tensor<float> &input, const float *w,
+                        const LaneEpilogue &epi, const LayoutConvShape &cs,
+                        const Conv2DParam &p, Tensor<float> &output)
+    {
+        const int L = cs.lanes_in;
+        const int Gi = cs.blocks_in, Go = cs.blocks_out;
+        const float *src = input.data();
+        int Hp = cs.H_in, Wp = cs.W_in;
+        Tensor<float> padded;
+        if (p.pad_h || p.pad_w)
+        {
+            Hp += 2 * p.pad_h;
+            Wp += 2 * p.pad_w;
+            padded = Tensor<float>({cs.N * Gi, Hp, Wp, L}, TensorInit::UNINITIALIZED);
+            pad_planes(src, cs.N * Gi, cs.H_in, cs.W_in, L, p.pad_h, p.pad_w, padded.data());
+            src = padded.data();
+        }
+
+        const BlockedKernel *k = blocked_kernel(L);
+        const int max_tile = k ? k->max_tile : 8;
+        const int pairs = (Go + 1) / 2;
+        const size_t in_plane = (size_t)Hp * Wp * L;
+        const size_t out_plane = (size_t)cs.out_h * cs.out_w * L;
+        const size_t w_block = (size_t)Gi * cs.kH * cs.kW * L * L;
+
+        ThreadPool::instance().parallel_for(cs.N * pairs * cs.out_h, [&](int task)
+                                            {
+            const int oh = task % cs.out_h;
+            const int ob = (task / cs.out_h) % pairs * 2;
+            const int n = task / (cs.out_h * pairs);
+
+            BlockedTile a;
+            a.in_block = in_plane;
+            a.in_row = Wp * L;
+            a.in_step = p.stride_w * L;
+            a.in_blocks = Gi;
+            a.last_lanes = cs.C_in - (Gi - 1) * L;
+            a.kH = cs.kH;
+            a.kW = cs.kW;
+            a.w = w + ob * w_block;
+            a.w_block = w_block;
+            a.scale = epi.scale(ob * L);
+            a.shift = epi.shift(ob * L);
+            a.out_block = out_plane;
+            a.act = epi.act;
+            a.lanes = L;
+            a.out_blocks = std::min(2, Go - ob);
+
+            const float *in_row = src + (size_t)n * Gi * in_plane + (size_t)oh * p.stride_h * Wp * L;
+            const size_t out_row = ((size_t)n * Go + ob) * out_plane + (size_t)oh * cs.out_w * L;
+            for (int ow = 0; ow < cs.out_w; ow += a.tile)
+            {
+                a.tile = std::min(max_tile, cs.out_w - ow);
+                a.in = in_row + (size_t)ow * a.in_step;
+                a.out = output.data() + out_row + (size_t)ow * L;
+                a.res = epi.residual ? epi.residual + out_row + (size_t)ow * L : nullptr;
+                if (k)
+                    k->fn[a.out_blocks - 1][a.tile - 1](a);
+                else
+                    blocked_tile_generic(a);
+            } });
+    }
+
+    // ---------------- depthwise ----------------
+    // one output pixel over all lanes, skipping taps that fall into the padding
+    void dw_lanes_pixel(const float *plane, int H, int W, int L, const float *w,
+                        int kH, int kW, const float *init, int ih0, int iw0, float *out)
+    {
+        std::copy(init, init + L, out);
+        for (int kh = 0; kh < kH; kh++)
+        {
+            int ih = ih0 + kh;
+            if (ih < 0 || ih >= H)
+                continue;
+            for (int kw = 0; kw < kW; kw++)
+            {
+                int iw = iw0 + kw;
+                if (iw < 0 || iw >= W)
+                    continue;
+                const float *x = plane + ((size_t)ih * W + iw) * L;
+                const float *wk = w + (kh * kW + kw) * L;
+                for (int l = 0; l < L; l++)
+                    out[l] += wk[l] * x[l];
+            }
+        }
+    }
+
+    // An interior run of n output pixels of a 3x3 depthwise conv:
+    // out[i][l] = init[l] + sum w[kh][kw][l] * r_kh[i * step + kw * L + l]
+    typedef void (*DwLanesFn)(const float *r0, const float *r1, const float *r2, int step,
+                              const float *w, const float *init, float *out, int n, int lanes);
+
+#define POLY_DW_LANES_BODY(L)                                                            \
+    for (int i = 0; i < n; i++)                                                          \
+    {                                                                                    \
+        const float *a = r0 + (size_t)i * step;                                          \
+        const float *b = r1 + (size_t)i * step;                                          \
+        const float *c = r2 + (size_t)i * step;                                          \
+        float *__restrict o = out + (size_t)i * (L);                                     \
+        for (int l = 0; l < (L); l++)                                                    \
+            o[l] = init[l] +                                                             \
+                   w[l] * a[l] + w[(L) + l] * a[(L) + l] + w[2 * (L) + l] * a[2 * (L) + l] + \
+                   w[3 * (L) + l] * b[l] + w[4 * (L) + l] * b[(L) + l] +                 \
+                   w[5 * (L) + l] * b[2 * (L) + l] +                                     \
+                   w[6 * (L) + l] * c[l] + w[7 * (L) + l] * c[(L) + l] +                 \
+                   w[8 * (L) + l] * c[2 * (L) + l];                                      \
+    }
+
+#define POLY_DW_LANES_FN(name, L, target)                                                \
+    target void name(const float *r0, const float *r1, const float *r2, int step,        \
+                     const float *w, const float *init, float *out, int n, int lanes)     \
+    {                                                                                    \
+        (void)lanes;                                                                     \
+        POLY_DW_LANES_BODY(L)                                                            \
+    }
+
+    POLY_DW_LANES_FN(dw_lanes_generic, lanes, )
+#ifdef POLY_X86
+    POLY_DW_LANES_FN(dw_lanes_avx2, lanes, POLY_TARGET("avx2,fma"))
+    POLY_DW_LANES_FN(dw_lanes8_avx2, 8, POLY_TARGET("avx2,fma"))
+    POLY_DW_LANES_FN(dw_lanes_avx512, lanes, POLY_TARGET("avx512f,fma"))
+    POLY_DW_LANES_FN(dw_lanes16_avx512, 16, POLY_TARGET("avx512f,fma"))
+#endif
+#undef POLY_DW_LANES_FN
+#undef POLY_DW_LANES_BODY
+
+    // interior kernel for `lanes` (fixed-width ones for the block sizes)
+    DwLanesFn dw_lanes_fn(int lanes)
+    {
+#ifdef POLY_X86
+        switch (best_isa())
+        {
+        case IsaLevel::AVX512:
+            if (lanes == 16)
+                return dw_lanes16_avx512;
+            return lanes == 8 ? dw_lanes8_avx2 : dw_lanes_avx512;
+        case IsaLevel::AVX2:
+            return lanes == 8 ? dw_lanes8_avx2 : dw_lanes_avx2;
+        default:
+            break;
+        }
+#endif
+        (void)lanes;
+        return dw_lanes_generic;
+    }
+
+    // [K, C_out] right operand of the NHWC GEMM, K in (kh, kw, ci) order
+    size_t nhwc_index(int co, int ci, int k, int C_in, int C_out)
+    {
+        return ((size_t)k * C_in + ci) * C_out + co;
+    }
+
+    // [C_out/L][C_in/L][kH*kW][L ci][L co]
+    size_t blocked_index(int co, int ci, int k, int blocks_in, int khw, int L)
+    {
+        return ((((size_t)(co / L) * blocks_in + ci / L) * khw + k) * L + ci % L) * L + co % L;
+    }
+}
+
+void pack_conv2d_weight_layout(const Tensor<float> &weight, PackedConv2DWeight &pw,
+                               WeightPrecision precision)
+{
+    const int C_out = pw.out_channels, C_in = pw.in_channels;
+    const int khw = pw.kernel_h * pw.kernel_w;
+    const float *src = weight.data();
+    if (pw.layout == TensorLayout::NHWC)
+    {
+        const int K = khw * C_in;
+        std::vector<float> b((size_t)K * C_out);
+        for (int co = 0; co < C_out; co++)
+            for (int ci = 0; ci < C_in; ci++)
+                for (int k = 0; k < khw; k++)
+                    b[nhwc_index(co, ci, k, C_in, C_out)] = src[((size_t)co * C_in + ci) * khw + k];
+        pw.gemm = PackedMatrix::pack_b(b.data(), K, C_out, C_out, precision);
+        return;
+    }
+    const int L = layout_lanes(pw.layout, C_in);
+    const int blocks_in = (C_in + L - 1) / L;
+    const int blocks_out = (C_out + L - 1) / L;
+    pw.blocked = Tensor<float>({blocks_out * blocks_in * khw * L * L});
+    for (int co = 0; co < C_out; co++)
+        for (int ci = 0; ci < C_in; ci++)
+            for (int k = 0; k < khw; k++)
+                pw.blocked[blocked_index(co, ci, k, blocks_in, khw, L)] =
+                    src[((size_t)co * C_in + ci) * khw + k];
+}
+
+void unpack_conv2d_weight_layout(const PackedConv2DWeight &pw, float *dst)
+{
+    const int C_out = pw.out_channels, C_in = pw.in_channels;
+    const int khw = pw.kernel_h * pw.kernel_w;
+    std::vector<float> b;
+    const float *src = pw.blocked.data();
+    const int L = layout_lanes(pw.layout, C_in);
+    const int blocks_in = (C_in + L - 1) / L;
+    if (pw.layout == TensorLayout::NHWC)
+    {
+        b.resize((size_t)khw * C_in * C_out);
+        pw.gemm.unpack(b.data());
+        src = b.data();
+    }
+    for (int co = 0; co < C_out; co++)
+        for (int ci = 0; ci < C_in; ci++)
+            for (int k = 0; k < khw; k++)
+                dst[((size_t)co * C_in + ci) * khw + k] =
+                    pw.layout == TensorLayout::NHWC
+                        ? src[nhwc_index(co, ci, k, C_in, C_out)]
+                        : src[blocked_index(co, ci, k, blocks_in, khw, L)];
+}
+
+void conv2d_layout_into(const Tensor<float> &input,
+                        const PackedConv2DWeight &weight,
+                        const std::vector<float> &bias,
+                        const Conv2DParam &param,
+                        Tensor<float> &output,
+                        const Conv2DEpilogue &epilogue)
+{
+    const TensorLayout layout = input.layout();
+    if (weight.layout != layout)
+    {
+        throw std::runtime_error(std::string("conv2d: weight is not packed for ") +
+                                 layout_name(layout));
+    }
+    LayoutConvShape cs = layout_conv_shape(input, weight.out_channels,
+                                           weight.kernel_h, weight.kernel_w,
+                                           param.stride_h, param.stride_w,
+                                           param.pad_h, param.pad_w);
+    output.ensure_shape({cs.N, cs.C_out, cs.out_h, cs.out_w}, layout);
+    check_residual(epilogue, output, "conv2d");
+    LaneEpilogue epi(bias, epilogue, cs.C_out, cs.blocks_out * cs.lanes_out);
+
+    if (layout == TensorLayout::NHWC)
+        conv2d_nhwc(input, weight.gemm, epi, cs, param, output);
+    else
+        conv2d_blocked(input, weight.blocked.data(), epi, cs, param, output);
+}
+
+void depthwise_conv2d_layout_into(const Tensor<float> &input,
+                                  const Tensor<float> &weight,
+                                  const std::vector<float> &bias,
+                                  const DepthwiseConv2DParam &param,
+                                  Tensor<float> &output,
+                                  const Conv2DEpilogue &epilogue)
+{
+    const TensorLayout layout = input.layout();
+    const int N = input.shape()[0];
+    const int C = input.shape()[1];
+    const int H = input.shape()[2];
+    const int W = input.shape()[3];
+    if (weight.shape()[0] != C || weight.shape()[1] != 1)
+    {
+        throw std::runtime_error("depthwise_conv2d: weight must be [C, 1, kH, kW]");
+    }
+    const int kH = weight.shape()[2];
+    const int kW = weight.shape()[3];
+    const int sh = param.stride_h, sw = param.stride_w;
+    const int out_h = (H + 2 * param.pad_h - kH) / sh + 1;
+    const int out_w = (W + 2 * param.pad_w - kW) / sw + 1;
+    const int L = layout_lanes(layout, C);
+    const int G = (C + L - 1) / L;
+
+    output.ensure_shape({N, C, out_h, out_w}, layout);
+    check_residual(epilogue, output, "depthwise_conv2d");
+    LaneEpilogue epi(bias, epilogue, C, G * L);
+
+    // weight per block and tap with the lanes innermost, [G][kH*kW][L]
+    const int khw = kH * kW;
+    Tensor<float> wl({G * khw * L});
+    const float *wsrc = weight.data();
+    for (int c = 0; c < C; c++)
+        for (int k = 0; k < khw; k++)
+            wl[((c / L) * khw + k) * L + c % L] = wsrc[c * khw + k];
+    const Tensor<float> zeros({L});
+
+    // 3x3 interior columns take the vectorised run kernel
+    const bool fast = kH == 3 && kW == 3;
+    int ow_lo = out_w, ow_hi = out_w;
+    if (fast)
+        interior_range(W, kW, sw, param.pad_w, out_w, ow_lo, ow_hi);
+    const DwLanesFn run = dw_lanes_fn(L);
+
+    const float *in = input.data();
+    ThreadPool::instance().parallel_for(N * G * out_h, [&](int task)
+                                        {
+        const int oh = task % out_h;
+        const int plane_i = task / out_h;
+        const int g = plane_i % G;
+        const float *plane = in + (size_t)plane_i * H * W * L;
+        float *o = output.data() + (size_t)task * out_w * L;
+        const float *wg = wl.data() + (size_t)g * khw * L;
+        const float *init = epi.init(g * L, zeros.data());
+
+        const int ih0 = oh * sh - param.pad_h;
+        const bool inside = fast && ih0 >= 0 && ih0 + kH <= H;
+        const int lo = inside ? ow_lo : out_w;
+        const int hi = inside ? ow_hi : out_w;
+        for (int ow = 0; ow < lo; ow++)
+            dw_lanes_pixel(plane, H, W, L, wg, kH, kW, init, ih0, ow * sw - param.pad_w, o + ow * L);
+        if (hi > lo)
+        {
+            const float *r0 = plane + ((size_t)ih0 * W + lo * sw - param.pad_w) * L;
+            run(r0, r0 + (size_t)W * L, r0 + (size_t)2 * W * L, sw * L, wg, init,
+                o + lo * L, hi - lo, L);
+        }
+        for (int ow = hi; ow < out_w; ow++)
+            dw_lanes_pixel(plane, H, W, L, wg, kH, kW, init, ih0, ow * sw - param.pad_w, o + ow * L);
+
+        if (epi.needs_post())
+        {
+            GemmEpilogue ep = epi.post(o - output.data(), g * L, L);
+            apply_epilogue(ep, o, L, 0, 0, out_w, L);
+        } });
+}
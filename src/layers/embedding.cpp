@@ -11,6 +11,14 @@
  */
 Tensor<float> embedding_forward(const Tensor<float> &input_ids,
                                 const EmbeddingParam &param)
+{
+    Tensor<float> out;
+    embedding_forward_into(input_ids, param, out);
+    return out;
+}
+
+void embedding_forward_into(const Tensor<float> &input_ids,
+                            const EmbeddingParam &param, Tensor<float> &out)
 {
     // time stats
     ScopedTimer t_embed(OpType::OTHERS);
@@ -21,7 +29,7 @@ Tensor<float> embedding_forward(const Tensor<float> &input_ids,
     int emb_dim = param.weight.shape()[1];
 
     // output
-    Tensor<float> out({N, seq_len, emb_dim}); // 3D if we wish, or 4D with last=1
+    out.ensure_shape({N, seq_len, emb_dim}); // 3D if we wish, or 4D with last=1
 
     for (int n = 0; n < N; n++)
     {
@@ -41,8 +49,6 @@ Tensor<float> embedding_forward(const Tensor<float> &input_ids,
             }
         }
     }
-
-    return out;
 }
 
 /**
@@ -53,6 +59,14 @@ Tensor<float> embedding_forward(const Tensor<float> &input_ids,
  */
 Tensor<float> patch_embed_forward(const Tensor<float> &input,
                                   const PatchEmbedParam &param)
+{
+    Tensor<float> out;
+    patch_embed_forward_into(input, param, out);
+    return out;
+}
+
+void patch_embed_forward_into(const Tensor<float> &input,
+                              const PatchEmbedParam &param, Tensor<float> &out)
 {
     ScopedTimer t_patch(OpType::OTHERS);
 
@@ -78,9 +92,12 @@ Tensor<float> patch_embed_forward(const Tensor<float> &input,
     int embed_dim = param.embed_dim;
 
     // output => [N, num_patches, embed_dim]
-    Tensor<float> out({N, num_patches, embed_dim});
+    out.ensure_shape({N, num_patches, embed_dim});
 
-    // flatten each patch => [1, in_size], then matmul => [1, embed_dim]
+    // flatten each patch => [1, in_size], then matmul => [1, embed_dim];
+    // both buffers are reused across patches
+    std::vector<float> patch_flat(in_size, 0.f);
+    std::vector<float> embed_vec(embed_dim, 0.f);
     for (int n = 0; n < N; n++)
     {
         for (int ph = 0; ph < H_out; ph++)
@@ -88,7 +105,6 @@ Tensor<float> patch_embed_forward(const Tensor<float> &input,
             for (int pw = 0; pw < W_out; pw++)
             {
                 // flatten patch
-                std::vector<float> patch_flat(in_size, 0.f);
                 int patch_idx = ph * W_out + pw;
                 // read from input
                 // patch top-left => (ph*patch_h, pw*patch_w)
@@ -105,7 +121,6 @@ Tensor<float> patch_embed_forward(const Tensor<float> &input,
                     }
                 }
                 // matmul => [1, embed_dim]
-                std::vector<float> embed_vec(embed_dim, 0.f);
                 // A= patch_flat(1 x in_size)
                 // B= param.weight.data() (in_size x embed_dim)
                 // C= embed_vec(1 x embed_dim)
@@ -126,5 +141,14 @@ Tensor<float> patch_embed_forward(const Tensor<float> &input,
             }
         }
     }
-    return out;
-}
\ No newline at end of file
+}
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, EmbeddingParam &param)
+{
+    list_params(params, prefix + ".weight", param.weight);
+}
+
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, PatchEmbedParam &param)
+{
+    list_params(params, prefix + ".weight", param.weight);
+    list_params(params, prefix + ".bias", param.bias);
+}
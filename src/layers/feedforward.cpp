@@ -3,12 +3,41 @@
 #include "common/matmul.hpp" // use global matmul
 #include <cmath>
 
+void pack_ff_param(FFParam &param, WeightPrecision precision)
+{
+    param.W1_packed = PackedMatrix::pack_b(param.W1.data(), param.W1.shape()[0],
+                                           param.W1.shape()[1], param.W1.shape()[1], precision);
+    param.W2_packed = PackedMatrix::pack_b(param.W2.data(), param.W2.shape()[0],
+                                           param.W2.shape()[1], param.W2.shape()[1], precision);
+}
+
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, FFParam &param)
+{
+    list_params(params, prefix + ".w1", param.W1);
+    list_params(params, prefix + ".b1", param.b1);
+    list_params(params, prefix + ".w2", param.W2);
+    list_params(params, prefix + ".b2", param.b2);
+}
+
+void plan_io(PlanArchive &ar, const std::string &prefix, FFParam &param)
+{
+    ar.io(prefix + ".w1_packed", param.W1_packed);
+    ar.io(prefix + ".w2_packed", param.W2_packed);
+}
+
 /**
  * feed_forward:
  *  shape: x [N, S, D]
  *  out = ( (x*W1 + b1) relu ) * W2 + b2
  */
 Tensor<float> feed_forward(const Tensor<float> &x, const FFParam &param)
+{
+    Tensor<float> out;
+    feed_forward_into(x, param, out);
+    return out;
+}
+
+void feed_forward_into(const Tensor<float> &x, const FFParam &param, Tensor<float> &out)
 {
     ScopedTimer t_ff(OpType::OTHERS);
 
@@ -17,27 +46,20 @@ Tensor<float> feed_forward(const Tensor<float> &x, const FFParam &param)
     int D = x.shape()[2];
     int D4 = param.W1.shape()[1]; // 4*D
 
-    // flatten => [N*S, D]
-    Tensor<float> inp2d({N * S, D});
-    for (int n = 0; n < N; n++)
-    {
-        for (int s = 0; s < S; s++)
-        {
-            for (int d = 0; d < D; d++)
-            {
-                inp2d.at4d(n * S + s, d, 0, 0) = x.at4d(n, s, d, 0);
-            }
-        }
-    }
+    // flatten => [N*S, D], a view unless x is strided
+    Tensor<float> inp2d = x.reshape({N * S, D});
 
     // first matmul => [N*S, D4]
-    Tensor<float> hidden({N * S, D4});
+    Tensor<float> hidden({N * S, D4}, TensorInit::UNINITIALIZED);
     {
         // param.W1: [D, D4]
         const float *Ap = inp2d.data();
         const float *Bp = param.W1.data();
         float *Cp = hidden.data();
-        ::matmul(Ap, Bp, Cp, N * S, D, D4);
+        if (!param.W1_packed.empty())
+            ::matmul(Ap, param.W1_packed, Cp, N * S);
+        else
+            ::matmul(Ap, Bp, Cp, N * S, D, D4);
 
         // add b1 + relu
         for (int i = 0; i < (N * S); i++)
@@ -52,13 +74,17 @@ Tensor<float> feed_forward(const Tensor<float> &x, const FFParam &param)
         }
     }
 
-    // second matmul => [N*S, D]
-    Tensor<float> out2d({N * S, D});
+    // second matmul => [N*S, D], a view of out
+    out.ensure_shape({N, S, D});
+    Tensor<float> out2d = out.view({N * S, D});
     {
         const float *Ap = hidden.data();
         const float *Bp = param.W2.data();
         float *Cp = out2d.data();
-        ::matmul(Ap, Bp, Cp, N * S, D4, D);
+        if (!param.W2_packed.empty())
+            ::matmul(Ap, param.W2_packed, Cp, N * S);
+        else
+            ::matmul(Ap, Bp, Cp, N * S, D4, D);
 
         // add b2
         for (int i = 0; i < (N * S); i++)
@@ -70,18 +96,4 @@ Tensor<float> feed_forward(const Tensor<float> &x, const FFParam &param)
             }
         }
     }
-
-    // reshape => [N,S,D]
-    Tensor<float> out({N, S, D});
-    for (int n = 0; n < N; n++)
-    {
-        for (int s = 0; s < S; s++)
-        {
-            for (int d = 0; d < D; d++)
-            {
-                out.at4d(n, s, d, 0) = out2d.at4d(n * S + s, d, 0, 0);
-            }
-        }
-    }
-    return out;
 }
\ No newline at end of file
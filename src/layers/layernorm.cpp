@@ -9,22 +9,32 @@
  */
 Tensor<float> layernorm(const Tensor<float> &input,
                         const LayerNormParam &param)
+{
+    Tensor<float> out;
+    layernorm_into(input, param, out);
+    return out;
+}
+
+void layernorm_into(const Tensor<float> &input, const LayerNormParam &param,
+                    Tensor<float> &out)
 {
     ScopedTimer t_ln(OpType::OTHERS);
 
+    // holds the input while out (possibly the same tensor) is set up
+    Tensor<float> in = input.contiguous();
     // shape e.g. [N, seq_len, hidden_dim]
-    int N = input.shape()[0];
-    int seq_len = input.shape()[1];
-    int hidden_dim = input.shape()[2]; 
+    int N = in.shape()[0];
+    int seq_len = in.shape()[1];
+    int hidden_dim = in.shape()[2]; 
     // if shape has 4 dims, adjust accordingly
 
-    Tensor<float> out({N, seq_len, hidden_dim});
+    out.ensure_shape({N, seq_len, hidden_dim});
     for(int n=0; n<N; n++){
         for(int s=0; s<seq_len; s++){
             // compute mean/var for this row
             double sum=0.0, sum_sq=0.0;
             for(int h=0; h<hidden_dim; h++){
-                float v = input.at4d(n,s,h,0);
+                float v = in.at4d(n,s,h,0);
                 sum+= (double)v;
                 sum_sq += (double)v*(double)v;
             }
@@ -34,7 +44,7 @@ Tensor<float> layernorm(const Tensor<float> &input,
 
             // apply LN
             for(int h=0; h<hidden_dim; h++){
-                float x = input.at4d(n,s,h,0);
+                float x = in.at4d(n,s,h,0);
                 float xhat = (float)((x-mean)*denom);
                 float g = param.gamma[h];
                 float b = param.beta[h];
@@ -43,5 +53,9 @@ Tensor<float> layernorm(const Tensor<float> &input,
             }
         }
     }
-    return out;
-}
\ No newline at end of file
+}
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, LayerNormParam &param)
+{
+    list_params(params, prefix + ".gamma", param.gamma);
+    list_params(params, prefix + ".beta", param.beta);
+}
@@ -1,31 +1,72 @@
 #include "layers/linear.hpp"
-#include "common/time_utils.hpp"
+#include "common/matmul.hpp"
+
+void pack_linear_param(LinearParam &param, WeightPrecision precision)
+{
+    // [out, in] read as the transposed [in, out] right operand
+    int out_features = param.weight.shape()[0];
+    int in_features = param.weight.shape()[1];
+    Tensor<float> wt = param.weight.transpose(0, 1).contiguous();
+    param.weight_packed = PackedMatrix::pack_b(wt.data(), in_features, out_features,
+                                               out_features, precision);
+}
+
+void list_params(std::vector<ModelParam> &params, const std::string &prefix, LinearParam &param)
+{
+    list_params(params, prefix + ".weight", param.weight);
+    list_params(params, prefix + ".bias", param.bias);
+}
+
+void plan_io(PlanArchive &ar, const std::string &prefix, LinearParam &param)
+{
+    ar.io(prefix + ".weight_packed", param.weight_packed);
+}
 
 Tensor<float> linear(const Tensor<float> &input, const LinearParam &param)
+{
+    Tensor<float> output;
+    linear_into(input, param, output);
+    return output;
+}
+
+void linear_into(const Tensor<float> &input, const LinearParam &param,
+                 Tensor<float> &output)
 {
     // input shape: [N, in_features], weight: [out_features, in_features]
-    // out: [N, out_features]
-    ScopedTimer timer(OpType::MATMUL);
+    // out: [N, out_features]; timed as MATMUL by sgemm
 
     int N = input.shape()[0];
     int in_features = input.shape()[1];
     int out_features= param.weight.shape()[0];
 
-    Tensor<float> output({N, out_features});
-    const float* wptr = param.weight.data();
-    const float* inptr= input.data();
-    float* outptr = output.data();
-
-    // for(int n_i=0; n_i<N; n_i++){
-    //     for(int oc=0; oc<out_features; oc++){
-    //         double sum = 0.0;
-    //         for(int ic=0; ic<in_features; ic++){
-    //             sum += (double)inptr[n_i*in_features + ic] * (double)wptr[oc*in_features + ic];
-    //         }
-    //         sum += param.bias[oc];
-    //         outptr[n_i*out_features + oc] = (float)sum;
-    //     }
-    // }
+    output.ensure_shape({N, out_features});
 
-    return output;
+    // rows may be strided (e.g. a slice of a sequence), columns dense
+    const Tensor<float> *in = &input;
+    Tensor<float> dense;
+    if (input.stride(1) != 1)
+    {
+        dense = input.contiguous();
+        in = &dense;
+    }
+    int lda = N > 1 ? in->stride(0) : in_features;
+
+    // out = input * weight^T + bias, the weight read in place as B^T
+    GemmEpilogue ep;
+    ep.shift = param.bias.data();
+    ep.per_column = true;
+    if (!param.weight_packed.empty())
+    {
+        // the packed GEMM wants dense rows
+        if (lda != in_features)
+        {
+            dense = in->contiguous();
+            in = &dense;
+        }
+        matmul(in->data(), param.weight_packed, output.data(), N, &ep);
+        return;
+    }
+    sgemm(false, true, N, out_features, in_features,
+          1.f, in->data(), lda, param.weight.data(), in_features,
+          0.f, output.data(), out_features, &ep);
 }
\ No newline at end of file
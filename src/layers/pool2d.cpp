@@ -1,11 +1,79 @@
 #include "layers/pool2d.hpp"
 #include "common/time_utils.hpp"
+#include "common/thread_pool.hpp"
 #include <algorithm>
 
+namespace
+{
+    /**
+     * Pooling on NHWC / NCHWxc inputs, seen as [N*blocks][H][W][lanes]
+     * planes: every tap is a run of lanes values, so the inner loop is
+     * across channels. Padded lanes stay zero (max and mean of zeros).
+     */
+    void pool2d_lanes(const Tensor<float> &input, const Pool2DParam &param,
+                      Tensor<float> &output, bool is_max)
+    {
+        Tensor<float> in = input.dense();
+        const int N = in.shape()[0];
+        const int C = in.shape()[1];
+        const int H = in.shape()[2];
+        const int W = in.shape()[3];
+        const int L = layout_lanes(in.layout(), C);
+        const int planes = N * ((C + L - 1) / L);
+
+        const int out_h = (H + 2*param.pad_h - param.kernel_h) / param.stride_h + 1;
+        const int out_w = (W + 2*param.pad_w - param.kernel_w) / param.stride_w + 1;
+        output.ensure_shape({N, C, out_h, out_w}, in.layout());
+
+        ThreadPool::instance().parallel_for(planes * out_h, [&](int task)
+                                            {
+            const int oh = task % out_h;
+            const float *plane = in.data() + (size_t)(task / out_h) * H * W * L;
+            float *o = output.data() + (size_t)task * out_w * L;
+            const int hstart = oh*param.stride_h - param.pad_h;
+            for(int ow=0; ow<out_w; ow++, o += L){
+                const int wstart = ow*param.stride_w - param.pad_w;
+                std::fill(o, o + L, is_max ? -1e30f : 0.f);
+                int count = 0;
+                for(int kh=0; kh<param.kernel_h; kh++){
+                    int ih = hstart + kh;
+                    if(ih<0 || ih>=H) continue;
+                    for(int kw=0; kw<param.kernel_w; kw++){
+                        int iw = wstart + kw;
+                        if(iw<0 || iw>=W) continue;
+                        const float *x = plane + ((size_t)ih*W + iw) * L;
+                        if(is_max){
+                            for(int l=0; l<L; l++) o[l] = std::max(o[l], x[l]);
+                        } else {
+                            for(int l=0; l<L; l++) o[l] += x[l];
+                        }
+                        count++;
+                    }
+                }
+                if(!is_max && count > 0){
+                    const float inv = 1.f / (float)count;
+                    for(int l=0; l<L; l++) o[l] *= inv;
+                }
+            } });
+    }
+}
+
 Tensor<float> max_pool2d(const Tensor<float> &input, const Pool2DParam &param)
+{
+    Tensor<float> output;
+    max_pool2d_into(input, param, output);
+    return output;
+}
+
+void max_pool2d_into(const Tensor<float> &input, const Pool2DParam &param, Tensor<float> &output)
 {
     ScopedTimer timer(OpType::POOL);
 
+    if(input.layout() != TensorLayout::NCHW){
+        pool2d_lanes(input, param, output, true);
+        return;
+    }
+
     int N = input.shape()[0];
     int C = input.shape()[1];
     int H = input.shape()[2];
@@ -14,7 +82,7 @@ Tensor<float> max_pool2d(const Tensor<float> &input, const Pool2DParam &param)
     int out_h = (H + 2*param.pad_h - param.kernel_h) / param.stride_h + 1;
     int out_w = (W + 2*param.pad_w - param.kernel_w) / param.stride_w + 1;
 
-    Tensor<float> output({N, C, out_h, out_w});
+    output.ensure_shape({N, C, out_h, out_w});
 
     for(int n=0; n<N; n++){
         for(int c=0; c<C; c++){
@@ -38,13 +106,24 @@ Tensor<float> max_pool2d(const Tensor<float> &input, const Pool2DParam &param)
             }
         }
     }
-    return output;
 }
 
 Tensor<float> avg_pool2d(const Tensor<float> &input, const Pool2DParam &param)
+{
+    Tensor<float> output;
+    avg_pool2d_into(input, param, output);
+    return output;
+}
+
+void avg_pool2d_into(const Tensor<float> &input, const Pool2DParam &param, Tensor<float> &output)
 {
     ScopedTimer timer(OpType::POOL);
 
+    if(input.layout() != TensorLayout::NCHW){
+        pool2d_lanes(input, param, output, false);
+        return;
+    }
+
     int N = input.shape()[0];
     int C = input.shape()[1];
     int H = input.shape()[2];
@@ -53,7 +132,7 @@ Tensor<float> avg_pool2d(const Tensor<float> &input, const Pool2DParam &param)
     int out_h = (H + 2*param.pad_h - param.kernel_h) / param.stride_h + 1;
     int out_w = (W + 2*param.pad_w - param.kernel_w) / param.stride_w + 1;
 
-    Tensor<float> output({N, C, out_h, out_w});
+    output.ensure_shape({N, C, out_h, out_w});
 
     for(int n=0; n<N; n++){
         for(int c=0; c<C; c++){
@@ -82,5 +161,4 @@ Tensor<float> avg_pool2d(const Tensor<float> &input, const Pool2DParam &param)
             }
         }
     }
-    return output;
 }
\ No newline at end of file
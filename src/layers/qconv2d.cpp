@@ -0,0 +1,439 @@
+#include "layers/qconv2d.hpp"
+#include "common/time_utils.hpp"
+#include "common/thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+namespace
+{
+    struct QConvShape
+    {
+        int N, C_in, H, W;
+        int out_h, out_w;
+        int K;
+    };
+
+    QConvShape qconv_shape(const QTensor &input, const PackedQConv2DWeight &weight,
+                           const Conv2DParam &param)
+    {
+        const TensorShape &s = input.shape();
+        if (s.size() != 4 || s[1] != weight.in_channels)
+        {
+            throw std::runtime_error("qconv2d: input does not match the weight");
+        }
+        QConvShape cs;
+        cs.N = s[0];
+        cs.C_in = s[1];
+        cs.H = s[2];
+        cs.W = s[3];
+        cs.out_h = (cs.H + 2 * param.pad_h - weight.kernel_h) / param.stride_h + 1;
+        cs.out_w = (cs.W + 2 * param.pad_w - weight.kernel_w) / param.stride_w + 1;
+        cs.K = cs.C_in * weight.kernel_h * weight.kernel_w;
+        return cs;
+    }
+
+    // u8 im2col of image n: [C_in*kH*kW, out_h*out_w], padding = zero point
+    void qim2col(const QTensor &input, int n, const PackedQConv2DWeight &weight,
+                 const Conv2DParam &param, const QConvShape &cs, unsigned char *col)
+    {
+        ScopedTimer timer(OpType::IM2COL);
+        const int kH = weight.kernel_h, kW = weight.kernel_w;
+        const int hw = cs.out_h * cs.out_w;
+        const unsigned char pad = (unsigned char)input.params.zero_point;
+        const unsigned char *image = input.data.data() + (size_t)n * cs.C_in * cs.H * cs.W;
+        // one task per input channel, its kH * kW rows
+        ThreadPool::instance().parallel_for(cs.C_in, [&](int c)
+                                            {
+            const unsigned char *plane = image + (size_t)c * cs.H * cs.W;
+            for (int r = 0; r < kH * kW; r++)
+            {
+                const int kh = r / kW;
+                const int kw = r % kW;
+                unsigned char *dst = col + ((size_t)c * kH * kW + r) * hw;
+                // columns [ow0, ow1) read inside the input row, the rest is padding
+                const int s = param.stride_w;
+                const int off = kw - param.pad_w;
+                const int ow0 = std::min(cs.out_w, std::max(0, (-off + s - 1) / s));
+                const int ow1 = std::max(ow0, std::min(cs.out_w, (cs.W - off + s - 1) / s));
+                for (int oh = 0; oh < cs.out_h; oh++, dst += cs.out_w)
+                {
+                    const int ih = oh * param.stride_h + kh - param.pad_h;
+                    if (ih < 0 || ih >= cs.H)
+                    {
+                        std::memset(dst, pad, cs.out_w);
+                        continue;
+                    }
+                    const unsigned char *src = plane + (size_t)ih * cs.W + off;
+                    for (int ow = 0; ow < ow0; ow++)
+                    {
+                        dst[ow] = pad;
+                    }
+                    if (s == 1)
+                    {
+                        for (int ow = ow0; ow < ow1; ow++)
+                        {
+                            dst[ow] = src[ow];
+                        }
+                    }
+                    else
+                    {
+                        for (int ow = ow0; ow < ow1; ow++)
+                        {
+                            dst[ow] = src[ow * s];
+                        }
+                    }
+                    for (int ow = ow1; ow < cs.out_w; ow++)
+                    {
+                        dst[ow] = pad;
+                    }
+                }
+            } });
+    }
+
+    template <typename OutT>
+    void qconv2d_impl(const QTensor &input, const PackedQConv2DWeight &weight,
+                      const std::vector<float> &bias, const Conv2DParam &param,
+                      Tensor<OutT> &output, const QuantParams &out_params,
+                      const Conv2DEpilogue &epilogue)
+    {
+        const QConvShape cs = qconv_shape(input, weight, param);
+        const int C_out = weight.out_channels;
+        const int hw = cs.out_h * cs.out_w;
+        output.ensure_shape({cs.N, C_out, cs.out_h, cs.out_w});
+        Tensor<float> residual;
+        if (epilogue.residual)
+        {
+            if (epilogue.residual->total_size() != output.total_size())
+            {
+                throw std::runtime_error("qconv2d: residual does not match the output shape");
+            }
+            residual = epilogue.residual->contiguous();
+        }
+
+        // y = (conv + bias) * scale + shift = conv * scale + (bias * scale + shift)
+        Tensor<float> shift({C_out}, TensorInit::UNINITIALIZED);
+        for (int c = 0; c < C_out; c++)
+        {
+            const float b = bias.empty() ? 0.f : bias[c];
+            shift.data()[c] = b * (epilogue.scale ? epilogue.scale[c] : 1.f) +
+                              (epilogue.shift ? epilogue.shift[c] : 0.f);
+        }
+        QGemmEpilogue ep;
+        ep.b = input.params;
+        ep.scale = epilogue.scale;
+        ep.shift = shift.data();
+        ep.ldr = hw;
+        ep.act = epilogue.act;
+        ep.out = out_params;
+
+        const bool pointwise = weight.kernel_h == 1 && weight.kernel_w == 1 &&
+                               param.stride_h == 1 && param.stride_w == 1 &&
+                               param.pad_h == 0 && param.pad_w == 0;
+        Tensor<unsigned char> col;
+        if (!pointwise)
+        {
+            col = Tensor<unsigned char>({cs.K, hw}, TensorInit::UNINITIALIZED);
+        }
+        for (int n = 0; n < cs.N; n++)
+        {
+            const unsigned char *B = input.data.data() + (size_t)n * cs.C_in * cs.H * cs.W;
+            if (!pointwise)
+            {
+                qim2col(input, n, weight, param, cs, col.data());
+                B = col.data();
+            }
+            ep.residual = epilogue.residual ? residual.data() + (size_t)n * C_out * hw : nullptr;
+            qgemm(weight.gemm, B, hw, output.data() + (size_t)n * C_out * hw, ep);
+        }
+    }
+
+    // the slot's conv of an fp32 or u8 input into an fp32 or u8 output
+    void slot_conv(const Tensor<float> *fin, const QTensor *qin, const QConv2DSlot &slot,
+                   const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                   const Conv2DParam &param, Tensor<float> *fout, QTensor *qout,
+                   const Conv2DEpilogue &epilogue)
+    {
+        if (fin)
+        {
+            observe_activation(&slot, *fin);
+        }
+        if (!slot.enabled)
+        {
+            // a u8 input only comes from an enabled slot; undo it
+            Tensor<float> deq;
+            if (qin)
+            {
+                dequantize_into(*qin, deq);
+                fin = &deq;
+            }
+            conv2d_into(*fin, weight, bias, param, *fout, epilogue);
+            return;
+        }
+        QTensor q;
+        if (!qin)
+        {
+            quantize_into(*fin, slot.input, q);
+            qin = &q;
+        }
+        if (qout)
+        {
+            qconv2d_into(*qin, slot.weight, bias, param, *qout, epilogue);
+        }
+        else
+        {
+            qconv2d_into(*qin, slot.weight, bias, param, *fout, epilogue);
+        }
+    }
+
+    void slot_conv_next(const Tensor<float> *fin, const QTensor *qin, const QConv2DSlot &slot,
+                        const QConv2DSlot &next, const PackedConv2DWeight &weight,
+                        const std::vector<float> &bias, const Conv2DParam &param,
+                        ConvActivation &output, const Conv2DEpilogue &epilogue)
+    {
+        output.quantized = slot.enabled && next.enabled;
+        if (output.quantized)
+        {
+            output.q.params = next.input;
+            slot_conv(fin, qin, slot, weight, bias, param, nullptr, &output.q, epilogue);
+        }
+        else
+        {
+            slot_conv(fin, qin, slot, weight, bias, param, &output.f, nullptr, epilogue);
+        }
+    }
+
+    // row-wise drift of `y` from `ref`, both [N, ...]
+    struct Drift
+    {
+        float max_abs = 0.f;
+        float rel_l2 = 0.f;
+        int top1_same = 0;
+    };
+
+    Drift output_drift(const Tensor<float> &ref, const Tensor<float> &y)
+    {
+        Tensor<float> r = ref.contiguous(), o = y.contiguous();
+        Drift d;
+        const int N = r.shape()[0];
+        const int row = N > 0 ? r.total_size() / N : 0;
+        double err = 0.0, norm = 0.0;
+        for (int n = 0; n < N; n++)
+        {
+            const float *a = r.data() + (size_t)n * row;
+            const float *b = o.data() + (size_t)n * row;
+            for (int i = 0; i < row; i++)
+            {
+                const double e = (double)b[i] - a[i];
+                d.max_abs = std::max(d.max_abs, (float)std::fabs(e));
+                err += e * e;
+                norm += (double)a[i] * a[i];
+            }
+            if (std::max_element(a, a + row) - a == std::max_element(b, b + row) - b)
+            {
+                d.top1_same++;
+            }
+        }
+        d.rel_l2 = norm > 0.0 ? (float)std::sqrt(err / norm) : (float)std::sqrt(err);
+        return d;
+    }
+
+    Tensor<float> timed_run(const std::function<Tensor<float>()> &run, double &ms)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        Tensor<float> y = run();
+        ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        return y;
+    }
+}
+
+PackedQConv2DWeight pack_qconv2d_weight(const Tensor<float> &weight)
+{
+    if (weight.shape().size() != 4)
+    {
+        throw std::runtime_error("qconv2d: weight must be [C_out, C_in, kH, kW]");
+    }
+    Tensor<float> w = weight.contiguous();
+    PackedQConv2DWeight pw;
+    pw.out_channels = w.shape()[0];
+    pw.in_channels = w.shape()[1];
+    pw.kernel_h = w.shape()[2];
+    pw.kernel_w = w.shape()[3];
+    const int K = pw.in_channels * pw.kernel_h * pw.kernel_w;
+    pw.gemm = PackedQMatrix::quantize_a(w.data(), pw.out_channels, K, K);
+    return pw;
+}
+
+void qconv2d_into(const QTensor &input,
+                  const PackedQConv2DWeight &weight,
+                  const std::vector<float> &bias,
+                  const Conv2DParam &param,
+                  Tensor<float> &output,
+                  const Conv2DEpilogue &epilogue)
+{
+    qconv2d_impl(input, weight, bias, param, output, QuantParams(), epilogue);
+}
+
+void qconv2d_into(const QTensor &input,
+                  const PackedQConv2DWeight &weight,
+                  const std::vector<float> &bias,
+                  const Conv2DParam &param,
+                  QTensor &output,
+                  const Conv2DEpilogue &epilogue)
+{
+    qconv2d_impl(input, weight, bias, param, output.data, output.params, epilogue);
+}
+
+void conv2d_slot_into(const Tensor<float> &input, const QConv2DSlot &slot,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, Tensor<float> &output,
+                      const Conv2DEpilogue &epilogue)
+{
+    slot_conv(&input, nullptr, slot, weight, bias, param, &output, nullptr, epilogue);
+}
+
+void conv2d_slot_into(const ConvActivation &input, const QConv2DSlot &slot,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, Tensor<float> &output,
+                      const Conv2DEpilogue &epilogue)
+{
+    slot_conv(input.quantized ? nullptr : &input.f, input.quantized ? &input.q : nullptr,
+              slot, weight, bias, param, &output, nullptr, epilogue);
+}
+
+void conv2d_slot_into(const Tensor<float> &input, const QConv2DSlot &slot,
+                      const QConv2DSlot &next,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, ConvActivation &output,
+                      const Conv2DEpilogue &epilogue)
+{
+    slot_conv_next(&input, nullptr, slot, next, weight, bias, param, output, epilogue);
+}
+
+void conv2d_slot_into(const ConvActivation &input, const QConv2DSlot &slot,
+                      const QConv2DSlot &next,
+                      const PackedConv2DWeight &weight, const std::vector<float> &bias,
+                      const Conv2DParam &param, ConvActivation &output,
+                      const Conv2DEpilogue &epilogue)
+{
+    slot_conv_next(input.quantized ? nullptr : &input.f, input.quantized ? &input.q : nullptr,
+                   slot, next, weight, bias, param, output, epilogue);
+}
+
+void plan_io(PlanArchive &ar, const std::string &prefix, QConv2DSlot &slot)
+{
+    ar.io(prefix + ".enabled", slot.enabled);
+    if (!slot.enabled)
+    {
+        if (ar.loading())
+            slot = QConv2DSlot();
+        return;
+    }
+    ar.io(prefix + ".input.scale", slot.input.scale);
+    ar.io(prefix + ".input.zero_point", slot.input.zero_point);
+    ar.io(prefix + ".out_channels", slot.weight.out_channels);
+    ar.io(prefix + ".in_channels", slot.weight.in_channels);
+    ar.io(prefix + ".kernel_h", slot.weight.kernel_h);
+    ar.io(prefix + ".kernel_w", slot.weight.kernel_w);
+    ar.io(prefix + ".gemm", slot.weight.gemm);
+}
+
+void quantize_layers(const std::vector<QuantLayer> &layers, const ActivationRanges &ranges,
+                     const std::vector<bool> &enable)
+{
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        QConv2DSlot &slot = *layers[i].slot;
+        if (!enable[i])
+        {
+            slot = QConv2DSlot();
+            continue;
+        }
+        const ActivationRanges::Range *r = ranges.find(&slot);
+        if (!r)
+        {
+            throw std::runtime_error("quantize: layer " + layers[i].name + " was not calibrated");
+        }
+        slot.input = choose_quant_params(r->lo, r->hi);
+        slot.weight = pack_qconv2d_weight(unpack_conv2d_weight(*layers[i].weight));
+        slot.enabled = true;
+    }
+}
+
+std::vector<bool> select_quant_layers(const std::vector<QuantLayer> &layers,
+                                      const std::vector<std::string> &names)
+{
+    std::vector<bool> enable(layers.size(), names.empty());
+    for (const std::string &name : names)
+    {
+        size_t i = 0;
+        while (i < layers.size() && layers[i].name != name)
+        {
+            i++;
+        }
+        if (i == layers.size())
+        {
+            throw std::runtime_error("quantize: no conv layer named " + name);
+        }
+        enable[i] = true;
+    }
+    return enable;
+}
+
+void quantization_report(const std::vector<QuantLayer> &layers,
+                         const ActivationRanges &ranges,
+                         const std::function<Tensor<float>()> &run,
+                         std::ostream &os)
+{
+    std::vector<QConv2DSlot> saved;
+    for (const QuantLayer &l : layers)
+    {
+        saved.push_back(*l.slot);
+    }
+
+    // timed runs follow an untimed one, which plans the arena anew
+    quantize_layers(layers, ranges, std::vector<bool>(layers.size(), false));
+    run();
+    double fp32_ms;
+    const Tensor<float> ref = timed_run(run, fp32_ms);
+    const int N = ref.shape()[0];
+
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    os << "int8 drift vs fp32 (" << qgemm_kernel_name() << "): max |dy| / rel L2 / top-1 kept of "
+       << N << "\n"
+       << std::setprecision(3);
+    auto line = [&](const std::string &name, const Tensor<float> &y)
+    {
+        const Drift d = output_drift(ref, y);
+        os << "  " << std::left << std::setw(20) << name << std::right
+           << std::setw(10) << d.max_abs << " / " << std::setw(10) << d.rel_l2
+           << " / " << d.top1_same << "\n";
+    };
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        std::vector<bool> one(layers.size(), false);
+        one[i] = true;
+        quantize_layers(layers, ranges, one);
+        line(layers[i].name, run());
+    }
+    quantize_layers(layers, ranges, std::vector<bool>(layers.size(), true));
+    run();
+    double int8_ms;
+    line("all int8", timed_run(run, int8_ms));
+    os << std::fixed << std::setprecision(2)
+       << "  time fp32 " << fp32_ms << " ms, all int8 " << int8_ms << " ms ("
+       << fp32_ms / int8_ms << "x)\n";
+
+    os.flags(flags);
+    os.precision(precision);
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        *layers[i].slot = saved[i];
+    }
+}
@@ -1,34 +1,70 @@
 #include "layers/relu.hpp"
 #include "common/time_utils.hpp"
+#include <algorithm>
+#include <limits>
 
-Tensor<float> relu(const Tensor<float> &input)
+namespace
 {
-    ScopedTimer timer(OpType::RELU);
-
-    Tensor<float> output = input; // 拷贝
-    float* ptr = output.data();
-    int total = output.total_size();
-    for(int i=0; i<total; i++){
-        if(ptr[i] < 0.f) {
-            ptr[i] = 0.f;
+    const float kNoBound = std::numeric_limits<float>::infinity();
+
+    // out[i] = min(max(in[i], 0), hi)
+    void clamp_into(const Tensor<float> &input, Tensor<float> &output, float hi)
+    {
+        ScopedTimer timer(OpType::RELU);
+
+        // any layout: padded lanes are zero and stay zero
+        Tensor<float> in = input.dense();
+        output.ensure_shape(in.shape(), in.layout());
+        const float *src = in.data();
+        float *dst = output.data();
+        int total = in.storage_size();
+        for (int i = 0; i < total; i++)
+        {
+            dst[i] = std::min(std::max(src[i], 0.f), hi);
         }
     }
+
+    void require_dense(const Tensor<float> &x, const char *op)
+    {
+        if (!x.is_dense())
+        {
+            throw std::runtime_error(std::string(op) + ": tensor must be dense");
+        }
+    }
+}
+
+Tensor<float> relu(const Tensor<float> &input)
+{
+    Tensor<float> output;
+    relu_into(input, output);
     return output;
 }
 
 Tensor<float> relu6(const Tensor<float> &input)
 {
-    ScopedTimer timer(OpType::RELU);
-
-    Tensor<float> output = input;
-    float* ptr = output.data();
-    int total = output.total_size();
-    for(int i=0; i<total; i++){
-        if(ptr[i] < 0.f) {
-            ptr[i] = 0.f;
-        } else if(ptr[i] > 6.f) {
-            ptr[i] = 6.f;
-        }
-    }
+    Tensor<float> output;
+    relu6_into(input, output);
     return output;
-}
\ No newline at end of file
+}
+
+void relu_into(const Tensor<float> &input, Tensor<float> &output)
+{
+    clamp_into(input, output, kNoBound);
+}
+
+void relu6_into(const Tensor<float> &input, Tensor<float> &output)
+{
+    clamp_into(input, output, 6.f);
+}
+
+void relu_inplace(Tensor<float> &x)
+{
+    require_dense(x, "relu_inplace");
+    clamp_into(x, x, kNoBound);
+}
+
+void relu6_inplace(Tensor<float> &x)
+{
+    require_dense(x, "relu6_inplace");
+    clamp_into(x, x, 6.f);
+}
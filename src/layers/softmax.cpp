@@ -3,30 +3,38 @@
 #include <cmath>
 
 Tensor<float> softmax(const Tensor<float> &input)
+{
+    Tensor<float> output;
+    softmax_into(input, output);
+    return output;
+}
+
+void softmax_into(const Tensor<float> &input, Tensor<float> &output)
 {
     ScopedTimer timer(OpType::OTHERS);
 
-    int N = input.shape()[0];
-    int C = input.shape()[1];
+    // holds the input while output (possibly the same tensor) is set up
+    Tensor<float> in = input.contiguous();
+    int N = in.shape()[0];
+    int C = in.shape()[1];
 
-    Tensor<float> output(std::vector<int>{N, C});
+    output.ensure_shape({N, C});
     for(int n=0; n<N; n++){
         float max_val = -1e30f;
         for(int c=0; c<C; c++){
-            float v = input.at4d(n,c,0,0);
+            float v = in.at4d(n,c,0,0);
             if(v>max_val) max_val=v;
         }
         double sum_exp = 0.0;
         for(int c=0; c<C; c++){
-            float v = input.at4d(n,c,0,0);
+            float v = in.at4d(n,c,0,0);
             double e = std::exp((double)v - (double)max_val);
             sum_exp += e;
         }
         for(int c=0; c<C; c++){
-            float v = input.at4d(n,c,0,0);
+            float v = in.at4d(n,c,0,0);
             double e = std::exp((double)v - (double)max_val);
             output.at4d(n,c,0,0) = (float)(e / sum_exp);
         }
     }
-    return output;
 }
\ No newline at end of file
@@ -1,9 +1,22 @@
 #include <iostream>
+#include <cstdlib>
+#include <string>
+#include <chrono>
 #include "models/resnet50.hpp"
 #include "models/mobilenet.hpp"
 #include "models/bert.hpp"
 #include "models/deit-t.hpp"
 #include "common/time_utils.hpp"
+#include "common/matmul.hpp"
+#include "common/qgemm.hpp"
+#include "common/plan_cache.hpp"
+#include "common/core_groups.hpp"
+#include "common/load_generator.hpp"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <sys/stat.h>
 
 void output_time(int freq)
 {
@@ -25,6 +38,299 @@ void output_time(int freq)
               << "==============================" << std::endl;
 }
 
+void output_arena(const ActivationArena &arena)
+{
+    std::cout << "activations: planned peak " << arena.peak_bytes() / (1024.0 * 1024.0)
+              << " MB, unplanned " << arena.unplanned_bytes() / (1024.0 * 1024.0)
+              << " MB, " << arena.num_buffers() << " buffers\n";
+}
+
+/**
+ * POLY_PLAN_DIR=dir: take the prepared model from its plan in dir (see
+ * common/plan_cache.hpp) instead of running `prepare`, or run it and a
+ * warm-up forward pass on `input` and store the plan there. `config`
+ * names what the preparation depends on besides the model and input.
+ */
+template <typename Model, typename Prepare>
+void prepare_model(Model &model, const std::string &name, const std::string &config,
+                   const Tensor<float> &input, Prepare prepare)
+{
+    const char *dir = std::getenv("POLY_PLAN_DIR");
+    if (!dir)
+    {
+        prepare();
+        return;
+    }
+    std::vector<int> shape(input.shape().begin(), input.shape().end());
+    std::string key = plan_key(name, config, shape);
+    auto t0 = std::chrono::steady_clock::now();
+    bool hit = prepare_cached(model, dir, key, prepare, [&]
+                              { model.forward(input); });
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - t0;
+    printf("plan cache: %s %s in %.3f ms\n", hit ? "loaded" : "miss, prepared and stored",
+           plan_path(dir, key).c_str(), ms.count());
+}
+
+/**
+ * POLY_CORE_GROUPS=n: serve POLY_GROUP_REQUESTS (default 4n) requests
+ * for `input` from this one model on n core groups at once (see
+ * CoreGroups), one ExecutionContext per group, against the same
+ * requests run one after another on all threads.
+ */
+template <typename Model>
+void run_core_groups(const Model &model, const Tensor<float> &input)
+{
+    const char *env = std::getenv("POLY_CORE_GROUPS");
+    if (!env)
+    {
+        return;
+    }
+    const int num_groups = std::max(1, std::atoi(env));
+    const char *requests_env = std::getenv("POLY_GROUP_REQUESTS");
+    const int requests = requests_env ? std::max(1, std::atoi(requests_env)) : 4 * num_groups;
+
+    ExecutionContext ctx;
+    Tensor<float> reference = model.forward(input, ctx).contiguous();
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < requests; r++)
+    {
+        model.forward(input, ctx);
+    }
+    std::chrono::duration<double, std::milli> serial_ms = std::chrono::steady_clock::now() - t0;
+
+    CoreGroups groups(num_groups);
+    if (groups.pin_failures() > 0)
+    {
+        printf("core groups: %d threads could not be pinned and run unpinned\n", groups.pin_failures());
+    }
+    std::vector<ExecutionContext> contexts(num_groups);
+    std::vector<Tensor<float>> outputs(requests);
+    auto serve = [&]()
+    {
+        std::vector<std::future<void>> done;
+        for (int r = 0; r < requests; r++)
+        {
+            done.push_back(groups.submit([&, r](int g)
+                                         { outputs[r] = model.forward(input, contexts[g]); }));
+        }
+        for (auto &d : done)
+        {
+            d.get();
+        }
+    };
+    serve(); // plans each group's arena
+    t0 = std::chrono::steady_clock::now();
+    serve();
+    std::chrono::duration<double, std::milli> groups_ms = std::chrono::steady_clock::now() - t0;
+
+    float max_diff = 0.f;
+    for (const auto &out : outputs)
+    {
+        Tensor<float> o = out.contiguous();
+        for (int i = 0; i < o.total_size(); i++)
+        {
+            max_diff = std::max(max_diff, std::fabs(o[i] - reference[i]));
+        }
+    }
+    printf("core groups: %d x %d threads, %d requests in %.1f ms (%.1f req/s); "
+           "one after another on %d threads: %.1f ms (%.1f req/s); max diff %g\n",
+           groups.num_groups(), groups.threads_per_group(), requests, groups_ms.count(),
+           requests * 1000.0 / groups_ms.count(), get_num_threads(), serial_ms.count(),
+           requests * 1000.0 / serial_ms.count(), max_diff);
+}
+
+double env_number(const char *name, double fallback)
+{
+    const char *env = std::getenv(name);
+    return env ? std::atof(env) : fallback;
+}
+
+/**
+ * POLY_SERVE=1: serve single-image requests from this one model with a
+ * BatchingServer (POLY_MAX_BATCH, default 8; POLY_MAX_DELAY_MS, default
+ * 2; POLY_CORE_GROUPS workers, default 1) under the load generator:
+ * POLY_SERVE_RATE requests/s (default 0, closed loop) from
+ * POLY_SERVE_CLIENTS clients (default 16) for POLY_SERVE_SECONDS
+ * (default 3). `input` is one request, [1, ...].
+ */
+template <typename Model>
+void run_server(const Model &model, const Tensor<float> &input)
+{
+    if (!std::getenv("POLY_SERVE"))
+    {
+        return;
+    }
+    BatchingOptions options;
+    options.max_batch = (int)env_number("POLY_MAX_BATCH", 8);
+    options.max_delay_ms = env_number("POLY_MAX_DELAY_MS", 2.0);
+    options.num_groups = (int)env_number("POLY_CORE_GROUPS", 1);
+    LoadOptions load;
+    load.rate = env_number("POLY_SERVE_RATE", 0.0);
+    load.clients = (int)env_number("POLY_SERVE_CLIENTS", 16);
+    load.seconds = env_number("POLY_SERVE_SECONDS", 3.0);
+
+    BatchingServer server([&](const Tensor<float> &batch, ExecutionContext &ctx)
+                          { return model.forward(batch, ctx); },
+                          options);
+    LoadResult r = generate_load(server, [&](int, long long)
+                                 { return input; },
+                                 load);
+    if (load.rate > 0.0)
+        printf("load: open loop at %.1f requests/s, %d clients, %.1f s\n", load.rate, load.clients, load.seconds);
+    else
+        printf("load: closed loop, %d clients, %.1f s\n", load.clients, load.seconds);
+    printf("served %lld of %lld requests (%lld failed, %lld rejected) in %.2f s: %.1f requests/s\n",
+           r.completed, r.sent, r.failed, r.rejected, r.seconds, r.throughput());
+    server.report(std::cout);
+}
+
+/**
+ * POLY_CHECKPOINT_DIR=dir: map the weights from dir/<name>.ckpt (see
+ * common/checkpoint.hpp); call before prepare(). POLY_EXPORT_DIR=dir:
+ * write them to dir/<name>.ckpt.
+ */
+template <typename Model>
+void checkpoint_io(Model &model, const std::string &name)
+{
+    if (const char *dir = std::getenv("POLY_CHECKPOINT_DIR"))
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        model.load(std::string(dir) + "/" + name + ".ckpt");
+        std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - t0;
+        printf("checkpoint: mapped %s/%s.ckpt in %.3f ms\n", dir, name.c_str(), ms.count());
+    }
+    if (const char *dir = std::getenv("POLY_EXPORT_DIR"))
+    {
+        model.save(std::string(dir) + "/" + name + ".ckpt");
+        printf("checkpoint: wrote %s/%s.ckpt\n", dir, name.c_str());
+    }
+}
+
+// what the weights come from, for the plan key: the checkpoint (path,
+// size and mtime) or the built-in initialisation
+std::string weights_source(const std::string &name)
+{
+    const char *dir = std::getenv("POLY_CHECKPOINT_DIR");
+    if (!dir)
+    {
+        return "params=init";
+    }
+    std::string path = std::string(dir) + "/" + name + ".ckpt";
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return "params=" + path;
+    }
+    return "params=" + path + ":" + std::to_string((long long)st.st_size) + ":" +
+           std::to_string((long long)st.st_mtime);
+}
+
+/**
+ * The built-in initialisation leaves every weight and the demo inputs
+ * zero, so an accuracy report run on them measures nothing: every error
+ * is 0. The reports run on a separate copy of the model instead, with
+ * the checkpoint's weights or random ones, and a random input.
+ */
+// uniform(-b, b) in every "*.weight" tensor, b = sqrt(3 / fan_in) with
+// fan_in all but the first dimension (weight variance 1 / fan_in), so
+// the logits stay small enough for the softmax not to saturate; biases
+// and BatchNorm statistics stay as they are
+void randomize_weights(const std::vector<ModelParam> &params, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    const std::string suffix = ".weight";
+    for (const ModelParam &p : params)
+    {
+        if (!p.tensor || p.tensor->total_size() == 0 || p.name.size() < suffix.size() ||
+            p.name.compare(p.name.size() - suffix.size(), suffix.size(), suffix) != 0)
+        {
+            continue;
+        }
+        Tensor<float> &w = *p.tensor;
+        const float bound = std::sqrt(3.0f * w.shape()[0] / w.total_size());
+        std::uniform_real_distribution<float> dist(-bound, bound);
+        for (int i = 0; i < w.total_size(); i++)
+        {
+            w[i] = dist(rng);
+        }
+    }
+}
+
+// a prepared copy of the model for the reports, and its random input
+template <typename Model, typename Prepare>
+std::unique_ptr<Model> report_model(const std::string &name, Tensor<float> &input, Prepare prepare)
+{
+    std::unique_ptr<Model> model(new Model{DeferPrepare()});
+    if (const char *dir = std::getenv("POLY_CHECKPOINT_DIR"))
+    {
+        model->load(std::string(dir) + "/" + name + ".ckpt");
+    }
+    else
+    {
+        randomize_weights(model->parameters(), 1);
+    }
+    prepare(*model);
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (int i = 0; i < input.total_size(); i++)
+    {
+        input[i] = dist(rng);
+    }
+    return model;
+}
+
+/**
+ * POLY_INT8=1: calibrate the CNN on `input`, quantize every conv and run
+ * it again in int8; POLY_QUANT_REPORT=1 also prints the per-layer drift,
+ * measured on a report_model prepared by `prepare`. Needs the NCHW
+ * layout. With POLY_PLAN_DIR the quantized model is cached too, under
+ * `config` + ";int8".
+ */
+template <typename Model, typename Prepare>
+void run_int8(Model &model, const Tensor<float> &input, TensorLayout layout, int freq,
+              const std::string &name, const std::string &config, Prepare prepare)
+{
+    if (!std::getenv("POLY_INT8") && !std::getenv("POLY_QUANT_REPORT"))
+    {
+        return;
+    }
+    if (layout != TensorLayout::NCHW)
+    {
+        printf("int8 needs the nchw layout, skipped\n");
+        return;
+    }
+    if (std::getenv("POLY_QUANT_REPORT"))
+    {
+        Tensor<float> report_input(input.shape());
+        auto report = report_model<Model>(name, report_input, prepare);
+        ActivationRanges report_ranges;
+        {
+            CalibrationScope scope(report_ranges);
+            report->forward(report_input);
+        }
+        report->quantization_report(report_input, report_ranges, std::cout);
+    }
+    if (std::getenv("POLY_INT8"))
+    {
+        ActivationRanges ranges;
+        prepare_model(model, name, config + ";int8", input, [&]
+                      {
+                          {
+                              CalibrationScope scope(ranges);
+                              model.forward(input);
+                          }
+                          model.quantize(ranges); });
+        model.forward(input);
+        GlobalProfiler::instance().reset();
+        {
+            ScopedTimer t(OpType::OVERALL);
+            model.forward(input);
+        }
+        std::cout << "int8:\n";
+        output_time(freq);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int freq = 80000; // Cycle per ms
@@ -33,14 +339,44 @@ int main(int argc, char **argv)
         freq = std::stoi(argv[1]);
     }
     printf("CPU frequency: %d\n", freq);
+    printf("GEMM kernel: %s\n", matmul_kernel_name());
+    printf("int8 GEMM kernel: %s\n", qgemm_kernel_name());
+    printf("Threads: %d\n", get_num_threads());
+
+    // POLY_LAYOUT=nhwc|nchw8c|nchw16c: activation layout of the CNNs,
+    // "blocked" for the one this CPU's conv kernels are vectorised for
+    TensorLayout layout = TensorLayout::NCHW;
+    const char *layout_env = std::getenv("POLY_LAYOUT");
+    if (layout_env && std::string(layout_env) == "blocked")
+    {
+        layout = conv2d_blocked_layout();
+    }
+    else if (layout_env && !layout_from_name(layout_env, layout))
+    {
+        printf("unknown POLY_LAYOUT '%s', using nchw\n", layout_env);
+    }
+    printf("CNN layout: %s\n", layout_name(layout));
+
+    // POLY_WEIGHTS=fp16|bf16: storage of the packed GEMM weights
+    WeightPrecision precision = WeightPrecision::FP32;
+    const char *weights_env = std::getenv("POLY_WEIGHTS");
+    if (weights_env && !precision_from_name(weights_env, precision))
+    {
+        printf("unknown POLY_WEIGHTS '%s', using fp32\n", weights_env);
+    }
+    printf("GEMM weights: %s\n", precision_name(precision));
     printf("===== Start Inference =====\n");
 
     printf("\n====== (1) ResNet50 ======\n");
     GlobalProfiler::instance().reset();
 
-    ResNet50 model;
-
+    ResNet50 model{DeferPrepare()};
+    checkpoint_io(model, "resnet50");
     Tensor<float> input(std::vector<int>{1, 3, 224, 224});
+    const std::string config = weights_source("resnet50") + ";fold_bn=1;layout=" +
+                               layout_name(layout) + ";weights=" + precision_name(precision);
+    prepare_model(model, "resnet50", config, input, [&]
+                  { model.prepare(true, layout, precision); });
 
     {
         ScopedTimer t(OpType::OVERALL);
@@ -53,13 +389,31 @@ int main(int argc, char **argv)
                   << output.shape()[3] << ")\n";
     }
     output_time(freq);
+    output_arena(model.activation_arena());
+
+    // POLY_WINOGRAD_REPORT=1: per-layer Winograd error against the direct conv
+    if (std::getenv("POLY_WINOGRAD_REPORT"))
+    {
+        Tensor<float> report_input(input.shape());
+        auto report = report_model<ResNet50>("resnet50", report_input, [&](ResNet50 &m)
+                                             { m.prepare(true, layout, precision); });
+        report->winograd_report(report_input, std::cout);
+    }
+    run_core_groups(model, input);
+    run_server(model, input);
+    run_int8(model, input, layout, freq, "resnet50", config, [&](ResNet50 &m)
+             { m.prepare(true, layout, precision); });
 
     printf("\n====== (2) MobileNetV2 ======\n");
     GlobalProfiler::instance().reset();
 
-    MobileNetV2 model2;
-
+    MobileNetV2 model2{DeferPrepare()};
+    checkpoint_io(model2, "mobilenetv2");
     Tensor<float> input2(std::vector<int>{1, 3, 224, 224});
+    const std::string config2 = weights_source("mobilenetv2") + ";fold_bn=1;layout=" +
+                                layout_name(layout) + ";weights=" + precision_name(precision);
+    prepare_model(model2, "mobilenetv2", config2, input2, [&]
+                  { model2.prepare(true, layout, precision); });
 
     {
         ScopedTimer t(OpType::OVERALL);
@@ -72,11 +426,18 @@ int main(int argc, char **argv)
                   << output2.shape()[3] << ")\n";
     }
     output_time(freq);
+    output_arena(model2.activation_arena());
+    run_core_groups(model2, input2);
+    run_server(model2, input2);
+    run_int8(model2, input2, layout, freq, "mobilenetv2", config2, [&](MobileNetV2 &m)
+             { m.prepare(true, layout, precision); });
 
     // printf("\n====== (3) BERT ======\n");
     // GlobalProfiler::instance().reset();
 
     // BertModel bert;
+    // checkpoint_io(bert, "bert");
+    // bert.prepare(precision);
 
     // Tensor<float> token_ids({1, 128});
     // Tensor<float> pos_ids({1, 128});
@@ -97,12 +458,15 @@ int main(int argc, char **argv)
     //               << out.shape()[2] << ")\n";
     // }
     // output_time(freq);
+    // output_arena(bert.activation_arena());
 
     // printf("\n====== (4) DeiT-Tiny ======\n");
     // GlobalProfiler::instance().reset();
 
     // // create DeiT-Tiny
     // DeiTTiny model3;
+    // checkpoint_io(model3, "deit-tiny");
+    // model3.prepare(precision);
 
     // // construct dummy input => [N=1, C=3, H=224, W=224]
     // Tensor<float> input3({1, 3, 224, 224});
@@ -119,6 +483,7 @@ int main(int argc, char **argv)
     //               << outs[1].shape()[0] << ", " << outs[1].shape()[1] << ")\n";
     // }
     // output_time(freq);
+    // output_arena(model3.activation_arena());
 
     printf("===== End Inference =====\n");
 
@@ -1,48 +1,52 @@
 #include "models/bert.hpp"
 #include <stdexcept>
+#include <utility>
 
 Tensor<float> BertEncoderLayer::forward(const Tensor<float> &x) const
 {
-    auto attn_out = multi_head_self_attention(x, mha);
+    Tensor<float> out;
+    forward_into(x, out);
+    return out;
+}
 
-    int N = x.shape()[0];
-    int S = x.shape()[1];
-    int D = x.shape()[2];
+void BertEncoderLayer::forward_into(const Tensor<float> &x, Tensor<float> &out) const
+{
+    // h = ln1(attn(x) + x), in the attention output
+    Tensor<float> h;
+    multi_head_self_attention_into(x, mha, h);
+    add_inplace(h, x);
+    layernorm_into(h, ln1, h);
+
+    // out = ln2(ff(h) + h)
+    feed_forward_into(h, ff, out);
+    add_inplace(out, h);
+    layernorm_into(out, ln2, out);
+}
 
-    // residual
-    Tensor<float> res1({N, S, D});
-    for (int n = 0; n < N; n++)
-    {
-        for (int s = 0; s < S; s++)
-        {
-            for (int d = 0; d < D; d++)
-            {
-                float v = attn_out.at4d(n, s, d, 0) + x.at4d(n, s, d, 0);
-                res1.at4d(n, s, d, 0) = v;
-            }
-        }
-    }
-    auto ln1_out = layernorm(res1, ln1);
+void BertEncoderLayer::list_params(std::vector<ModelParam> &params, const std::string &prefix)
+{
+    ::list_params(params, prefix + ".attn", mha);
+    ::list_params(params, prefix + ".ln1", ln1);
+    ::list_params(params, prefix + ".ff", ff);
+    ::list_params(params, prefix + ".ln2", ln2);
+}
 
-    auto ff_out = feed_forward(ln1_out, ff);
-    Tensor<float> res2({N, S, D});
-    for (int n = 0; n < N; n++)
-    {
-        for (int s = 0; s < S; s++)
-        {
-            for (int d = 0; d < D; d++)
-            {
-                float v = ff_out.at4d(n, s, d, 0) + ln1_out.at4d(n, s, d, 0);
-                res2.at4d(n, s, d, 0) = v;
-            }
-        }
-    }
-    auto ln2_out = layernorm(res2, ln2);
-    return ln2_out;
+void BertEncoderLayer::plan_io(PlanArchive &ar, const std::string &prefix)
+{
+    ::plan_io(ar, prefix + ".attn", mha);
+    ::plan_io(ar, prefix + ".ff", ff);
 }
 
 BertModel::BertModel()
+    : BertModel(DeferPrepare())
+{
+    prepare();
+}
+
+BertModel::BertModel(DeferPrepare)
 {
+    // weights: multi-MB tensors go on transparent huge pages
+    TensorBackendScope weight_backend(huge_page_backend());
     hidden_dim_ = 768;
     num_layers_ = 12;
 
@@ -77,41 +81,139 @@ BertModel::BertModel()
         layer.ln2.gamma.resize(hidden_dim_, 1.f);
         layer.ln2.beta.resize(hidden_dim_, 0.f);
 
-        layers_.push_back(layer);
+        layers_.push_back(std::move(layer));
     }
 }
 
+void BertModel::prepare(WeightPrecision precision)
+{
+    stream_.reset();
+    for (auto &layer : layers_)
+    {
+        pack_mha_param(layer.mha, true, precision);
+        pack_ff_param(layer.ff, precision);
+    }
+}
+
+std::vector<ModelParam> BertModel::parameters()
+{
+    std::vector<ModelParam> params;
+    list_params(params, "embeddings.word", word_emb_);
+    list_params(params, "embeddings.pos", pos_emb_);
+    list_params(params, "embeddings.seg", seg_emb_);
+    list_params(params, "embeddings.ln", emb_ln_);
+    for (size_t i = 0; i < layers_.size(); i++)
+    {
+        layers_[i].list_params(params, "layer" + std::to_string(i));
+    }
+    return params;
+}
+
+void BertModel::save(const std::string &path)
+{
+    save_checkpoint(path, parameters());
+}
+
+void BertModel::load(const std::string &path)
+{
+    load_checkpoint(Checkpoint(path), parameters());
+}
+
+void BertModel::plan_io(PlanArchive &ar)
+{
+    ::plan_io(ar, parameters());
+    for (size_t i = 0; i < layers_.size(); i++)
+    {
+        layers_[i].plan_io(ar, "layer" + std::to_string(i));
+    }
+    ar.io("arena", arena_);
+}
+
+void BertModel::save_plan(const std::string &path, const std::string &key)
+{
+    PlanArchive ar(key);
+    plan_io(ar);
+    ar.write(path);
+}
+
+bool BertModel::load_plan(const std::string &path, const std::string &key)
+{
+    std::unique_ptr<Checkpoint> plan = open_plan(path, key);
+    if (!plan)
+    {
+        return false;
+    }
+    stream_.reset();
+    PlanArchive ar(*plan);
+    plan_io(ar);
+    return true;
+}
+
+bool BertModel::stream_plan(const std::string &path, const std::string &key,
+                     const WeightStreamOptions &options)
+{
+    // no readahead: the stream pages the layers in itself
+    std::unique_ptr<Checkpoint> plan = open_plan(path, key, false);
+    if (!plan)
+    {
+        return false;
+    }
+    stream_.reset();
+    {
+        PlanArchive ar(*plan);
+        plan_io(ar);
+    }
+    std::vector<std::string> prefix;
+    for (size_t i = 0; i < layers_.size(); i++)
+    {
+        prefix.push_back("layer" + std::to_string(i) + ".");
+    }
+    stream_.reset(new WeightStream(std::move(plan), prefix, options));
+    return true;
+}
+
 Tensor<float> BertModel::forward(const Tensor<float> &token_ids,
                                  const Tensor<float> &pos_ids,
                                  const Tensor<float> &seg_ids)
 {
-    auto w_embed = embedding_forward(token_ids, word_emb_);
-    auto p_embed = embedding_forward(pos_ids, pos_emb_);
-    auto s_embed = embedding_forward(seg_ids, seg_emb_);
+    ArenaScope arena_scope(arena_);
+    return run(token_ids, pos_ids, seg_ids);
+}
 
-    int N = w_embed.shape()[0];
-    int S = w_embed.shape()[1];
-    int D = w_embed.shape()[2];
+Tensor<float> BertModel::forward(const Tensor<float> &token_ids,
+                                 const Tensor<float> &pos_ids,
+                                 const Tensor<float> &seg_ids,
+                                 ExecutionContext &ctx) const
+{
+    ExecutionScope scope(ctx);
+    return run(token_ids, pos_ids, seg_ids);
+}
 
-    Tensor<float> sum_emb({N, S, D});
-    for (int n = 0; n < N; n++)
+Tensor<float> BertModel::run(const Tensor<float> &token_ids,
+                             const Tensor<float> &pos_ids,
+                             const Tensor<float> &seg_ids) const
+{
+    std::unique_lock<std::mutex> streaming;
+    if (stream_)
     {
-        for (int s = 0; s < S; s++)
-        {
-            for (int d = 0; d < D; d++)
-            {
-                float val = w_embed.at4d(n, s, d, 0) + p_embed.at4d(n, s, d, 0) + s_embed.at4d(n, s, d, 0);
-                sum_emb.at4d(n, s, d, 0) = val;
-            }
-        }
+        streaming = std::unique_lock<std::mutex>(stream_->pass_mutex());
     }
-
-    auto emb_out = layernorm(sum_emb, emb_ln_);
-
-    auto x = emb_out;
-    for (auto &layer : layers_)
+    // x = ln(word + pos + seg), summed and normalized in place
+    Tensor<float> x, e;
+    embedding_forward_into(token_ids, word_emb_, x);
+    embedding_forward_into(pos_ids, pos_emb_, e);
+    add_inplace(x, e);
+    embedding_forward_into(seg_ids, seg_emb_, e);
+    add_inplace(x, e);
+    layernorm_into(x, emb_ln_, x);
+
+    // encoder layers ping-pong between x and y
+    Tensor<float> y;
+    for (size_t i = 0; i < layers_.size(); i++)
     {
-        x = layer.forward(x);
+        WeightStreamScope streamed(stream_.get(), (int)i);
+        layers_[i].forward_into(x, y);
+        std::swap(x, y);
     }
     return x;
 }
\ No newline at end of file
@@ -5,52 +5,55 @@
 #include "common/time_utils.hpp"
 #include <cmath>
 #include <stdexcept>
+#include <utility>
 
 // ----- DeiTEncoderLayer -----
 Tensor<float> DeiTEncoderLayer::forward(const Tensor<float> &x) const
 {
-    // self-attn
-    auto attn_out = multi_head_self_attention(x, mha);
-    // add+ln
-    int N = x.shape()[0];
-    int L = x.shape()[1];
-    int D = x.shape()[2];
-    Tensor<float> res1({N, L, D});
-    for (int n = 0; n < N; n++)
-    {
-        for (int l = 0; l < L; l++)
-        {
-            for (int d = 0; d < D; d++)
-            {
-                float v = attn_out.at4d(n, l, d, 0) + x.at4d(n, l, d, 0);
-                res1.at4d(n, l, d, 0) = v;
-            }
-        }
-    }
-    auto ln1_out = layernorm(res1, ln1);
+    Tensor<float> out;
+    forward_into(x, out);
+    return out;
+}
 
-    // feedforward
-    auto ff_out = feed_forward(ln1_out, ff);
-    // add+ln
-    Tensor<float> res2({N, L, D});
-    for (int n = 0; n < N; n++)
-    {
-        for (int l = 0; l < L; l++)
-        {
-            for (int d = 0; d < D; d++)
-            {
-                float v = ff_out.at4d(n, l, d, 0) + ln1_out.at4d(n, l, d, 0);
-                res2.at4d(n, l, d, 0) = v;
-            }
-        }
-    }
-    auto ln2_out = layernorm(res2, ln2);
-    return ln2_out;
+void DeiTEncoderLayer::forward_into(const Tensor<float> &x, Tensor<float> &out) const
+{
+    // self-attn, then add+ln in place
+    Tensor<float> h;
+    multi_head_self_attention_into(x, mha, h);
+    add_inplace(h, x);
+    layernorm_into(h, ln1, h);
+
+    // feedforward, then add+ln in place
+    feed_forward_into(h, ff, out);
+    add_inplace(out, h);
+    layernorm_into(out, ln2, out);
 }
 
 // ----- DeiTTiny -----
+void DeiTEncoderLayer::list_params(std::vector<ModelParam> &params, const std::string &prefix)
+{
+    ::list_params(params, prefix + ".attn", mha);
+    ::list_params(params, prefix + ".ln1", ln1);
+    ::list_params(params, prefix + ".ff", ff);
+    ::list_params(params, prefix + ".ln2", ln2);
+}
+
+void DeiTEncoderLayer::plan_io(PlanArchive &ar, const std::string &prefix)
+{
+    ::plan_io(ar, prefix + ".attn", mha);
+    ::plan_io(ar, prefix + ".ff", ff);
+}
+
 DeiTTiny::DeiTTiny()
+    : DeiTTiny(DeferPrepare())
+{
+    prepare();
+}
+
+DeiTTiny::DeiTTiny(DeferPrepare)
 {
+    // weights: multi-MB tensors go on transparent huge pages
+    TensorBackendScope weight_backend(huge_page_backend());
     // config
     embed_dim_ = 192;
     depth_ = 12;
@@ -100,7 +103,7 @@ DeiTTiny::DeiTTiny()
         layer.ln2.gamma.resize(embed_dim_, 1.f);
         layer.ln2.beta.resize(embed_dim_, 0.f);
 
-        layers_.push_back(layer);
+        layers_.push_back(std::move(layer));
     }
 
     // final LN
@@ -114,10 +117,121 @@ DeiTTiny::DeiTTiny()
     dist_head_.bias.resize(1000, 0.f);
 }
 
+void DeiTTiny::prepare(WeightPrecision precision)
+{
+    stream_.reset();
+    for (auto &layer : layers_)
+    {
+        pack_mha_param(layer.mha, true, precision);
+        pack_ff_param(layer.ff, precision);
+    }
+    head_packed_ = PackedMatrix::pack_b(head_.weight.data(), embed_dim_, 1000, 1000, precision);
+    dist_head_packed_ = PackedMatrix::pack_b(dist_head_.weight.data(), embed_dim_, 1000, 1000, precision);
+}
+
+std::vector<ModelParam> DeiTTiny::parameters()
+{
+    std::vector<ModelParam> params;
+    list_params(params, "patch_embed", patch_);
+    list_params(params, "cls_token", cls_token_);
+    list_params(params, "dist_token", dist_token_);
+    list_params(params, "pos_embed", pos_embed_);
+    for (size_t i = 0; i < layers_.size(); i++)
+    {
+        layers_[i].list_params(params, "layer" + std::to_string(i));
+    }
+    list_params(params, "ln", ln_);
+    list_params(params, "head", head_);
+    list_params(params, "dist_head", dist_head_);
+    return params;
+}
+
+void DeiTTiny::save(const std::string &path)
+{
+    save_checkpoint(path, parameters());
+}
+
+void DeiTTiny::load(const std::string &path)
+{
+    load_checkpoint(Checkpoint(path), parameters());
+}
+
+void DeiTTiny::plan_io(PlanArchive &ar)
+{
+    ::plan_io(ar, parameters());
+    for (size_t i = 0; i < layers_.size(); i++)
+    {
+        layers_[i].plan_io(ar, "layer" + std::to_string(i));
+    }
+    ar.io("head.packed", head_packed_);
+    ar.io("dist_head.packed", dist_head_packed_);
+    ar.io("arena", arena_);
+}
+
+void DeiTTiny::save_plan(const std::string &path, const std::string &key)
+{
+    PlanArchive ar(key);
+    plan_io(ar);
+    ar.write(path);
+}
+
+bool DeiTTiny::load_plan(const std::string &path, const std::string &key)
+{
+    std::unique_ptr<Checkpoint> plan = open_plan(path, key);
+    if (!plan)
+    {
+        return false;
+    }
+    stream_.reset();
+    PlanArchive ar(*plan);
+    plan_io(ar);
+    return true;
+}
+
+bool DeiTTiny::stream_plan(const std::string &path, const std::string &key,
+                     const WeightStreamOptions &options)
+{
+    // no readahead: the stream pages the layers in itself
+    std::unique_ptr<Checkpoint> plan = open_plan(path, key, false);
+    if (!plan)
+    {
+        return false;
+    }
+    stream_.reset();
+    {
+        PlanArchive ar(*plan);
+        plan_io(ar);
+    }
+    std::vector<std::string> prefix;
+    for (size_t i = 0; i < layers_.size(); i++)
+    {
+        prefix.push_back("layer" + std::to_string(i) + ".");
+    }
+    stream_.reset(new WeightStream(std::move(plan), prefix, options));
+    return true;
+}
+
 std::vector<Tensor<float>> DeiTTiny::forward(const Tensor<float> &input)
+{
+    ArenaScope arena_scope(arena_);
+    return run(input);
+}
+
+std::vector<Tensor<float>> DeiTTiny::forward(const Tensor<float> &input, ExecutionContext &ctx) const
+{
+    ExecutionScope scope(ctx);
+    return run(input);
+}
+
+std::vector<Tensor<float>> DeiTTiny::run(const Tensor<float> &input) const
 {
     // input: [N,3,224,224]
     ScopedTimer t_deit(OpType::OTHERS);
+    std::unique_lock<std::mutex> streaming;
+    if (stream_)
+    {
+        streaming = std::unique_lock<std::mutex>(stream_->pass_mutex());
+    }
 
     int N = input.shape()[0];
     int C = input.shape()[1];
@@ -134,7 +248,7 @@ std::vector<Tensor<float>> DeiTTiny::forward(const Tensor<float> &input)
     // 2) cat cls_token + dist_token => shape [N, 2+num_patches, embed_dim]
     //    cls_token_, dist_token_ are [1,1,embed_dim], so we broadcast along batch
     int L = 2 + num_patches_;
-    Tensor<float> x_cat({N, L, embed_dim_});
+    Tensor<float> x_cat({N, L, embed_dim_}, TensorInit::UNINITIALIZED);
     for (int n = 0; n < N; n++)
     {
         // first row => cls_token
@@ -174,73 +288,54 @@ std::vector<Tensor<float>> DeiTTiny::forward(const Tensor<float> &input)
         }
     }
 
-    // 4) pass through 12 transformer layers
-    auto z = x_cat;
-    for (auto &layer : layers_)
+    // 4) pass through 12 transformer layers, ping-pong between z and z_next
+    Tensor<float> z = std::move(x_cat);
+    Tensor<float> z_next;
+    for (size_t i = 0; i < layers_.size(); i++)
     {
-        z = layer.forward(z);
+        WeightStreamScope streamed(stream_.get(), (int)i);
+        layers_[i].forward_into(z, z_next);
+        std::swap(z, z_next);
     }
 
     // 5) final LN
     // shape => [N,L,embed_dim_]
-    // LN over last dim => reuse layernorm
-    // create a new LN param or use ln_
-    auto ln_out = layernorm(z, ln_);
+    // LN over last dim, in place
+    layernorm_into(z, ln_, z);
+    const Tensor<float> &ln_out = z;
 
     // 6) cls_token => ln_out[:,0,:], dist_token => ln_out[:,1,:]
-    // then feed each into linear head => logits => [N,1000]
-    Tensor<float> cls_in({N, embed_dim_});
-    Tensor<float> dist_in({N, embed_dim_});
-    for (int n = 0; n < N; n++)
-    {
-        for (int d = 0; d < embed_dim_; d++)
-        {
-            cls_in.at4d(n, d, 0, 0) = ln_out.at4d(n, 0, d, 0);
-            dist_in.at4d(n, d, 0, 0) = ln_out.at4d(n, 1, d, 0);
-        }
-    }
-    // linear => logits
-    // head_.weight => [1000, embed_dim_], bias=>[1000]
-    // => out => [N,1000]
-    auto cls_logits = Tensor<float>({N, 1000});
+    // as [N, embed_dim_] views with row stride L*embed_dim_, then each
+    // into its linear head => logits => [N,1000]
+    Tensor<float> cls_in = ln_out.slice(1, 0, 1).squeeze(1);
+    Tensor<float> dist_in = ln_out.slice(1, 1, 2).squeeze(1);
+    // head_.weight / dist_head_.weight read as [embed_dim_, 1000], bias=>[1000]
+    // => (N,embed_dim_)*(embed_dim_,1000) + bias => (N,1000)
+    auto head = [&](const Tensor<float> &in, const LinearParam &param, const PackedMatrix &packed)
     {
-        const float *Ap = cls_in.data();
-        const float *Bp = head_.weight.data();
-        float *Cp = cls_logits.data();
-        // matmul => (N,embed_dim_)*(embed_dim_,1000) => (N,1000)
-        ::matmul(Ap, Bp, Cp, N, embed_dim_, 1000);
-
-        // add bias
-        for (int n_i = 0; n_i < N; n_i++)
+        GemmEpilogue ep;
+        ep.per_column = true;
+        ep.shift = param.bias.data();
+        Tensor<float> logits({N, 1000}, TensorInit::UNINITIALIZED);
+        if (packed.empty())
         {
-            for (int c = 0; c < 1000; c++)
-            {
-                float val = cls_logits.at4d(n_i, c, 0, 0) + head_.bias[c];
-                cls_logits.at4d(n_i, c, 0, 0) = val;
-            }
+            sgemm(false, false, N, 1000, embed_dim_, 1.f, in.data(), in.stride(0),
+                  param.weight.data(), 1000, 0.f, logits.data(), 1000, &ep);
         }
-    }
-    // dist logits
-    auto dist_logits = Tensor<float>({N, 1000});
-    {
-        const float *Ap = dist_in.data();
-        const float *Bp = dist_head_.weight.data();
-        float *Cp = dist_logits.data();
-        ::matmul(Ap, Bp, Cp, N, embed_dim_, 1000);
-
-        for (int n_i = 0; n_i < N; n_i++)
+        else
         {
-            for (int c = 0; c < 1000; c++)
-            {
-                float val = dist_logits.at4d(n_i, c, 0, 0) + dist_head_.bias[c];
-                dist_logits.at4d(n_i, c, 0, 0) = val;
-            }
+            // the packed GEMM wants dense rows
+            Tensor<float> dense = in.contiguous();
+            matmul(dense.data(), packed, logits.data(), N, &ep);
         }
-    }
+        return logits;
+    };
+    Tensor<float> cls_logits = head(cls_in, head_, head_packed_);
+    Tensor<float> dist_logits = head(dist_in, dist_head_, dist_head_packed_);
 
     // return [cls_logits, dist_logits]
     std::vector<Tensor<float>> outs;
-    outs.push_back(cls_logits);
-    outs.push_back(dist_logits);
+    outs.push_back(std::move(cls_logits));
+    outs.push_back(std::move(dist_logits));
     return outs;
 }
\ No newline at end of file
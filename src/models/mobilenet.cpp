@@ -1,52 +1,100 @@
 #include "models/mobilenet.hpp"
 #include <cmath>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
+void InvertedResidual::prepare(bool fold_bn, TensorLayout layout, WeightPrecision precision)
+{
+    const Conv2DParam p1;
+    q_expand = q_project = QConv2DSlot();
+    if (fold_bn)
+    {
+        if (expand_ratio != 1)
+        {
+            pw_expand = pack_conv2d_weight_bn(w_expand, b_expand, bn_expand, fb_expand, p1, layout, precision);
+        }
+        fold_batchnorm(w_dwise, b_dwise, bn_dwise, fw_dwise, fb_dwise);
+        pw_project = pack_conv2d_weight_bn(w_project, b_project, bn_project, fb_project, p1, layout, precision);
+        aff_expand = aff_dwise = aff_project = BNAffine();
+        return;
+    }
+    if (expand_ratio != 1)
+    {
+        pw_expand = pack_conv2d_weight(w_expand, p1, layout, precision);
+        aff_expand = conv2d_bn_affine(b_expand, bn_expand, fb_expand);
+    }
+    fw_dwise = w_dwise;
+    aff_dwise = conv2d_bn_affine(b_dwise, bn_dwise, fb_dwise);
+    pw_project = pack_conv2d_weight(w_project, p1, layout, precision);
+    aff_project = conv2d_bn_affine(b_project, bn_project, fb_project);
+}
+
+void InvertedResidual::list_params(std::vector<ModelParam> &params, const std::string &prefix)
+{
+    if (expand_ratio != 1)
+    {
+        ::list_params(params, prefix + ".expand.weight", w_expand);
+        ::list_params(params, prefix + ".expand.bias", b_expand);
+        ::list_params(params, prefix + ".expand.bn", bn_expand);
+    }
+    ::list_params(params, prefix + ".dwise.weight", w_dwise);
+    ::list_params(params, prefix + ".dwise.bias", b_dwise);
+    ::list_params(params, prefix + ".dwise.bn", bn_dwise);
+    ::list_params(params, prefix + ".project.weight", w_project);
+    ::list_params(params, prefix + ".project.bias", b_project);
+    ::list_params(params, prefix + ".project.bn", bn_project);
+}
+
+void InvertedResidual::plan_io(PlanArchive &ar, const std::string &prefix)
+{
+    ::plan_io(ar, prefix + ".pw_expand", pw_expand);
+    ::plan_io(ar, prefix + ".pw_project", pw_project);
+    ar.io(prefix + ".fw_dwise", fw_dwise);
+    ar.io(prefix + ".fb_expand", fb_expand);
+    ar.io(prefix + ".fb_dwise", fb_dwise);
+    ar.io(prefix + ".fb_project", fb_project);
+    ::plan_io(ar, prefix + ".aff_expand", aff_expand);
+    ::plan_io(ar, prefix + ".aff_dwise", aff_dwise);
+    ::plan_io(ar, prefix + ".aff_project", aff_project);
+    ::plan_io(ar, prefix + ".q_expand", q_expand);
+    ::plan_io(ar, prefix + ".q_project", q_project);
+}
+
 Tensor<float> InvertedResidual::forward(const Tensor<float> &x) const
+{
+    Tensor<float> out;
+    forward_into(x, out);
+    return out;
+}
+
+void InvertedResidual::forward_into(const Tensor<float> &x, Tensor<float> &out) const
 {
     // expand
-    Tensor<float> out = x;
+    const Tensor<float> *in = &x;
+    Tensor<float> expanded;
     if (expand_ratio != 1)
     {
         Conv2DParam p1;
-        auto tmp = conv2d(x, w_expand, b_expand, p1);
-        tmp = batchnorm2d(tmp, bn_expand);
-        tmp = relu6(tmp);
-        out = tmp;
+        conv2d_slot_into(x, q_expand, pw_expand, fb_expand, p1, expanded,
+                         conv2d_epilogue(aff_expand, Activation::RELU6));
+        in = &expanded;
     }
     // depthwise
-    Tensor<float> dw = depthwise_conv2d_im2col(out, w_dwise, b_dwise,
-                                               stride, stride, 1, 1);
-    dw = batchnorm2d(dw, bn_dwise);
-    dw = relu6(dw);
-    // project
+    DepthwiseConv2DParam pd;
+    pd.stride_h = stride;
+    pd.stride_w = stride;
+    pd.pad_h = 1;
+    pd.pad_w = 1;
+    Tensor<float> dw;
+    depthwise_conv2d_into(*in, fw_dwise, fb_dwise, pd, dw,
+                          conv2d_epilogue(aff_dwise, Activation::RELU6));
+    // project, with the residual (proj + x) added in the epilogue
     Conv2DParam p2;
-    auto proj = conv2d(dw, w_project, b_project, p2);
-    proj = batchnorm2d(proj, bn_project);
-    // residual
-    if (stride == 1 && in_channels == out_channels)
-    {
-        // proj + x
-        int N = proj.shape()[0];
-        int C = proj.shape()[1];
-        int H = proj.shape()[2];
-        int W = proj.shape()[3];
-        for (int n = 0; n < N; n++)
-        {
-            for (int c = 0; c < C; c++)
-            {
-                for (int h = 0; h < H; h++)
-                {
-                    for (int w = 0; w < W; w++)
-                    {
-                        float val = proj.at4d(n, c, h, w) + x.at4d(n, c, h, w);
-                        proj.at4d(n, c, h, w) = val;
-                    }
-                }
-            }
-        }
-    }
-    return proj;
+    const Tensor<float> *residual = (stride == 1 && in_channels == out_channels) ? &x : nullptr;
+    conv2d_slot_into(dw, q_project, pw_project, fb_project, p2, out,
+                     conv2d_epilogue(aff_project, Activation::NONE, residual));
 }
 
 InvertedResidual MobileNetV2::make_inverted_residual(int in_c, int out_c, int stride, int expand_ratio)
@@ -87,7 +135,15 @@ InvertedResidual MobileNetV2::make_inverted_residual(int in_c, int out_c, int st
 }
 
 MobileNetV2::MobileNetV2()
+    : MobileNetV2(DeferPrepare())
+{
+    prepare();
+}
+
+MobileNetV2::MobileNetV2(DeferPrepare)
 {
+    // weights: multi-MB tensors go on transparent huge pages
+    TensorBackendScope weight_backend(huge_page_backend());
     // first conv
     first_conv_w_ = Tensor<float>(std::vector<int>{32, 3, 3, 3});
     first_conv_b_.resize(32, 0.f);
@@ -162,7 +218,159 @@ MobileNetV2::MobileNetV2()
     fc_.bias.resize(1000, 0.f);
 }
 
+void MobileNetV2::prepare(bool fold_bn, TensorLayout layout, WeightPrecision precision)
+{
+    layout_ = layout;
+    first_conv_q_ = last_conv_q_ = QConv2DSlot();
+    const Conv2DParam p;
+    if (fold_bn)
+    {
+        first_conv_pw_ = pack_conv2d_weight_bn(first_conv_w_, first_conv_b_, first_conv_bn_, first_conv_fb_, p, layout, precision);
+        last_conv_pw_ = pack_conv2d_weight_bn(last_conv_w_, last_conv_b_, last_conv_bn_, last_conv_fb_, p, layout, precision);
+        first_conv_aff_ = last_conv_aff_ = BNAffine();
+    }
+    else
+    {
+        first_conv_pw_ = pack_conv2d_weight(first_conv_w_, p, layout, precision);
+        first_conv_aff_ = conv2d_bn_affine(first_conv_b_, first_conv_bn_, first_conv_fb_);
+        last_conv_pw_ = pack_conv2d_weight(last_conv_w_, p, layout, precision);
+        last_conv_aff_ = conv2d_bn_affine(last_conv_b_, last_conv_bn_, last_conv_fb_);
+    }
+    for (auto &b : blocks_)
+    {
+        b.prepare(fold_bn, layout, precision);
+    }
+    pack_linear_param(fc_, precision);
+}
+
+std::vector<ModelParam> MobileNetV2::parameters()
+{
+    std::vector<ModelParam> params;
+    list_params(params, "first_conv.weight", first_conv_w_);
+    list_params(params, "first_conv.bias", first_conv_b_);
+    list_params(params, "first_conv.bn", first_conv_bn_);
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+        blocks_[i].list_params(params, "block" + std::to_string(i));
+    }
+    list_params(params, "last_conv.weight", last_conv_w_);
+    list_params(params, "last_conv.bias", last_conv_b_);
+    list_params(params, "last_conv.bn", last_conv_bn_);
+    list_params(params, "fc", fc_);
+    return params;
+}
+
+void MobileNetV2::save(const std::string &path)
+{
+    save_checkpoint(path, parameters());
+}
+
+void MobileNetV2::load(const std::string &path)
+{
+    load_checkpoint(Checkpoint(path), parameters());
+}
+
+void MobileNetV2::plan_io(PlanArchive &ar)
+{
+    ::plan_io(ar, parameters());
+    ar.io_enum("layout", layout_);
+    ::plan_io(ar, "first_conv.pw", first_conv_pw_);
+    ar.io("first_conv.fb", first_conv_fb_);
+    ::plan_io(ar, "first_conv.aff", first_conv_aff_);
+    ::plan_io(ar, "first_conv.q", first_conv_q_);
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+        blocks_[i].plan_io(ar, "block" + std::to_string(i));
+    }
+    ::plan_io(ar, "last_conv.pw", last_conv_pw_);
+    ar.io("last_conv.fb", last_conv_fb_);
+    ::plan_io(ar, "last_conv.aff", last_conv_aff_);
+    ::plan_io(ar, "last_conv.q", last_conv_q_);
+    ::plan_io(ar, "fc", fc_);
+    ar.io("arena", arena_);
+}
+
+void MobileNetV2::save_plan(const std::string &path, const std::string &key)
+{
+    PlanArchive ar(key);
+    plan_io(ar);
+    ar.write(path);
+}
+
+bool MobileNetV2::load_plan(const std::string &path, const std::string &key)
+{
+    std::unique_ptr<Checkpoint> plan = open_plan(path, key);
+    if (!plan)
+    {
+        return false;
+    }
+    PlanArchive ar(*plan);
+    plan_io(ar);
+    return true;
+}
+
+std::vector<QuantLayer> MobileNetV2::quant_layer_list()
+{
+    std::vector<QuantLayer> layers;
+    layers.push_back({"first_conv", &first_conv_q_, &first_conv_pw_});
+    for (size_t i = 0; i < blocks_.size(); i++)
+    {
+        InvertedResidual &b = blocks_[i];
+        const std::string prefix = "block" + std::to_string(i) + ".";
+        if (b.expand_ratio != 1)
+        {
+            layers.push_back({prefix + "expand", &b.q_expand, &b.pw_expand});
+        }
+        layers.push_back({prefix + "project", &b.q_project, &b.pw_project});
+    }
+    layers.push_back({"last_conv", &last_conv_q_, &last_conv_pw_});
+    return layers;
+}
+
+std::vector<std::string> MobileNetV2::quant_layers()
+{
+    std::vector<std::string> names;
+    for (const QuantLayer &l : quant_layer_list())
+    {
+        names.push_back(l.name);
+    }
+    return names;
+}
+
+void MobileNetV2::quantize(const ActivationRanges &ranges, const std::vector<std::string> &layers)
+{
+    if (layout_ != TensorLayout::NCHW)
+    {
+        throw std::runtime_error("MobileNetV2::quantize: int8 convs need the NCHW layout");
+    }
+    std::vector<QuantLayer> list = quant_layer_list();
+    quantize_layers(list, ranges, select_quant_layers(list, layers));
+}
+
+void MobileNetV2::quantization_report(const Tensor<float> &input, const ActivationRanges &ranges,
+                                      std::ostream &os)
+{
+    if (layout_ != TensorLayout::NCHW)
+    {
+        throw std::runtime_error("MobileNetV2::quantization_report: int8 convs need the NCHW layout");
+    }
+    ::quantization_report(quant_layer_list(), ranges,
+                          [&]() { return forward(input); }, os);
+}
+
 Tensor<float> MobileNetV2::forward(const Tensor<float> &input)
+{
+    ArenaScope arena_scope(arena_);
+    return run(input);
+}
+
+Tensor<float> MobileNetV2::forward(const Tensor<float> &input, ExecutionContext &ctx) const
+{
+    ExecutionScope scope(ctx);
+    return run(input);
+}
+
+Tensor<float> MobileNetV2::run(const Tensor<float> &input) const
 {
     // first conv
     Conv2DParam p;
@@ -170,15 +378,20 @@ Tensor<float> MobileNetV2::forward(const Tensor<float> &input)
     p.stride_w = 2; 
     p.pad_h = 1; 
     p.pad_w = 1;
-    auto x = conv2d(input, first_conv_w_, first_conv_b_, p);
-    x = batchnorm2d(x, first_conv_bn_);
-    x = relu6(x);
+    Tensor<float> x;
+    // the one layout conversion of the body; every layer keeps it
+    conv2d_slot_into(input.to_layout(layout_), first_conv_q_, first_conv_pw_, first_conv_fb_, p, x,
+                     conv2d_epilogue(first_conv_aff_, Activation::RELU6));
 
-    // inverted residual blocks
+    // inverted residual blocks; a fresh output per block lets the arena
+    // pack them tighter than two long-lived ping-pong buffers
     for (auto &b : blocks_) {
-        x = b.forward(x);
+        Tensor<float> y;
+        b.forward_into(x, y);
+        x = std::move(y);
     }
 
+    Tensor<float> y;
     // last 1x1 conv
     {
         Conv2DParam p2;
@@ -186,16 +399,14 @@ Tensor<float> MobileNetV2::forward(const Tensor<float> &input)
         p2.stride_w = 1; 
         p2.pad_h = 0; 
         p2.pad_w = 0;
-        auto tmp = conv2d(x, last_conv_w_, last_conv_b_, p2);
-        tmp = batchnorm2d(tmp, last_conv_bn_);
-        tmp = relu6(tmp);
-        x = tmp;
+        conv2d_slot_into(x, last_conv_q_, last_conv_pw_, last_conv_fb_, p2, y,
+                         conv2d_epilogue(last_conv_aff_, Activation::RELU6));
     }
 
     // global average pool via avg_pool2d
     {
-        int H = x.shape()[2];
-        int W = x.shape()[3];
+        int H = y.shape()[2];
+        int W = y.shape()[3];
         Pool2DParam pool_param;
         pool_param.kernel_h = H;
         pool_param.kernel_w = W;
@@ -203,27 +414,17 @@ Tensor<float> MobileNetV2::forward(const Tensor<float> &input)
         pool_param.stride_w = W;  
         pool_param.pad_h = 0;     
         pool_param.pad_w = 0;
-        x = avg_pool2d(x, pool_param);  // => [N, 1280, 1, 1] if width multiplier=1
+        avg_pool2d_into(y, pool_param, x);  // => [N, 1280, 1, 1] if width multiplier=1
     }
 
     // flatten => linear => softmax
     {
         int N = x.shape()[0];
-        int C = x.shape()[1]; // 1280
-        Tensor<float> flat({N, C});
-        for (int n = 0; n < N; n++) {
-            for (int c = 0; c < C; c++) {
-                flat.at4d(n, c, 0, 0) = x.at4d(n, c, 0, 0);
-            }
-        }
-        auto logits = linear(flat, fc_);
-        auto probs  = softmax(logits);
-        Tensor<float> out({N, 1000, 1, 1});
-        for (int n = 0; n < N; n++) {
-            for (int c = 0; c < 1000; c++) {
-                out.at4d(n, c, 0, 0) = probs.at4d(n, c, 0, 0);
-            }
-        }
-        return out;
+        // [N, 1280, 1, 1] viewed as [N, 1280], no copy (a copy back to
+        // NCHW when the body ran in another layout)
+        Tensor<float> probs;
+        linear_into(x.flatten(1), fc_, probs);
+        softmax_into(probs, probs);
+        return probs.view({N, 1000, 1, 1});
     }
-}
\ No newline at end of file
+}
@@ -1,66 +1,141 @@
 #include "models/resnet50.hpp"
 #include <iostream>
 #include <cmath>
+#include <utility>
+#include <stdexcept>
+#include <string>
 
-Tensor<float> Bottleneck::forward(const Tensor<float> &x) const
+void Bottleneck::prepare(bool fold_bn, TensorLayout layout, WeightPrecision precision)
 {
-    // branch
-    // 1x1 conv
-    Conv2DParam p1; // stride=1
-    Tensor<float> out = conv2d(x, w1, b1, p1);
-    out = batchnorm2d(out, bn1);
-    out = relu(out);
+    const Conv2DParam p1;
+    q1 = q2 = q3 = q_down = QConv2DSlot();
+    if(fold_bn) {
+        pw1 = pack_conv2d_weight_bn(w1, b1, bn1, fb1, p1, layout, precision);
+        pw2 = pack_conv2d_weight_bn(w2, b2, bn2, fb2, conv2_param(), layout, precision);
+        pw3 = pack_conv2d_weight_bn(w3, b3, bn3, fb3, p1, layout, precision);
+        if(use_downsample) {
+            pw_down = pack_conv2d_weight_bn(w_down, b_down, bn_down, fb_down, p1, layout, precision);
+        }
+        aff1 = aff2 = aff3 = aff_down = BNAffine();
+        return;
+    }
+    pw1 = pack_conv2d_weight(w1, p1, layout, precision);
+    pw2 = pack_conv2d_weight(w2, conv2_param(), layout, precision);
+    pw3 = pack_conv2d_weight(w3, p1, layout, precision);
+    aff1 = conv2d_bn_affine(b1, bn1, fb1);
+    aff2 = conv2d_bn_affine(b2, bn2, fb2);
+    aff3 = conv2d_bn_affine(b3, bn3, fb3);
+    if(use_downsample) {
+        pw_down = pack_conv2d_weight(w_down, p1, layout, precision);
+        aff_down = conv2d_bn_affine(b_down, bn_down, fb_down);
+    }
+}
 
-    // 3x3 conv
+Conv2DParam Bottleneck::conv2_param() const
+{
     Conv2DParam p2;
     p2.stride_h = stride;
     p2.stride_w = stride;
     p2.pad_h = 1;
     p2.pad_w = 1;
-    out = conv2d(out, w2, b2, p2);
-    out = batchnorm2d(out, bn2);
-    out = relu(out);
+    p2.algo = algo2;
+    return p2;
+}
+
+void Bottleneck::list_params(std::vector<ModelParam> &params, const std::string &prefix)
+{
+    ::list_params(params, prefix + ".conv1.weight", w1);
+    ::list_params(params, prefix + ".conv1.bias", b1);
+    ::list_params(params, prefix + ".bn1", bn1);
+    ::list_params(params, prefix + ".conv2.weight", w2);
+    ::list_params(params, prefix + ".conv2.bias", b2);
+    ::list_params(params, prefix + ".bn2", bn2);
+    ::list_params(params, prefix + ".conv3.weight", w3);
+    ::list_params(params, prefix + ".conv3.bias", b3);
+    ::list_params(params, prefix + ".bn3", bn3);
+    if(use_downsample){
+        ::list_params(params, prefix + ".downsample.weight", w_down);
+        ::list_params(params, prefix + ".downsample.bias", b_down);
+        ::list_params(params, prefix + ".downsample.bn", bn_down);
+    }
+}
 
+void Bottleneck::plan_io(PlanArchive &ar, const std::string &prefix)
+{
+    ar.io_enum(prefix + ".algo2", algo2);
+    ::plan_io(ar, prefix + ".pw1", pw1);
+    ::plan_io(ar, prefix + ".pw2", pw2);
+    ::plan_io(ar, prefix + ".pw3", pw3);
+    ::plan_io(ar, prefix + ".pw_down", pw_down);
+    ar.io(prefix + ".fb1", fb1);
+    ar.io(prefix + ".fb2", fb2);
+    ar.io(prefix + ".fb3", fb3);
+    ar.io(prefix + ".fb_down", fb_down);
+    ::plan_io(ar, prefix + ".aff1", aff1);
+    ::plan_io(ar, prefix + ".aff2", aff2);
+    ::plan_io(ar, prefix + ".aff3", aff3);
+    ::plan_io(ar, prefix + ".aff_down", aff_down);
+    ::plan_io(ar, prefix + ".q1", q1);
+    ::plan_io(ar, prefix + ".q2", q2);
+    ::plan_io(ar, prefix + ".q3", q3);
+    ::plan_io(ar, prefix + ".q_down", q_down);
+}
+
+Tensor<float> Bottleneck::reduce(const Tensor<float> &x) const
+{
     // 1x1 conv
-    Conv2DParam p3; // stride=1
-    Tensor<float> out3 = conv2d(out, w3, b3, p3);
-    out3 = batchnorm2d(out3, bn3);
+    Conv2DParam p1; // stride=1
+    Tensor<float> t1;
+    conv2d_slot_into(x, q1, pw1, fb1, p1, t1, conv2d_epilogue(aff1, Activation::RELU));
+    return t1;
+}
+
+Tensor<float> Bottleneck::forward(const Tensor<float> &x) const
+{
+    Tensor<float> out;
+    forward_into(x, out);
+    return out;
+}
+
+void Bottleneck::forward_into(const Tensor<float> &x, Tensor<float> &out) const
+{
+    // branch: 1x1 conv, then the 3x3 conv; t1 is freed right after.
+    // Between two int8 convs the activations stay u8
+    ConvActivation t2;
+    {
+        ConvActivation t1;
+        conv2d_slot_into(x, q1, q2, pw1, fb1, Conv2DParam(), t1,
+                         conv2d_epilogue(aff1, Activation::RELU));
+        conv2d_slot_into(t1, q2, q3, pw2, fb2, conv2_param(), t2,
+                         conv2d_epilogue(aff2, Activation::RELU));
+    }
 
     // shortcut
-    Tensor<float> shortcut = x;
+    const Tensor<float> *shortcut = &x;
+    Tensor<float> sc;
     if(use_downsample) {
         Conv2DParam pd;
         pd.stride_h = stride;
         pd.stride_w = stride;
-        Tensor<float> sc = conv2d(x, w_down, b_down, pd);
-        sc = batchnorm2d(sc, bn_down);
-        shortcut = sc;
-    }
-
-    // add
-    // out3 + shortcut => out3
-    int N = out3.shape()[0];
-    int C = out3.shape()[1];
-    int H = out3.shape()[2];
-    int W = out3.shape()[3];
-    for(int n=0; n<N; n++){
-        for(int c=0; c<C; c++){
-            for(int h=0; h<H; h++){
-                for(int w=0; w<W; w++){
-                    float val = out3.at4d(n,c,h,w) + shortcut.at4d(n,c,h,w);
-                    out3.at4d(n,c,h,w) = val;
-                }
-            }
-        }
+        conv2d_slot_into(x, q_down, pw_down, fb_down, pd, sc, conv2d_epilogue(aff_down, Activation::NONE));
+        shortcut = &sc;
     }
 
-    // relu
-    out3 = relu(out3);
-    return out3;
+    // 1x1 conv, with the shortcut add and the relu fused into its store
+    Conv2DParam p3; // stride=1
+    conv2d_slot_into(t2, q3, pw3, fb3, p3, out, conv2d_epilogue(aff3, Activation::RELU, shortcut));
 }
 
 ResNet50::ResNet50()
+    : ResNet50(DeferPrepare())
 {
+    prepare();
+}
+
+ResNet50::ResNet50(DeferPrepare)
+{
+    // weights: multi-MB tensors go on transparent huge pages
+    TensorBackendScope weight_backend(huge_page_backend());
     // ========== conv1 ==========
     conv1_w_ = Tensor<float>(std::vector<int>{64, 3, 7, 7});
     conv1_b_.resize(64, 0.f);
@@ -71,22 +146,44 @@ ResNet50::ResNet50()
 
     current_inplanes_ = 64;
 
+    // 3x3 conv path per stage at 224x224 input: F(4x4) Winograd on the
+    // 56x56 / 28x28 maps, F(2x2) on 14x14 where F(4x4) leaves too few
+    // tiles, plain GEMM on 7x7 (see winograd_report for the error)
+
     // layer1: inplanes = 64, planes = 64, blocks=3, stride=1
-    layer1_ = make_layer(64, 64, 3, 1);
+    layer1_ = make_layer(64, 64, 3, 1, Conv2DAlgo::AUTO);
 
     // layer2: inplanes=256, planes=128, blocks=4, stride=2
-    layer2_ = make_layer(256, 128, 4, 2);
+    layer2_ = make_layer(256, 128, 4, 2, Conv2DAlgo::AUTO);
 
     // layer3: inplanes=128*4=512, planes=256, blocks=6, stride=2
-    layer3_ = make_layer(512, 256, 6, 2);
+    layer3_ = make_layer(512, 256, 6, 2, Conv2DAlgo::WINOGRAD_F2);
 
     // layer4: inplanes=256*4=1024, planes=512, blocks=3, stride=2
-    layer4_ = make_layer(1024, 512, 3, 2);
+    layer4_ = make_layer(1024, 512, 3, 2, Conv2DAlgo::IMPLICIT_GEMM);
 
     // 最终 fc => [1000, 2048], bias [1000]
     fc_.weight = Tensor<float>({1000, 2048});
     fc_.bias.resize(1000, 0.f);
+}
 
+void ResNet50::prepare(bool fold_bn, TensorLayout layout, WeightPrecision precision)
+{
+    layout_ = layout;
+    conv1_q_ = QConv2DSlot();
+    if(fold_bn) {
+        conv1_pw_ = pack_conv2d_weight_bn(conv1_w_, conv1_b_, bn1_, conv1_fb_, Conv2DParam(), layout, precision);
+        conv1_aff_ = BNAffine();
+    } else {
+        conv1_pw_ = pack_conv2d_weight(conv1_w_, Conv2DParam(), layout, precision);
+        conv1_aff_ = conv2d_bn_affine(conv1_b_, bn1_, conv1_fb_);
+    }
+    for(auto *layer : {&layer1_, &layer2_, &layer3_, &layer4_}){
+        for(auto &b : *layer){
+            b.prepare(fold_bn, layout, precision);
+        }
+    }
+    pack_linear_param(fc_, precision);
 }
 
 Bottleneck ResNet50::make_bottleneck(int inplanes, int planes, int stride, bool downsample)
@@ -135,34 +232,38 @@ Bottleneck ResNet50::make_bottleneck(int inplanes, int planes, int stride, bool
     return block;
 }
 
-std::vector<Bottleneck> ResNet50::make_layer(int inplanes, int planes, int blocks, int stride)
+std::vector<Bottleneck> ResNet50::make_layer(int inplanes, int planes, int blocks, int stride,
+                                             Conv2DAlgo algo2)
 {
     std::vector<Bottleneck> layer;
     bool downsample = (stride != 1 || inplanes != planes*4);
 
+    // the strided first block never takes Winograd
     Bottleneck b0 = make_bottleneck(inplanes, planes, stride, downsample);
-    layer.push_back(b0);
+    if(stride == 1){
+        b0.algo2 = algo2;
+    }
+    layer.push_back(std::move(b0));
 
     for(int i=1; i<blocks; i++){
         Bottleneck bN = make_bottleneck(planes*4, planes, 1, false);
-        layer.push_back(bN);
+        bN.algo2 = algo2;
+        layer.push_back(std::move(bN));
     }
 
     current_inplanes_ = planes*4;
     return layer;
 }
 
-Tensor<float> ResNet50::forward(const Tensor<float> &input)
+Tensor<float> ResNet50::stem(const Tensor<float> &input) const
 {
     // 1) conv1 (7x7, stride=2, pad=3)
     Conv2DParam p;
     p.stride_h=2; p.stride_w=2;
     p.pad_h=3;    p.pad_w=3;
-    auto x = conv2d(input, conv1_w_, conv1_b_, p);
-
-    // bn + relu
-    x = batchnorm2d(x, bn1_);
-    x = relu(x);
+    // bn + relu in the conv epilogue
+    Tensor<float> x;
+    conv2d_slot_into(input, conv1_q_, conv1_pw_, conv1_fb_, p, x, conv2d_epilogue(conv1_aff_, Activation::RELU));
 
     // 2) maxpool(3x3, stride=2, pad=1)
     Pool2DParam poolp;
@@ -170,69 +271,193 @@ Tensor<float> ResNet50::forward(const Tensor<float> &input)
     poolp.stride_h=2; poolp.stride_w=2;
     poolp.pad_h=1;    poolp.pad_w=1;
     x = max_pool2d(x, poolp);
+    return x;
+}
 
-    // 3) layer1..4
-    // layer1_
-    for(auto &b : layer1_){
-        x = b.forward(x);
-    }
-    // layer2_
-    for(auto &b : layer2_){
-        x = b.forward(x);
+void ResNet50::winograd_report(const Tensor<float> &input, std::ostream &os)
+{
+    os << "Winograd vs direct, 3x3 convs (max abs err / rel to max |y|)\n";
+    Tensor<float> x = stem(input.to_layout(layout_));
+    int stage = 1;
+    for(auto *layer : {&layer1_, &layer2_, &layer3_, &layer4_}){
+        for(size_t i=0; i<layer->size(); i++){
+            const Bottleneck &b = (*layer)[i];
+            Conv2DParam p2 = b.conv2_param();
+            if(p2.stride_h == 1 && p2.stride_w == 1){
+                Tensor<float> in2 = b.reduce(x).to_layout(TensorLayout::NCHW);
+                Conv2DError e2 = conv2d_winograd_error(in2, b.w2, b.b2, p2, 2);
+                Conv2DError e4 = conv2d_winograd_error(in2, b.w2, b.b2, p2, 4);
+                os << "layer" << stage << "." << i
+                   << " [" << in2.shape()[1] << "x" << in2.shape()[2] << "x" << in2.shape()[3] << "]"
+                   << "  F(2x2) " << e2.max_abs << " / " << e2.max_rel
+                   << "  F(4x4) " << e4.max_abs << " / " << e4.max_rel << "\n";
+            }
+            x = b.forward(x);
+        }
+        stage++;
     }
-    // layer3_
-    for(auto &b : layer3_){
-        x = b.forward(x);
+}
+
+std::vector<ModelParam> ResNet50::parameters()
+{
+    std::vector<ModelParam> params;
+    list_params(params, "conv1.weight", conv1_w_);
+    list_params(params, "conv1.bias", conv1_b_);
+    list_params(params, "bn1", bn1_);
+    int stage = 1;
+    for(auto *layer : {&layer1_, &layer2_, &layer3_, &layer4_}){
+        for(size_t i=0; i<layer->size(); i++){
+            (*layer)[i].list_params(params, "layer" + std::to_string(stage) + "." + std::to_string(i));
+        }
+        stage++;
     }
-    // layer4_
-    for(auto &b : layer4_){
-        x = b.forward(x);
+    list_params(params, "fc", fc_);
+    return params;
+}
+
+void ResNet50::save(const std::string &path)
+{
+    save_checkpoint(path, parameters());
+}
+
+void ResNet50::load(const std::string &path)
+{
+    load_checkpoint(Checkpoint(path), parameters());
+}
+
+void ResNet50::plan_io(PlanArchive &ar)
+{
+    ::plan_io(ar, parameters());
+    ar.io_enum("layout", layout_);
+    ::plan_io(ar, "conv1.pw", conv1_pw_);
+    ar.io("conv1.fb", conv1_fb_);
+    ::plan_io(ar, "conv1.aff", conv1_aff_);
+    ::plan_io(ar, "conv1.q", conv1_q_);
+    int stage = 1;
+    for(auto *layer : {&layer1_, &layer2_, &layer3_, &layer4_}){
+        for(size_t i=0; i<layer->size(); i++){
+            (*layer)[i].plan_io(ar, "layer" + std::to_string(stage) + "." + std::to_string(i));
+        }
+        stage++;
     }
+    ::plan_io(ar, "fc", fc_);
+    ar.io("arena", arena_);
+}
+
+void ResNet50::save_plan(const std::string &path, const std::string &key)
+{
+    PlanArchive ar(key);
+    plan_io(ar);
+    ar.write(path);
+}
 
+bool ResNet50::load_plan(const std::string &path, const std::string &key)
+{
+    std::unique_ptr<Checkpoint> plan = open_plan(path, key);
+    if (!plan)
     {
-        ScopedTimer t(OpType::POOL);
-        int N = x.shape()[0];
-        int C = x.shape()[1];
-        int H = x.shape()[2];
-        int W = x.shape()[3];
-        Tensor<float> pooled(std::vector<int>{N, C, 1, 1});
-        for(int n=0; n<N; n++){
-            for(int c=0; c<C; c++){
-                float sum=0.f;
-                for(int hh=0; hh<H; hh++){
-                    for(int ww=0; ww<W; ww++){
-                        sum += x.at4d(n,c,hh,ww);
-                    }
-                }
-                sum /= (H*W);
-                pooled.at4d(n,c,0,0)= sum;
+        return false;
+    }
+    PlanArchive ar(*plan);
+    plan_io(ar);
+    return true;
+}
+
+std::vector<QuantLayer> ResNet50::quant_layer_list()
+{
+    std::vector<QuantLayer> layers;
+    layers.push_back({"conv1", &conv1_q_, &conv1_pw_});
+    int stage = 1;
+    for(auto *layer : {&layer1_, &layer2_, &layer3_, &layer4_}){
+        for(size_t i=0; i<layer->size(); i++){
+            Bottleneck &b = (*layer)[i];
+            const std::string prefix = "layer" + std::to_string(stage) + "." + std::to_string(i) + ".";
+            layers.push_back({prefix + "conv1", &b.q1, &b.pw1});
+            layers.push_back({prefix + "conv2", &b.q2, &b.pw2});
+            layers.push_back({prefix + "conv3", &b.q3, &b.pw3});
+            if(b.use_downsample){
+                layers.push_back({prefix + "downsample", &b.q_down, &b.pw_down});
             }
         }
-        x=pooled;
+        stage++;
+    }
+    return layers;
+}
+
+std::vector<std::string> ResNet50::quant_layers()
+{
+    std::vector<std::string> names;
+    for(const QuantLayer &l : quant_layer_list()){
+        names.push_back(l.name);
+    }
+    return names;
+}
+
+void ResNet50::quantize(const ActivationRanges &ranges, const std::vector<std::string> &layers)
+{
+    if(layout_ != TensorLayout::NCHW){
+        throw std::runtime_error("ResNet50::quantize: int8 convs need the NCHW layout");
+    }
+    std::vector<QuantLayer> list = quant_layer_list();
+    quantize_layers(list, ranges, select_quant_layers(list, layers));
+}
+
+void ResNet50::quantization_report(const Tensor<float> &input, const ActivationRanges &ranges,
+                                   std::ostream &os)
+{
+    if(layout_ != TensorLayout::NCHW){
+        throw std::runtime_error("ResNet50::quantization_report: int8 convs need the NCHW layout");
+    }
+    ::quantization_report(quant_layer_list(), ranges,
+                          [&]() { return forward(input); }, os);
+}
+
+Tensor<float> ResNet50::forward(const Tensor<float> &input)
+{
+    ArenaScope arena_scope(arena_);
+    return run(input);
+}
+
+Tensor<float> ResNet50::forward(const Tensor<float> &input, ExecutionContext &ctx) const
+{
+    ExecutionScope scope(ctx);
+    return run(input);
+}
+
+Tensor<float> ResNet50::run(const Tensor<float> &input) const
+{
+    // the one layout conversion of the body; every layer keeps it
+    Tensor<float> x = stem(input.to_layout(layout_));
+
+    // 3) layer1..4; every block output is a fresh buffer, which the
+    // arena packs tighter than two long-lived ping-pong buffers
+    for(auto *layer : {&layer1_, &layer2_, &layer3_, &layer4_}){
+        for(auto &b : *layer){
+            Tensor<float> y;
+            b.forward_into(x, y);
+            x = std::move(y);
+        }
+    }
+
+    // 4) global average pool => [N, 2048, 1, 1]
+    Tensor<float> y;
+    {
+        Pool2DParam pool_param;
+        pool_param.kernel_h = pool_param.stride_h = x.shape()[2];
+        pool_param.kernel_w = pool_param.stride_w = x.shape()[3];
+        avg_pool2d_into(x, pool_param, y);
     }
 
     // 5) FC
-    // x: [N, 2048, 1, 1] => reshape to [N, 2048]
+    // y: [N, 2048, 1, 1] => view as [N, 2048] (a copy back to NCHW
+    // when the body ran in another layout, 2048 values per image)
     {
-        int N = x.shape()[0];
-        int C = x.shape()[1];
-        // flatten
-        Tensor<float> flatten(std::vector<int>{N, C});
-        for(int n=0; n<N; n++){
-            for(int c=0; c<C; c++){
-                flatten.at4d(n,c,0,0) = x.at4d(n,c,0,0);
-            }
-        }
-        auto logits = linear(flatten, fc_); // [N, 1000]
-        // softmax
-        auto probs = softmax(logits);      // [N, 1000]
-        // reshape to [N, 1000, 1, 1]
-        Tensor<float> out(std::vector<int>{N, 1000, 1, 1});
-        for(int n=0; n<N; n++){
-            for(int c=0; c<1000; c++){
-                out.at4d(n,c,0,0) = probs.at4d(n,c,0,0);
-            }
-        }
-        return out;
+        int N = y.shape()[0];
+        Tensor<float> probs;
+        linear_into(y.flatten(1), fc_, probs); // [N, 1000]
+        // softmax, in place
+        softmax_into(probs, probs);
+        // view as [N, 1000, 1, 1]
+        return probs.view({N, 1000, 1, 1});
     }
-}
\ No newline at end of file
+}
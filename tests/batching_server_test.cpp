@@ -0,0 +1,301 @@
+#include "common/batching_server.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool ok, const char *what)
+    {
+        if (!ok)
+        {
+            std::printf("FAIL: %s\n", what);
+            failures++;
+        }
+    }
+
+    // a [1, width] request whose values are all `id`
+    Tensor<float> request(int width, float id)
+    {
+        Tensor<float> t(std::vector<int>{1, width});
+        for (int i = 0; i < width; i++)
+            t[i] = id;
+        return t;
+    }
+
+    // 2 * batch, row by row
+    Tensor<float> twice(const Tensor<float> &batch)
+    {
+        Tensor<float> in = batch.contiguous();
+        Tensor<float> out(in.shape(), TensorInit::UNINITIALIZED);
+        for (int i = 0; i < in.total_size(); i++)
+            out[i] = 2.f * in[i];
+        return out;
+    }
+
+    bool all_equal(const Tensor<float> &t, float value)
+    {
+        Tensor<float> c = t.contiguous();
+        bool ok = c.total_size() > 0;
+        for (int i = 0; i < c.total_size(); i++)
+            ok = ok && c[i] == value;
+        return ok;
+    }
+
+    // holds the batch function until opened, so that requests pile up
+    // behind the batch it is running
+    class Gate {
+    public:
+        void wait_open()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            entered_ = true;
+            cv_.notify_all();
+            cv_.wait(lock, [this]
+                     { return open_; });
+        }
+        void wait_entered()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]
+                     { return entered_; });
+        }
+        void open()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            open_ = true;
+            cv_.notify_all();
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool entered_ = false;
+        bool open_ = false;
+    };
+
+    // row n of the batch output goes back to request n
+    void test_scatter()
+    {
+        BatchingOptions options;
+        options.max_batch = 4;
+        options.max_delay_ms = 1.0;
+        options.num_groups = 2;
+        BatchingServer server([](const Tensor<float> &batch, ExecutionContext &)
+                              { return twice(batch); },
+                              options);
+        std::atomic<int> wrong(0);
+        std::vector<std::thread> clients;
+        for (int c = 0; c < 4; c++)
+        {
+            clients.emplace_back([&, c]
+                                 {
+                for (int i = 0; i < 100; i++)
+                {
+                    float id = (float)(c * 1000 + i);
+                    Tensor<float> out = server.submit(request(3, id)).get();
+                    if (out.shape()[0] != 1 || !all_equal(out, 2.f * id))
+                        wrong++;
+                } });
+        }
+        for (auto &t : clients)
+            t.join();
+        check(wrong.load() == 0, "outputs scattered to their requests");
+        check(server.stats().requests == 400, "every request counted");
+    }
+
+    // requests of different shapes never share a batch
+    void test_mixed_shapes()
+    {
+        BatchingOptions options;
+        options.max_batch = 8;
+        options.max_delay_ms = 20.0;
+        Gate gate;
+        std::atomic<int> batches_3(0), batches_5(0);
+        BatchingServer server([&](const Tensor<float> &batch, ExecutionContext &)
+                              {
+                                  if (batch.shape()[1] == 1)
+                                      gate.wait_open();
+                                  else if (batch.shape()[1] == 3)
+                                      batches_3++;
+                                  else if (batch.shape()[1] == 5)
+                                      batches_5++;
+                                  return twice(batch); },
+                              options);
+        auto blocked = server.submit(request(1, 0.f));
+        gate.wait_entered();
+        std::vector<std::future<Tensor<float>>> results;
+        for (int i = 0; i < 8; i++)
+            results.push_back(server.submit(request(i % 2 ? 5 : 3, (float)i)));
+        gate.open();
+        bool ok = true;
+        for (int i = 0; i < 8; i++)
+        {
+            Tensor<float> out = results[i].get();
+            ok = ok && out.shape()[1] == (i % 2 ? 5 : 3) && all_equal(out, 2.f * i);
+        }
+        blocked.get();
+        check(ok, "mixed shapes: outputs");
+        check(batches_3.load() == 1 && batches_5.load() == 1, "mixed shapes: one batch per shape");
+    }
+
+    // an exception from the batch function reaches every request in it
+    void test_batch_error()
+    {
+        BatchingOptions options;
+        options.max_batch = 4;
+        options.max_delay_ms = 20.0;
+        Gate gate;
+        std::atomic<int> sizes(0);
+        BatchingServer server([&](const Tensor<float> &batch, ExecutionContext &)
+                              {
+                                  if (batch.shape()[1] == 1)
+                                  {
+                                      gate.wait_open();
+                                      return twice(batch);
+                                  }
+                                  sizes += batch.shape()[0];
+                                  throw std::runtime_error("bad batch"); },
+                              options);
+        auto blocked = server.submit(request(1, 0.f));
+        gate.wait_entered();
+        std::vector<std::future<Tensor<float>>> results;
+        for (int i = 0; i < 3; i++)
+            results.push_back(server.submit(request(2, (float)i)));
+        std::atomic<int> callback_errors(0);
+        server.submit(request(2, 3.f), [&](Tensor<float> out, std::exception_ptr error)
+                      {
+                          if (error && out.total_size() == 0)
+                              callback_errors++; });
+        gate.open();
+        int future_errors = 0;
+        for (auto &r : results)
+        {
+            try
+            {
+                r.get();
+            }
+            catch (const std::runtime_error &e)
+            {
+                if (std::string(e.what()) == "bad batch")
+                    future_errors++;
+            }
+        }
+        blocked.get();
+        check(sizes.load() == 4, "batch error: one batch of four");
+        check(future_errors == 3, "batch error: every future throws");
+        // the callback runs before the batch is counted as done: wait for it
+        for (int i = 0; i < 1000 && callback_errors.load() == 0; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        check(callback_errors.load() == 1, "batch error: the callback gets it");
+        check(server.stats().failed == 4, "batch error: failed count");
+    }
+
+    // submit() throws once queue_capacity requests are waiting
+    void test_queue_full()
+    {
+        BatchingOptions options;
+        options.max_batch = 1;
+        options.queue_capacity = 4;
+        Gate gate;
+        BatchingServer server([&](const Tensor<float> &batch, ExecutionContext &)
+                              {
+                                  gate.wait_open();
+                                  return twice(batch); },
+                              options);
+        auto blocked = server.submit(request(1, 0.f));
+        gate.wait_entered();
+        std::vector<std::future<Tensor<float>>> results;
+        for (int i = 0; i < 4; i++)
+            results.push_back(server.submit(request(1, (float)i)));
+        bool threw = false;
+        try
+        {
+            server.submit(request(1, 9.f));
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        check(threw, "queue full: submit throws");
+        gate.open();
+        blocked.get();
+        bool ok = true;
+        for (int i = 0; i < 4; i++)
+            ok = ok && all_equal(results[i].get(), 2.f * i);
+        check(ok, "queue full: queued requests still served");
+    }
+
+    // clients keep submitting while the server is destroyed: every
+    // request it accepted is completed, the others are refused with an
+    // exception
+    void test_shutdown_race()
+    {
+        // the storage outlives the server, so a submit() that starts after
+        // the destructor returned only finds it stopping
+        alignas(BatchingServer) static char storage[sizeof(BatchingServer)];
+        for (int round = 0; round < 50; round++)
+        {
+            BatchingOptions options;
+            options.max_batch = 4;
+            options.max_delay_ms = 0.1;
+            options.num_groups = 2;
+            BatchingServer *server = new (storage) BatchingServer(
+                [](const Tensor<float> &batch, ExecutionContext &)
+                { return batch.contiguous(); },
+                options);
+            std::atomic<long> accepted(0), completed(0);
+            std::vector<std::thread> clients;
+            for (int c = 0; c < 3; c++)
+            {
+                clients.emplace_back([&]
+                                     {
+                    for (;;)
+                    {
+                        try
+                        {
+                            server->submit(request(2, 1.f), [&](Tensor<float>, std::exception_ptr)
+                                           { completed++; });
+                            accepted++;
+                        }
+                        catch (const std::runtime_error &)
+                        {
+                            return; // stopping
+                        }
+                    } });
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200 + round * 20));
+            server->~BatchingServer();
+            for (auto &t : clients)
+                t.join();
+            if (accepted.load() != completed.load())
+            {
+                std::printf("round %d: %ld accepted, %ld completed\n", round, accepted.load(),
+                            completed.load());
+                check(false, "shutdown race: accepted requests completed");
+                return;
+            }
+        }
+    }
+}
+
+int main()
+{
+    test_scatter();
+    test_mixed_shapes();
+    test_batch_error();
+    test_queue_full();
+    test_shutdown_race();
+
+    std::printf("batching_server_test: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+#include "common/thread_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+    int failures = 0;
+
+    void check(bool ok, const char *what)
+    {
+        if (!ok)
+        {
+            std::printf("FAIL: %s\n", what);
+            failures++;
+        }
+    }
+
+    // every task runs exactly once, and all have run when parallel_for
+    // returns
+    void run_job(ThreadPool &pool, Schedule sched, const char *what)
+    {
+        const int n = 64;
+        std::vector<std::atomic<int>> hits(n);
+        for (auto &h : hits)
+            h.store(0);
+        pool.parallel_for(n, [&](int t)
+                          {
+                              std::this_thread::sleep_for(std::chrono::microseconds(200));
+                              hits[t].fetch_add(1); },
+                          sched);
+        bool ok = true;
+        for (auto &h : hits)
+            ok = ok && h.load() == 1;
+        check(ok, what);
+    }
+
+    // task `bad` throws: parallel_for rethrows it only once no task is
+    // running any more, and the pool stays usable from this thread
+    void throwing_job(ThreadPool &pool, Schedule sched, int bad, const char *what)
+    {
+        std::atomic<int> running(0);
+        bool caught = false;
+        try
+        {
+            pool.parallel_for(16, [&](int t)
+                              {
+                                  running.fetch_add(1);
+                                  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                                  running.fetch_sub(1);
+                                  if (t == bad)
+                                      throw std::runtime_error("task " + std::to_string(t)); },
+                              sched);
+        }
+        catch (const std::runtime_error &e)
+        {
+            caught = std::string(e.what()) == "task " + std::to_string(bad);
+            check(running.load() == 0, what);
+        }
+        check(caught, what);
+        check(!in_parallel_region(), what);
+        run_job(pool, sched, what);
+    }
+}
+
+int main()
+{
+    // a resized pool's new workers must wait for the next job rather
+    // than rerun the last one
+    const Schedule scheds[] = {Schedule::STATIC, Schedule::DYNAMIC};
+    for (Schedule sched : scheds)
+    {
+        ThreadPool pool(2);
+        run_job(pool, sched, "before resize");
+        pool.resize(3);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        run_job(pool, sched, "after growing");
+        pool.resize(2);
+        run_job(pool, sched, "after shrinking");
+    }
+
+    // a task that throws, on the calling thread (task 0) and on a worker
+    // (the last task)
+    for (Schedule sched : scheds)
+    {
+        ThreadPool pool(3);
+        throwing_job(pool, sched, 0, "throw on the calling thread");
+        throwing_job(pool, sched, 15, "throw on a worker");
+    }
+
+    std::printf("thread_pool_test: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}